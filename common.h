@@ -10,6 +10,9 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
@@ -21,10 +24,16 @@
 #include <dirent.h>
 #include <locale.h>
 #include <float.h>
-#include <ftw.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <pwd.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #ifdef __cplusplus
 #define ZERO_INIT(type) (type){}
 // TODO: Add the static assert and check it works in C++.
@@ -287,13 +296,31 @@ int main (int argv, char *argc[])
 
 #if 1
 // String implementation with small string optimization.
+//
+// By default string_t is 16 bytes long and has 15 bytes of inline storage, so
+// strings of up to 14 characters (plus the null byte) don't call malloc().
+// Defining STRING_T_32 before including common.h makes string_t 32 bytes long
+// with 31 bytes of inline storage. This keeps things like path components,
+// identifiers or timestamps inline, at the cost of doubling the size of every
+// string_t. The tagging of the long representation is the same in both cases,
+// the LSB of capacity is always 1.
+//
+// To compare both configurations on typical string lengths run:
+//
+//   ./pymk.py string_benchmark
+
+#if defined(STRING_T_32)
+#define STR_SMALL_SIZE 32
+#else
+#define STR_SMALL_SIZE 16
+#endif
 
 #pragma pack(push, 1)
 #if defined(__BYTE_ORDER__)&&(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
 typedef union {
     struct {
         uint8_t len_small;
-        char str_small[15];
+        char str_small[STR_SMALL_SIZE-1];
     };
 
     struct {
@@ -307,11 +334,15 @@ typedef union {
 // :untested
 typedef union {
     struct {
-        char str_small[15];
+        char str_small[STR_SMALL_SIZE-1];
         uint8_t len_small;
     };
 
     struct {
+#if STR_SMALL_SIZE > 16
+        // Padding so that the LSB of capacity overlaps len_small.
+        char _pad[STR_SMALL_SIZE-16];
+#endif
         char *str;
         uint32_t len;
         uint32_t capacity;
@@ -1049,6 +1080,264 @@ bool char_in_str (char c, char *str)
     return false;
 }
 
+// Character classes
+//
+// A set of bytes stored as a 256 bit bitset. Testing membership is O(1)
+// independent of the number of characters in the class, unlike char_in_str()
+// which is O(k). Classes can be built once and reused, for example:
+//
+//      char_class_t identifier = {0};
+//      char_class_add_range (&identifier, 'a', 'z');
+//      char_class_add_range (&identifier, 'A', 'Z');
+//      char_class_add_str (&identifier, "_0123456789");
+//
+// To search long runs of text char_class_find() and char_class_span() use a
+// vectorized classifier when the CPU supports it. It splits each byte into its
+// high and low nibbles and looks up each one in a 16 entry table with a byte
+// shuffle instruction, a byte is in the class if both lookups share a bit. This
+// representation is exact as long as there are at most 8 distinct sets of low
+// nibbles across all high nibbles, which is the case for the classes commonly
+// used when parsing text. Classes that can't be represented fall back to the
+// scalar loop.
+//
+// The functions that modify a class also update these tables, lookups never
+// write to the class, so it can be shared between threads once built.
+typedef struct {
+    uint64_t bits[4];
+
+    // Tables for the vectorized classifier, computed by char_class_compile().
+    bool has_nibble_tables;
+    uint8_t lo_nibble[16];
+    uint8_t hi_nibble[16];
+} char_class_t;
+
+static inline
+bool char_class_has (char_class_t *cls, char c)
+{
+    uint8_t b = (uint8_t)c;
+    return (cls->bits[b >> 6] >> (b & 63)) & 1;
+}
+
+// Computes the tables of the vectorized classifier. Only needs to be called
+// after modifying bits directly, the rest of the functions do it.
+void char_class_compile (char_class_t *cls)
+{
+    // Set of low nibbles present for each high nibble.
+    uint16_t lo_sets[16] = {0};
+    for (int b=0; b<256; b++) {
+        if (char_class_has (cls, (char)b)) {
+            lo_sets[b >> 4] |= 1 << (b & 0xF);
+        }
+    }
+
+    // Assign a bucket bit to each distinct non empty set of low nibbles.
+    uint16_t buckets[8];
+    int num_buckets = 0;
+
+    memset (cls->lo_nibble, 0, sizeof(cls->lo_nibble));
+    memset (cls->hi_nibble, 0, sizeof(cls->hi_nibble));
+    cls->has_nibble_tables = true;
+    for (int hi=0; hi<16 && cls->has_nibble_tables; hi++) {
+        if (lo_sets[hi] == 0) continue;
+
+        int bucket = 0;
+        while (bucket < num_buckets && buckets[bucket] != lo_sets[hi]) {
+            bucket++;
+        }
+
+        if (bucket == num_buckets) {
+            if (num_buckets == ARRAY_SIZE(buckets)) {
+                cls->has_nibble_tables = false;
+                break;
+            }
+
+            buckets[num_buckets++] = lo_sets[hi];
+            for (int lo=0; lo<16; lo++) {
+                if (lo_sets[hi] & (1 << lo)) {
+                    cls->lo_nibble[lo] |= 1 << bucket;
+                }
+            }
+        }
+
+        cls->hi_nibble[hi] = 1 << bucket;
+    }
+
+}
+
+static inline
+void _char_class_set (char_class_t *cls, char c)
+{
+    uint8_t b = (uint8_t)c;
+    cls->bits[b >> 6] |= (uint64_t)1 << (b & 63);
+}
+
+static inline
+void char_class_add (char_class_t *cls, char c)
+{
+    _char_class_set (cls, c);
+    char_class_compile (cls);
+}
+
+static inline
+void char_class_add_range (char_class_t *cls, char first, char last)
+{
+    for (int c=(uint8_t)first; c<=(uint8_t)last; c++) {
+        _char_class_set (cls, (char)c);
+    }
+    char_class_compile (cls);
+}
+
+static inline
+void char_class_add_str (char_class_t *cls, char *char_list)
+{
+    while (*char_list != '\0') {
+        _char_class_set (cls, *char_list);
+        char_list++;
+    }
+    char_class_compile (cls);
+}
+
+static inline
+void char_class_invert (char_class_t *cls)
+{
+    for (int i=0; i<ARRAY_SIZE(cls->bits); i++) {
+        cls->bits[i] = ~cls->bits[i];
+    }
+    char_class_compile (cls);
+}
+static inline
+char_class_t char_class_from_str (char *char_list)
+{
+    char_class_t cls = {0};
+    char_class_add_str (&cls, char_list);
+    return cls;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+// Returns a pointer to the first byte in [p, end) whose membership in cls is
+// equal to in_class, or to the start of the last block of less than 16 bytes
+// that wasn't checked.
+__attribute__((target("ssse3")))
+static char* char_class_find_ssse3 (char_class_t *cls, char *p, char *end, bool in_class)
+{
+    __m128i lo_tbl = _mm_loadu_si128 ((__m128i*)cls->lo_nibble);
+    __m128i hi_tbl = _mm_loadu_si128 ((__m128i*)cls->hi_nibble);
+    __m128i nibble_mask = _mm_set1_epi8 (0x0F);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128 ((__m128i*)p);
+        __m128i lo = _mm_shuffle_epi8 (lo_tbl, _mm_and_si128 (v, nibble_mask));
+        __m128i hi = _mm_shuffle_epi8 (hi_tbl, _mm_and_si128 (_mm_srli_epi16 (v, 4), nibble_mask));
+        __m128i not_in_class = _mm_cmpeq_epi8 (_mm_and_si128 (lo, hi), _mm_setzero_si128 ());
+
+        uint32_t mask = _mm_movemask_epi8 (not_in_class);
+        if (in_class) mask = ~mask & 0xFFFF;
+        if (mask != 0) {
+            return p + __builtin_ctz (mask);
+        }
+        p += 16;
+    }
+
+    return p;
+}
+
+// Same as char_class_find_ssse3() but processes 32 bytes at a time. Shuffles
+// work independently on each 128 bit lane so tables are duplicated in both.
+__attribute__((target("avx2")))
+static char* char_class_find_avx2 (char_class_t *cls, char *p, char *end, bool in_class)
+{
+    __m256i lo_tbl = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((__m128i*)cls->lo_nibble));
+    __m256i hi_tbl = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((__m128i*)cls->hi_nibble));
+    __m256i nibble_mask = _mm256_set1_epi8 (0x0F);
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256 ((__m256i*)p);
+        __m256i lo = _mm256_shuffle_epi8 (lo_tbl, _mm256_and_si256 (v, nibble_mask));
+        __m256i hi = _mm256_shuffle_epi8 (hi_tbl, _mm256_and_si256 (_mm256_srli_epi16 (v, 4), nibble_mask));
+        __m256i not_in_class = _mm256_cmpeq_epi8 (_mm256_and_si256 (lo, hi), _mm256_setzero_si256 ());
+
+        uint32_t mask = _mm256_movemask_epi8 (not_in_class);
+        if (in_class) mask = ~mask;
+        if (mask != 0) {
+            return p + __builtin_ctz (mask);
+        }
+        p += 32;
+    }
+
+    return char_class_find_ssse3 (cls, p, end, in_class);
+}
+#endif
+
+enum char_class_simd_t {
+    CHAR_CLASS_SIMD_UNKNOWN,
+    CHAR_CLASS_SIMD_NONE,
+    CHAR_CLASS_SIMD_SSSE3,
+    CHAR_CLASS_SIMD_AVX2
+};
+
+static inline
+enum char_class_simd_t char_class_simd_support ()
+{
+    // Threads may race to detect support, they all store the same value.
+    static enum char_class_simd_t support = CHAR_CLASS_SIMD_UNKNOWN;
+    enum char_class_simd_t result = __atomic_load_n (&support, __ATOMIC_RELAXED);
+    if (result == CHAR_CLASS_SIMD_UNKNOWN) {
+        result = CHAR_CLASS_SIMD_NONE;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2")) {
+            result = CHAR_CLASS_SIMD_AVX2;
+        } else if (__builtin_cpu_supports ("ssse3")) {
+            result = CHAR_CLASS_SIMD_SSSE3;
+        }
+#endif
+        __atomic_store_n (&support, result, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+static inline
+char* _char_class_find (char_class_t *cls, char *p, char *end, bool in_class)
+{
+    // Only bother with the vectorized version for long runs, otherwise
+    // loading the tables costs more than what we save.
+    if (end - p >= 32) {
+#if defined(__x86_64__) || defined(__i386__)
+        if (cls->has_nibble_tables) {
+            enum char_class_simd_t support = char_class_simd_support ();
+            if (support == CHAR_CLASS_SIMD_AVX2) {
+                p = char_class_find_avx2 (cls, p, end, in_class);
+            } else if (support == CHAR_CLASS_SIMD_SSSE3) {
+                p = char_class_find_ssse3 (cls, p, end, in_class);
+            }
+        }
+#endif
+    }
+
+    while (p < end && char_class_has (cls, *p) != in_class) {
+        p++;
+    }
+
+    return p;
+}
+
+// Returns a pointer to the first byte in [p, end) that is part of cls, or end
+// if there is none.
+static inline
+char* char_class_find (char_class_t *cls, char *p, char *end)
+{
+    return _char_class_find (cls, p, end, true);
+}
+
+// Returns a pointer to the first byte in [p, end) that is NOT part of cls, or
+// end if all of them are.
+static inline
+char* char_class_span (char_class_t *cls, char *p, char *end)
+{
+    return _char_class_find (cls, p, end, false);
+}
+
 static inline
 void str_strip (string_t *str)
 {
@@ -2029,66 +2318,153 @@ void swap_n_bytes (void *a, void*b, uint32_t n)
     }
 }
 
-// Templetized merge sort for arrays
+// Merge sort used by templ_sort() and templ_sort_stable(). It's a bottom-up
+// merge sort, first runs of TEMPL_SORT_RUN_LENGTH elements are sorted with
+// insertion sort, then runs are merged pairwise, alternating between the array
+// and a scratch buffer of the same size. There is no recursion, so the stack
+// usage doesn't depend on n. Pairs of runs that are already in order, or in
+// reverse order, are copied instead of merged. If all runs are in order the
+// scratch buffer isn't allocated.
 //
-// IS_A_LT_B is an expression where a and b are pointers
-// to _arr_ true when *a<*b.
-// NOTE: IS_A_LT_B as defined, will sort the array in ascending order.
-#define templ_sort(FUNCNAME,TYPE,IS_A_LT_B)                                       \
-void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                   \
+// IS_A_LT_B_FUNC is a function generated by the caller that returns true when
+// *a must go before *b. Merges take elements from the left run unless the one
+// in the right run goes strictly before, so the resulting sort is stable.
+#define TEMPL_SORT_RUN_LENGTH 16
+#define TEMPL_SORT_BLOCK_SIZE (128*1024)
+
+#define _templ_merge_sort_implementation(FUNCNAME,TYPE,IS_A_LT_B_FUNC)           \
+/* Merges pairs of consecutive runs of width elements between start and end       \
+ * from src into dst. */                                                          \
+static inline                                                                     \
+void FUNCNAME ## _merge_pass (TYPE *src, TYPE *dst, size_t start, size_t end,     \
+                              size_t width, void *user_data)                      \
 {                                                                                 \
-    if (arr == NULL || n<=1) {                                                    \
-        return;                                                                   \
-    } else if (n == 2) {                                                          \
-        TYPE *a = &arr[1];                                                        \
-        TYPE *b = &arr[0];                                                        \
-        int c = IS_A_LT_B;                                                        \
-        if (c) {                                                                  \
-            swap_n_bytes (&arr[0], &arr[1], sizeof(TYPE));                        \
+    for (size_t lo=start; lo<end; lo+=2*width) {                                  \
+        size_t mid = MIN (lo + width, end);                                       \
+        size_t hi = MIN (lo + 2*width, end);                                      \
+                                                                                  \
+        if (mid == hi ||                                                          \
+            !IS_A_LT_B_FUNC (&src[mid], &src[mid-1], user_data)) {                \
+            memcpy (&dst[lo], &src[lo], (hi-lo)*sizeof(TYPE));                    \
+            continue;                                                             \
+                                                                                  \
+        } else if (IS_A_LT_B_FUNC (&src[hi-1], &src[lo], user_data)) {            \
+            /* The whole right run goes before the left one. */                   \
+            memcpy (&dst[lo], &src[mid], (hi-mid)*sizeof(TYPE));                  \
+            memcpy (&dst[lo + hi-mid], &src[lo], (mid-lo)*sizeof(TYPE));          \
+            continue;                                                             \
         }                                                                         \
-    } else {                                                                      \
-        TYPE res[n];                                                              \
-        FUNCNAME ## _user_data (arr, n/2, user_data);                             \
-        FUNCNAME ## _user_data (&arr[n/2], n-n/2, user_data);                     \
                                                                                   \
-        /* Merge halfs until one of them runs out*/                               \
-        int i;                                                                    \
-        int h=0;                                                                  \
-        int k=n/2;                                                                \
-        for (i=0; k<n && h<n/2; i++) {                                            \
-            TYPE *a = &arr[h];                                                    \
-            TYPE *b = &arr[k];                                                    \
-            int c = IS_A_LT_B;                                                    \
-            if (c) {                                                              \
-                res[i] = arr[h];                                                  \
-                h++;                                                              \
+        /* Merge runs until one of them runs out. */                              \
+        size_t i = lo;                                                            \
+        size_t h = lo;                                                            \
+        size_t k = mid;                                                           \
+        while (h < mid && k < hi) {                                               \
+            if (IS_A_LT_B_FUNC (&src[k], &src[h], user_data)) {                   \
+                dst[i++] = src[k++];                                              \
             } else {                                                              \
-                res[i] = arr[k];                                                  \
-                k++;                                                              \
+                dst[i++] = src[h++];                                              \
             }                                                                     \
         }                                                                         \
                                                                                   \
-        /* If there are elements remaining in one half copy them. Separating
-         * loop this way avoids evaluating CMP_A_TO_B for invalid elements (past
-         * the maximum value for h).
-         */                                                                       \
-        int rest_idx = k==n ? h : k;                                              \
-        for (; i<n; i++) {                                                        \
-            res[i] = arr[rest_idx];                                               \
-            rest_idx++;                                                           \
+        /* Only one of these copies something. */                                 \
+        memcpy (&dst[i], &src[h], (mid-h)*sizeof(TYPE));                          \
+        i += mid-h;                                                               \
+        memcpy (&dst[i], &src[k], (hi-k)*sizeof(TYPE));                           \
+    }                                                                             \
+}                                                                                 \
+                                                                                  \
+void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                   \
+{                                                                                 \
+    if (arr == NULL || n<=1) {                                                    \
+        return;                                                                   \
+    }                                                                             \
+                                                                                  \
+    size_t len = n;                                                               \
+    for (size_t start=0; start<len; start+=TEMPL_SORT_RUN_LENGTH) {               \
+        size_t end = MIN (start + TEMPL_SORT_RUN_LENGTH, len);                    \
+        for (size_t i=start+1; i<end; i++) {                                      \
+            if (IS_A_LT_B_FUNC (&arr[i], &arr[i-1], user_data)) {                 \
+                TYPE tmp = arr[i];                                                \
+                size_t j = i;                                                     \
+                do {                                                              \
+                    arr[j] = arr[j-1];                                            \
+                    j--;                                                          \
+                } while (j > start &&                                             \
+                         IS_A_LT_B_FUNC (&tmp, &arr[j-1], user_data));            \
+                arr[j] = tmp;                                                     \
+            }                                                                     \
         }                                                                         \
+    }                                                                             \
+                                                                                  \
+    /* Nothing to merge if the runs are already in order. */                      \
+    size_t run_end = TEMPL_SORT_RUN_LENGTH;                                       \
+    while (run_end < len &&                                                       \
+           !IS_A_LT_B_FUNC (&arr[run_end], &arr[run_end-1], user_data)) {         \
+        run_end += TEMPL_SORT_RUN_LENGTH;                                         \
+    }                                                                             \
+                                                                                  \
+    if (run_end >= len) {                                                         \
+        return;                                                                   \
+    }                                                                             \
                                                                                   \
-        /* Copy the sorted array back from the temporary array. */                \
-        for (i=0; i<n; i++) {                                                     \
-            arr[i] = res[i];                                                      \
+    /* Blocks that fit in the cache are sorted completely before merging          \
+     * them, instead of going over the whole array for each width. All            \
+     * blocks do the same number of passes, so they end up in the same            \
+     * buffer. */                                                                 \
+    size_t block = TEMPL_SORT_RUN_LENGTH;                                         \
+    while (block < len && 2*block*sizeof(TYPE) <= TEMPL_SORT_BLOCK_SIZE) {        \
+        block *= 2;                                                               \
+    }                                                                             \
+                                                                                  \
+    TYPE *buff = malloc (len*sizeof(TYPE));                                       \
+    TYPE *src = arr;                                                              \
+    TYPE *dst = buff;                                                             \
+    for (size_t start=0; start<len; start+=block) {                               \
+        size_t end = MIN (start + block, len);                                    \
+        src = arr;                                                                \
+        dst = buff;                                                               \
+        for (size_t width=TEMPL_SORT_RUN_LENGTH; width<block; width*=2) {         \
+            FUNCNAME ## _merge_pass (src, dst, start, end, width, user_data);     \
+            TYPE *tmp = src;                                                      \
+            src = dst;                                                            \
+            dst = tmp;                                                            \
         }                                                                         \
     }                                                                             \
+                                                                                  \
+    for (size_t width=block; width<len; width*=2) {                               \
+        FUNCNAME ## _merge_pass (src, dst, 0, len, width, user_data);             \
+        TYPE *tmp = src;                                                          \
+        src = dst;                                                                \
+        dst = tmp;                                                                \
+    }                                                                             \
+                                                                                  \
+    if (src != arr) {                                                             \
+        memcpy (arr, src, len*sizeof(TYPE));                                      \
+    }                                                                             \
+    free (buff);                                                                  \
 }                                                                                 \
                                                                                   \
 void FUNCNAME(TYPE *arr, int n) {                                                 \
     FUNCNAME ## _user_data (arr,n,NULL);                                          \
 }
 
+// Templetized merge sort for arrays
+//
+// IS_A_LT_B is an expression where a and b are pointers
+// to _arr_ true when *a<*b.
+// NOTE: IS_A_LT_B as defined, will sort the array in ascending order.
+// NOTE: It allocates a temporary array of size n in the heap. If the order of
+// equal elements doesn't matter, templ_sort_unstable() sorts in place.
+#define templ_sort(FUNCNAME,TYPE,IS_A_LT_B)                                       \
+static inline                                                                     \
+bool FUNCNAME ## _is_a_lt_b (TYPE *a, TYPE *b, void *user_data)                   \
+{                                                                                 \
+    int c = IS_A_LT_B;                                                            \
+    return c;                                                                     \
+}                                                                                 \
+_templ_merge_sort_implementation(FUNCNAME,TYPE,FUNCNAME ## _is_a_lt_b)
+
 // Stable templetized merge sort for arrays
 //
 // CMP_A_TO_B is an expression where a and b are pointers to _arr_. Its value is
@@ -2101,60 +2477,310 @@ void FUNCNAME(TYPE *arr, int n) {
 // than a CMP_A_TO_B expression.
 //
 // NOTE: CMP_A_TO_B as defined, will sort the array in ascending order.
+// NOTE: It allocates a temporary array of size n in the heap.
 #define templ_sort_stable(FUNCNAME,TYPE,CMP_A_TO_B)                               \
-void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                   \
+static inline                                                                     \
+bool FUNCNAME ## _is_a_lt_b (TYPE *a, TYPE *b, void *user_data)                   \
 {                                                                                 \
-    if (arr == NULL || n<=1) {                                                    \
-        return;                                                                   \
-    } else if (n == 2) {                                                          \
-        TYPE *a = &arr[1];                                                        \
-        TYPE *b = &arr[0];                                                        \
-        int c = CMP_A_TO_B;                                                       \
-        if (c < 0) {                                                              \
-            swap_n_bytes (&arr[0], &arr[1], sizeof(TYPE));                        \
-        }                                                                         \
-                                                                                  \
-    } else {                                                                      \
-        TYPE res[n];                                                              \
-        FUNCNAME ## _user_data (arr, n/2, user_data);                             \
-        FUNCNAME ## _user_data (&arr[n/2], n-n/2, user_data);                     \
-                                                                                  \
-        /* Merge halfs until one of them runs out*/                               \
-        int i;                                                                    \
-        int h=0;                                                                  \
-        int k=n/2;                                                                \
-        for (i=0; k<n && h<n/2; i++) {                                            \
-            TYPE *a = &arr[h];                                                    \
-            TYPE *b = &arr[k];                                                    \
-            int c = CMP_A_TO_B;                                                   \
-            if (c < 1) {                                                          \
-                res[i] = arr[h];                                                  \
-                h++;                                                              \
-            } else {                                                              \
-                res[i] = arr[k];                                                  \
-                k++;                                                              \
-            }                                                                     \
-        }                                                                         \
-                                                                                  \
-        /* If there are elements remaining in one half copy them. Separating
-         * loop this way avoids evaluating CMP_A_TO_B for invalid elements, past
-         * the end of the array.
-         */                                                                       \
-        int rest_idx = k==n ? h : k;                                              \
-        for (; i<n; i++) {                                                        \
-            res[i] = arr[rest_idx];                                               \
-            rest_idx++;                                                           \
-        }                                                                         \
-                                                                                  \
-        /* Copy the sorted array back from the temporary array. */                \
-        for (i=0; i<n; i++) {                                                     \
-            arr[i] = res[i];                                                      \
-        }                                                                         \
-    }                                                                             \
+    int c = CMP_A_TO_B;                                                           \
+    return c < 0;                                                                 \
 }                                                                                 \
-                                                                                  \
-void FUNCNAME(TYPE *arr, int n) {                                                 \
-    FUNCNAME ## _user_data (arr,n,NULL);                                          \
+_templ_merge_sort_implementation(FUNCNAME,TYPE,FUNCNAME ## _is_a_lt_b)
+
+// Unstable templetized sort for arrays, it sorts in place without allocating.
+//
+// IS_A_LT_B is an expression where a and b are pointers to _arr_ true when
+// *a<*b, like in templ_sort(). Elements that compare as equal can end up in any
+// order, use templ_sort() or templ_sort_stable() if that matters.
+//
+// It's a pattern-defeating quicksort [1]. Quicksort with a median of 3 pivot,
+// or the median of 3 medians of 3 for large partitions, that:
+//
+//  - Uses insertion sort for small partitions.
+//  - Puts all elements equal to the pivot in a single partition, and doesn't
+//    sort it again. This makes inputs with many duplicates linear.
+//  - When a partition didn't need any swaps, tries to finish it with an
+//    insertion sort that gives up after a few moves. This makes sorted and
+//    reversed inputs, and runs of them, linear.
+//  - When a partition is very unbalanced, swaps some elements around to break
+//    the pattern that caused it. After log(n) of these it switches to heap
+//    sort, so the worst case is O(n log(n)).
+//  - Recurses into the smaller partition and loops on the larger one, so the
+//    stack usage is O(log(n)).
+//
+// [1]: https://arxiv.org/abs/2106.05123
+//
+// NOTE: IS_A_LT_B as defined, will sort the array in ascending order.
+#define TEMPL_SORT_UNSTABLE_INSERTION_THRESHOLD 24
+#define TEMPL_SORT_UNSTABLE_NINTHER_THRESHOLD 128
+#define TEMPL_SORT_UNSTABLE_PARTIAL_INSERTION_LIMIT 8
+
+#define templ_sort_unstable(FUNCNAME,TYPE,IS_A_LT_B)                                      \
+static inline                                                                             \
+bool FUNCNAME ## _is_a_lt_b (TYPE *a, TYPE *b, void *user_data)                           \
+{                                                                                         \
+    int c = IS_A_LT_B;                                                                    \
+    return c;                                                                             \
+}                                                                                         \
+                                                                                          \
+static inline                                                                             \
+void FUNCNAME ## _swap (TYPE *a, TYPE *b)                                                 \
+{                                                                                         \
+    TYPE tmp = *a;                                                                        \
+    *a = *b;                                                                              \
+    *b = tmp;                                                                             \
+}                                                                                         \
+                                                                                          \
+static inline                                                                             \
+void FUNCNAME ## _sort3 (TYPE *a, TYPE *b, TYPE *c, void *user_data)                      \
+{                                                                                         \
+    if (FUNCNAME ## _is_a_lt_b (b, a, user_data)) FUNCNAME ## _swap (a, b);               \
+    if (FUNCNAME ## _is_a_lt_b (c, b, user_data)) FUNCNAME ## _swap (b, c);               \
+    if (FUNCNAME ## _is_a_lt_b (b, a, user_data)) FUNCNAME ## _swap (a, b);               \
+}                                                                                         \
+                                                                                          \
+/* If unguarded is true, the element before begin must not be greater than                \
+ * any element in the range, then it's used to stop the inner loop. */                    \
+static inline                                                                             \
+void FUNCNAME ## _insertion (TYPE *begin, TYPE *end, bool unguarded,                      \
+                             void *user_data)                                             \
+{                                                                                         \
+    for (TYPE *curr=begin+1; curr<end; curr++) {                                          \
+        if (FUNCNAME ## _is_a_lt_b (curr, curr-1, user_data)) {                           \
+            TYPE tmp = *curr;                                                             \
+            TYPE *sift = curr;                                                            \
+            do {                                                                          \
+                *sift = *(sift-1);                                                        \
+                sift--;                                                                   \
+            } while ((unguarded || sift > begin) &&                                       \
+                     FUNCNAME ## _is_a_lt_b (&tmp, sift-1, user_data));                   \
+            *sift = tmp;                                                                  \
+        }                                                                                 \
+    }                                                                                     \
+}                                                                                         \
+                                                                                          \
+/* Like insertion sort but gives up and returns false after moving more than              \
+ * TEMPL_SORT_UNSTABLE_PARTIAL_INSERTION_LIMIT elements. */                               \
+static inline                                                                             \
+bool FUNCNAME ## _partial_insertion (TYPE *begin, TYPE *end, void *user_data)             \
+{                                                                                         \
+    size_t moves = 0;                                                                     \
+    for (TYPE *curr=begin+1; curr<end; curr++) {                                          \
+        if (moves > TEMPL_SORT_UNSTABLE_PARTIAL_INSERTION_LIMIT) {                        \
+            return false;                                                                 \
+        }                                                                                 \
+                                                                                          \
+        if (FUNCNAME ## _is_a_lt_b (curr, curr-1, user_data)) {                           \
+            TYPE tmp = *curr;                                                             \
+            TYPE *sift = curr;                                                            \
+            do {                                                                          \
+                *sift = *(sift-1);                                                        \
+                sift--;                                                                   \
+            } while (sift > begin && FUNCNAME ## _is_a_lt_b (&tmp, sift-1, user_data));   \
+            *sift = tmp;                                                                  \
+            moves += curr - sift;                                                         \
+        }                                                                                 \
+    }                                                                                     \
+                                                                                          \
+    return true;                                                                          \
+}                                                                                         \
+                                                                                          \
+static inline                                                                             \
+void FUNCNAME ## _sift_down (TYPE *arr, size_t root, size_t len, void *user_data)         \
+{                                                                                         \
+    while (2*root + 1 < len) {                                                            \
+        size_t child = 2*root + 1;                                                        \
+        if (child + 1 < len &&                                                            \
+            FUNCNAME ## _is_a_lt_b (&arr[child], &arr[child+1], user_data)) {             \
+            child++;                                                                      \
+        }                                                                                 \
+                                                                                          \
+        if (!FUNCNAME ## _is_a_lt_b (&arr[root], &arr[child], user_data)) {               \
+            break;                                                                        \
+        }                                                                                 \
+        FUNCNAME ## _swap (&arr[root], &arr[child]);                                      \
+        root = child;                                                                     \
+    }                                                                                     \
+}                                                                                         \
+                                                                                          \
+static inline                                                                             \
+void FUNCNAME ## _heap_sort (TYPE *arr, size_t len, void *user_data)                      \
+{                                                                                         \
+    for (size_t i=len/2; i>0; i--) {                                                      \
+        FUNCNAME ## _sift_down (arr, i-1, len, user_data);                                \
+    }                                                                                     \
+                                                                                          \
+    for (size_t end=len-1; end>0; end--) {                                                \
+        FUNCNAME ## _swap (&arr[0], &arr[end]);                                           \
+        FUNCNAME ## _sift_down (arr, 0, end, user_data);                                  \
+    }                                                                                     \
+}                                                                                         \
+                                                                                          \
+/* Partitions around the pivot in *begin, elements equal to it go to the                  \
+ * right. Returns the final position of the pivot. already_partitioned is set             \
+ * if no elements had to be swapped. Requires an element not less than the                \
+ * pivot somewhere after begin, pivot selection guarantees it. */                         \
+static inline                                                                             \
+TYPE* FUNCNAME ## _partition_right (TYPE *begin, TYPE *end, bool *already_partitioned,    \
+                                    void *user_data)                                      \
+{                                                                                         \
+    TYPE pivot = *begin;                                                                  \
+    TYPE *first = begin;                                                                  \
+    TYPE *last = end;                                                                     \
+                                                                                          \
+    while (FUNCNAME ## _is_a_lt_b (++first, &pivot, user_data));                          \
+                                                                                          \
+    if (first - 1 == begin) {                                                             \
+        while (first < last && !FUNCNAME ## _is_a_lt_b (--last, &pivot, user_data));      \
+    } else {                                                                              \
+        while (!FUNCNAME ## _is_a_lt_b (--last, &pivot, user_data));                      \
+    }                                                                                     \
+                                                                                          \
+    *already_partitioned = first >= last;                                                 \
+    while (first < last) {                                                                \
+        FUNCNAME ## _swap (first, last);                                                  \
+        while (FUNCNAME ## _is_a_lt_b (++first, &pivot, user_data));                      \
+        while (!FUNCNAME ## _is_a_lt_b (--last, &pivot, user_data));                      \
+    }                                                                                     \
+                                                                                          \
+    TYPE *pivot_pos = first - 1;                                                          \
+    *begin = *pivot_pos;                                                                  \
+    *pivot_pos = pivot;                                                                   \
+    return pivot_pos;                                                                     \
+}                                                                                         \
+                                                                                          \
+/* Partitions around the pivot in *begin, elements equal to it go to the                  \
+ * left. Used when the pivot is equal to the element before begin, then the               \
+ * left partition only has elements equal to the pivot and is already sorted.             \
+ * Returns the final position of the pivot. */                                            \
+static inline                                                                             \
+TYPE* FUNCNAME ## _partition_left (TYPE *begin, TYPE *end, void *user_data)               \
+{                                                                                         \
+    TYPE pivot = *begin;                                                                  \
+    TYPE *first = begin;                                                                  \
+    TYPE *last = end;                                                                     \
+                                                                                          \
+    while (FUNCNAME ## _is_a_lt_b (&pivot, --last, user_data));                           \
+                                                                                          \
+    if (last + 1 == end) {                                                                \
+        while (first < last && !FUNCNAME ## _is_a_lt_b (&pivot, ++first, user_data));     \
+    } else {                                                                              \
+        while (!FUNCNAME ## _is_a_lt_b (&pivot, ++first, user_data));                     \
+    }                                                                                     \
+                                                                                          \
+    while (first < last) {                                                                \
+        FUNCNAME ## _swap (first, last);                                                  \
+        while (FUNCNAME ## _is_a_lt_b (&pivot, --last, user_data));                       \
+        while (!FUNCNAME ## _is_a_lt_b (&pivot, ++first, user_data));                     \
+    }                                                                                     \
+                                                                                          \
+    *begin = *last;                                                                       \
+    *last = pivot;                                                                        \
+    return last;                                                                          \
+}                                                                                         \
+                                                                                          \
+/* Swaps elements at 1/4 and 3/4 of a partition with ones at its ends, to                 \
+ * break patterns that produced an unbalanced partition. */                               \
+static inline                                                                             \
+void FUNCNAME ## _break_patterns (TYPE *begin, TYPE *end)                                 \
+{                                                                                         \
+    size_t len = end - begin;                                                             \
+    if (len >= TEMPL_SORT_UNSTABLE_INSERTION_THRESHOLD) {                                 \
+        size_t quarter = len/4;                                                           \
+        FUNCNAME ## _swap (begin, begin + quarter);                                       \
+        FUNCNAME ## _swap (end - 1, end - quarter);                                       \
+                                                                                          \
+        if (len > TEMPL_SORT_UNSTABLE_NINTHER_THRESHOLD) {                                \
+            FUNCNAME ## _swap (begin + 1, begin + quarter + 1);                           \
+            FUNCNAME ## _swap (begin + 2, begin + quarter + 2);                           \
+            FUNCNAME ## _swap (end - 2, end - quarter - 1);                               \
+            FUNCNAME ## _swap (end - 3, end - quarter - 2);                               \
+        }                                                                                 \
+    }                                                                                     \
+}                                                                                         \
+                                                                                          \
+/* If leftmost is false, the element before begin is not greater than any                 \
+ * element in the range. bad_allowed is the number of unbalanced partitions               \
+ * left before switching to heap sort. */                                                 \
+static                                                                                    \
+void FUNCNAME ## _loop (TYPE *begin, TYPE *end, int bad_allowed, bool leftmost,           \
+                        void *user_data)                                                  \
+{                                                                                         \
+    while (true) {                                                                        \
+        size_t len = end - begin;                                                         \
+        if (len < TEMPL_SORT_UNSTABLE_INSERTION_THRESHOLD) {                              \
+            FUNCNAME ## _insertion (begin, end, !leftmost, user_data);                    \
+            return;                                                                       \
+        }                                                                                 \
+                                                                                          \
+        /* Pivot selection, leaves the pivot in *begin. */                                \
+        size_t half = len/2;                                                              \
+        if (len > TEMPL_SORT_UNSTABLE_NINTHER_THRESHOLD) {                                \
+            FUNCNAME ## _sort3 (begin, begin + half, end - 1, user_data);                 \
+            FUNCNAME ## _sort3 (begin + 1, begin + half - 1, end - 2, user_data);         \
+            FUNCNAME ## _sort3 (begin + 2, begin + half + 1, end - 3, user_data);         \
+            FUNCNAME ## _sort3 (begin + half - 1, begin + half, begin + half + 1,         \
+                                user_data);                                               \
+            FUNCNAME ## _swap (begin, begin + half);                                      \
+        } else {                                                                          \
+            FUNCNAME ## _sort3 (begin + half, begin, end - 1, user_data);                 \
+        }                                                                                 \
+                                                                                          \
+        /* If the pivot is equal to the element before the range, it's the                \
+         * smallest element. Skip all elements equal to it. */                            \
+        if (!leftmost && !FUNCNAME ## _is_a_lt_b (begin - 1, begin, user_data)) {         \
+            begin = FUNCNAME ## _partition_left (begin, end, user_data) + 1;              \
+            continue;                                                                     \
+        }                                                                                 \
+                                                                                          \
+        bool already_partitioned;                                                         \
+        TYPE *pivot_pos = FUNCNAME ## _partition_right (begin, end, &already_partitioned, \
+                                                        user_data);                       \
+        size_t left_len = pivot_pos - begin;                                              \
+        size_t right_len = end - (pivot_pos + 1);                                         \
+                                                                                          \
+        if (left_len < len/8 || right_len < len/8) {                                      \
+            bad_allowed--;                                                                \
+            if (bad_allowed == 0) {                                                       \
+                FUNCNAME ## _heap_sort (begin, len, user_data);                           \
+                return;                                                                   \
+            }                                                                             \
+                                                                                          \
+            FUNCNAME ## _break_patterns (begin, pivot_pos);                               \
+            FUNCNAME ## _break_patterns (pivot_pos + 1, end);                             \
+                                                                                          \
+        } else if (already_partitioned &&                                                 \
+                   FUNCNAME ## _partial_insertion (begin, pivot_pos, user_data) &&        \
+                   FUNCNAME ## _partial_insertion (pivot_pos + 1, end, user_data)) {      \
+            return;                                                                       \
+        }                                                                                 \
+                                                                                          \
+        if (left_len < right_len) {                                                       \
+            FUNCNAME ## _loop (begin, pivot_pos, bad_allowed, leftmost, user_data);       \
+            begin = pivot_pos + 1;                                                        \
+            leftmost = false;                                                             \
+        } else {                                                                          \
+            FUNCNAME ## _loop (pivot_pos + 1, end, bad_allowed, false, user_data);        \
+            end = pivot_pos;                                                              \
+        }                                                                                 \
+    }                                                                                     \
+}                                                                                         \
+                                                                                          \
+void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                           \
+{                                                                                         \
+    if (arr == NULL || n<=1) {                                                            \
+        return;                                                                           \
+    }                                                                                     \
+                                                                                          \
+    int bad_allowed = 0;                                                                  \
+    while (n >> bad_allowed) {                                                            \
+        bad_allowed++;                                                                    \
+    }                                                                                     \
+    FUNCNAME ## _loop (arr, arr + n, bad_allowed, true, user_data);                       \
+}                                                                                         \
+                                                                                          \
+void FUNCNAME(TYPE *arr, int n) {                                                         \
+    FUNCNAME ## _user_data (arr,n,NULL);                                                  \
 }
 
 // This is a function type to define sorting callbacks. It's not used in the
@@ -3213,7 +3839,7 @@ void flatten_array (mem_pool_t *pool, uint32_t num_arrs, size_t e_size,
 // For some time all file manipulation functions started with a call to
 // sh_expand(). Don't do that again!!. In fact, try to use sh_expand() as little
 // as possible. When a user may input a path with ~, better resolve it using
-// resolve_user_path().
+// resolve_user_path(), or path_expand() if it may also contain variables.
 char* sh_expand (char *str, mem_pool_t *pool)
 {
     wordexp_t out;
@@ -3241,97 +3867,436 @@ char *resolve_user_path (char *path, mem_pool_t *pool)
     return result;
 }
 
-// It's common to want absolute paths before we start a series of path
-// manipulation calls, so this is likely to be the first function to be called
-// on a string that represents a path. Because real path needs to traverse
-// folders to resolve "..", this fails if the path does not exist. Then... what
-// is the point of having separate *_exists() functions?. I think the useful
-// thing about those is for times when we already know a path is absolute and we
-// need to make multiple tests. But for a single sequence of abs_path() followed
-// by path_exists(), we can use abs_path()'s result.
+// Path expansion
 //
-// TODO: This function should probably also set a boolean value that tells the
-// caller if there was a file not found error.
-char* abs_path (char *path, mem_pool_t *pool)
-{
-    mem_pool_t l_pool = {0};
+// Expands ~, ~user, $VAR and ${VAR} in place of sh_expand() without spawning a
+// shell, so it's fast and safe to call on untrusted input, nothing is ever
+// executed. Unlike sh_expand() there's no word splitting or quote removal, the
+// whole string is a single word so paths with spaces, quotes or parentheses
+// are kept as they are.
+//
+//  - ~ and ~user are only expanded at the start of the string, when followed
+//    by / or the end of it. Unknown users are left as is.
+//  - Unset variables expand to an empty string. A $ not followed by a name is
+//    kept.
+//  - \ makes the next character literal.
+//
+// path_expand_glob() also matches the result against the filesystem with
+// glob(). Characters escaped with \ and those in ~ expansions are matched
+// literally, the content of variables is matched as a pattern like a shell
+// would.
+//
+// When expanding many strings use struct path_expander_t, it takes a snapshot
+// of the environment and caches home directories.
+//
+//      struct path_expander_t exp = {0};
+//      path_expander_init (&exp);
+//      for (...) {
+//          char *path = path_expander_expand (&exp, str, &pool);
+//      }
+//      path_expander_destroy (&exp);
+
+extern char **environ;
+
+struct _path_expander_user_t {
+    char *name;
+    char *home; // NULL if the user doesn't exist
+};
 
-    char *user_path = resolve_user_path (path, &l_pool);
+struct path_expander_t {
+    mem_pool_t pool;
 
-    char *absolute_path_m = realpath (user_path, NULL);
-    if (absolute_path_m == NULL) {
-        // NOTE: realpath() fails if the file does not exist.
-        //printf ("Error: %s (%d)\n", strerror(errno), errno);
-    }
-    char *absolute_path = pom_strdup (pool, absolute_path_m);
-    free (absolute_path_m);
+    // Copies of "NAME=VALUE" strings sorted by name.
+    char **env;
+    int env_len;
 
-    mem_pool_destroy (&l_pool);
+    char *home;
 
-    return absolute_path;
-}
+    struct _path_expander_user_t *users;
+    int users_len;
+    int users_size;
+};
 
-void str_set_path (string_t *str, char *path)
+static inline
+int _path_expander_env_cmp_name (const char *entry, const char *name, int name_len)
 {
-    char *user_path = resolve_user_path (path, NULL);
-    str_set (str, user_path);
-    free (user_path);
+    int cmp = strncmp (entry, name, name_len);
+    if (cmp == 0) {
+        cmp = (unsigned char)entry[name_len] - (unsigned char)'=';
+    }
+    return cmp;
 }
 
-void file_write (int file, void *pos,  ssize_t size)
+int _path_expander_env_cmp (const void *a, const void *b)
 {
-    if (write (file, pos, size) < size) {
-        printf ("Write interrupted\n");
+    const char *e1 = *(const char**)a;
+    const char *e2 = *(const char**)b;
+    while (*e1 != '=' && *e1 == *e2) {
+        e1++;
+        e2++;
     }
+
+    // '=' ends the name so it sorts before any other character.
+    int c1 = *e1 == '=' ? 0 : (unsigned char)*e1 + 1;
+    int c2 = *e2 == '=' ? 0 : (unsigned char)*e2 + 1;
+    return c1 - c2;
 }
 
-void file_read (int file, void *pos,  ssize_t size)
+void path_expander_init (struct path_expander_t *exp)
 {
-    int bytes_read = read (file, pos, size);
-    if (bytes_read < size) {
-        printf ("Did not read full file\n"
-                "asked for: %ld\n"
-                "received: %d\n", size, bytes_read);
+    *exp = (struct path_expander_t){0};
+
+    int len = 0;
+    while (environ != NULL && environ[len] != NULL) len++;
+
+    exp->env = (char**)mem_pool_push_size (&exp->pool, MAX(len, 1)*sizeof(char*));
+    for (int i=0; i<len; i++) {
+        if (strchr (environ[i], '=') != NULL) {
+            exp->env[exp->env_len++] = pom_strdup (&exp->pool, environ[i]);
+        }
     }
+    qsort (exp->env, exp->env_len, sizeof(char*), _path_expander_env_cmp);
 }
 
-// NOTE: If path does not exist, it will be created. If it does, it will be
-// overwritten.
-bool full_file_write (const void *data, ssize_t size, const char *path)
+void path_expander_destroy (struct path_expander_t *exp)
 {
-    bool failed = false;
+    free (exp->users);
+    mem_pool_destroy (&exp->pool);
+    *exp = (struct path_expander_t){0};
+}
 
-    // TODO: If writing fails, we will leave a blank file behind. We should make
-    // a backup in case things go wrong.
-    int file = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (file != -1) {
-        int bytes_written = 0;
-        do {
-            int status = write (file, data, size);
-            if (status == -1) {
-                printf ("Error writing %s: %s\n", path, strerror(errno));
-                failed = true;
-                break;
-            }
-            bytes_written += status;
-        } while (bytes_written != size);
-        close (file);
+// Value of the variable name[0..name_len] or NULL if it's not set. If exp is
+// NULL the current environment is used.
+char* _path_expander_getenv (struct path_expander_t *exp, const char *name, int name_len)
+{
+    if (exp == NULL) {
+        char buff[name_len + 1];
+        memcpy (buff, name, name_len);
+        buff[name_len] = '\0';
+        return getenv (buff);
+    }
 
-    } else {
-        failed = true;
-        if (errno != EACCES) {
-            // If we don't have permissions fail silently so that the caller can
-            // detect this with errno and maybe retry.
-            printf ("Error opening %s: %s\n", path, strerror(errno));
+    int lo = 0, hi = exp->env_len - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo)/2;
+        int cmp = _path_expander_env_cmp_name (exp->env[mid], name, name_len);
+        if (cmp == 0) {
+            return exp->env[mid] + name_len + 1;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
         }
     }
-
-    return failed;
+    return NULL;
 }
 
-// TODO: Make this silent, then we will be able to just call it, without needing
-// to make sure the file exists beforehand.
-char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
+// Home directory of user, or of the current user if user_len is 0. Returns
+// NULL if the user doesn't exist. Result is valid until the next call if exp
+// is NULL.
+char* _path_expander_home (struct path_expander_t *exp, const char *user, int user_len)
+{
+    if (user_len == 0) {
+        char *home = _path_expander_getenv (exp, "HOME", 4);
+        if (home != NULL) return home;
+        if (exp != NULL && exp->home != NULL) return exp->home;
+    }
+
+    if (exp != NULL) {
+        for (int i=0; i<exp->users_len; i++) {
+            if (strncmp (exp->users[i].name, user, user_len) == 0 && exp->users[i].name[user_len] == '\0') {
+                return exp->users[i].home;
+            }
+        }
+    }
+
+    char name[user_len + 1];
+    memcpy (name, user, user_len);
+    name[user_len] = '\0';
+
+    static __thread char buff[4096];
+    struct passwd pwd, *found = NULL;
+    if (user_len == 0) {
+        getpwuid_r (getuid (), &pwd, buff, sizeof(buff), &found);
+    } else {
+        getpwnam_r (name, &pwd, buff, sizeof(buff), &found);
+    }
+    char *home = found != NULL ? found->pw_dir : NULL;
+
+    if (exp != NULL) {
+        if (home != NULL) {
+            home = pom_strdup (&exp->pool, home);
+        }
+
+        if (user_len == 0) {
+            exp->home = home;
+        } else {
+            if (exp->users_len == exp->users_size) {
+                exp->users_size = exp->users_size == 0 ? 8 : 2*exp->users_size;
+                exp->users = (struct _path_expander_user_t*)realloc (exp->users, exp->users_size*sizeof(struct _path_expander_user_t));
+            }
+            exp->users[exp->users_len++] = (struct _path_expander_user_t){pom_strdup (&exp->pool, name), home};
+        }
+    }
+
+    return home;
+}
+
+// Appends c_str to out escaping glob characters.
+void _path_expand_cat_literal (string_t *out, const char *c_str, int len, bool pattern)
+{
+    if (!pattern) {
+        strn_cat_c (out, c_str, len);
+        return;
+    }
+
+    for (int i=0; i<len; i++) {
+        if (strchr ("*?[]\\", c_str[i]) != NULL) {
+            str_cat_char (out, '\\', 1);
+        }
+        str_cat_char (out, c_str[i], 1);
+    }
+}
+
+static inline
+bool _path_expand_is_name_char (char c, bool first)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+// Expands str into out. If pattern is true the result is a glob() pattern and
+// has_glob_chars is set if it contains unescaped glob characters.
+void _path_expand (struct path_expander_t *exp, char *str, string_t *out, bool pattern, bool *has_glob_chars)
+{
+    str_set (out, "");
+    char *p = str;
+
+    if (*p == '~') {
+        char *user_end = p + 1;
+        while (*user_end != '\0' && *user_end != '/') user_end++;
+
+        char *home = _path_expander_home (exp, p + 1, user_end - (p + 1));
+        if (home != NULL) {
+            _path_expand_cat_literal (out, home, strlen (home), pattern);
+            p = user_end;
+        }
+    }
+
+    while (*p != '\0') {
+        if (*p == '\\' && p[1] != '\0') {
+            _path_expand_cat_literal (out, p + 1, 1, pattern);
+            p += 2;
+
+        } else if (*p == '$' && _path_expand_is_name_char (p[1], true)) {
+            char *name = p + 1;
+            char *name_end = name;
+            while (_path_expand_is_name_char (*name_end, false)) name_end++;
+
+            str_cat_c (out, _path_expander_getenv (exp, name, name_end - name));
+            p = name_end;
+
+        } else if (*p == '$' && p[1] == '{' && _path_expand_is_name_char (p[2], true)) {
+            char *name = p + 2;
+            char *name_end = name;
+            while (_path_expand_is_name_char (*name_end, false)) name_end++;
+
+            if (*name_end == '}') {
+                str_cat_c (out, _path_expander_getenv (exp, name, name_end - name));
+                p = name_end + 1;
+            } else {
+                _path_expand_cat_literal (out, p, 1, pattern);
+                p++;
+            }
+
+        } else {
+            if (pattern && *p == '\\') {
+                str_cat_char (out, '\\', 1);
+            }
+            str_cat_char (out, *p, 1);
+            p++;
+        }
+    }
+
+    if (pattern && has_glob_chars != NULL) {
+        *has_glob_chars = false;
+        for (char *c = str_data(out); *c != '\0'; c++) {
+            if (*c == '\\' && c[1] != '\0') {
+                c++;
+            } else if (*c == '*' || *c == '?' || *c == '[') {
+                *has_glob_chars = true;
+                break;
+            }
+        }
+    }
+}
+
+char* path_expander_expand (struct path_expander_t *exp, char *str, mem_pool_t *pool)
+{
+    string_t out = {0};
+    _path_expand (exp, str, &out, false, NULL);
+    char *res = pom_strndup (pool, str_data(&out), str_len(&out));
+    str_free (&out);
+    return res;
+}
+
+// Expands str and matches it against the filesystem. Returns the number of
+// paths found and stores them, sorted like glob() does, in matches. If nothing matches, or str
+// has no glob characters, the result is the expanded string, like a shell
+// does. Returns 0 only if glob() fails.
+int path_expander_glob (struct path_expander_t *exp, char *str, mem_pool_t *pool, char ***matches)
+{
+    string_t out = {0};
+    bool has_glob_chars;
+    _path_expand (exp, str, &out, true, &has_glob_chars);
+
+    int num_matches = 0;
+    if (has_glob_chars) {
+        glob_t g;
+        int status = glob (str_data(&out), 0, NULL, &g);
+        if (status == 0) {
+            num_matches = g.gl_pathc;
+            *matches = (char**)pom_push_size (pool, num_matches*sizeof(char*));
+            for (int i=0; i<num_matches; i++) {
+                (*matches)[i] = pom_strdup (pool, g.gl_pathv[i]);
+            }
+            globfree (&g);
+
+        } else if (status == GLOB_NOMATCH) {
+            has_glob_chars = false;
+        }
+    }
+
+    if (!has_glob_chars) {
+        _path_expand (exp, str, &out, false, NULL);
+        num_matches = 1;
+        *matches = (char**)pom_push_size (pool, sizeof(char*));
+        (*matches)[0] = pom_strndup (pool, str_data(&out), str_len(&out));
+    }
+
+    str_free (&out);
+    return num_matches;
+}
+
+// Expands str using the current environment.
+char* path_expand (char *str, mem_pool_t *pool)
+{
+    return path_expander_expand (NULL, str, pool);
+}
+
+int path_expand_glob (char *str, mem_pool_t *pool, char ***matches)
+{
+    return path_expander_glob (NULL, str, pool, matches);
+}
+
+// Expands num_strs strings with a single snapshot of the environment. Returns
+// an array with the results, allocated in pool.
+char** path_expand_all (char **strs, int num_strs, mem_pool_t *pool)
+{
+    struct path_expander_t exp;
+    path_expander_init (&exp);
+
+    char **res = (char**)pom_push_size (pool, MAX(num_strs, 1)*sizeof(char*));
+    for (int i=0; i<num_strs; i++) {
+        res[i] = path_expander_expand (&exp, strs[i], pool);
+    }
+
+    path_expander_destroy (&exp);
+    return res;
+}
+
+// It's common to want absolute paths before we start a series of path
+// manipulation calls, so this is likely to be the first function to be called
+// on a string that represents a path. Because real path needs to traverse
+// folders to resolve "..", this fails if the path does not exist. Then... what
+// is the point of having separate *_exists() functions?. I think the useful
+// thing about those is for times when we already know a path is absolute and we
+// need to make multiple tests. But for a single sequence of abs_path() followed
+// by path_exists(), we can use abs_path()'s result.
+//
+// TODO: This function should probably also set a boolean value that tells the
+// caller if there was a file not found error.
+char* abs_path (char *path, mem_pool_t *pool)
+{
+    mem_pool_t l_pool = {0};
+
+    char *user_path = resolve_user_path (path, &l_pool);
+
+    char *absolute_path_m = realpath (user_path, NULL);
+    if (absolute_path_m == NULL) {
+        // NOTE: realpath() fails if the file does not exist.
+        //printf ("Error: %s (%d)\n", strerror(errno), errno);
+    }
+    char *absolute_path = pom_strdup (pool, absolute_path_m);
+    free (absolute_path_m);
+
+    mem_pool_destroy (&l_pool);
+
+    return absolute_path;
+}
+
+void str_set_path (string_t *str, char *path)
+{
+    char *user_path = resolve_user_path (path, NULL);
+    str_set (str, user_path);
+    free (user_path);
+}
+
+void file_write (int file, void *pos,  ssize_t size)
+{
+    if (write (file, pos, size) < size) {
+        printf ("Write interrupted\n");
+    }
+}
+
+void file_read (int file, void *pos,  ssize_t size)
+{
+    int bytes_read = read (file, pos, size);
+    if (bytes_read < size) {
+        printf ("Did not read full file\n"
+                "asked for: %ld\n"
+                "received: %d\n", size, bytes_read);
+    }
+}
+
+// NOTE: If path does not exist, it will be created. If it does, it will be
+// overwritten.
+bool full_file_write (const void *data, ssize_t size, const char *path)
+{
+    bool failed = false;
+
+    // NOTE: If writing fails, we will leave a blank file behind. Use
+    // file_writer_open() to atomically replace the file instead.
+    int file = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file != -1) {
+        ssize_t bytes_written = 0;
+        do {
+            ssize_t status = write (file, (char*)data + bytes_written, size - bytes_written);
+            if (status == -1) {
+                if (errno == EINTR) continue;
+
+                printf ("Error writing %s: %s\n", path, strerror(errno));
+                failed = true;
+                break;
+            }
+            bytes_written += status;
+        } while (bytes_written != size);
+        close (file);
+
+    } else {
+        failed = true;
+        if (errno != EACCES) {
+            // If we don't have permissions fail silently so that the caller can
+            // detect this with errno and maybe retry.
+            printf ("Error opening %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    return failed;
+}
+
+// TODO: Make this silent, then we will be able to just call it, without needing
+// to make sure the file exists beforehand.
+char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
 {
     bool success = true;
     char *expanded_path = NULL;
@@ -3348,20 +4313,26 @@ char* full_file_read (mem_pool_t *pool, const char *path, uint64_t *len)
 
         int file = open (path, O_RDONLY);
         if (file != -1) {
-            int bytes_read = 0;
+            uint64_t bytes_read = 0;
             do {
-                int status = read (file, loaded_data+bytes_read, st.st_size-bytes_read);
+                ssize_t status = read (file, loaded_data+bytes_read, st.st_size-bytes_read);
                 if (status == -1) {
+                    if (errno == EINTR) continue;
+
                     success = false;
                     printf ("Error reading %s: %s\n", path, strerror(errno));
                     break;
+
+                } else if (status == 0) {
+                    // File was truncated after we called stat().
+                    break;
                 }
                 bytes_read += status;
             } while (bytes_read != st.st_size);
-            loaded_data[st.st_size] = '\0';
+            loaded_data[bytes_read] = '\0';
 
             if (len != NULL) {
-                *len = st.st_size;
+                *len = bytes_read;
             }
 
             close (file);
@@ -3406,138 +4377,1709 @@ char* full_file_read_no_trailing_newline (mem_pool_t *pool, const char *path, ui
     return data;
 }
 
-bool path_exists (char *path)
-{
-    if (path == NULL) return false;
+// Memory mapped files
+//
+// file_map() returns a read only view of the content of the file at path, and
+// stores its size in len. Mapping a file is O(1), pages are only read from
+// disk when they are touched, which makes this a better alternative to
+// full_file_read() for large inputs that will be scanned once.
+//
+// The data is always followed by a '\0' byte, so it can be passed to functions
+// that expect null terminated strings. For regular files this comes for free,
+// the kernel fills the rest of the last page with zeros, only files whose size
+// is a multiple of the page size need an extra page.
+//
+// Files that can't be mapped, like pipes or files in /proc that report a size
+// of 0, are read into anonymous memory instead. Either way the result must be
+// released with file_unmap().
+//
+// Unlike full_file_read() this doesn't print anything, on failure it returns
+// NULL and errno is set.
 
-    bool retval = true;
+// Files up to this size are prefetched with MADV_WILLNEED, larger ones are only
+// read ahead as they are accessed.
+#define FILE_MAP_WILLNEED_MAX (16*1024*1024)
 
-    struct stat st;
-    int status;
-    if ((status = stat(path, &st)) == -1) {
-        retval = false;
-        if (errno != ENOENT) {
-            printf ("Error checking existance of %s: %s\n", path, strerror(errno));
-        }
-    }
-    return retval;
+static inline
+size_t file_map_size (uint64_t len)
+{
+    size_t page_size = sysconf (_SC_PAGESIZE);
+    return ((len + 1) + page_size - 1) & ~(page_size - 1);
 }
 
-bool path_isdir (char *path)
+char* file_map_read_fallback (int fd, uint64_t *len)
 {
-    if (path == NULL) return false;
+    size_t size = file_map_size (64*1024 - 1);
+    char *data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
 
-    bool retval = true;
+    uint64_t bytes_read = 0;
+    while (true) {
+        // Always keep space for the null byte.
+        if (bytes_read + 1 == size) {
+            char *new_data = mremap (data, size, 2*size, MREMAP_MAYMOVE);
+            if (new_data == MAP_FAILED) {
+                int error = errno;
+                munmap (data, size);
+                errno = error;
+                return NULL;
+            }
+            data = new_data;
+            size *= 2;
+        }
 
-    struct stat st;
-    int status;
-    if ((status = stat(path, &st)) == -1) {
-        retval = false;
-    } else {
-        if (!S_ISDIR(st.st_mode)) {
-            retval = false;
+        ssize_t status = read (fd, data + bytes_read, size - bytes_read - 1);
+        if (status == -1) {
+            if (errno == EINTR) continue;
+
+            int error = errno;
+            munmap (data, size);
+            errno = error;
+            return NULL;
+
+        } else if (status == 0) {
+            break;
         }
+
+        bytes_read += status;
     }
 
-    return retval;
-}
+    // Shrink the mapping so file_unmap() can compute its size from the length.
+    size_t final_size = file_map_size (bytes_read);
+    if (final_size < size) {
+        munmap (data + final_size, size - final_size);
+    }
+    mprotect (data, final_size, PROT_READ);
 
+    *len = bytes_read;
+    return data;
+}
 
-bool dir_exists (char *path)
+char* file_map (const char *path, uint64_t *len)
 {
-    if (path == NULL) return false;
+    assert (len != NULL);
 
-    bool retval = true;
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
 
+    char *data = NULL;
     struct stat st;
-    int status;
-    if ((status = stat(path, &st)) == -1) {
-        retval = false;
-        if (errno != ENOENT) {
-            printf ("Error checking existance of %s: %s\n", path, strerror(errno));
+    if (fstat (fd, &st) == 0) {
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            uint64_t file_len = st.st_size;
+            size_t size = file_map_size (file_len);
+
+            // Reserve space for the file plus the null byte, then map the file
+            // on top of it.
+            data = mmap (NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (data != MAP_FAILED) {
+                if (mmap (data, file_len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                    madvise (data, file_len, MADV_SEQUENTIAL);
+                    if (file_len <= FILE_MAP_WILLNEED_MAX) {
+                        madvise (data, file_len, MADV_WILLNEED);
+                    }
+                    *len = file_len;
+
+                } else {
+                    munmap (data, size);
+                    data = NULL;
+                }
+
+            } else {
+                data = NULL;
+            }
         }
 
-    } else {
-        if (!S_ISDIR(st.st_mode)) {
-            return false;
+        if (data == NULL) {
+            data = file_map_read_fallback (fd, len);
         }
     }
 
-    return retval;
+    int error = errno;
+    close (fd);
+    errno = error;
+
+    return data;
+}
+
+void file_unmap (char *data, uint64_t len)
+{
+    if (data != NULL) {
+        munmap (data, file_map_size (len));
+    }
+}
+
+// Buffered file writer
+//
+// Writes a file from many pieces without first concatenating them in memory.
+// Small pieces are copied into an internal buffer, large ones are written
+// directly from the caller's memory together with the buffered data in a
+// single writev() call, so nothing needs to stay alive after a call returns.
+//
+// Data is written to a temporary file in the same directory which replaces
+// path atomically with rename() when file_writer_close() succeeds. If anything
+// fails, or file_writer_discard() is called, the previous content of path is
+// left untouched.
+//
+//      struct file_writer_t wrtr;
+//      file_writer_open (&wrtr, path, false);
+//      file_writer_str (&wrtr, &header);
+//      for (...) {
+//          file_writer_printf (&wrtr, "%d,%s\n", id, name);
+//      }
+//      if (!file_writer_close (&wrtr)) {
+//          printf ("Error writing %s: %s\n", path, strerror(wrtr.error));
+//      }
+//
+// If sync is true, file data is flushed to disk with fdatasync() before
+// renaming, and the directory is flushed with fsync() after it so the rename
+// itself survives a crash.
+
+#define FILE_WRITER_BUFFER_SIZE (64*1024)
+
+// Pieces at least this large are not copied into the buffer.
+#define FILE_WRITER_COPY_MAX 1024
+
+struct file_writer_t {
+    int fd;
+    bool sync;
+
+    // errno of the first error, 0 if there was none. After an error all
+    // writes are ignored.
+    int error;
+
+    char *path;
+    char *tmp_path;
+
+    size_t buff_used;
+    char buff[FILE_WRITER_BUFFER_SIZE];
+};
+
+static inline
+void file_writer_set_error (struct file_writer_t *wrtr, int error)
+{
+    if (wrtr->error == 0) {
+        wrtr->error = error;
+    }
+}
+
+bool file_writer_open (struct file_writer_t *wrtr, const char *path, bool sync)
+{
+    wrtr->sync = sync;
+    wrtr->error = 0;
+    wrtr->buff_used = 0;
+    wrtr->path = strdup (path);
+
+    // We don't use mkstemp() because it creates files with 0600 permissions,
+    // open() applies the umask like full_file_write() does.
+    static int counter = 0;
+    string_t tmp_path = {0};
+    do {
+        str_set_printf (&tmp_path, "%s.tmp.%d.%d", path, (int)getpid(), __sync_fetch_and_add (&counter, 1));
+        wrtr->fd = open (str_data(&tmp_path), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    } while (wrtr->fd == -1 && errno == EEXIST);
+
+    wrtr->tmp_path = strdup (str_data(&tmp_path));
+    str_free (&tmp_path);
+
+    if (wrtr->fd == -1) {
+        file_writer_set_error (wrtr, errno);
+        return false;
+    }
+
+    // Keep the permissions of the file we are replacing.
+    struct stat st;
+    if (stat (path, &st) == 0) {
+        fchmod (wrtr->fd, st.st_mode & 07777);
+    }
+
+    return true;
+}
+
+static inline
+void file_writer_writev (struct file_writer_t *wrtr, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0 && wrtr->error == 0) {
+        ssize_t status = writev (wrtr->fd, iov, iov_count);
+        if (status == -1) {
+            if (errno != EINTR) {
+                file_writer_set_error (wrtr, errno);
+            }
+            continue;
+        }
+
+        // Skip what was written, writev() may write less than requested.
+        while (iov_count > 0 && status >= iov->iov_len) {
+            status -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + status;
+            iov->iov_len -= status;
+        }
+    }
+}
+
+void file_writer_flush (struct file_writer_t *wrtr)
+{
+    if (wrtr->buff_used > 0) {
+        struct iovec iov = {wrtr->buff, wrtr->buff_used};
+        file_writer_writev (wrtr, &iov, 1);
+        wrtr->buff_used = 0;
+    }
+}
+
+void file_writer_write (struct file_writer_t *wrtr, const void *data, size_t len)
+{
+    if (wrtr->error != 0) return;
+
+    if (len < FILE_WRITER_COPY_MAX) {
+        if (wrtr->buff_used + len > FILE_WRITER_BUFFER_SIZE) {
+            file_writer_flush (wrtr);
+        }
+
+        memcpy (wrtr->buff + wrtr->buff_used, data, len);
+        wrtr->buff_used += len;
+
+    } else {
+        struct iovec iov[2];
+        int iov_count = 0;
+        if (wrtr->buff_used > 0) {
+            iov[iov_count++] = (struct iovec){wrtr->buff, wrtr->buff_used};
+        }
+        iov[iov_count++] = (struct iovec){(void*)data, len};
+
+        file_writer_writev (wrtr, iov, iov_count);
+        wrtr->buff_used = 0;
+    }
+}
+
+#define file_writer_str(wrtr,str) file_writer_write(wrtr, str_data(str), str_len(str))
+#define file_writer_sstr(wrtr,sstr) file_writer_write(wrtr, (sstr).s, (sstr).len)
+#define file_writer_cstr(wrtr,cstr) file_writer_write(wrtr, cstr, strlen(cstr))
+
+GCC_PRINTF_FORMAT(2, 3)
+void file_writer_printf (struct file_writer_t *wrtr, const char *format, ...)
+{
+    if (wrtr->error != 0) return;
+
+    va_list args1, args2;
+    va_start (args1, format);
+    va_copy (args2, args1);
+
+    // Try to format directly into the buffer, only if it doesn't fit we flush
+    // or allocate.
+    size_t available = FILE_WRITER_BUFFER_SIZE - wrtr->buff_used;
+    size_t len = vsnprintf (wrtr->buff + wrtr->buff_used, available, format, args1);
+    va_end (args1);
+
+    if (len < available) {
+        wrtr->buff_used += len;
+
+    } else if (len < FILE_WRITER_BUFFER_SIZE) {
+        file_writer_flush (wrtr);
+        vsnprintf (wrtr->buff, FILE_WRITER_BUFFER_SIZE, format, args2);
+        wrtr->buff_used = len;
+
+    } else {
+        char *tmp_str = malloc (len + 1);
+        vsnprintf (tmp_str, len + 1, format, args2);
+        file_writer_write (wrtr, tmp_str, len);
+        free (tmp_str);
+    }
+    va_end (args2);
+}
+
+static inline
+void file_writer_free (struct file_writer_t *wrtr)
+{
+    free (wrtr->path);
+    free (wrtr->tmp_path);
+    wrtr->path = NULL;
+    wrtr->tmp_path = NULL;
+    wrtr->fd = -1;
+}
+
+// Closes the temporary file and removes it, leaving the destination untouched.
+void file_writer_discard (struct file_writer_t *wrtr)
+{
+    if (wrtr->fd != -1) {
+        close (wrtr->fd);
+        unlink (wrtr->tmp_path);
+    }
+    file_writer_free (wrtr);
+}
+
+// Flushes everything and replaces the destination. Returns false if any
+// operation failed, in that case the destination is untouched and the error
+// field contains the errno of the first error.
+bool file_writer_close (struct file_writer_t *wrtr)
+{
+    if (wrtr->fd == -1) {
+        file_writer_free (wrtr);
+        return false;
+    }
+
+    file_writer_flush (wrtr);
+
+    if (wrtr->error == 0 && wrtr->sync && fdatasync (wrtr->fd) == -1) {
+        file_writer_set_error (wrtr, errno);
+    }
+
+    if (close (wrtr->fd) == -1) {
+        file_writer_set_error (wrtr, errno);
+    }
+    wrtr->fd = -1;
+
+    if (wrtr->error == 0 && rename (wrtr->tmp_path, wrtr->path) == -1) {
+        file_writer_set_error (wrtr, errno);
+    }
+
+    bool success = wrtr->error == 0;
+    if (!success) {
+        unlink (wrtr->tmp_path);
+
+    } else if (wrtr->sync) {
+        // The destination was already replaced, if this fails we still report
+        // it because the new content may not survive a crash.
+        char *dir = ".";
+        char *slash = strrchr (wrtr->path, '/');
+        if (slash == wrtr->path) {
+            dir = "/";
+        } else if (slash != NULL) {
+            *slash = '\0';
+            dir = wrtr->path;
+        }
+
+        int dir_fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1 || fsync (dir_fd) == -1) {
+            file_writer_set_error (wrtr, errno);
+            success = false;
+        }
+
+        if (dir_fd != -1) {
+            close (dir_fd);
+        }
+    }
+
+    file_writer_free (wrtr);
+    return success;
+}
+
+// Content hashing
+//
+// 64 bit non cryptographic hash, this is XXH64 so results match other
+// implementations of it. Useful as cache keys or to find duplicate files, not
+// to protect against someone crafting collisions. Assumes a little endian
+// machine.
+//
+//      uint64_t h = hash_64 (data, len, 0);
+//
+//      struct hash_64_state_t state;
+//      hash_64_init (&state, 0);
+//      for (...) {
+//          hash_64_update (&state, piece, piece_len);
+//      }
+//      h = hash_64_final (&state);
+//
+//      if (!file_hash_64 (path, &h)) {
+//          printf ("Error hashing %s: %s\n", path, strerror(errno));
+//      }
+
+#define HASH_64_PRIME_1 0x9E3779B185EBCA87ULL
+#define HASH_64_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_64_PRIME_3 0x165667B19E3779F9ULL
+#define HASH_64_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define HASH_64_PRIME_5 0x27D4EB2F165667C5ULL
+
+struct hash_64_state_t {
+    uint64_t total_len;
+    uint64_t seed;
+    uint64_t acc[4];
+
+    // Input that doesn't fill a 32 byte stripe yet.
+    unsigned char buff[32];
+    uint32_t buff_len;
+};
+
+static inline
+uint64_t _hash_64_rotl (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline
+uint64_t _hash_64_read_64 (const unsigned char *p)
+{
+    uint64_t v;
+    memcpy (&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+uint32_t _hash_64_read_32 (const unsigned char *p)
+{
+    uint32_t v;
+    memcpy (&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+uint64_t _hash_64_round (uint64_t acc, uint64_t input)
+{
+    acc += input * HASH_64_PRIME_2;
+    acc = _hash_64_rotl (acc, 31);
+    return acc * HASH_64_PRIME_1;
+}
+
+static inline
+uint64_t _hash_64_merge_round (uint64_t h, uint64_t acc)
+{
+    h ^= _hash_64_round (0, acc);
+    return h * HASH_64_PRIME_1 + HASH_64_PRIME_4;
+}
+
+static inline
+void _hash_64_acc_init (uint64_t *acc, uint64_t seed)
+{
+    acc[0] = seed + HASH_64_PRIME_1 + HASH_64_PRIME_2;
+    acc[1] = seed + HASH_64_PRIME_2;
+    acc[2] = seed;
+    acc[3] = seed - HASH_64_PRIME_1;
+}
+
+// Consumes as many complete 32 byte stripes as possible, returns the number of
+// bytes consumed.
+static inline
+size_t _hash_64_stripes (uint64_t *acc, const unsigned char *p, size_t len)
+{
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    const unsigned char *start = p;
+    const unsigned char *limit = p + (len & ~(size_t)31);
+    while (p < limit) {
+        a0 = _hash_64_round (a0, _hash_64_read_64 (p));
+        a1 = _hash_64_round (a1, _hash_64_read_64 (p + 8));
+        a2 = _hash_64_round (a2, _hash_64_read_64 (p + 16));
+        a3 = _hash_64_round (a3, _hash_64_read_64 (p + 24));
+        p += 32;
+    }
+    acc[0] = a0; acc[1] = a1; acc[2] = a2; acc[3] = a3;
+    return p - start;
+}
+
+static inline
+uint64_t _hash_64_acc_merge (uint64_t *acc)
+{
+    uint64_t h = _hash_64_rotl (acc[0], 1) + _hash_64_rotl (acc[1], 7) +
+                 _hash_64_rotl (acc[2], 12) + _hash_64_rotl (acc[3], 18);
+    for (int i=0; i<4; i++) {
+        h = _hash_64_merge_round (h, acc[i]);
+    }
+    return h;
+}
+
+// Mixes the last len (< 32) bytes into h.
+uint64_t _hash_64_finalize (uint64_t h, const unsigned char *p, size_t len)
+{
+    while (len >= 8) {
+        h ^= _hash_64_round (0, _hash_64_read_64 (p));
+        h = _hash_64_rotl (h, 27) * HASH_64_PRIME_1 + HASH_64_PRIME_4;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len >= 4) {
+        h ^= (uint64_t)_hash_64_read_32 (p) * HASH_64_PRIME_1;
+        h = _hash_64_rotl (h, 23) * HASH_64_PRIME_2 + HASH_64_PRIME_3;
+        p += 4;
+        len -= 4;
+    }
+
+    while (len > 0) {
+        h ^= (*p) * HASH_64_PRIME_5;
+        h = _hash_64_rotl (h, 11) * HASH_64_PRIME_1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_64_PRIME_2;
+    h ^= h >> 29;
+    h *= HASH_64_PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_64 (const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char*)data;
+
+    uint64_t h;
+    size_t consumed = 0;
+    if (len >= 32) {
+        uint64_t acc[4];
+        _hash_64_acc_init (acc, seed);
+        consumed = _hash_64_stripes (acc, p, len);
+        h = _hash_64_acc_merge (acc);
+    } else {
+        h = seed + HASH_64_PRIME_5;
+    }
+    h += len;
+
+    return _hash_64_finalize (h, p + consumed, len - consumed);
+}
+
+void hash_64_init (struct hash_64_state_t *state, uint64_t seed)
+{
+    *state = (struct hash_64_state_t){0};
+    state->seed = seed;
+    _hash_64_acc_init (state->acc, seed);
+}
+
+void hash_64_update (struct hash_64_state_t *state, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    state->total_len += len;
+
+    if (state->buff_len > 0) {
+        size_t fill = MIN (len, 32 - state->buff_len);
+        memcpy (state->buff + state->buff_len, p, fill);
+        state->buff_len += fill;
+        p += fill;
+        len -= fill;
+
+        if (state->buff_len < 32) return;
+        _hash_64_stripes (state->acc, state->buff, 32);
+        state->buff_len = 0;
+    }
+
+    size_t consumed = _hash_64_stripes (state->acc, p, len);
+    memcpy (state->buff, p + consumed, len - consumed);
+    state->buff_len = len - consumed;
+}
+
+// Doesn't modify the state, more data can be added after calling this.
+uint64_t hash_64_final (struct hash_64_state_t *state)
+{
+    uint64_t h;
+    if (state->total_len >= 32) {
+        uint64_t acc[4];
+        memcpy (acc, state->acc, sizeof(acc));
+        h = _hash_64_acc_merge (acc);
+    } else {
+        h = state->seed + HASH_64_PRIME_5;
+    }
+    h += state->total_len;
+
+    return _hash_64_finalize (h, state->buff, state->buff_len);
+}
+
+// Files are read in pieces of this size, files that fit are hashed in one call.
+#define FILE_HASH_BUFFER_SIZE (256*1024)
+
+// Hashes the content of the file at path with read() calls into buff, which
+// must have FILE_HASH_BUFFER_SIZE bytes. If size isn't NULL the number of
+// bytes hashed is stored there.
+//
+// Only regular files are hashed, anything else fails with EISDIR for
+// directories and EINVAL otherwise. The file is opened with O_NONBLOCK so
+// opening a FIFO doesn't wait for a writer.
+bool _file_hash_64 (const char *path, char *buff, uint64_t *hash, uint64_t *size)
+{
+    int fd = open (path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1) {
+        int error = errno;
+        close (fd);
+        errno = error;
+        return false;
+
+    } else if (!S_ISREG(st.st_mode)) {
+        close (fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return false;
+    }
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct hash_64_state_t state;
+    hash_64_init (&state, 0);
+
+    bool success = true;
+    bool first = true;
+    while (true) {
+        // Fill the buffer completely so small files take a single call to
+        // hash_64() and large ones are hashed in big pieces.
+        size_t buff_len = 0;
+        while (buff_len < FILE_HASH_BUFFER_SIZE) {
+            ssize_t status = read (fd, buff + buff_len, FILE_HASH_BUFFER_SIZE - buff_len);
+            if (status == -1) {
+                if (errno == EINTR) continue;
+                success = false;
+                break;
+            } else if (status == 0) {
+                break;
+            }
+            buff_len += status;
+        }
+        if (!success) break;
+
+        if (first && buff_len < FILE_HASH_BUFFER_SIZE) {
+            *hash = hash_64 (buff, buff_len, 0);
+            if (size != NULL) *size = buff_len;
+            break;
+        }
+        first = false;
+
+        hash_64_update (&state, buff, buff_len);
+        if (buff_len < FILE_HASH_BUFFER_SIZE) {
+            *hash = hash_64_final (&state);
+            if (size != NULL) *size = state.total_len;
+            break;
+        }
+    }
+
+    int error = errno;
+    close (fd);
+    errno = error;
+    return success;
+}
+
+// Hashes the content of the file at path, gives the same result as calling
+// hash_64() on it with a seed of 0. Returns false and sets errno on failure,
+// nothing is printed.
+bool file_hash_64 (const char *path, uint64_t *hash)
+{
+    char *buff = (char*)malloc (FILE_HASH_BUFFER_SIZE);
+    bool success = _file_hash_64 (path, buff, hash, NULL);
+
+    int error = errno;
+    free (buff);
+    errno = error;
+    return success;
+}
+
+// Block compression
+//
+// LZ77 compressor using the LZ4 block format: a sequence of tokens, each one
+// with a run of literals followed by a match of at least 4 bytes at a distance
+// of up to 64 KiB. Compression uses a single hash table probe per position, so
+// it's fast but the ratio is lower than zlib's. Decompression is a loop of
+// memory copies.
+//
+// lz_compress() produces a frame that can be stored and given back to
+// lz_decompress():
+//
+//      magic       u32  LZ_FRAME_MAGIC
+//      reserved    u32  0
+//      size        u64  size of the original data
+//      blocks           one for each LZ_BLOCK_SIZE bytes of original data
+//          len     u32  size of the block data, if LZ_BLOCK_STORED is set the
+//                       data is stored uncompressed
+//          data
+//      checksum    u64  hash_64() of the original data
+//
+// All integers are little endian. Blocks are independent from each other.
+
+#define LZ_FRAME_MAGIC 0x315A4C43 // "CLZ1"
+#define LZ_BLOCK_SIZE (1024*1024)
+#define LZ_BLOCK_STORED 0x80000000u
+
+#define LZ_MIN_MATCH 4
+// The last match must start at least 12 bytes before the end of the block and
+// the last 5 bytes are always literals. This lets the decompressor copy in
+// chunks without checking every byte.
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_DISTANCE 65535
+#define LZ_HASH_BITS 13
+
+static inline
+uint32_t _lz_read_32 (const unsigned char *p)
+{
+    uint32_t v;
+    memcpy (&v, p, sizeof(v));
+    return v;
+}
+
+static inline
+uint32_t _lz_hash (uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Returns the number of equal bytes at a and b, reading no further than limit.
+static inline
+size_t _lz_match_len (const unsigned char *a, const unsigned char *b, const unsigned char *limit)
+{
+    const unsigned char *start = a;
+    while (a + 8 <= limit) {
+        uint64_t va, vb;
+        memcpy (&va, a, 8);
+        memcpy (&vb, b, 8);
+        uint64_t diff = va ^ vb;
+        if (diff != 0) {
+            return (a - start) + (__builtin_ctzll (diff) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// Writes a length that didn't fit in its 4 bits of the token.
+static inline
+unsigned char* _lz_put_len (unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Compresses src into dst, which has space for dst_cap bytes. Returns the
+// compressed size, or 0 if it didn't fit.
+size_t lz_compress_block (const void *src, size_t src_len, void *dst, size_t dst_cap)
+{
+    const unsigned char *base = (const unsigned char*)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + src_len;
+    unsigned char *op = (unsigned char*)dst;
+    unsigned char *op_end = op + dst_cap;
+
+    if (src_len > LZ_MF_LIMIT) {
+        const unsigned char *mf_limit = end - LZ_MF_LIMIT;
+        const unsigned char *match_limit = end - LZ_LAST_LITERALS;
+
+        uint32_t table[1<<LZ_HASH_BITS];
+        memset (table, 0, sizeof(table));
+
+        ip++;
+        while (true) {
+            // Look for a match. Skip faster over data that doesn't compress.
+            const unsigned char *ref;
+            uint32_t attempts = 1 << 6;
+            while (true) {
+                if (ip > mf_limit) goto last_literals;
+
+                uint32_t seq = _lz_read_32 (ip);
+                uint32_t h = _lz_hash (seq);
+                ref = base + table[h];
+                table[h] = ip - base;
+                if (ip - ref <= LZ_MAX_DISTANCE && _lz_read_32 (ref) == seq) {
+                    break;
+                }
+                ip += attempts++ >> 6;
+            }
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            size_t lit_len = ip - anchor;
+            size_t match_len = LZ_MIN_MATCH + _lz_match_len (ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, match_limit);
+
+            // Token, literals, offset and both lengths.
+            if (op + 1 + lit_len + lit_len/255 + 2 + match_len/255 + 2 > op_end) {
+                return 0;
+            }
+
+            unsigned char *token = op++;
+            if (lit_len >= 15) {
+                *token = 15 << 4;
+                op = _lz_put_len (op, lit_len - 15);
+            } else {
+                *token = lit_len << 4;
+            }
+            memcpy (op, anchor, lit_len);
+            op += lit_len;
+
+            uint16_t offset = ip - ref;
+            *op++ = offset & 0xFF;
+            *op++ = offset >> 8;
+
+            size_t ml = match_len - LZ_MIN_MATCH;
+            if (ml >= 15) {
+                *token |= 15;
+                op = _lz_put_len (op, ml - 15);
+            } else {
+                *token |= ml;
+            }
+
+            ip += match_len;
+            anchor = ip;
+            if (ip > mf_limit) break;
+
+            table[_lz_hash (_lz_read_32 (ip - 2))] = ip - 2 - base;
+        }
+    }
+
+last_literals:
+    {
+        size_t lit_len = end - anchor;
+        if (op + 1 + lit_len + lit_len/255 + 1 > op_end) {
+            return 0;
+        }
+
+        if (lit_len >= 15) {
+            *op++ = 15 << 4;
+            op = _lz_put_len (op, lit_len - 15);
+        } else {
+            *op++ = lit_len << 4;
+        }
+        memcpy (op, anchor, lit_len);
+        op += lit_len;
+    }
+
+    return op - (unsigned char*)dst;
+}
+
+// Copies 16 bytes at a time from src to dst until reaching dst_end. Can read
+// and write up to 15 bytes past the end.
+static inline
+void _lz_wild_copy_16 (unsigned char *dst, const unsigned char *src, unsigned char *dst_end)
+{
+    do {
+        memcpy (dst, src, 16);
+        dst += 16;
+        src += 16;
+    } while (dst < dst_end);
+}
+
+// Copies a match with an offset smaller than 16, which overlaps the bytes it
+// writes. The first 8 bytes are copied so that afterwards ref is a whole
+// number of repetitions of the pattern and at least 8 bytes behind op, then the
+// rest is copied in 8 byte chunks. Can write up to 7 bytes past match_end.
+static inline
+void _lz_copy_pattern (unsigned char *op, const unsigned char *ref, size_t offset, unsigned char *match_end)
+{
+    static const int inc[8] = {0, 1, 2, 1, 0, 4, 4, 4};
+    static const int dec[8] = {0, 0, 0, -1, -4, 1, 2, 3};
+
+    if (offset < 8) {
+        op[0] = ref[0];
+        op[1] = ref[1];
+        op[2] = ref[2];
+        op[3] = ref[3];
+        ref += inc[offset];
+        memcpy (op + 4, ref, 4);
+        ref -= dec[offset];
+    } else {
+        memcpy (op, ref, 8);
+        ref += 8;
+    }
+    op += 8;
+
+    while (op < match_end) {
+        memcpy (op, ref, 8);
+        op += 8;
+        ref += 8;
+    }
+}
+
+// Decompresses a block of src_len bytes into dst, which must have space for
+// dst_len bytes. Returns the decompressed size or -1 if the block is invalid.
+// It's safe to call on untrusted data, nothing is read or written outside of
+// the buffers.
+ssize_t lz_decompress_block (const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+    const unsigned char *ip = (const unsigned char*)src;
+    const unsigned char *ip_end = ip + src_len;
+    unsigned char *op = (unsigned char*)dst;
+    unsigned char *op_start = op;
+    unsigned char *op_end = op + dst_len;
+
+    // Sequences that start before these limits are followed by at least 32
+    // bytes in both buffers, enough to copy short literals and matches with a
+    // few fixed size moves that may run past their end.
+    const unsigned char *ip_fast_end = src_len > 32 ? ip_end - 32 : ip;
+    unsigned char *op_fast_end = dst_len > 32 ? op_end - 32 : op;
+
+    while (ip < ip_end) {
+        while (ip < ip_fast_end && op < op_fast_end) {
+            const unsigned char *seq_ip = ip;
+            unsigned char *seq_op = op;
+            unsigned token = *ip++;
+            size_t lit_len = token >> 4;
+            size_t match_len = token & 15;
+
+            if (lit_len < 15) {
+                memcpy (op, ip, 16);
+            } else {
+                unsigned s;
+                do {
+                    if (ip >= ip_end) return -1;
+                    s = *ip++;
+                    lit_len += s;
+                } while (s == 255);
+
+                if (ip > ip_fast_end ||
+                    lit_len > (size_t)(ip_fast_end - ip) || lit_len > (size_t)(op_fast_end - op)) {
+                    ip = seq_ip;
+                    op = seq_op;
+                    break;
+                }
+                _lz_wild_copy_16 (op, ip, op + lit_len);
+            }
+            ip += lit_len;
+            op += lit_len;
+
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            // Also rejects an offset of 0, which wraps around.
+            if (offset - 1 >= (size_t)(op - op_start)) return -1;
+            unsigned char *ref = op - offset;
+
+            if (match_len < 15 && offset >= 8) {
+                // The common case, at most 18 bytes that can be copied 8 at a
+                // time without overlapping.
+                memcpy (op, ref, 8);
+                memcpy (op + 8, ref + 8, 8);
+                memcpy (op + 16, ref + 16, 2);
+                op += match_len + LZ_MIN_MATCH;
+                continue;
+            }
+
+            if (match_len == 15) {
+                unsigned s;
+                do {
+                    if (ip >= ip_end) return -1;
+                    s = *ip++;
+                    match_len += s;
+                } while (s == 255);
+            }
+            match_len += LZ_MIN_MATCH;
+
+            if (match_len > (size_t)(op_end - op) || (size_t)(op_end - op) - match_len < 16) {
+                ip = seq_ip;
+                op = seq_op;
+                break;
+            }
+
+            unsigned char *match_end = op + match_len;
+            if (offset >= 16) {
+                _lz_wild_copy_16 (op, ref, match_end);
+            } else {
+                _lz_copy_pattern (op, ref, offset, match_end);
+            }
+            op = match_end;
+        }
+
+        if (ip >= ip_end) break;
+
+        // Sequences close to the end of the buffers, or too long to fit in the
+        // space left before them, check every length before copying.
+        unsigned token = *ip++;
+        size_t lit_len = token >> 4;
+        size_t match_len = token & 15;
+
+        if (lit_len == 15) {
+            unsigned s;
+            do {
+                if (ip >= ip_end) return -1;
+                s = *ip++;
+                lit_len += s;
+            } while (s == 255);
+        }
+
+        if (lit_len > (size_t)(ip_end - ip) || lit_len > (size_t)(op_end - op)) return -1;
+        if ((size_t)(ip_end - ip) - lit_len >= 16 && (size_t)(op_end - op) - lit_len >= 16) {
+            _lz_wild_copy_16 (op, ip, op + lit_len);
+        } else {
+            memcpy (op, ip, lit_len);
+        }
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == ip_end) break; // Last literals
+
+        if (ip + 2 > ip_end) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (match_len == 15) {
+            unsigned s;
+            do {
+                if (ip >= ip_end) return -1;
+                s = *ip++;
+                match_len += s;
+            } while (s == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - op_start)) return -1;
+        if (match_len > (size_t)(op_end - op)) return -1;
+
+        unsigned char *ref = op - offset;
+        unsigned char *match_end = op + match_len;
+        if ((size_t)(op_end - match_end) < 16) {
+            while (op < match_end) *op++ = *ref++;
+
+        } else if (offset >= 16) {
+            // Chunks don't overlap the data they copy, what's written past
+            // the end of the match is overwritten later.
+            _lz_wild_copy_16 (op, ref, match_end);
+
+        } else {
+            _lz_copy_pattern (op, ref, offset, match_end);
+        }
+        op = match_end;
+    }
+
+    return op - op_start;
+}
+
+static inline
+void _lz_put_32 (unsigned char *p, uint32_t v)
+{
+    memcpy (p, &v, sizeof(v));
+}
+
+static inline
+void _lz_put_64 (unsigned char *p, uint64_t v)
+{
+    memcpy (p, &v, sizeof(v));
+}
+
+// Maximum size of a frame for len bytes of data.
+static inline
+size_t lz_frame_bound (size_t len)
+{
+    size_t num_blocks = (len + LZ_BLOCK_SIZE - 1)/LZ_BLOCK_SIZE;
+    return 16 + 4*num_blocks + len + 8;
+}
+
+// Returns a frame with the compressed data, allocated in pool or with malloc()
+// if pool is NULL. Its size is stored in out_len.
+char* lz_compress (mem_pool_t *pool, const void *data, size_t len, size_t *out_len)
+{
+    unsigned char *frame = (unsigned char*)pom_push_size (pool, lz_frame_bound (len));
+    _lz_put_32 (frame, LZ_FRAME_MAGIC);
+    _lz_put_32 (frame + 4, 0);
+    _lz_put_64 (frame + 8, len);
+
+    unsigned char *op = frame + 16;
+    const unsigned char *ip = (const unsigned char*)data;
+    size_t remaining = len;
+    while (remaining > 0) {
+        size_t block_len = MIN (remaining, LZ_BLOCK_SIZE);
+
+        // Blocks that don't get smaller are stored as they are.
+        size_t compressed = lz_compress_block (ip, block_len, op + 4, block_len - 1);
+        if (compressed > 0) {
+            _lz_put_32 (op, compressed);
+        } else {
+            compressed = block_len;
+            _lz_put_32 (op, compressed | LZ_BLOCK_STORED);
+            memcpy (op + 4, ip, block_len);
+        }
+
+        op += 4 + compressed;
+        ip += block_len;
+        remaining -= block_len;
+    }
+
+    _lz_put_64 (op, hash_64 (data, len, 0));
+    op += 8;
+
+    *out_len = op - frame;
+    return (char*)frame;
+}
+
+// Reads the original size from a frame header. Returns false if data doesn't
+// start with a frame header.
+bool lz_frame_size (const void *data, size_t len, uint64_t *size)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    if (len < 24 || _lz_read_32 (p) != LZ_FRAME_MAGIC) {
+        return false;
+    }
+
+    memcpy (size, p + 8, sizeof(*size));
+    return true;
+}
+
+// Decompresses a frame into dst, which must have space for the size returned
+// by lz_frame_size(). Returns false if the frame is invalid or the checksum
+// doesn't match.
+bool lz_decompress_into (const void *data, size_t len, void *dst, uint64_t dst_len)
+{
+    uint64_t size;
+    if (!lz_frame_size (data, len, &size) || size != dst_len) {
+        return false;
+    }
+
+    const unsigned char *ip = (const unsigned char*)data + 16;
+    const unsigned char *ip_end = (const unsigned char*)data + len - 8;
+    unsigned char *op = (unsigned char*)dst;
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        if (ip_end - ip < 4) return false;
+
+        uint32_t block_header = _lz_read_32 (ip);
+        size_t block_len = block_header & ~LZ_BLOCK_STORED;
+        size_t expected = MIN (remaining, LZ_BLOCK_SIZE);
+        ip += 4;
+        if (block_len > (size_t)(ip_end - ip)) return false;
+
+        if (block_header & LZ_BLOCK_STORED) {
+            if (block_len != expected) return false;
+            memcpy (op, ip, block_len);
+        } else if (lz_decompress_block (ip, block_len, op, expected) != (ssize_t)expected) {
+            return false;
+        }
+
+        ip += block_len;
+        op += expected;
+        remaining -= expected;
+    }
+
+    uint64_t checksum;
+    memcpy (&checksum, ip_end, sizeof(checksum));
+    return ip == ip_end && checksum == hash_64 (dst, size, 0);
+}
+
+// Returns the decompressed content of a frame, followed by a null byte so text
+// can be used directly. Memory is allocated in pool, or with malloc() if pool
+// is NULL. Returns NULL if the frame is invalid.
+char* lz_decompress (mem_pool_t *pool, const void *data, size_t len, uint64_t *out_len)
+{
+    // A byte of compressed data can't expand to more than 255 bytes, don't
+    // trust a header that says otherwise.
+    uint64_t size;
+    if (!lz_frame_size (data, len, &size) || size/255 > len) {
+        return NULL;
+    }
+
+    mem_pool_marker_t mrk;
+    if (pool != NULL) {
+        mrk = mem_pool_begin_temporary_memory (pool);
+    }
+
+    char *res = (char*)pom_push_size (pool, size + 1);
+    if (!lz_decompress_into (data, len, res, size)) {
+        if (pool != NULL) {
+            mem_pool_end_temporary_memory (mrk);
+        } else {
+            free (res);
+        }
+        return NULL;
+    }
+    res[size] = '\0';
+
+    if (out_len != NULL) {
+        *out_len = size;
+    }
+    return res;
+}
+
+// Like full_file_write() but stores the data compressed with lz_compress().
+// Returns true on failure, same as full_file_write().
+bool full_file_write_compressed (const void *data, ssize_t size, const char *path)
+{
+    size_t compressed_len;
+    char *compressed = lz_compress (NULL, data, size, &compressed_len);
+    bool failed = full_file_write (compressed, compressed_len, path);
+    free (compressed);
+    return failed;
+}
+
+// Reads a file written by full_file_write_compressed(). Like full_file_read()
+// the result is null terminated and errors are printed.
+char* full_file_read_compressed (mem_pool_t *pool, const char *path, uint64_t *len)
+{
+    uint64_t compressed_len;
+    char *compressed = file_map (path, &compressed_len);
+    if (compressed == NULL) {
+        printf ("Could not read %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char *data = lz_decompress (pool, compressed, compressed_len, len);
+    if (data == NULL) {
+        printf ("Invalid compressed file %s\n", path);
+    }
+
+    file_unmap (compressed, compressed_len);
+    return data;
+}
+
+bool path_exists (char *path)
+{
+    if (path == NULL) return false;
+
+    bool retval = true;
+
+    struct stat st;
+    int status;
+    if ((status = stat(path, &st)) == -1) {
+        retval = false;
+        if (errno != ENOENT) {
+            printf ("Error checking existance of %s: %s\n", path, strerror(errno));
+        }
+    }
+    return retval;
+}
+
+bool path_isdir (char *path)
+{
+    if (path == NULL) return false;
+
+    bool retval = true;
+
+    struct stat st;
+    int status;
+    if ((status = stat(path, &st)) == -1) {
+        retval = false;
+    } else {
+        if (!S_ISDIR(st.st_mode)) {
+            retval = false;
+        }
+    }
+
+    return retval;
+}
+
+
+bool dir_exists (char *path)
+{
+    if (path == NULL) return false;
+
+    bool retval = true;
+
+    struct stat st;
+    int status;
+    if ((status = stat(path, &st)) == -1) {
+        retval = false;
+        if (errno != ENOENT) {
+            printf ("Error checking existance of %s: %s\n", path, strerror(errno));
+        }
+
+    } else {
+        if (!S_ISDIR(st.st_mode)) {
+            return false;
+        }
+    }
+
+    return retval;
+}
+
+// NOTE: Returns false if there was an error creating the directory.
+#define ensure_dir_exists(path) path_ensure_dir(path)
+bool path_ensure_dir (char *path)
+{
+    bool retval = true;
+
+    // Creating the directory directly tells us if it already existed, no need
+    // to stat() it first.
+    if (mkdir (path, 0777) == -1 && errno != EEXIST) {
+        printf ("Could not create %s: %s\n", path, strerror (errno));
+        retval = false;
+    }
+
+    return retval;
+}
+
+// Creates the directory path[0..len] and any missing parent. path must be
+// writable, it's temporarily modified.
+bool _path_mkdir_parents (char *path, int len)
+{
+    char c = path[len];
+    path[len] = '\0';
+    int status = mkdir (path, 0777);
+    int error = errno;
+    path[len] = c;
+
+    if (status == 0 || error == EEXIST) {
+        return true;
+
+    } else if (error == ENOENT) {
+        // Parent is missing, create it and try again.
+        int parent_len = len;
+        while (parent_len > 0 && path[parent_len-1] != '/') parent_len--;
+        while (parent_len > 1 && path[parent_len-1] == '/') parent_len--;
+
+        if (parent_len > 0 && parent_len < len && _path_mkdir_parents (path, parent_len)) {
+            path[len] = '\0';
+            status = mkdir (path, 0777);
+            error = errno;
+            path[len] = c;
+            if (status == 0 || error == EEXIST) {
+                return true;
+            }
+        }
+    }
+
+    path[len] = '\0';
+    printf ("Error creating %s: %s\n", path, strerror (error));
+    path[len] = c;
+    return false;
+}
+
+// Checks if path exists (either as a file or directory). If it doesn't it tries
+// to create all directories required for it to exist. If path ends in / then
+// all components are checked, otherwise the last part after / is assumed to be
+// a filename and is not created as a directory.
+//
+// Missing directories are created starting from the deepest one, so when only
+// the last directory is missing this takes a few system calls regardless of
+// the depth of the path. Use struct dir_cache_t when creating many paths that
+// share parent directories.
+bool ensure_path_exists (char *path_str)
+{
+    struct stat st;
+    if (stat(path_str, &st) == 0) {
+        // Path exists. Maybe check if it's the same type as on path, either
+        // file or directory?.
+        return true;
+
+    } else if (errno != ENOENT) {
+        printf ("Error ensuring path for %s: %s\n", path_str, strerror(errno));
+        return false;
+    }
+
+    // Create a duplicate so we don't write over the passed path
+    string_t _path = {0};
+    str_set (&_path, path_str);
+    char *path = str_data(&_path);
+
+    int len = str_len (&_path);
+    while (len > 0 && path[len-1] != '/') len--;
+    while (len > 1 && path[len-1] == '/') len--;
+
+    bool success = true;
+    if (len > 0) {
+        success = _path_mkdir_parents (path, len);
+    }
+
+    str_free (&_path);
+
+    return success;
+}
+
+// Directory creation cache
+//
+// Remembers directories known to exist, and keeps file descriptors for them so
+// missing directories are created with mkdirat() relative to their closest
+// known parent. Meant for programs that write many files into a nested layout,
+// once a directory is in the cache ensuring it exists takes no system calls.
+//
+//      struct dir_cache_t cache = {0};
+//      for (...) {
+//          int fd = dir_cache_open (&cache, path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+//          ...
+//      }
+//      dir_cache_destroy (&cache);
+//
+// The cache assumes directories are not removed while it's in use. If a cached
+// parent is found to be gone the cache is cleared and the path created again
+// from scratch, but a directory that is itself in the cache will be reported
+// as existing. Call dir_cache_clear() after removing directories.
+//
+// Nothing is printed, on failure errno is set.
+#define DIR_CACHE_DEFAULT_MAX_FDS 256
+
+struct _dir_cache_entry_t {
+    char *path; // NULL for empty slots
+    uint32_t len;
+    uint32_t hash;
+    int fd; // -1 if not open
+};
+
+struct dir_cache_t {
+    mem_pool_t pool;
+
+    // Hash table with open addressing.
+    struct _dir_cache_entry_t *table;
+    uint32_t table_size;
+    uint32_t num_entries;
+
+    // Maximum number of directory file descriptors kept open, 0 means
+    // DIR_CACHE_DEFAULT_MAX_FDS.
+    int max_fds;
+    int num_fds;
+};
+
+static inline
+uint32_t _dir_cache_hash (char *path, uint32_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i=0; i<len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the slot for path, which is empty if it's not in the cache.
+struct _dir_cache_entry_t* _dir_cache_lookup (struct dir_cache_t *cache, char *path, uint32_t len, uint32_t hash)
+{
+    if (cache->table_size == 0) return NULL;
+
+    uint32_t mask = cache->table_size - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct _dir_cache_entry_t *entry = &cache->table[i];
+        if (entry->path == NULL ||
+            (entry->hash == hash && entry->len == len && memcmp (entry->path, path, len) == 0)) {
+            return entry;
+        }
+    }
+}
+
+void _dir_cache_insert (struct dir_cache_t *cache, char *path, uint32_t len, uint32_t hash, int fd)
+{
+    if (10*(cache->num_entries + 1) > 7*cache->table_size) {
+        struct _dir_cache_entry_t *old_table = cache->table;
+        uint32_t old_size = cache->table_size;
+
+        cache->table_size = old_size == 0 ? 256 : 2*old_size;
+        cache->table = (struct _dir_cache_entry_t*)calloc (cache->table_size, sizeof(struct _dir_cache_entry_t));
+        for (uint32_t i=0; i<old_size; i++) {
+            if (old_table[i].path != NULL) {
+                *_dir_cache_lookup (cache, old_table[i].path, old_table[i].len, old_table[i].hash) = old_table[i];
+            }
+        }
+        free (old_table);
+    }
+
+    struct _dir_cache_entry_t *entry = _dir_cache_lookup (cache, path, len, hash);
+    if (entry->path == NULL) {
+        entry->path = pom_strndup (&cache->pool, path, len);
+        entry->len = len;
+        entry->hash = hash;
+        entry->fd = fd;
+        cache->num_entries++;
+    }
+}
+
+void dir_cache_clear (struct dir_cache_t *cache)
+{
+    for (uint32_t i=0; i<cache->table_size; i++) {
+        if (cache->table[i].fd != -1 && cache->table[i].path != NULL) {
+            close (cache->table[i].fd);
+        }
+    }
+    free (cache->table);
+    mem_pool_destroy (&cache->pool);
+
+    int max_fds = cache->max_fds;
+    *cache = (struct dir_cache_t){0};
+    cache->max_fds = max_fds;
+}
+
+void dir_cache_destroy (struct dir_cache_t *cache)
+{
+    dir_cache_clear (cache);
+}
+
+static inline
+uint32_t _dir_cache_trim (char *path, uint32_t len)
+{
+    while (len > 1 && path[len-1] == '/') len--;
+    return len;
+}
+
+bool _dir_cache_ensure_dir (struct dir_cache_t *cache, char *path, uint32_t len, bool retry)
+{
+    len = _dir_cache_trim (path, len);
+    if (len == 0) return true;
+
+    uint32_t hash = _dir_cache_hash (path, len);
+    struct _dir_cache_entry_t *entry = _dir_cache_lookup (cache, path, len, hash);
+    if (entry != NULL && entry->path != NULL) {
+        return true;
+    }
+
+    // Look for the closest parent in the cache.
+    int base_fd = AT_FDCWD;
+    uint32_t start = 0;
+    for (uint32_t prefix = len; prefix > 0; ) {
+        while (prefix > 0 && path[prefix-1] != '/') prefix--;
+        if (prefix == 0) break;
+
+        uint32_t prefix_len = _dir_cache_trim (path, prefix - 1);
+        if (prefix_len == 0) break;
+
+        entry = _dir_cache_lookup (cache, path, prefix_len, _dir_cache_hash (path, prefix_len));
+        if (entry != NULL && entry->path != NULL) {
+            start = prefix;
+            base_fd = entry->fd;
+            if (base_fd == -1) {
+                base_fd = open (entry->path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+                if (base_fd == -1) {
+                    base_fd = AT_FDCWD;
+                    start = 0;
+                }
+            }
+            break;
+        }
+        prefix = prefix_len;
+    }
+    bool base_owned = start > 0 && (entry == NULL || entry->fd != base_fd);
+
+    int max_fds = cache->max_fds > 0 ? cache->max_fds : DIR_CACHE_DEFAULT_MAX_FDS;
+    char *name = (char*)malloc (len + 1);
+    bool success = true;
+    bool stale = false;
+
+    // Create the remaining components one at a time. Without a cached parent
+    // names are relative to the working directory and include the prefix.
+    uint32_t name_start = start;
+    for (uint32_t end = start; success && end < len; ) {
+        while (end < len && path[end] == '/') end++;
+        while (end < len && path[end] != '/') end++;
+
+        char *name_src = base_fd == AT_FDCWD ? path : path + name_start;
+        uint32_t name_len = (path + end) - name_src;
+        memcpy (name, name_src, name_len);
+        name[name_len] = '\0';
+
+        if (mkdirat (base_fd, name, 0777) == -1 && errno != EEXIST) {
+            stale = errno == ENOENT && base_fd != AT_FDCWD;
+            success = false;
+            break;
+        }
+
+        int fd = openat (base_fd, name, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        if (fd == -1) {
+            success = false;
+            break;
+        }
+
+        bool keep_fd = cache->num_fds < max_fds;
+        _dir_cache_insert (cache, path, end, _dir_cache_hash (path, end), keep_fd ? fd : -1);
+        if (keep_fd) cache->num_fds++;
+
+        if (base_owned) close (base_fd);
+        base_fd = fd;
+        base_owned = !keep_fd;
+
+        while (end < len && path[end] == '/') end++;
+        name_start = end;
+    }
+
+    int error = errno;
+    if (base_owned) close (base_fd);
+    free (name);
+
+    if (stale && retry) {
+        // A cached parent was removed.
+        dir_cache_clear (cache);
+        return _dir_cache_ensure_dir (cache, path, len, false);
+    }
+
+    errno = error;
+    return success;
+}
+
+// Makes sure the directory path exists.
+bool dir_cache_ensure_dir (struct dir_cache_t *cache, char *path)
+{
+    return _dir_cache_ensure_dir (cache, path, strlen (path), true);
+}
+
+// Length of the directory part of path, like in ensure_path_exists() if path
+// ends in / it's all a directory.
+static inline
+uint32_t _dir_cache_dir_len (char *path)
+{
+    uint32_t len = strlen (path);
+    while (len > 0 && path[len-1] != '/') len--;
+    return len;
+}
+
+// Makes sure the parent directories of path exist, see ensure_path_exists().
+bool dir_cache_ensure_path (struct dir_cache_t *cache, char *path)
+{
+    return _dir_cache_ensure_dir (cache, path, _dir_cache_dir_len (path), true);
 }
 
-// NOTE: Returns false if there was an error creating the directory.
-#define ensure_dir_exists(path) path_ensure_dir(path)
-bool path_ensure_dir (char *path)
+// Opens path with openat() relative to its cached parent, creating missing
+// parent directories first. Returns the file descriptor or -1.
+int dir_cache_open (struct dir_cache_t *cache, char *path, int flags, mode_t mode)
 {
-    bool retval = true;
-
-    struct stat st;
-    int success = 0;
-    if (stat(path, &st) == -1 && errno == ENOENT) {
-        success = mkdir (path, 0777);
+    uint32_t dir_len = _dir_cache_dir_len (path);
+    if (!_dir_cache_ensure_dir (cache, path, dir_len, true)) {
+        return -1;
     }
 
-    if (success == -1) {
-        char *expl = strerror (errno);
-        printf ("Could not create %s: %s\n", path, expl);
-        free (expl);
-        retval = false;
+    uint32_t trimmed = _dir_cache_trim (path, dir_len);
+    if (trimmed > 0) {
+        struct _dir_cache_entry_t *entry = _dir_cache_lookup (cache, path, trimmed, _dir_cache_hash (path, trimmed));
+        if (entry != NULL && entry->path != NULL && entry->fd != -1) {
+            return openat (entry->fd, path + dir_len, flags|O_CLOEXEC, mode);
+        }
     }
 
-    return retval;
+    return open (path, flags|O_CLOEXEC, mode);
 }
 
-// Checks if path exists (either as a file or directory). If it doesn't it tries
-// to create all directories required for it to exist. If path ends in / then
-// all components are checked, otherwise the last part after / is assumed to be
-// a filename and is not created as a directory.
-bool ensure_path_exists (char *path_str)
+int _dir_cache_path_cmp (const void *a, const void *b)
 {
-    // Create a duplicate so we don't write over the passed path
-    string_t _path = {0};
-    str_set (&_path, path_str);
-    char *path = str_data(&_path);
+    char *p1 = *(char**)a;
+    char *p2 = *(char**)b;
+    uint32_t len1 = _dir_cache_dir_len (p1);
+    uint32_t len2 = _dir_cache_dir_len (p2);
+    int cmp = memcmp (p1, p2, MIN (len1, len2));
+    return cmp != 0 ? cmp : (int)len1 - (int)len2;
+}
 
-    bool success = true;
+// Bulk version of dir_cache_ensure_path(). Paths are grouped by directory so
+// each one is checked once. If errors isn't NULL it receives an errno value
+// for each path, 0 if it succeeded. Returns true if all succeeded.
+bool dir_cache_ensure_paths (struct dir_cache_t *cache, char **paths, int num_paths, int *errors)
+{
+    char **sorted = (char**)malloc (MAX(num_paths, 1)*sizeof(char*));
+    memcpy (sorted, paths, num_paths*sizeof(char*));
+    qsort (sorted, num_paths, sizeof(char*), _dir_cache_path_cmp);
 
-    char *c = path;
-    if (*c == '/') {
-        c++;
+    bool success = true;
+    char *prev = NULL;
+    int prev_error = 0;
+    for (int i=0; i<num_paths; i++) {
+        if (prev == NULL || _dir_cache_path_cmp (&prev, &sorted[i]) != 0) {
+            prev = sorted[i];
+            prev_error = dir_cache_ensure_path (cache, prev) ? 0 : errno;
+            if (prev_error != 0) success = false;
+        }
     }
 
-    struct stat st;
-    if (stat(path, &st) == -1) {
-        if (errno == ENOENT) {
-            while (*c && success) {
-                while (*c && *c != '/') {
-                    c++;
+    if (errors != NULL) {
+        for (int i=0; i<num_paths; i++) {
+            errors[i] = 0;
+            if (!success) {
+                struct _dir_cache_entry_t *entry = NULL;
+                uint32_t len = _dir_cache_trim (paths[i], _dir_cache_dir_len (paths[i]));
+                if (len > 0) {
+                    entry = _dir_cache_lookup (cache, paths[i], len, _dir_cache_hash (paths[i], len));
                 }
-
-                if (*c != '\0') {
-                    *c = '\0';
-                    if (stat(path, &st) == -1 && errno == ENOENT) {
-                        if (mkdir (path, 0777) == -1) {
-                            success = false;
-                            printf ("Error creating %s: %s\n", path, strerror (errno));
-                        }
-                    }
-
-                    *c = '/';
-                    c++;
+                if (len > 0 && (entry == NULL || entry->path == NULL)) {
+                    errors[i] = dir_cache_ensure_path (cache, paths[i]) ? 0 : errno;
                 }
             }
-        } else {
-            success = false;
-            printf ("Error ensuring path for %s: %s\n", path, strerror(errno));
         }
-    } else {
-        // Path exists. Maybe check if it's the same type as on path, either
-        // file or directory?.
     }
 
-    str_free (&_path);
-
+    free (sorted);
     return success;
 }
 
@@ -3586,20 +6128,393 @@ bool read_dir (DIR *dirp, struct dirent **res)
     return true;
 }
 
-int unlink_cb(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+// Directory reader
+//
+// Reads directory entries in large batches with the getdents64 system call.
+// Directories can be opened relative to the file descriptor of a parent
+// directory, which avoids resolving the full path again for each level of a
+// recursive traversal. The type of each entry comes from d_type, so in most
+// file systems no stat() call is needed, dir_reader_entry_type() falls back to
+// fstatat() when the type is unknown.
+//
+// Usage:
+//   struct dir_reader_t rdr;
+//   if (dir_reader_open (&rdr, path)) {
+//       char *name;
+//       unsigned char type;
+//       while (dir_reader_next (&rdr, &name, &type)) {
+//           ...
+//       }
+//       dir_reader_close (&rdr);
+//   }
+//
+// Names returned by dir_reader_next() point into the reader's buffer, they are
+// valid until the next call. The entries "." and ".." are skipped.
+//
+// If follow_links is false, dir_reader_open_at_full() fails with ELOOP when
+// name is a symbolic link instead of opening the directory it points to.
+#define DIR_READER_BUFF_SIZE (32*1024)
+
+struct _linux_dirent64_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_reader_t {
+    int fd;
+    char *buff;
+    int buff_len;
+    int buff_pos;
+};
+
+#define dir_reader_open(rdr,path) dir_reader_open_at_full(rdr,AT_FDCWD,path,true)
+#define dir_reader_open_at(rdr,parent_fd,name) dir_reader_open_at_full(rdr,parent_fd,name,true)
+bool dir_reader_open_at_full (struct dir_reader_t *rdr, int parent_fd, char *name, bool follow_links)
+{
+    *rdr = (struct dir_reader_t){0};
+    rdr->fd = openat (parent_fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC|(follow_links ? 0 : O_NOFOLLOW));
+    return rdr->fd != -1;
+}
+
+// Returns false when there are no more entries. If reading failed errno will
+// be different than 0.
+bool dir_reader_next (struct dir_reader_t *rdr, char **name, unsigned char *type)
+{
+    while (true) {
+        if (rdr->buff_pos >= rdr->buff_len) {
+            if (rdr->buff == NULL) {
+                rdr->buff = (char*)malloc (DIR_READER_BUFF_SIZE);
+            }
+
+            errno = 0;
+            long len = syscall (SYS_getdents64, rdr->fd, rdr->buff, DIR_READER_BUFF_SIZE);
+            if (len <= 0) {
+                return false;
+            }
+            rdr->buff_len = len;
+            rdr->buff_pos = 0;
+        }
+
+        struct _linux_dirent64_t *entry = (struct _linux_dirent64_t*)(rdr->buff + rdr->buff_pos);
+        rdr->buff_pos += entry->d_reclen;
+
+        char *n = entry->d_name;
+        if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0'))) {
+            continue;
+        }
+
+        *name = n;
+        *type = entry->d_type;
+        return true;
+    }
+}
+
+// Returns the type of an entry as a DT_* value. File systems that don't fill
+// d_type return DT_UNKNOWN, in that case we call fstatat(). If follow_links is
+// true, symbolic links are resolved like stat() does, broken links return
+// DT_UNKNOWN.
+unsigned char dir_reader_entry_type (struct dir_reader_t *rdr, char *name, unsigned char type, bool follow_links)
+{
+    if (type == DT_UNKNOWN || (follow_links && type == DT_LNK)) {
+        struct stat st;
+        if (fstatat (rdr->fd, name, &st, follow_links ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+            type = IFTODT (st.st_mode);
+        } else {
+            type = DT_UNKNOWN;
+        }
+    }
+
+    return type;
+}
+
+void dir_reader_close (struct dir_reader_t *rdr)
+{
+    if (rdr->fd != -1) {
+        close (rdr->fd);
+    }
+    free (rdr->buff);
+    *rdr = (struct dir_reader_t){0};
+    rdr->fd = -1;
+}
+
+// Recursive removal
+//
+// Directories are traversed with file descriptors, entries are removed with
+// unlinkat() relative to their parent so paths are never resolved from the
+// root again. Symbolic links are removed, not followed.
+//
+// Nothing is printed, errors are collected as a path and an errno value. If
+// pool is NULL errors are not collected, the return value still tells if
+// everything was removed. A version that removes independent subtrees
+// concurrently, path_rmrf_parallel(), is available if pthread.h is included.
+struct path_rmrf_error_t {
+    char *path;
+    int error;
+};
+
+struct _path_rmrf_t {
+    bool collect;
+    bool success;
+    struct path_rmrf_error_t *errors;
+    int errors_len;
+    int errors_size;
+};
+
+void _path_rmrf_error (struct _path_rmrf_t *ctx, char *path, int error)
+{
+    ctx->success = false;
+    if (!ctx->collect) return;
+
+    if (ctx->errors_len == ctx->errors_size) {
+        ctx->errors_size = ctx->errors_size == 0 ? 16 : 2*ctx->errors_size;
+        ctx->errors = (struct path_rmrf_error_t*)realloc (ctx->errors, ctx->errors_size*sizeof(struct path_rmrf_error_t));
+    }
+
+    struct path_rmrf_error_t *entry = &ctx->errors[ctx->errors_len++];
+    entry->path = strdup (path);
+    entry->error = error;
+}
+
+// Moves collected errors into pool.
+void _path_rmrf_errors_end (struct _path_rmrf_t *ctx, int num_ctx, mem_pool_t *pool,
+                            struct path_rmrf_error_t **errors, int *num_errors)
+{
+    int total = 0;
+    for (int i=0; i<num_ctx; i++) {
+        total += ctx[i].errors_len;
+    }
+
+    struct path_rmrf_error_t *res = NULL;
+    if (pool != NULL) {
+        res = (struct path_rmrf_error_t*)pom_push_size (pool, MAX(total, 1)*sizeof(struct path_rmrf_error_t));
+    }
+
+    int idx = 0;
+    for (int i=0; i<num_ctx; i++) {
+        for (int j=0; j<ctx[i].errors_len; j++) {
+            if (res != NULL) {
+                res[idx].path = pom_strdup (pool, ctx[i].errors[j].path);
+                res[idx].error = ctx[i].errors[j].error;
+                idx++;
+            }
+            free (ctx[i].errors[j].path);
+        }
+        free (ctx[i].errors);
+    }
+
+    if (errors != NULL) *errors = res;
+    if (num_errors != NULL) *num_errors = idx;
+}
+
+// Removes everything except subdirectories from the directory open in rdr,
+// path is its path ending in a separator and is only used for errors. All
+// entries are read before removing anything, some file systems skip entries if
+// the directory changes while being read.
+//
+// Names of subdirectories are returned one after the other, null separated, in
+// a malloc'd buffer.
+char* _path_rmrf_files (struct _path_rmrf_t *ctx, struct dir_reader_t *rdr, string_t *path, int *num_subdirs)
+{
+    int path_len = str_len (path);
+    *num_subdirs = 0;
+
+    // Each entry is stored as its type followed by the null terminated name.
+    char *buff = NULL;
+    size_t buff_len = 0;
+    size_t buff_size = 0;
+
+    char *name;
+    unsigned char type;
+    while (dir_reader_next (rdr, &name, &type)) {
+        type = dir_reader_entry_type (rdr, name, type, false);
+
+        size_t len = strlen (name) + 1;
+        if (buff_len + len + 1 > buff_size) {
+            buff_size = MAX (MAX (2*buff_size, buff_len + len + 1), 4096);
+            buff = (char*)realloc (buff, buff_size);
+        }
+        buff[buff_len] = type;
+        memcpy (buff + buff_len + 1, name, len);
+        buff_len += len + 1;
+    }
+
+    if (errno != 0) {
+        _path_rmrf_error (ctx, str_data(path), errno);
+    }
+
+    // Subdirectory names are moved to the start of the buffer.
+    size_t subdirs_len = 0;
+    for (size_t pos = 0; pos < buff_len; ) {
+        type = buff[pos];
+        name = buff + pos + 1;
+        size_t len = strlen (name) + 1;
+        pos += len + 1;
+
+        if (type == DT_DIR) {
+            memmove (buff + subdirs_len, name, len);
+            subdirs_len += len;
+            (*num_subdirs)++;
+
+        } else if (unlinkat (rdr->fd, name, 0) == -1) {
+            str_put_c (path, path_len, name);
+            _path_rmrf_error (ctx, str_data(path), errno);
+        }
+    }
+    str_put_c (path, path_len, "");
+
+    return buff;
+}
+
+// Opens a directory to be removed. Symbolic links are never followed, if name
+// was replaced by a link or a file after we saw it as a directory, it's
+// unlinked instead and false is returned.
+bool _path_rmrf_open_dir (struct _path_rmrf_t *ctx, struct dir_reader_t *rdr,
+                          int parent_fd, char *name, char *path)
+{
+    if (dir_reader_open_at_full (rdr, parent_fd, name, false)) {
+        return true;
+    }
+
+    if (errno == ELOOP || errno == ENOTDIR) {
+        if (unlinkat (parent_fd, name, 0) == -1) {
+            _path_rmrf_error (ctx, path, errno);
+        }
+    } else {
+        _path_rmrf_error (ctx, path, errno);
+    }
+    return false;
+}
+
+// Directories at this depth or deeper don't keep their file descriptor open
+// while their subdirectories are removed. This bounds the number of open files
+// no matter how deep the tree is, like the limit passed to nftw().
+#define PATH_RMRF_OPEN_DEPTH 32
+
+void _path_rmrf_dir (struct _path_rmrf_t *ctx, int parent_fd, char *name, string_t *path, int depth);
+
+// Removes everything inside the directory open in rdr, path is its path
+// without a trailing separator.
+//
+// If depth is PATH_RMRF_OPEN_DEPTH or more, rdr->fd is closed while removing
+// each subdirectory and then reopened through the subdirectory's "..". If it's
+// not the same directory anymore, because something moved it, we stop and
+// rdr->fd is left as -1.
+void _path_rmrf_contents (struct _path_rmrf_t *ctx, struct dir_reader_t *rdr, string_t *path, int depth)
+{
+    int path_len = str_len (path);
+    str_cat_c (path, "/");
+    int num_subdirs;
+    char *subdirs = _path_rmrf_files (ctx, rdr, path, &num_subdirs);
+
+    struct stat st;
+    bool close_fd = depth >= PATH_RMRF_OPEN_DEPTH && num_subdirs > 0;
+    if (close_fd && fstat (rdr->fd, &st) == -1) {
+        close_fd = false;
+    }
+
+    char *subdir = subdirs;
+    for (int i=0; i<num_subdirs; i++, subdir += strlen (subdir) + 1) {
+        str_put_c (path, path_len + 1, subdir);
+        if (!close_fd) {
+            _path_rmrf_dir (ctx, rdr->fd, subdir, path, depth + 1);
+            continue;
+        }
+
+        struct dir_reader_t child;
+        if (!_path_rmrf_open_dir (ctx, &child, rdr->fd, subdir, str_data(path))) {
+            continue;
+        }
+
+        close (rdr->fd);
+        rdr->fd = -1;
+        _path_rmrf_contents (ctx, &child, path, depth + 1);
+
+        int error = 0;
+        struct stat reopened;
+        if (child.fd == -1) {
+            error = ESTALE;
+        } else if ((rdr->fd = openat (child.fd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1 ||
+                   fstat (rdr->fd, &reopened) == -1) {
+            error = errno;
+        } else if (reopened.st_dev != st.st_dev || reopened.st_ino != st.st_ino) {
+            error = ESTALE;
+        }
+        dir_reader_close (&child);
+
+        if (error != 0) {
+            str_put_c (path, path_len, "");
+            _path_rmrf_error (ctx, str_data(path), error);
+            if (rdr->fd != -1) {
+                close (rdr->fd);
+                rdr->fd = -1;
+            }
+            break;
+        }
+
+        str_put_c (path, path_len + 1, subdir);
+        if (unlinkat (rdr->fd, subdir, AT_REMOVEDIR) == -1) {
+            _path_rmrf_error (ctx, str_data(path), errno);
+        }
+    }
+    free (subdirs);
+    str_put_c (path, path_len, "");
+}
+
+// path is the path of the directory, without a trailing separator.
+void _path_rmrf_dir (struct _path_rmrf_t *ctx, int parent_fd, char *name, string_t *path, int depth)
+{
+    struct dir_reader_t rdr;
+    if (!_path_rmrf_open_dir (ctx, &rdr, parent_fd, name, str_data(path))) {
+        return;
+    }
+
+    _path_rmrf_contents (ctx, &rdr, path, depth);
+    bool lost = rdr.fd == -1;
+    dir_reader_close (&rdr);
+
+    if (!lost && unlinkat (parent_fd, name, AT_REMOVEDIR) == -1) {
+        _path_rmrf_error (ctx, str_data(path), errno);
+    }
+}
+
+// Returns true if path doesn't exist anymore.
+bool path_rmrf_full (char *path, mem_pool_t *pool, struct path_rmrf_error_t **errors, int *num_errors)
 {
-    int rv = remove(fpath);
+    struct _path_rmrf_t ctx = {0};
+    ctx.collect = pool != NULL;
+    ctx.success = true;
+
+    struct stat st;
+    if (lstat (path, &st) == -1) {
+        _path_rmrf_error (&ctx, path, errno);
+
+    } else if (!S_ISDIR(st.st_mode)) {
+        if (unlink (path) == -1) {
+            _path_rmrf_error (&ctx, path, errno);
+        }
 
-    if (rv) {
-        printf ("Error: could not delete: %s\n", fpath);
+    } else {
+        string_t path_str = str_new (path);
+        // Avoid a double separator in error messages.
+        while (str_len(&path_str) > 1 && str_last(&path_str) == '/') {
+            str_put_c (&path_str, str_len(&path_str) - 1, "");
+        }
+        _path_rmrf_dir (&ctx, AT_FDCWD, path, &path_str, 0);
+        str_free (&path_str);
     }
 
-    return rv;
+    _path_rmrf_errors_end (&ctx, 1, pool, errors, num_errors);
+    return ctx.success;
 }
 
-int path_rmrf(char *path)
+// Returns 0 on success, -1 if something couldn't be removed. Like rm -rf but a
+// missing path is an error.
+int path_rmrf (char *path)
 {
-    return nftw(path, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+    return path_rmrf_full (path, NULL, NULL, NULL) ? 0 : -1;
 }
 
 ////////////////////////////
@@ -3629,40 +6544,44 @@ ITERATE_DIR_CB (iterate_dir_printf)
     printf ("%s\n", fname);
 }
 
-void iterate_dir_helper (string_t *path,  iterate_dir_cb_t *callback, void *data, bool include_hidden)
+// Subdirectories are opened relative to their parent's file descriptor, path
+// is only used to build the names passed to the callback.
+void iterate_dir_helper_at (int parent_fd, char *name, string_t *path,
+                            iterate_dir_cb_t *callback, void *data, bool include_hidden)
 {
     int path_len = str_len (path);
 
-    struct stat st;
     callback (str_data(path), true, data);
-    DIR *d = opendir (str_data(path));
-    if (d != NULL) {
-        struct dirent *entry_info;
-        while (read_dir (d, &entry_info)) {
-            bool is_current = false;
-            if (entry_info->d_name[0] == '.' && strlen(entry_info->d_name) == 1) is_current = true;
-
-            bool is_parent = false;
-            if (entry_info->d_name[0] == '.' && entry_info->d_name[1] == '.' && strlen(entry_info->d_name) == 2) is_parent = true;
-
-            if ((include_hidden && !is_current && !is_parent) || entry_info->d_name[0] != '.') {
-                str_put_c (path, path_len, entry_info->d_name);
-                if (stat(str_data(path), &st) == 0) {
-                    if (S_ISREG(st.st_mode)) {
-                        callback (str_data(path), false, data);
-
-                    } else if (S_ISDIR(st.st_mode)) {
-                        str_cat_c (path, "/");
-                        iterate_dir_helper (path, callback, data, include_hidden);
-                    }
-                }
-            }
-        }
-        closedir (d);
 
-    } else {
+    struct dir_reader_t rdr;
+    if (!dir_reader_open_at (&rdr, parent_fd, name)) {
         printf ("error: can't open directory '%s'\n", str_data(path));
+        return;
+    }
+
+    char *entry;
+    unsigned char type;
+    while (dir_reader_next (&rdr, &entry, &type)) {
+        if (!include_hidden && entry[0] == '.') {
+            continue;
+        }
+
+        type = dir_reader_entry_type (&rdr, entry, type, true);
+        str_put_c (path, path_len, entry);
+        if (type == DT_REG) {
+            callback (str_data(path), false, data);
+
+        } else if (type == DT_DIR) {
+            str_cat_c (path, "/");
+            iterate_dir_helper_at (rdr.fd, entry, path, callback, data, include_hidden);
+        }
     }
+    dir_reader_close (&rdr);
+}
+
+void iterate_dir_helper (string_t *path,  iterate_dir_cb_t *callback, void *data, bool include_hidden)
+{
+    iterate_dir_helper_at (AT_FDCWD, str_data(path), path, callback, data, include_hidden);
 }
 
 #define iterate_dir(path,callback,data) iterate_dir_full(path,callback,data,false)
@@ -3677,110 +6596,315 @@ void iterate_dir_full (char *path, iterate_dir_cb_t *callback, void *data, bool
 }
 
 #define MAX_FILENAME 255
-#define MAX_DEPTH 255
+
+// Stack of directories pending to be opened by the iterators. Paths are stored
+// one after the other in a single buffer, the stack itself only contains
+// offsets into it. This keeps iterators small, and makes reordering the stack
+// a matter of swapping integers.
+struct _dir_stack_entry_t {
+    size_t offset;
+    int depth;
+};
+
+struct _dir_stack_t {
+    char *buff;
+    size_t buff_len;
+    size_t buff_size;
+
+    struct _dir_stack_entry_t *entries;
+    int len;
+    int size;
+};
+
+void _dir_stack_push (struct _dir_stack_t *stack, char *path, size_t path_len, int depth)
+{
+    if (stack->len == stack->size) {
+        stack->size = stack->size == 0 ? 32 : 2*stack->size;
+        stack->entries = (struct _dir_stack_entry_t*)realloc (stack->entries, stack->size*sizeof(struct _dir_stack_entry_t));
+    }
+
+    if (stack->buff_len + path_len + 1 > stack->buff_size) {
+        stack->buff_size = MAX (2*stack->buff_size, stack->buff_len + path_len + 1);
+        stack->buff_size = MAX (stack->buff_size, 1024);
+        stack->buff = (char*)realloc (stack->buff, stack->buff_size);
+    }
+
+    stack->entries[stack->len].offset = stack->buff_len;
+    stack->entries[stack->len].depth = depth;
+    stack->len++;
+    memcpy (stack->buff + stack->buff_len, path, path_len);
+    stack->buff[stack->buff_len + path_len] = '\0';
+    stack->buff_len += path_len + 1;
+}
+
+// The returned path is valid until the next push.
+char* _dir_stack_pop (struct _dir_stack_t *stack, int *depth)
+{
+    struct _dir_stack_entry_t *entry = &stack->entries[--stack->len];
+
+    // Storage can be reused only if the popped path is the last one in the
+    // buffer. This isn't the case after reversing part of the stack, but once
+    // all paths of a reversed range are popped the last one will be.
+    if (stack->len == 0 || stack->entries[stack->len-1].offset < entry->offset) {
+        stack->buff_len = entry->offset;
+    }
+
+    if (depth != NULL) {
+        *depth = entry->depth;
+    }
+    return stack->buff + entry->offset;
+}
+
+void _dir_stack_reverse (struct _dir_stack_t *stack, int start)
+{
+    int i = start;
+    int j = stack->len - 1;
+    while (i < j) {
+        struct _dir_stack_entry_t tmp = stack->entries[i];
+        stack->entries[i] = stack->entries[j];
+        stack->entries[j] = tmp;
+        i++;
+        j--;
+    }
+}
+
+void _dir_stack_destroy (struct _dir_stack_t *stack)
+{
+    free (stack->buff);
+    free (stack->entries);
+    *stack = (struct _dir_stack_t){0};
+}
+
+// Filters for directory iterators
+//
+// Filters are applied before entries are yielded, directories excluded by them
+// are never opened. A zero initialized filter accepts everything.
+//
+// Directories are yielded and traversed unless they are hidden and skip_hidden
+// is set, they are deeper than max_depth, or their basename matches one of the
+// exclude_dirs globs. The name_glob and extensions filters only apply to
+// files, directories are still traversed to look for matching files inside
+// them.
+//
+// Depth is counted from the root, entries directly inside of it have depth 1.
+//
+// Usage:
+//   char *exclude[] = {".git", "node_modules"};
+//   char *extensions[] = {"c", "h"};
+//
+//   struct dir_filter_t filter = {0};
+//   filter.extensions = extensions;
+//   filter.num_extensions = ARRAY_SIZE(extensions);
+//   filter.exclude_dirs = exclude;
+//   filter.num_exclude_dirs = ARRAY_SIZE(exclude);
+//
+//   PATH_FOR_FILTERED (path, &filter, it) {
+//       ...
+//   }
+struct dir_filter_t {
+    // Glob matched against the basename of files with fnmatch().
+    char *name_glob;
+
+    // Accepted file extensions, without the leading dot.
+    char **extensions;
+    int num_extensions;
+
+    // Globs matched against directory basenames.
+    char **exclude_dirs;
+    int num_exclude_dirs;
+
+    // 0 means no limit.
+    int max_depth;
+
+    bool skip_hidden;
+};
+
+enum dir_filter_result_t {
+    DIR_FILTER_SKIP,
+    DIR_FILTER_YIELD,
+    DIR_FILTER_YIELD_AND_DESCEND
+};
+
+enum dir_filter_result_t dir_filter_entry (struct dir_filter_t *filter, char *basename, bool is_dir, int depth)
+{
+    if (filter == NULL) {
+        return is_dir ? DIR_FILTER_YIELD_AND_DESCEND : DIR_FILTER_YIELD;
+    }
+
+    if ((filter->skip_hidden && basename[0] == '.') ||
+        (filter->max_depth > 0 && depth > filter->max_depth)) {
+        return DIR_FILTER_SKIP;
+    }
+
+    if (is_dir) {
+        for (int i=0; i<filter->num_exclude_dirs; i++) {
+            if (fnmatch (filter->exclude_dirs[i], basename, 0) == 0) {
+                return DIR_FILTER_SKIP;
+            }
+        }
+
+        if (filter->max_depth > 0 && depth == filter->max_depth) {
+            return DIR_FILTER_YIELD;
+        }
+        return DIR_FILTER_YIELD_AND_DESCEND;
+    }
+
+    if (filter->name_glob != NULL && fnmatch (filter->name_glob, basename, 0) != 0) {
+        return DIR_FILTER_SKIP;
+    }
+
+    if (filter->num_extensions > 0) {
+        char *ext = strrchr (basename, '.');
+        if (ext == NULL) {
+            return DIR_FILTER_SKIP;
+        }
+
+        int i;
+        for (i=0; i<filter->num_extensions; i++) {
+            if (strcmp (ext + 1, filter->extensions[i]) == 0) break;
+        }
+
+        if (i == filter->num_extensions) {
+            return DIR_FILTER_SKIP;
+        }
+    }
+
+    return DIR_FILTER_YIELD;
+}
 
 struct dir_iterator_t {
-  DIR *dir;
+  struct dir_filter_t *filter;
+
+  struct dir_reader_t reader;
   string_t current_dir;
-  struct dirent *entry;
+  int current_depth;
+  char *entry;
 
-  // TODO: Better use dynamic array
-  char directories[MAX_DEPTH][PATH_MAX];
-  int dir_stack_top;
+  struct _dir_stack_t directories;
 
   bool entered_loop1;
   bool done_loop1;
-  bool entered_loop2;
-  bool done_loop2;
   bool yield;
 
+  // Length of the directory prefix of path, only the basename is replaced
+  // for each entry.
+  int path_dir_len;
+
   // TODO: Which of these are the most used ones in practice?
   string_t path;
   char *basename;
   bool is_dir;
+  unsigned char type; // DT_* value, symbolic links aren't resolved
+  int depth;
+
+  // Set if the current entry is a directory that will be traversed.
+  bool will_descend;
 };
 
 void dir_iterator_next(struct dir_iterator_t *it, char *path) {
     it->yield = false;
 
-    if (it->dir_stack_top == 0 && !(it->entered_loop1 && !it->done_loop1)) {
+    if (!it->entered_loop1) {
+        it->entered_loop1 = true;
+
         // Push the initial directory onto the stack of directories to be opened
-        strcpy(it->directories[it->dir_stack_top++], path);
+        _dir_stack_push (&it->directories, path, strlen(path), 0);
     }
 
-    // while (it->dir_stack_top > 0) // LOOP1
-    if (it->dir_stack_top > 0 || (it->entered_loop1 && !it->done_loop1)) {
-        it->entered_loop1 = true;
-
-        if (it->entry == NULL && !(it->entered_loop2 && !it->done_loop2)) {
-            it->done_loop2 = false;
+    while (!it->yield && !it->done_loop1) {
+        if (it->entry == NULL) {
+            if (it->directories.len == 0) {
+                it->done_loop1 = true;
+                break;
+            }
 
             // Pop the top directory from the stack
-            char *current_dir = it->directories[--it->dir_stack_top];
-            str_set (&it->current_dir, current_dir);
+            char *popped = _dir_stack_pop (&it->directories, &it->current_depth);
+            str_set (&it->current_dir, popped);
+            char *current_dir = str_data(&it->current_dir);
 
-            it->dir = opendir(current_dir);
-            if (it->dir == NULL) {
+            if (!dir_reader_open (&it->reader, current_dir)) {
                 fprintf(stderr, "Failed to open directory '%s'\n", current_dir);
-                return;
+                continue;
             }
-        }
-
-        // while ((it->entry = readdir(it->dir)) != NULL) // LOOP2
-        if ((it->entry = readdir(it->dir)) != NULL) {
-            it->entered_loop2 = true;
 
-            if (strcmp(it->entry->d_name, ".") == 0 || strcmp(it->entry->d_name, "..") == 0) {
-                return;
+            str_set (&it->path, current_dir);
+            if (str_len(&it->path) > 0) {
+                str_path_ensure_ends_in_separator (&it->path);
             }
+            it->path_dir_len = str_len (&it->path);
+        }
 
-            // Construct the full path of the entry
-            str_set(&it->path, str_data(&it->current_dir));
-            str_cat_path (&it->path, it->entry->d_name);
+        unsigned char type;
+        if (dir_reader_next (&it->reader, &it->entry, &type)) {
+            type = dir_reader_entry_type (&it->reader, it->entry, type, false);
+            bool is_dir = type == DT_DIR;
+            int depth = it->current_depth + 1;
 
-            it->basename = it->entry->d_name;
+            enum dir_filter_result_t action = dir_filter_entry (it->filter, it->entry, is_dir, depth);
+            if (action == DIR_FILTER_SKIP) {
+                continue;
+            }
+
+            str_put_c (&it->path, it->path_dir_len, it->entry);
+            it->basename = it->entry;
+            it->is_dir = is_dir;
+            it->type = type;
+            it->depth = depth;
 
-            if (it->entry->d_type == DT_DIR) {
-                // TODO: Add a mechanism to easily skip a subtree during
-                // iteration. I think just skipping the directory will still
-                // traverse all files under it.
-                strcpy(it->directories[it->dir_stack_top++], str_data(&it->path));
-                it->is_dir = true;
-            }  else {
-                it->is_dir = false;
+            it->will_descend = action == DIR_FILTER_YIELD_AND_DESCEND;
+            if (it->will_descend) {
+                _dir_stack_push (&it->directories, str_data(&it->path), str_len(&it->path), depth);
             }
 
             // Yield
             it->yield = true;
-        }
-
-        if (it->entry == NULL && it->entered_loop2) {
-            it->done_loop2 = true;
 
-            closedir(it->dir);
+        } else {
+            it->entry = NULL;
+            dir_reader_close (&it->reader);
         }
+    }
+}
 
+// Called from inside the loop when the current entry is a directory, makes the
+// iterator not open it.
+void dir_iterator_skip_subtree (struct dir_iterator_t *it)
+{
+    if (it->yield && it->will_descend) {
+        // The directory was the last thing pushed.
+        _dir_stack_pop (&it->directories, NULL);
+        it->will_descend = false;
     }
+}
 
-    if (it->dir_stack_top == 0 && it->done_loop2) {
-        it->done_loop1 = true;
+void dir_iterator_destroy (struct dir_iterator_t *it)
+{
+    if (it->entry != NULL) {
+        dir_reader_close (&it->reader);
     }
+    str_free (&it->path);
+    str_free (&it->current_dir);
+    _dir_stack_destroy (&it->directories);
 }
 
-#define PATH_FOR(path_str, it) \
-    for (struct dir_iterator_t it = {0}; it.done_loop1 ? (str_free(&it.path), str_free(&it.current_dir), 0) : 1 ; dir_iterator_next(&it, path_str))\
+#define PATH_FOR(path_str, it) PATH_FOR_FILTERED(path_str, NULL, it)
+
+#define PATH_FOR_FILTERED(path_str, filter_ptr, it) \
+    for (struct dir_iterator_t it = {.filter = filter_ptr}; it.done_loop1 ? (dir_iterator_destroy(&it), 0) : 1 ; dir_iterator_next(&it, path_str))\
         if (it.yield)
 
 struct dir_sorted_iterator_t {
+  struct dir_filter_t *filter;
+
   string_t current_dir;
+  int current_depth;
   struct dirent **entries;
   int entries_len;
   int entries_idx;
   struct dirent *entry;
 
-  // TODO: Better use dynamic array
-  char directories[MAX_DEPTH][PATH_MAX];
-  int dir_stack_top;
+  struct _dir_stack_t directories;
   int stack_frame_start_idx;
 
   bool entered_loop1;
@@ -3793,6 +6917,10 @@ struct dir_sorted_iterator_t {
   string_t path;
   char *basename;
   bool is_dir;
+  int depth;
+
+  // Set if the current entry is a directory that will be traversed.
+  bool will_descend;
 };
 
 int dirent_nat_cmp(const struct dirent **a, const struct dirent **b)
@@ -3810,22 +6938,23 @@ int strcmp_cb(const void *a, const void *b)
 void dir_sorted_iterator_next(struct dir_sorted_iterator_t *it, char *path) {
     it->yield = false;
 
-    if (it->dir_stack_top == 0 && !(it->entered_loop1 && !it->done_loop1)) {
+    if (it->directories.len == 0 && !(it->entered_loop1 && !it->done_loop1)) {
         // Push the initial directory onto the stack of directories to be opened
-        strcpy(it->directories[it->dir_stack_top++], path);
+        _dir_stack_push (&it->directories, path, strlen(path), 0);
     }
 
-    // while (it->dir_stack_top > 0) // LOOP1
-    if (it->dir_stack_top > 0 || (it->entered_loop1 && !it->done_loop1)) {
+    // while (it->directories.len > 0) // LOOP1
+    if (it->directories.len > 0 || (it->entered_loop1 && !it->done_loop1)) {
         it->entered_loop1 = true;
 
         if (!(it->entries_idx < it->entries_len) && !(it->entered_loop2 && !it->done_loop2)) {
             it->done_loop2 = false;
 
             // Pop the top directory from the stack
-            char *current_dir = it->directories[--it->dir_stack_top];
-            str_set (&it->current_dir, current_dir);
-            it->stack_frame_start_idx = it->dir_stack_top;
+            char *popped = _dir_stack_pop (&it->directories, &it->current_depth);
+            str_set (&it->current_dir, popped);
+            char *current_dir = str_data(&it->current_dir);
+            it->stack_frame_start_idx = it->directories.len;
 
             it->entries_idx = 0;
             it->entries_len = scandir(current_dir, &it->entries, NULL, dirent_nat_cmp);
@@ -3849,17 +6978,24 @@ void dir_sorted_iterator_next(struct dir_sorted_iterator_t *it, char *path) {
                 return;
             }
 
+            bool is_dir = it->entry->d_type == DT_DIR;
+            int depth = it->current_depth + 1;
+            enum dir_filter_result_t action = dir_filter_entry (it->filter, it->entry->d_name, is_dir, depth);
+            if (action == DIR_FILTER_SKIP) {
+                return;
+            }
+
             // Construct the full path of the entry
             str_set(&it->path, str_data(&it->current_dir));
             str_cat_path (&it->path, it->entry->d_name);
 
             it->basename = it->entry->d_name;
+            it->is_dir = is_dir;
+            it->depth = depth;
 
-            if (it->entry->d_type == DT_DIR) {
-                strcpy(it->directories[it->dir_stack_top++], str_data(&it->path));
-                it->is_dir = true;
-            }  else {
-                it->is_dir = false;
+            it->will_descend = action == DIR_FILTER_YIELD_AND_DESCEND;
+            if (it->will_descend) {
+                _dir_stack_push (&it->directories, str_data(&it->path), str_len(&it->path), depth);
             }
 
             // Yield
@@ -3870,15 +7006,7 @@ void dir_sorted_iterator_next(struct dir_sorted_iterator_t *it, char *path) {
 
             // To preserve entity ordering, reverse the order of directories
             // pushed in this stack frame
-            int i = it->stack_frame_start_idx;
-            int j = it->dir_stack_top - 1;
-            char tmp[PATH_MAX];
-            for (int k = 0; k < (j - i + 1) / 2; k++)
-            {
-                strcpy(tmp, it->directories[i + k]);
-                strcpy(it->directories[i + k], it->directories[j - k]);
-                strcpy(it->directories[j - k], tmp);
-            }
+            _dir_stack_reverse (&it->directories, it->stack_frame_start_idx);
 
             // Free memory allocated by scandir
             for (int i=0; i<it->entries_len; i++) {
@@ -3888,16 +7016,33 @@ void dir_sorted_iterator_next(struct dir_sorted_iterator_t *it, char *path) {
         }
     }
 
-    if (it->dir_stack_top == 0 && it->done_loop2) {
+    if (it->directories.len == 0 && it->done_loop2) {
         it->done_loop1 = true;
     }
 }
 
+void dir_sorted_iterator_skip_subtree (struct dir_sorted_iterator_t *it)
+{
+    if (it->yield && it->will_descend) {
+        _dir_stack_pop (&it->directories, NULL);
+        it->will_descend = false;
+    }
+}
+
+void dir_sorted_iterator_destroy (struct dir_sorted_iterator_t *it)
+{
+    str_free (&it->path);
+    str_free (&it->current_dir);
+    _dir_stack_destroy (&it->directories);
+}
+
 // TODO: Presumably this version should be slower than PATH_FOR because of the
 // stack reversal operation and the sorting of entries performed by scandir().
 // Is this true?, if so, how much slower is it?.
-#define PATH_FOR_SORTED(path_str, it) \
-    for (struct dir_sorted_iterator_t it = {0}; it.done_loop1 ? (str_free(&it.path), str_free(&it.current_dir), 0) : 1 ; dir_sorted_iterator_next(&it, path_str))\
+#define PATH_FOR_SORTED(path_str, it) PATH_FOR_SORTED_FILTERED(path_str, NULL, it)
+
+#define PATH_FOR_SORTED_FILTERED(path_str, filter_ptr, it) \
+    for (struct dir_sorted_iterator_t it = {.filter = filter_ptr}; it.done_loop1 ? (dir_sorted_iterator_destroy(&it), 0) : 1 ; dir_sorted_iterator_next(&it, path_str))\
         if (it.yield)
 
 //////////////////////////////
@@ -4160,6 +7305,668 @@ void end_mutex (volatile int *lock) {
     *lock = 0;
 }
 
+#ifdef _PTHREAD_H
+// Helpers that need pthreads are only available if pthread.h is included
+// before common.h, and the program is built with -pthread. Because pthread.h
+// also reads feature test macros, define _GNU_SOURCE before including it:
+//
+//      #define _GNU_SOURCE
+//      #include <pthread.h>
+//      #include "common.h"
+
+static inline
+int get_num_cpus ()
+{
+    long num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    return num_cpus < 1 ? 1 : num_cpus;
+}
+
+#define THREAD_WORKER_CB(name) void name(int thread_idx, void *clsr)
+typedef THREAD_WORKER_CB(thread_worker_cb_t);
+
+struct _thread_worker_info_t {
+    int thread_idx;
+    thread_worker_cb_t *cb;
+    void *clsr;
+};
+
+void* _thread_worker_start (void *arg)
+{
+    struct _thread_worker_info_t *info = (struct _thread_worker_info_t*)arg;
+    info->cb (info->thread_idx, info->clsr);
+    return NULL;
+}
+
+// Runs cb in num_threads threads and waits for all of them to finish. The
+// calling thread is used as the thread with index 0. If a thread can't be
+// created its work is done by the calling thread after the others finish, so
+// the callback is always called exactly once for each index.
+void run_threads (int num_threads, thread_worker_cb_t *cb, void *clsr)
+{
+    if (num_threads < 1) num_threads = 1;
+
+    struct _thread_worker_info_t info[num_threads];
+    pthread_t threads[num_threads];
+    bool started[num_threads];
+
+    for (int i=0; i<num_threads; i++) {
+        info[i].thread_idx = i;
+        info[i].cb = cb;
+        info[i].clsr = clsr;
+        started[i] = false;
+    }
+
+    for (int i=1; i<num_threads; i++) {
+        started[i] = pthread_create (&threads[i], NULL, _thread_worker_start, &info[i]) == 0;
+    }
+
+    cb (0, clsr);
+
+    for (int i=1; i<num_threads; i++) {
+        if (started[i]) {
+            pthread_join (threads[i], NULL);
+        } else {
+            cb (i, clsr);
+        }
+    }
+}
+
+// Parallel directory traversal
+//
+// Walks the tree under path calling cb for each directory and regular file,
+// like iterate_dir_full(), but subdirectories are distributed among a pool of
+// threads. Each thread has a deque of directories to open, it takes work from
+// the bottom of its own deque (depth first, good locality) and when it runs
+// out it steals from the top of another thread's deque (the oldest directories,
+// which usually contain the largest subtrees).
+//
+// Directory paths passed to the callback end in '/'. Symbolic links are
+// followed like stat() does.
+//
+// By default the callback is called concurrently from all threads as entries
+// are found, thread_idx can be used to index per thread state. If sorted is
+// true, entries are collected and the callback is called from the calling
+// thread after the walk finishes, in a deterministic order: a depth first
+// traversal where entries of each directory are sorted by name.
+#define DIR_WALK_CB(name) void name(char *path, bool is_dir, int thread_idx, void *data)
+typedef DIR_WALK_CB(dir_walk_cb_t);
+
+struct dir_walk_opts_t {
+    int num_threads; // 0 means one thread per CPU
+    bool include_hidden;
+    bool sorted;
+};
+
+struct _dir_walk_deque_t {
+    pthread_mutex_t mutex;
+    char **items;
+    int start;
+    int end;
+    int size;
+};
+
+struct _dir_walk_entry_t {
+    char *path;
+    bool is_dir;
+};
+
+struct _dir_walk_thread_t {
+    struct _dir_walk_deque_t deque;
+
+    // Only used for sorted walks.
+    struct _dir_walk_entry_t *entries;
+    int entries_len;
+    int entries_size;
+};
+
+struct _dir_walk_t {
+    dir_walk_cb_t *cb;
+    void *data;
+    struct dir_walk_opts_t opts;
+
+    int num_threads;
+    struct _dir_walk_thread_t *threads;
+
+    // Directories that have been pushed but not completely processed.
+    volatile int pending;
+
+    // Threads that didn't find work sleep on idle_cond until a directory is
+    // pushed or the walk ends.
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+    volatile int num_idle;
+};
+
+void _dir_walk_push (struct _dir_walk_t *walk, int thread_idx, char *dir)
+{
+    struct _dir_walk_deque_t *deque = &walk->threads[thread_idx].deque;
+    __sync_fetch_and_add (&walk->pending, 1);
+
+    pthread_mutex_lock (&deque->mutex);
+    if (deque->end == deque->size) {
+        if (deque->start > 0) {
+            memmove (deque->items, deque->items + deque->start, (deque->end - deque->start)*sizeof(char*));
+            deque->end -= deque->start;
+            deque->start = 0;
+        }
+
+        if (deque->end == deque->size) {
+            deque->size = deque->size == 0 ? 64 : 2*deque->size;
+            deque->items = realloc (deque->items, deque->size*sizeof(char*));
+        }
+    }
+    deque->items[deque->end++] = dir;
+    pthread_mutex_unlock (&deque->mutex);
+
+    // Pairs with the fence in _dir_walk_wait(), either the idle thread sees
+    // the new directory or we see that it's idle.
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&walk->num_idle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock (&walk->idle_mutex);
+        pthread_cond_signal (&walk->idle_cond);
+        pthread_mutex_unlock (&walk->idle_mutex);
+    }
+}
+
+char* _dir_walk_pop (struct _dir_walk_t *walk, int thread_idx, bool steal)
+{
+    struct _dir_walk_deque_t *deque = &walk->threads[thread_idx].deque;
+
+    char *dir = NULL;
+    pthread_mutex_lock (&deque->mutex);
+    if (deque->start < deque->end) {
+        dir = steal ? deque->items[deque->start++] : deque->items[--deque->end];
+        if (deque->start == deque->end) {
+            deque->start = deque->end = 0;
+        }
+    }
+    pthread_mutex_unlock (&deque->mutex);
+
+    return dir;
+}
+
+// Sleeps until a directory is pushed or the walk ends. Returns false if the
+// walk ended.
+bool _dir_walk_wait (struct _dir_walk_t *walk)
+{
+    pthread_mutex_lock (&walk->idle_mutex);
+    __atomic_add_fetch (&walk->num_idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    // Check again, something may have been pushed before we became idle.
+    bool has_work = false;
+    for (int i=0; !has_work && i<walk->num_threads; i++) {
+        struct _dir_walk_deque_t *deque = &walk->threads[i].deque;
+        pthread_mutex_lock (&deque->mutex);
+        has_work = deque->start < deque->end;
+        pthread_mutex_unlock (&deque->mutex);
+    }
+
+    bool done = __atomic_load_n (&walk->pending, __ATOMIC_ACQUIRE) == 0;
+    if (!has_work && !done) {
+        pthread_cond_wait (&walk->idle_cond, &walk->idle_mutex);
+    }
+
+    __atomic_sub_fetch (&walk->num_idle, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&walk->idle_mutex);
+
+    return !done;
+}
+
+static inline
+void _dir_walk_emit (struct _dir_walk_t *walk, int thread_idx, char *path, bool is_dir)
+{
+    if (walk->opts.sorted) {
+        struct _dir_walk_thread_t *thread = &walk->threads[thread_idx];
+        if (thread->entries_len == thread->entries_size) {
+            thread->entries_size = thread->entries_size == 0 ? 256 : 2*thread->entries_size;
+            thread->entries = realloc (thread->entries, thread->entries_size*sizeof(struct _dir_walk_entry_t));
+        }
+        thread->entries[thread->entries_len++] = (struct _dir_walk_entry_t){strdup (path), is_dir};
+    } else {
+        walk->cb (path, is_dir, thread_idx, walk->data);
+    }
+}
+
+void _dir_walk_process (struct _dir_walk_t *walk, int thread_idx, char *dir_path, string_t *path)
+{
+    _dir_walk_emit (walk, thread_idx, dir_path, true);
+
+    str_set (path, dir_path);
+    int path_len = str_len (path);
+
+    struct dir_reader_t rdr;
+    if (!dir_reader_open (&rdr, dir_path)) {
+        printf ("error: can't open directory '%s'\n", dir_path);
+        return;
+    }
+
+    char *name;
+    unsigned char type;
+    while (dir_reader_next (&rdr, &name, &type)) {
+        if (!walk->opts.include_hidden && name[0] == '.') {
+            continue;
+        }
+
+        type = dir_reader_entry_type (&rdr, name, type, true);
+        str_put_c (path, path_len, name);
+        if (type == DT_REG) {
+            _dir_walk_emit (walk, thread_idx, str_data(path), false);
+
+        } else if (type == DT_DIR) {
+            str_cat_c (path, "/");
+            _dir_walk_push (walk, thread_idx, strndup (str_data(path), str_len(path)));
+        }
+    }
+    dir_reader_close (&rdr);
+}
+
+THREAD_WORKER_CB(_dir_walk_worker)
+{
+    struct _dir_walk_t *walk = (struct _dir_walk_t*)clsr;
+
+    string_t path = {0};
+    while (true) {
+        char *dir = _dir_walk_pop (walk, thread_idx, false);
+        for (int i=1; dir == NULL && i<walk->num_threads; i++) {
+            dir = _dir_walk_pop (walk, (thread_idx + i)%walk->num_threads, true);
+        }
+
+        if (dir == NULL) {
+            // Other threads may still push new directories while they process
+            // the ones they have, we are done only when nothing is pending.
+            if (!_dir_walk_wait (walk)) {
+                break;
+            }
+            continue;
+        }
+
+        _dir_walk_process (walk, thread_idx, dir, &path);
+        free (dir);
+
+        if (__sync_sub_and_fetch (&walk->pending, 1) == 0) {
+            pthread_mutex_lock (&walk->idle_mutex);
+            pthread_cond_broadcast (&walk->idle_cond);
+            pthread_mutex_unlock (&walk->idle_mutex);
+        }
+    }
+    str_free (&path);
+}
+
+// Compares paths so that '/' sorts before any other character, this makes
+// the contents of a directory come right after it.
+int _dir_walk_entry_cmp (const void *a, const void *b)
+{
+    const unsigned char *s1 = (const unsigned char*)((struct _dir_walk_entry_t*)a)->path;
+    const unsigned char *s2 = (const unsigned char*)((struct _dir_walk_entry_t*)b)->path;
+    while (*s1 != '\0' && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+
+    int c1 = *s1 == '/' ? 1 : (*s1 == '\0' ? 0 : *s1 + 1);
+    int c2 = *s2 == '/' ? 1 : (*s2 == '\0' ? 0 : *s2 + 1);
+    return c1 - c2;
+}
+
+void dir_walk_parallel (char *path, dir_walk_cb_t *cb, void *data, struct dir_walk_opts_t *opts)
+{
+    struct _dir_walk_t walk = {0};
+    walk.cb = cb;
+    walk.data = data;
+    if (opts != NULL) {
+        walk.opts = *opts;
+    }
+    walk.num_threads = walk.opts.num_threads > 0 ? walk.opts.num_threads : get_num_cpus ();
+
+    walk.threads = calloc (walk.num_threads, sizeof(struct _dir_walk_thread_t));
+    for (int i=0; i<walk.num_threads; i++) {
+        pthread_mutex_init (&walk.threads[i].deque.mutex, NULL);
+    }
+    pthread_mutex_init (&walk.idle_mutex, NULL);
+    pthread_cond_init (&walk.idle_cond, NULL);
+
+    string_t root = str_new (path);
+    str_path_ensure_ends_in_separator (&root);
+    _dir_walk_push (&walk, 0, strndup (str_data(&root), str_len(&root)));
+    str_free (&root);
+
+    run_threads (walk.num_threads, _dir_walk_worker, &walk);
+
+    if (walk.opts.sorted) {
+        int num_entries = 0;
+        for (int i=0; i<walk.num_threads; i++) {
+            num_entries += walk.threads[i].entries_len;
+        }
+
+        struct _dir_walk_entry_t *entries = malloc (MAX(num_entries, 1)*sizeof(struct _dir_walk_entry_t));
+        int idx = 0;
+        for (int i=0; i<walk.num_threads; i++) {
+            struct _dir_walk_thread_t *thread = &walk.threads[i];
+            memcpy (entries + idx, thread->entries, thread->entries_len*sizeof(struct _dir_walk_entry_t));
+            idx += thread->entries_len;
+        }
+
+        qsort (entries, num_entries, sizeof(struct _dir_walk_entry_t), _dir_walk_entry_cmp);
+        for (int i=0; i<num_entries; i++) {
+            cb (entries[i].path, entries[i].is_dir, 0, data);
+            free (entries[i].path);
+        }
+        free (entries);
+    }
+
+    for (int i=0; i<walk.num_threads; i++) {
+        pthread_mutex_destroy (&walk.threads[i].deque.mutex);
+        free (walk.threads[i].deque.items);
+        free (walk.threads[i].entries);
+    }
+    pthread_mutex_destroy (&walk.idle_mutex);
+    pthread_cond_destroy (&walk.idle_cond);
+    free (walk.threads);
+}
+
+// Parallel recursive removal
+//
+// Same as path_rmrf_full() but directories are processed by a pool of
+// threads. A directory is removed by the thread that removes its last pending
+// subdirectory.
+//
+// Like in the sequential version everything is opened and removed relative to
+// the file descriptor of the parent directory, which stays open until all its
+// subdirectories are gone. The full path is only used for error messages.
+// Directories at PATH_RMRF_OPEN_DEPTH are removed with the sequential code by
+// the thread that finds them, so deep trees don't run out of file descriptors.
+struct _path_rmrf_dir_t {
+    struct _path_rmrf_dir_t *parent;
+    int depth;
+
+    // Subdirectories not removed yet, plus one while the directory is being
+    // processed.
+    int pending;
+
+    // -1 if it couldn't be opened as a directory, then there is nothing to
+    // remove when it's released.
+    int fd;
+
+    // Points into path, it's all of it for the root.
+    char *name;
+    char path[];
+};
+
+struct _path_rmrf_parallel_t {
+    // Protects the stack. Threads wait on cond while it's empty and there are
+    // still directories being processed.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct _path_rmrf_dir_t **stack;
+    int stack_len;
+    int stack_size;
+
+    // Directories that have been pushed but not processed yet.
+    volatile int active;
+
+    struct _path_rmrf_t *ctx; // One per thread
+};
+
+void _path_rmrf_parallel_push (struct _path_rmrf_parallel_t *rmrf, struct _path_rmrf_dir_t *dir)
+{
+    __sync_fetch_and_add (&rmrf->active, 1);
+
+    pthread_mutex_lock (&rmrf->mutex);
+    if (rmrf->stack_len == rmrf->stack_size) {
+        rmrf->stack_size = rmrf->stack_size == 0 ? 64 : 2*rmrf->stack_size;
+        rmrf->stack = (struct _path_rmrf_dir_t**)realloc (rmrf->stack, rmrf->stack_size*sizeof(struct _path_rmrf_dir_t*));
+    }
+    rmrf->stack[rmrf->stack_len++] = dir;
+    pthread_cond_signal (&rmrf->cond);
+    pthread_mutex_unlock (&rmrf->mutex);
+}
+
+struct _path_rmrf_dir_t* _path_rmrf_new_dir (struct _path_rmrf_dir_t *parent, char *path, int path_len, char *name)
+{
+    int name_len = name != NULL ? strlen (name) : 0;
+    struct _path_rmrf_dir_t *dir = (struct _path_rmrf_dir_t*)malloc (sizeof(struct _path_rmrf_dir_t) + path_len + name_len + 2);
+    dir->parent = parent;
+    dir->depth = parent != NULL ? parent->depth + 1 : 0;
+    dir->pending = 1;
+    dir->fd = -1;
+
+    memcpy (dir->path, path, path_len);
+    if (name != NULL) {
+        dir->path[path_len] = '/';
+        memcpy (dir->path + path_len + 1, name, name_len + 1);
+        dir->name = dir->path + path_len + 1;
+    } else {
+        dir->path[path_len] = '\0';
+        dir->name = dir->path;
+    }
+    return dir;
+}
+
+static inline
+int _path_rmrf_parent_fd (struct _path_rmrf_dir_t *dir)
+{
+    return dir->parent != NULL ? dir->parent->fd : AT_FDCWD;
+}
+
+// Called when a directory is done with a pending item, if it was the last one
+// the directory is removed, which may complete its parent.
+void _path_rmrf_dir_release (struct _path_rmrf_t *ctx, struct _path_rmrf_dir_t *dir)
+{
+    while (dir != NULL && __sync_sub_and_fetch (&dir->pending, 1) == 0) {
+        if (dir->fd != -1) {
+            close (dir->fd);
+            if (unlinkat (_path_rmrf_parent_fd (dir), dir->name, AT_REMOVEDIR) == -1) {
+                _path_rmrf_error (ctx, dir->path, errno);
+            }
+        }
+
+        struct _path_rmrf_dir_t *parent = dir->parent;
+        free (dir);
+        dir = parent;
+    }
+}
+
+THREAD_WORKER_CB(_path_rmrf_worker)
+{
+    struct _path_rmrf_parallel_t *rmrf = (struct _path_rmrf_parallel_t*)clsr;
+    struct _path_rmrf_t *ctx = &rmrf->ctx[thread_idx];
+
+    string_t path = {0};
+    while (true) {
+        // Other threads may still push new directories while they process the
+        // ones they have, we are done only when nothing is active.
+        struct _path_rmrf_dir_t *dir = NULL;
+        pthread_mutex_lock (&rmrf->mutex);
+        while (rmrf->stack_len == 0 && __atomic_load_n (&rmrf->active, __ATOMIC_ACQUIRE) > 0) {
+            pthread_cond_wait (&rmrf->cond, &rmrf->mutex);
+        }
+        if (rmrf->stack_len > 0) {
+            dir = rmrf->stack[--rmrf->stack_len];
+        }
+        pthread_mutex_unlock (&rmrf->mutex);
+
+        if (dir == NULL) {
+            break;
+        }
+
+        struct dir_reader_t rdr;
+        if (dir->depth >= PATH_RMRF_OPEN_DEPTH) {
+            // Removes the directory too, dir->fd stays -1 so releasing it
+            // won't try again.
+            str_set (&path, dir->path);
+            _path_rmrf_dir (ctx, _path_rmrf_parent_fd (dir), dir->name, &path, dir->depth);
+
+        } else if (_path_rmrf_open_dir (ctx, &rdr, _path_rmrf_parent_fd (dir), dir->name, dir->path)) {
+            str_set (&path, dir->path);
+            str_cat_c (&path, "/");
+
+            int num_subdirs;
+            char *subdirs = _path_rmrf_files (ctx, &rdr, &path, &num_subdirs);
+
+            // Keep the file descriptor, subdirectories are opened and removed
+            // relative to it.
+            dir->fd = rdr.fd;
+            rdr.fd = -1;
+            dir_reader_close (&rdr);
+
+            int path_len = strlen (dir->path);
+            char *subdir = subdirs;
+            for (int i=0; i<num_subdirs; i++) {
+                __sync_fetch_and_add (&dir->pending, 1);
+                _path_rmrf_parallel_push (rmrf, _path_rmrf_new_dir (dir, dir->path, path_len, subdir));
+                subdir += strlen (subdir) + 1;
+            }
+            free (subdirs);
+        }
+
+        _path_rmrf_dir_release (ctx, dir);
+
+        if (__sync_sub_and_fetch (&rmrf->active, 1) == 0) {
+            pthread_mutex_lock (&rmrf->mutex);
+            pthread_cond_broadcast (&rmrf->cond);
+            pthread_mutex_unlock (&rmrf->mutex);
+        }
+    }
+    str_free (&path);
+}
+
+// If num_threads is 0 one thread per CPU is used.
+bool path_rmrf_parallel (char *path, int num_threads, mem_pool_t *pool,
+                         struct path_rmrf_error_t **errors, int *num_errors)
+{
+    struct stat st;
+    if (lstat (path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return path_rmrf_full (path, pool, errors, num_errors);
+    }
+
+    if (num_threads <= 0) {
+        num_threads = get_num_cpus ();
+    }
+
+    struct _path_rmrf_parallel_t rmrf = {0};
+    pthread_mutex_init (&rmrf.mutex, NULL);
+    pthread_cond_init (&rmrf.cond, NULL);
+    rmrf.ctx = (struct _path_rmrf_t*)calloc (num_threads, sizeof(struct _path_rmrf_t));
+    for (int i=0; i<num_threads; i++) {
+        rmrf.ctx[i].collect = pool != NULL;
+        rmrf.ctx[i].success = true;
+    }
+
+    int path_len = strlen (path);
+    while (path_len > 1 && path[path_len-1] == '/') {
+        path_len--;
+    }
+    _path_rmrf_parallel_push (&rmrf, _path_rmrf_new_dir (NULL, path, path_len, NULL));
+
+    run_threads (num_threads, _path_rmrf_worker, &rmrf);
+
+    bool success = true;
+    for (int i=0; i<num_threads; i++) {
+        success = success && rmrf.ctx[i].success;
+    }
+    _path_rmrf_errors_end (rmrf.ctx, num_threads, pool, errors, num_errors);
+
+    free (rmrf.ctx);
+    free (rmrf.stack);
+    pthread_mutex_destroy (&rmrf.mutex);
+    pthread_cond_destroy (&rmrf.cond);
+    return success;
+}
+
+// Parallel file hashing
+//
+// Hashes many files at once with file_hash_64(). With enough threads the time
+// is dominated by I/O, useful to find duplicates in large trees.
+//
+//      struct file_hash_t *files;
+//      int num_files;
+//      file_hash_tree_parallel (path, NULL, 0, &pool, &files, &num_files);
+//      // Sort by hash and compare neighbors to find duplicates.
+
+struct file_hash_t {
+    char *path;
+    uint64_t size;
+    uint64_t hash;
+    int error; // errno value, 0 if hashing succeeded
+};
+
+struct _file_hash_parallel_t {
+    struct file_hash_t *files;
+    int num_files;
+    int next;
+};
+
+THREAD_WORKER_CB(_file_hash_worker)
+{
+    struct _file_hash_parallel_t *ctx = (struct _file_hash_parallel_t*)clsr;
+
+    char *buff = (char*)malloc (FILE_HASH_BUFFER_SIZE);
+    while (true) {
+        int idx = __sync_fetch_and_add (&ctx->next, 1);
+        if (idx >= ctx->num_files) break;
+
+        struct file_hash_t *file = &ctx->files[idx];
+        file->error = _file_hash_64 (file->path, buff, &file->hash, &file->size) ? 0 : errno;
+    }
+    free (buff);
+}
+
+// Fills the hash, size and error fields of files, path must be set. If
+// num_threads is 0 one thread per CPU is used. Returns true if all files were
+// hashed.
+bool file_hash_parallel (struct file_hash_t *files, int num_files, int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = get_num_cpus ();
+    }
+
+    struct _file_hash_parallel_t ctx = {0};
+    ctx.files = files;
+    ctx.num_files = num_files;
+    run_threads (MIN (num_threads, MAX (num_files, 1)), _file_hash_worker, &ctx);
+
+    bool success = true;
+    for (int i=0; i<num_files; i++) {
+        success = success && files[i].error == 0;
+    }
+    return success;
+}
+
+// Hashes all files under path that pass filter, which can be NULL. The array of
+// results and the paths in it are allocated in pool. Devices, FIFOs and
+// sockets are skipped, symbolic links are hashed if they point to a regular
+// file and reported as an error otherwise.
+bool file_hash_tree_parallel (char *path, struct dir_filter_t *filter, int num_threads,
+                              mem_pool_t *pool, struct file_hash_t **files, int *num_files)
+{
+    struct file_hash_t *tmp_files = NULL;
+    int len = 0;
+    int size = 0;
+
+    PATH_FOR_FILTERED (path, filter, it) {
+        if (it.type == DT_REG || it.type == DT_LNK) {
+            if (len == size) {
+                size = size == 0 ? 256 : 2*size;
+                tmp_files = (struct file_hash_t*)realloc (tmp_files, size*sizeof(struct file_hash_t));
+            }
+            tmp_files[len++] = (struct file_hash_t){pom_strdup (pool, str_data(&it.path))};
+        }
+    }
+
+    bool success = file_hash_parallel (tmp_files, len, num_threads);
+
+    *files = pom_push_size (pool, MAX(len, 1)*sizeof(struct file_hash_t));
+    if (len > 0) {
+        memcpy (*files, tmp_files, len*sizeof(struct file_hash_t));
+    }
+    *num_files = len;
+    free (tmp_files);
+
+    return success;
+}
+#endif
+
 ///////////////////////
 //
 //   SHARED VARIABLE
@@ -4396,7 +8203,8 @@ for (; varname != NULL; varname = varname->next)
 // NOTE: IS_A_LT_B as defined, will sort the linked list in ascending order.
 // NOTE: The last node of the linked list is expected to have NEXT_FIELD field
 // set to NULL.
-// NOTE: It uses a pointer array of size n, and calls merge sort on that array.
+// NOTE: It allocates a pointer array of size n, and calls merge sort on that
+// array.
 
 // We say a and b are pointers, for arrays it's well defined. When talking about
 // linked lists we could mean a pointer to a node, or a pointer to an element of
@@ -4437,7 +8245,7 @@ TYPE* FUNCNAME ## _user_data (TYPE **head, int n, void *user_data)  \
     }                                                               \
                                                                     \
     TYPE *node = *head;                                             \
-    TYPE *arr[n];                                                   \
+    TYPE **arr = malloc (n*sizeof(TYPE*));                          \
                                                                     \
     int j = 0;                                                      \
     while (node != NULL) {                                          \
@@ -4454,7 +8262,9 @@ TYPE* FUNCNAME ## _user_data (TYPE **head, int n, void *user_data)  \
     }                                                               \
     arr[j]->NEXT_FIELD = NULL;                                      \
                                                                     \
-    return arr[n-1];                                                \
+    TYPE *last = arr[n-1];                                          \
+    free (arr);                                                     \
+    return last;                                                    \
 }                                                                   \
                                                                     \
 TYPE* FUNCNAME(TYPE **head, int n) {                                \
@@ -77,7 +77,7 @@ char* full_file_read_prefix (mem_pool_t *out_pool, const char *path, char **pref
     mem_pool_t pool = {0};
     string_t pfx_s = {0};
     string_t path_s = str_new (path);
-    char *dir_path = sh_expand (path, &pool);
+    char *dir_path = path_expand ((char*)path, &pool);
 
     int status, i = 0;
     struct stat st;
@@ -86,7 +86,7 @@ char* full_file_read_prefix (mem_pool_t *out_pool, const char *path, char **pref
             str_set (&pfx_s, prefix[i]);
             assert (str_last(&pfx_s) == '/');
             str_cat (&pfx_s, &path_s);
-            dir_path = sh_expand (str_data(&pfx_s), &pool);
+            dir_path = path_expand (str_data(&pfx_s), &pool);
             i++;
         } else {
             break;
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Reader for CSV and TSV files (RFC 4180), built on top of scanner_t. Depends
+// on scanner.c.
+//
+// Rows are returned as arrays of sstring_t pointing into the input, fields are
+// never copied. Quoted fields are returned without the surrounding quotes, if
+// they contain escaped quotes ("") the field needs to be unescaped before using
+// it, this is done lazily by csv_field() only for the fields the caller asks
+// for:
+//
+//      struct csv_reader_t rdr;
+//      csv_reader_init_file (&rdr, "data.csv", ',');
+//      while (csv_next_row (&rdr)) {
+//          sstring_t name = csv_field (&rdr, 0, &pool);
+//          ...
+//      }
+//      scanner_output_error (&rdr.scnr, NULL);
+//      csv_reader_destroy (&rdr);
+//
+// Fields are only valid until the next call to csv_next_row(). In streaming
+// mode (csv_reader_init_fd()) the current row is pinned in the scanner's
+// window, so a single row can be larger than the window but the file can be
+// larger than memory.
+//
+// Searching for the next delimiter, quote or newline uses char_class_find(),
+// which processes 16 or 32 bytes at a time on CPUs that support it.
+
+struct csv_reader_t {
+    struct scanner_t scnr;
+    char delimiter;
+
+    // Characters that end an unquoted field, and characters that are
+    // special inside a quoted field.
+    char_class_t unquoted_end;
+    char_class_t quoted_end;
+
+    bool row_pinned;
+
+    // Current row.
+    int num_fields;
+    sstring_t *fields;
+    bool *escaped;
+
+    // Field offsets are stored while scanning the row because the window of a
+    // streaming scanner may move. Pointers are computed once the row is
+    // complete.
+    int fields_size;
+    uint64_t *field_offsets;
+    uint32_t *field_lens;
+};
+
+void csv_reader_init_common (struct csv_reader_t *rdr, char delimiter)
+{
+    rdr->delimiter = delimiter;
+
+    rdr->unquoted_end = (char_class_t){0};
+    char_class_add (&rdr->unquoted_end, delimiter);
+    char_class_add_str (&rdr->unquoted_end, "\r\n");
+
+    rdr->quoted_end = (char_class_t){0};
+    char_class_add (&rdr->quoted_end, '"');
+
+    rdr->row_pinned = false;
+    rdr->num_fields = 0;
+    rdr->fields_size = 0;
+    rdr->fields = NULL;
+    rdr->escaped = NULL;
+    rdr->field_offsets = NULL;
+    rdr->field_lens = NULL;
+}
+
+void csv_reader_init (struct csv_reader_t *rdr, char *data, size_t len, char delimiter)
+{
+    scanner_init (&rdr->scnr, data, len);
+    csv_reader_init_common (rdr, delimiter);
+}
+
+bool csv_reader_init_file (struct csv_reader_t *rdr, char *path, char delimiter)
+{
+    bool success = scanner_init_file (&rdr->scnr, path);
+    csv_reader_init_common (rdr, delimiter);
+    return success;
+}
+
+// Reads the input from fd with a window of window_size bytes, see
+// scanner_init_fd().
+void csv_reader_init_fd (struct csv_reader_t *rdr, int fd, size_t window_size, char delimiter)
+{
+    scanner_init_fd (&rdr->scnr, fd, window_size);
+    csv_reader_init_common (rdr, delimiter);
+}
+
+void csv_reader_destroy (struct csv_reader_t *rdr)
+{
+    scanner_destroy (&rdr->scnr);
+    free (rdr->fields);
+    free (rdr->escaped);
+    free (rdr->field_offsets);
+    free (rdr->field_lens);
+    rdr->fields_size = 0;
+    rdr->num_fields = 0;
+}
+
+static inline
+void csv_push_field (struct csv_reader_t *rdr, uint64_t offset, uint64_t end_offset, bool escaped)
+{
+    if (rdr->num_fields == rdr->fields_size) {
+        rdr->fields_size = rdr->fields_size == 0 ? 16 : 2*rdr->fields_size;
+        rdr->fields = realloc (rdr->fields, rdr->fields_size*sizeof(*rdr->fields));
+        rdr->escaped = realloc (rdr->escaped, rdr->fields_size*sizeof(*rdr->escaped));
+        rdr->field_offsets = realloc (rdr->field_offsets, rdr->fields_size*sizeof(*rdr->field_offsets));
+        rdr->field_lens = realloc (rdr->field_lens, rdr->fields_size*sizeof(*rdr->field_lens));
+    }
+
+    rdr->field_offsets[rdr->num_fields] = offset;
+    rdr->field_lens[rdr->num_fields] = end_offset - offset;
+    rdr->escaped[rdr->num_fields] = escaped;
+    rdr->num_fields++;
+}
+
+static inline
+bool csv_peek (struct scanner_t *scnr, char c)
+{
+    return !scanner_is_end (scnr) && *scnr->pos == c;
+}
+
+// Reads the next row. Returns false at the end of the input or if there was an
+// error, in which case the scanner's error is set.
+bool csv_next_row (struct csv_reader_t *rdr)
+{
+    struct scanner_t *scnr = &rdr->scnr;
+
+    if (rdr->row_pinned) {
+        scanner_unpin (scnr);
+        rdr->row_pinned = false;
+    }
+    rdr->num_fields = 0;
+
+    if (scnr->error || scanner_is_end (scnr)) {
+        return false;
+    }
+
+    scanner_pin (scnr);
+    rdr->row_pinned = true;
+
+    bool row_end = false;
+    while (!row_end && !scnr->error) {
+        uint64_t start, end;
+        bool escaped = false;
+
+        if (csv_peek (scnr, '"')) {
+            scanner_advance_char (scnr);
+            start = scanner_offset (scnr);
+
+            while (true) {
+                if (!scanner_skip_until (scnr, &rdr->quoted_end)) {
+                    scanner_set_error (scnr, "Unterminated quoted field.");
+                    break;
+                }
+
+                end = scanner_offset (scnr);
+                scanner_advance_char (scnr);
+                if (csv_peek (scnr, '"')) {
+                    scanner_advance_char (scnr);
+                    escaped = true;
+                } else {
+                    break;
+                }
+            }
+
+            if (!scnr->error && !scanner_is_end (scnr) && !char_class_has (&rdr->unquoted_end, *scnr->pos)) {
+                scanner_set_error (scnr, "Unexpected character after quoted field.");
+            }
+
+        } else {
+            start = scanner_offset (scnr);
+            scanner_skip_until (scnr, &rdr->unquoted_end);
+            end = scanner_offset (scnr);
+        }
+
+        if (scnr->error) {
+            break;
+        }
+
+        csv_push_field (rdr, start, end, escaped);
+
+        if (csv_peek (scnr, rdr->delimiter)) {
+            scanner_advance_char (scnr);
+
+            // A delimiter at the end of the input is followed by an empty
+            // field.
+            if (scanner_is_end (scnr)) {
+                uint64_t offset = scanner_offset (scnr);
+                csv_push_field (rdr, offset, offset, false);
+                row_end = true;
+            }
+
+        } else {
+            if (csv_peek (scnr, '\r')) {
+                scanner_advance_char (scnr);
+            }
+            if (csv_peek (scnr, '\n')) {
+                scanner_advance_char (scnr);
+            }
+            row_end = true;
+        }
+    }
+
+    if (scnr->error) {
+        rdr->num_fields = 0;
+        return false;
+    }
+
+    for (int i=0; i<rdr->num_fields; i++) {
+        rdr->fields[i] = SSTRING(scanner_offset_ptr (scnr, rdr->field_offsets[i]), rdr->field_lens[i]);
+    }
+
+    return true;
+}
+
+// Returns the unescaped value of the field at idx in the current row. Only
+// quoted fields containing escaped quotes need to be copied, the copy is
+// allocated in pool, which can be NULL to use malloc().
+sstring_t csv_field (struct csv_reader_t *rdr, int idx, mem_pool_t *pool)
+{
+    assert (idx >= 0 && idx < rdr->num_fields);
+
+    sstring_t field = rdr->fields[idx];
+    if (!rdr->escaped[idx]) {
+        return field;
+    }
+
+    char *unescaped = pom_push_size (pool, field.len + 1);
+    size_t len = 0;
+    for (size_t i=0; i<field.len; i++) {
+        unescaped[len++] = field.s[i];
+        if (field.s[i] == '"') {
+            // Quotes inside quoted fields are always doubled.
+            i++;
+        }
+    }
+    unescaped[len] = '\0';
+
+    return SSTRING(unescaped, len);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+bool csv_test_row (struct test_ctx_t *t, struct csv_reader_t *rdr, mem_pool_t *pool,
+                   char **expected, int num_expected)
+{
+    bool success = csv_next_row (rdr) && rdr->num_fields == num_expected;
+    for (int i=0; success && i<num_expected; i++) {
+        sstring_t field = csv_field (rdr, i, pool);
+        success = field.len == strlen(expected[i]) && memcmp (field.s, expected[i], field.len) == 0;
+    }
+
+    if (!success) {
+        str_cat_printf (t->error, "Expected:");
+        for (int i=0; i<num_expected; i++) {
+            str_cat_printf (t->error, " '%s'", expected[i]);
+        }
+        str_cat_printf (t->error, "\nGot:");
+        for (int i=0; i<rdr->num_fields; i++) {
+            str_cat_printf (t->error, " '%.*s'", (int)rdr->fields[i].len, rdr->fields[i].s);
+        }
+        str_cat_printf (t->error, "\n");
+    }
+
+    return success;
+}
+
+#define CSV_TEST_ROW(t,name,rdr,pool,...)                                              \
+{                                                                                      \
+    char *expected[] = {__VA_ARGS__};                                                  \
+    test_push (t, name);                                                               \
+    test_pop (t, csv_test_row (t, rdr, pool, expected, ARRAY_SIZE(expected)));         \
+}
+
+void csv_tests (struct test_ctx_t *t)
+{
+    test_push (t, "CSV");
+
+    mem_pool_t pool = {0};
+
+    {
+        test_push (t, "Parsing");
+
+        char *input =
+            "name,quantity,comment\n"
+            "apple,3,\n"
+            "\"pear, green\",12,\"said \"\"hi\"\"\"\r\n"
+            "\"multi\nline\",,last\n"
+            "\n"
+            "trailing,";
+
+        struct csv_reader_t rdr;
+        csv_reader_init (&rdr, input, strlen(input), ',');
+        CSV_TEST_ROW (t, "header", &rdr, &pool, "name", "quantity", "comment");
+        CSV_TEST_ROW (t, "empty last field", &rdr, &pool, "apple", "3", "");
+        test_bool (t, "fields point into the input", rdr.fields[0].s > input && rdr.fields[0].s < input + strlen(input));
+        CSV_TEST_ROW (t, "quoted fields and CRLF", &rdr, &pool, "pear, green", "12", "said \"hi\"");
+        CSV_TEST_ROW (t, "newline inside quotes", &rdr, &pool, "multi\nline", "", "last");
+        CSV_TEST_ROW (t, "empty line", &rdr, &pool, "");
+        CSV_TEST_ROW (t, "trailing delimiter", &rdr, &pool, "trailing", "");
+        test_bool (t, "end", !csv_next_row (&rdr) && !rdr.scnr.error);
+        test_int (t, "line number", scanner_line (&rdr.scnr), 6);
+        csv_reader_destroy (&rdr);
+
+        input = "a\tb c\t\"d\"\n";
+        csv_reader_init (&rdr, input, strlen(input), '\t');
+        CSV_TEST_ROW (t, "TSV", &rdr, &pool, "a", "b c", "d");
+        csv_reader_destroy (&rdr);
+
+        input = "a,\"unterminated\n";
+        csv_reader_init (&rdr, input, strlen(input), ',');
+        test_bool (t, "unterminated quote", !csv_next_row (&rdr) && rdr.scnr.error);
+        csv_reader_destroy (&rdr);
+
+        input = "\"a\"b,c\n";
+        csv_reader_init (&rdr, input, strlen(input), ',');
+        test_bool (t, "text after closing quote", !csv_next_row (&rdr) && rdr.scnr.error);
+        csv_reader_destroy (&rdr);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Streaming");
+
+        // Compare a streaming reader with a small window against a reader of
+        // the full file.
+        string_t content = {0};
+        for (int i=0; i<500; i++) {
+            str_cat_printf (&content, "%d,\"field with \"\"quotes\"\" and, commas %d\",", i, i*7);
+            for (int j=0; j<i%40; j++) {
+                str_cat_c (&content, "x");
+            }
+            str_cat_c (&content, "\n");
+        }
+
+        char *path = "bin/csv_test_stream";
+        full_file_write (str_data(&content), str_len(&content), path);
+
+        struct csv_reader_t full;
+        csv_reader_init_file (&full, path, ',');
+
+        int fd = open (path, O_RDONLY);
+        struct csv_reader_t stream;
+        csv_reader_init_fd (&stream, fd, 32, ',');
+
+        int num_rows = 0;
+        bool success = true;
+        while (success && csv_next_row (&full)) {
+            success = csv_next_row (&stream) && stream.num_fields == full.num_fields;
+            for (int i=0; success && i<full.num_fields; i++) {
+                sstring_t a = csv_field (&full, i, &pool);
+                sstring_t b = csv_field (&stream, i, &pool);
+                success = a.len == b.len && memcmp (a.s, b.s, a.len) == 0;
+            }
+            num_rows++;
+        }
+        test_bool (t, "same rows", success && num_rows == 500);
+        test_bool (t, "end", !csv_next_row (&stream) && !stream.scnr.error);
+
+        csv_reader_destroy (&full);
+        csv_reader_destroy (&stream);
+        close (fd);
+        unlink (path);
+        str_free (&content);
+
+        test_pop_parent (t);
+    }
+
+    mem_pool_destroy (&pool);
+
+    test_pop_parent (t);
+}
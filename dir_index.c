@@ -0,0 +1,755 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Persistent directory index
+//
+// Keeps the inode, size and modification time of every file under a root
+// directory, and detects what changed since the last refresh. It's meant for
+// tools that repeatedly need to know which files changed, like build systems,
+// without walking the whole tree and calling stat() on everything from scratch
+// each time.
+//
+//      struct dir_index_t idx;
+//      dir_index_init (&idx, "src");
+//      dir_index_load (&idx, ".src_index");
+//
+//      struct dir_index_changes_t changes;
+//      dir_index_refresh (&idx, &pool, &changes);
+//      for (int i=0; i<changes.modified_len; i++) {
+//          printf ("%s\n", changes.modified[i]);
+//      }
+//
+//      dir_index_save (&idx, ".src_index");
+//      dir_index_destroy (&idx);
+//
+// Paths in the change sets are relative to the root, directories end in '/'.
+// Directories are only reported as added or removed, files can also be
+// modified, which means their inode, size or modification time changed. If a
+// directory is removed everything inside of it is reported as removed too.
+//
+// A refresh opens every directory but only reads its entries again if the
+// directory's modification time changed, otherwise the entries of the previous
+// refresh are used. Files are still checked with fstatat(), relative to the
+// file descriptor of their parent directory, because modifying a file doesn't
+// update its directory.
+//
+// After calling dir_index_watch() the index uses inotify to track which
+// directories received events. Refreshes then only look at those, everything
+// else is copied from the previous state without system calls, so refreshing
+// an unchanged tree takes time proportional to copying the index in memory.
+// The first refresh after enabling watch mode is a full one that installs the
+// watches. If the kernel's event queue overflows the next refresh is a full
+// one too. Directories where a watch couldn't be added, for example because of
+// the limit in /proc/sys/fs/inotify/max_user_watches, are checked on every
+// refresh. Loading an index in watch mode removes the existing watches, so
+// the next refresh is a full one again.
+//
+// The on-disk format is a header followed by the arrays in dir_index_t, in the
+// native byte order. It's a cache, if it can't be loaded the index starts
+// empty and the next refresh reports everything as added.
+
+#include <sys/inotify.h>
+
+#define DIR_INDEX_MAGIC "DIDX"
+#define DIR_INDEX_VERSION 1
+
+struct dir_index_dir_t {
+    uint64_t inode;
+    int64_t mtime;
+
+    // Entries of the directory, sorted by name.
+    uint32_t first_entry;
+    uint32_t num_entries;
+};
+
+struct dir_index_entry_t {
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;
+
+    // Offset into names.
+    uint32_t name;
+
+    // Index into dirs for directories, -1 for everything else.
+    int32_t dir;
+};
+
+struct _dir_index_header_t {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_dirs;
+    uint32_t num_entries;
+    uint64_t names_len;
+};
+
+struct _dir_index_watch_t {
+    int wd;
+    bool dirty;
+};
+
+struct dir_index_t {
+    char *root;
+
+    // The root is dirs[0] if it exists.
+    DYNAMIC_ARRAY_DEFINE (struct dir_index_dir_t, dirs);
+    DYNAMIC_ARRAY_DEFINE (struct dir_index_entry_t, entries);
+
+    // Null terminated names, the first one is the root.
+    char *names;
+    uint64_t names_len;
+    uint64_t names_size;
+
+    // Watch mode. The inotify file descriptor can be used with poll() to wait
+    // for changes.
+    bool watching;
+    int inotify_fd;
+    struct _dir_index_watch_t *watches; // One per directory
+    DYNAMIC_ARRAY_DEFINE (int, wd_dirs); // Watch descriptor to directory
+};
+
+struct dir_index_changes_t {
+    char **added;
+    int added_len;
+
+    char **removed;
+    int removed_len;
+
+    char **modified;
+    int modified_len;
+};
+
+#define DIR_INDEX_WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_MODIFY| \
+                              IN_ATTRIB|IN_CLOSE_WRITE|IN_DELETE_SELF|IN_MOVE_SELF|     \
+                              IN_ONLYDIR|IN_DONT_FOLLOW)
+
+static inline
+int64_t dir_index_mtime (struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+}
+
+uint32_t _dir_index_push_name (struct dir_index_t *idx, char *name)
+{
+    size_t len = strlen (name) + 1;
+    if (idx->names_len + len > idx->names_size) {
+        idx->names_size = MAX (2*idx->names_size, idx->names_len + len);
+        idx->names_size = MAX (idx->names_size, 4096);
+        idx->names = (char*)realloc (idx->names, idx->names_size);
+    }
+
+    uint32_t offset = idx->names_len;
+    memcpy (idx->names + offset, name, len);
+    idx->names_len += len;
+    return offset;
+}
+
+void _dir_index_clear (struct dir_index_t *idx)
+{
+    free (idx->dirs);
+    free (idx->entries);
+    free (idx->names);
+    free (idx->watches);
+    idx->dirs = NULL;
+    idx->dirs_len = idx->dirs_size = 0;
+    idx->entries = NULL;
+    idx->entries_len = idx->entries_size = 0;
+    idx->names = NULL;
+    idx->names_len = idx->names_size = 0;
+    idx->watches = NULL;
+}
+
+// In watch mode, makes every directory start without a watch and dirty, the
+// next refresh will be a full one.
+void _dir_index_reset_watches (struct dir_index_t *idx)
+{
+    free (idx->watches);
+    idx->watches = (struct _dir_index_watch_t*)malloc (MAX(idx->dirs_len, 1)*sizeof(struct _dir_index_watch_t));
+    for (int i=0; i<idx->dirs_len; i++) {
+        idx->watches[i].wd = -1;
+        idx->watches[i].dirty = true;
+    }
+    idx->wd_dirs_len = 0;
+}
+
+void dir_index_init (struct dir_index_t *idx, char *root)
+{
+    *idx = (struct dir_index_t){0};
+    idx->root = strdup (root);
+    idx->inotify_fd = -1;
+}
+
+void dir_index_destroy (struct dir_index_t *idx)
+{
+    if (idx->watching) {
+        close (idx->inotify_fd);
+    }
+    _dir_index_clear (idx);
+    free (idx->wd_dirs);
+    free (idx->root);
+    *idx = (struct dir_index_t){0};
+}
+
+// Replaces the content of the index with the one stored in path. Returns false
+// if the file doesn't exist, is corrupt or belongs to a different root, in
+// which case the index is left empty.
+bool dir_index_load (struct dir_index_t *idx, char *path)
+{
+    if (idx->watching) {
+        // Watches belong to the directories being replaced.
+        for (int i=0; i<idx->dirs_len; i++) {
+            if (idx->watches[i].wd != -1) {
+                inotify_rm_watch (idx->inotify_fd, idx->watches[i].wd);
+            }
+        }
+    }
+    _dir_index_clear (idx);
+
+    uint64_t len = 0;
+    char *data = file_map (path, &len);
+    bool success = data != NULL;
+
+    struct _dir_index_header_t header;
+    if (len < sizeof(header)) {
+        success = false;
+    }
+
+    uint64_t dirs_size = 0, entries_size = 0;
+    if (success) {
+        memcpy (&header, data, sizeof(header));
+        dirs_size = (uint64_t)header.num_dirs*sizeof(struct dir_index_dir_t);
+        entries_size = (uint64_t)header.num_entries*sizeof(struct dir_index_entry_t);
+
+        success = memcmp (header.magic, DIR_INDEX_MAGIC, 4) == 0 &&
+                  header.version == DIR_INDEX_VERSION &&
+                  len == sizeof(header) + dirs_size + entries_size + header.names_len &&
+                  header.names_len > 0 && data[len-1] == '\0' &&
+                  strcmp (data + len - header.names_len, idx->root) == 0;
+    }
+
+    if (success) {
+        char *pos = data + sizeof(header);
+        idx->dirs = (struct dir_index_dir_t*)malloc (MAX(dirs_size, 1));
+        memcpy (idx->dirs, pos, dirs_size);
+        idx->dirs_len = idx->dirs_size = header.num_dirs;
+        pos += dirs_size;
+
+        idx->entries = (struct dir_index_entry_t*)malloc (MAX(entries_size, 1));
+        memcpy (idx->entries, pos, entries_size);
+        idx->entries_len = idx->entries_size = header.num_entries;
+        pos += entries_size;
+
+        idx->names = (char*)malloc (header.names_len);
+        memcpy (idx->names, pos, header.names_len);
+        idx->names_len = idx->names_size = header.names_len;
+
+        // Don't trust offsets coming from disk.
+        for (int i=0; success && i<idx->dirs_len; i++) {
+            struct dir_index_dir_t *dir = &idx->dirs[i];
+            success = (uint64_t)dir->first_entry + dir->num_entries <= (uint64_t)idx->entries_len;
+        }
+
+        for (int i=0; success && i<idx->entries_len; i++) {
+            struct dir_index_entry_t *entry = &idx->entries[i];
+            success = entry->name < idx->names_len &&
+                      entry->dir >= -1 && entry->dir < idx->dirs_len && entry->dir != 0;
+        }
+
+        // Directories are stored in depth first order, so a subdirectory
+        // always comes after its parent and is the child of a single entry.
+        // Otherwise walking the tree could loop forever.
+        bool *is_child = (bool*)calloc (MAX(idx->dirs_len, 1), sizeof(bool));
+        for (int i=0; success && i<idx->dirs_len; i++) {
+            struct dir_index_dir_t *dir = &idx->dirs[i];
+            for (uint32_t j=0; success && j<dir->num_entries; j++) {
+                int32_t child = idx->entries[dir->first_entry + j].dir;
+                if (child != -1) {
+                    success = child > i && !is_child[child];
+                    is_child[child] = true;
+                }
+            }
+        }
+        free (is_child);
+    }
+
+    if (!success) {
+        _dir_index_clear (idx);
+    }
+
+    if (idx->watching) {
+        _dir_index_reset_watches (idx);
+    }
+
+    file_unmap (data, len);
+    return success;
+}
+
+// The file is replaced atomically, see file_writer_open().
+bool dir_index_save (struct dir_index_t *idx, char *path)
+{
+    struct _dir_index_header_t header = {0};
+    memcpy (header.magic, DIR_INDEX_MAGIC, 4);
+    header.version = DIR_INDEX_VERSION;
+    header.num_dirs = idx->dirs_len;
+    header.num_entries = idx->entries_len;
+
+    // An index that was never refreshed has no names, not even the root.
+    char *names = idx->names;
+    uint64_t names_len = idx->names_len;
+    if (names_len == 0) {
+        names = idx->root;
+        names_len = strlen (idx->root) + 1;
+    }
+    header.names_len = names_len;
+
+    struct file_writer_t wrtr;
+    file_writer_open (&wrtr, path, false);
+    file_writer_write (&wrtr, &header, sizeof(header));
+    file_writer_write (&wrtr, idx->dirs, idx->dirs_len*sizeof(struct dir_index_dir_t));
+    file_writer_write (&wrtr, idx->entries, idx->entries_len*sizeof(struct dir_index_entry_t));
+    file_writer_write (&wrtr, names, names_len);
+    return file_writer_close (&wrtr);
+}
+
+// Enables watch mode. Returns false if inotify isn't available.
+bool dir_index_watch (struct dir_index_t *idx)
+{
+    if (idx->watching) {
+        return true;
+    }
+
+    idx->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (idx->inotify_fd == -1) {
+        return false;
+    }
+    idx->watching = true;
+
+    // No directory has a watch yet.
+    _dir_index_reset_watches (idx);
+    return true;
+}
+
+// Marks directories that received events since the last call as dirty.
+void _dir_index_read_events (struct dir_index_t *idx)
+{
+    char buff[64*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    bool overflow = false;
+    while (true) {
+        ssize_t len = read (idx->inotify_fd, buff, sizeof(buff));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len <= 0) {
+            break;
+        }
+
+        for (char *pos = buff; pos < buff + len; ) {
+            struct inotify_event *event = (struct inotify_event*)pos;
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+
+            } else if (event->wd >= 0 && event->wd < idx->wd_dirs_len) {
+                int dir = idx->wd_dirs[event->wd];
+                if (dir != -1) {
+                    idx->watches[dir].dirty = true;
+                }
+            }
+        }
+    }
+
+    if (overflow) {
+        for (int i=0; i<idx->dirs_len; i++) {
+            idx->watches[i].dirty = true;
+        }
+    }
+}
+
+struct _dir_index_child_t {
+    char *name;
+    int old_entry;
+    int new_entry;
+    int old_dir;
+    bool is_dir;
+};
+
+struct _dir_index_refresh_t {
+    struct dir_index_t *old;
+    struct dir_index_t *new;
+
+    // Full path of the directory being processed, ending in a separator.
+    // Reported paths start at rel_start.
+    string_t path;
+    int rel_start;
+
+    // Names read from directories, released as the traversal goes back up.
+    mem_pool_t tmp;
+
+    // Watches of the new directories, only in watch mode.
+    DYNAMIC_ARRAY_DEFINE (struct _dir_index_watch_t, watches);
+
+    mem_pool_t *pool;
+    DYNAMIC_ARRAY_DEFINE (char*, added);
+    DYNAMIC_ARRAY_DEFINE (char*, removed);
+    DYNAMIC_ARRAY_DEFINE (char*, modified);
+};
+
+char* _dir_index_rel_path (struct _dir_index_refresh_t *r, bool is_dir)
+{
+    char *rel = str_data(&r->path) + r->rel_start;
+    int len = str_len(&r->path) - r->rel_start;
+    char *str = (char*)pom_push_size (r->pool, len + 2);
+    memcpy (str, rel, len);
+    if (is_dir) {
+        str[len++] = '/';
+    }
+    str[len] = '\0';
+    return str;
+}
+
+// Adds the path of the current entry to one of the change sets.
+#define _dir_index_report(r,set,is_dir)                           \
+    if ((r)->pool != NULL) {                                      \
+        char *_rel_path = _dir_index_rel_path (r, is_dir);        \
+        DYNAMIC_ARRAY_APPEND ((r)->set, _rel_path);               \
+    }
+
+// Reports an entry of the old index and everything under it as removed. The
+// entry's name must already be at the end of path.
+void _dir_index_report_removed (struct _dir_index_refresh_t *r, int old_entry)
+{
+    struct dir_index_t *old = r->old;
+    struct dir_index_entry_t *entry = &old->entries[old_entry];
+    _dir_index_report (r, removed, entry->dir != -1);
+
+    if (entry->dir != -1) {
+        str_cat_c (&r->path, "/");
+        int path_len = str_len (&r->path);
+
+        struct dir_index_dir_t *dir = &old->dirs[entry->dir];
+        for (uint32_t i=0; i<dir->num_entries; i++) {
+            int child = dir->first_entry + i;
+            str_put_c (&r->path, path_len, old->names + old->entries[child].name);
+            _dir_index_report_removed (r, child);
+        }
+    }
+}
+
+int _dir_index_child_cmp (const void *a, const void *b)
+{
+    return strcmp (((struct _dir_index_child_t*)a)->name, ((struct _dir_index_child_t*)b)->name);
+}
+
+bool _dir_index_is_clean (struct _dir_index_refresh_t *r, int old_dir)
+{
+    return r->old->watching && old_dir != -1 &&
+           r->old->watches[old_dir].wd != -1 && !r->old->watches[old_dir].dirty;
+}
+
+void _dir_index_push_dir (struct _dir_index_refresh_t *r, uint64_t inode, int64_t mtime, int wd)
+{
+    struct dir_index_dir_t dir = {0};
+    dir.inode = inode;
+    dir.mtime = mtime;
+    dir.first_entry = r->new->entries_len;
+    DYNAMIC_ARRAY_APPEND (r->new->dirs, dir);
+
+    if (r->old->watching) {
+        struct _dir_index_watch_t watch = {wd, false};
+        DYNAMIC_ARRAY_APPEND (r->watches, watch);
+    }
+}
+
+int _dir_index_refresh_dir (struct _dir_index_refresh_t *r, int parent_fd, char *name,
+                            uint64_t inode, int64_t mtime, int old_dir);
+
+// Copies a directory without changes from the old index. Only subdirectories
+// that received events are looked at again.
+int _dir_index_copy_dir (struct _dir_index_refresh_t *r, int old_dir)
+{
+    struct dir_index_t *old = r->old;
+    struct dir_index_t *new = r->new;
+    struct dir_index_dir_t old_d = old->dirs[old_dir];
+
+    int dir_idx = new->dirs_len;
+    _dir_index_push_dir (r, old_d.inode, old_d.mtime, old->watches[old_dir].wd);
+    new->dirs[dir_idx].num_entries = old_d.num_entries;
+
+    for (uint32_t i=0; i<old_d.num_entries; i++) {
+        struct dir_index_entry_t entry = old->entries[old_d.first_entry + i];
+        entry.name = _dir_index_push_name (new, old->names + entry.name);
+        DYNAMIC_ARRAY_APPEND (new->entries, entry);
+    }
+
+    int path_len = str_len (&r->path);
+    for (uint32_t i=0; i<old_d.num_entries; i++) {
+        struct dir_index_entry_t *old_entry = &old->entries[old_d.first_entry + i];
+        if (old_entry->dir == -1) continue;
+
+        str_put_c (&r->path, path_len, old->names + old_entry->name);
+        str_cat_c (&r->path, "/");
+
+        int child;
+        if (_dir_index_is_clean (r, old_entry->dir)) {
+            child = _dir_index_copy_dir (r, old_entry->dir);
+        } else {
+            // If the directory is gone its parent received an event too, so
+            // this only happens if it was removed after reading the events.
+            // Then it will be indexed as empty.
+            struct stat st = {0};
+            stat (str_data(&r->path), &st);
+            child = _dir_index_refresh_dir (r, AT_FDCWD, str_data(&r->path),
+                                            st.st_ino, dir_index_mtime (&st), old_entry->dir);
+        }
+        new->entries[new->dirs[dir_idx].first_entry + i].dir = child;
+    }
+    str_put_c (&r->path, path_len, "");
+
+    return dir_idx;
+}
+
+// Refreshes a directory that exists on disk, old_dir is its index in the old
+// index or -1 if it's new. Returns its index in the new index.
+int _dir_index_refresh_dir (struct _dir_index_refresh_t *r, int parent_fd, char *name,
+                            uint64_t inode, int64_t mtime, int old_dir)
+{
+    struct dir_index_t *old = r->old;
+    struct dir_index_t *new = r->new;
+
+    if (_dir_index_is_clean (r, old_dir)) {
+        return _dir_index_copy_dir (r, old_dir);
+    }
+
+    int wd = -1;
+    if (old->watching) {
+        // Add the watch before reading entries so nothing created in between
+        // is missed. Adding a watch to an already watched directory returns
+        // the existing watch descriptor.
+        wd = inotify_add_watch (old->inotify_fd, str_data(&r->path), DIR_INDEX_WATCH_MASK);
+    }
+
+    int dir_idx = new->dirs_len;
+    _dir_index_push_dir (r, inode, mtime, wd);
+
+    int path_len = str_len (&r->path);
+    struct dir_index_dir_t *old_d = old_dir != -1 ? &old->dirs[old_dir] : NULL;
+
+    int fd = openat (parent_fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd == -1) {
+        // Unreadable directories are indexed as empty.
+        for (uint32_t i=0; old_d != NULL && i<old_d->num_entries; i++) {
+            str_put_c (&r->path, path_len, old->names + old->entries[old_d->first_entry + i].name);
+            _dir_index_report_removed (r, old_d->first_entry + i);
+        }
+        str_put_c (&r->path, path_len, "");
+        return dir_idx;
+    }
+
+    mem_pool_marker_t mrk = mem_pool_begin_temporary_memory (&r->tmp);
+    struct _dir_index_child_t *children = NULL;
+    int children_len = 0;
+    int children_size = 0;
+
+    if (old_d != NULL && old_d->inode == inode && old_d->mtime == mtime) {
+        // Same entries as last time.
+        for (uint32_t i=0; i<old_d->num_entries; i++) {
+            int old_entry = old_d->first_entry + i;
+            struct _dir_index_child_t child = {old->names + old->entries[old_entry].name, old_entry, -1, -1, false};
+            DYNAMIC_ARRAY_APPEND (children, child);
+        }
+
+    } else {
+        struct dir_reader_t rdr;
+        if (dir_reader_open_at (&rdr, fd, ".")) {
+            char *entry_name;
+            unsigned char type;
+            while (dir_reader_next (&rdr, &entry_name, &type)) {
+                struct _dir_index_child_t child = {pom_strdup (&r->tmp, entry_name), -1, -1, -1, false};
+                DYNAMIC_ARRAY_APPEND (children, child);
+            }
+            dir_reader_close (&rdr);
+        }
+        qsort (children, children_len, sizeof(struct _dir_index_child_t), _dir_index_child_cmp);
+
+        // Both lists are sorted by name, match them.
+        uint32_t i = 0;
+        int j = 0;
+        while (old_d != NULL && i < old_d->num_entries) {
+            int old_entry = old_d->first_entry + i;
+            char *old_name = old->names + old->entries[old_entry].name;
+            int cmp = j < children_len ? strcmp (old_name, children[j].name) : -1;
+
+            if (cmp == 0) {
+                children[j].old_entry = old_entry;
+                i++;
+                j++;
+
+            } else if (cmp < 0) {
+                str_put_c (&r->path, path_len, old_name);
+                _dir_index_report_removed (r, old_entry);
+                i++;
+
+            } else {
+                j++;
+            }
+        }
+    }
+
+    new->dirs[dir_idx].first_entry = new->entries_len;
+    for (int i=0; i<children_len; i++) {
+        struct _dir_index_child_t *child = &children[i];
+        struct dir_index_entry_t *old_entry = child->old_entry != -1 ? &old->entries[child->old_entry] : NULL;
+        str_put_c (&r->path, path_len, child->name);
+
+        struct stat st;
+        if (fstatat (fd, child->name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (old_entry != NULL) {
+                _dir_index_report_removed (r, child->old_entry);
+            }
+            continue;
+        }
+
+        bool is_dir = S_ISDIR(st.st_mode);
+        struct dir_index_entry_t entry = {0};
+        entry.inode = st.st_ino;
+        entry.size = is_dir ? 0 : st.st_size;
+        entry.mtime = dir_index_mtime (&st);
+        entry.dir = -1;
+
+        if (old_entry != NULL && (old_entry->dir != -1) != is_dir) {
+            _dir_index_report_removed (r, child->old_entry);
+            str_put_c (&r->path, path_len, child->name);
+            old_entry = NULL;
+        }
+
+        if (old_entry == NULL) {
+            _dir_index_report (r, added, is_dir);
+
+        } else if (!is_dir && (old_entry->inode != entry.inode ||
+                               old_entry->size != entry.size ||
+                               old_entry->mtime != entry.mtime)) {
+            _dir_index_report (r, modified, false);
+        }
+
+        if (is_dir) {
+            child->is_dir = true;
+            child->old_dir = old_entry != NULL ? old_entry->dir : -1;
+        }
+
+        entry.name = _dir_index_push_name (new, child->name);
+        child->new_entry = new->entries_len;
+        DYNAMIC_ARRAY_APPEND (new->entries, entry);
+    }
+    new->dirs[dir_idx].num_entries = new->entries_len - new->dirs[dir_idx].first_entry;
+
+    for (int i=0; i<children_len; i++) {
+        struct _dir_index_child_t *child = &children[i];
+        if (child->new_entry == -1 || !child->is_dir) continue;
+
+        str_put_c (&r->path, path_len, child->name);
+        str_cat_c (&r->path, "/");
+
+        struct dir_index_entry_t *entry = &new->entries[child->new_entry];
+        int child_dir = _dir_index_refresh_dir (r, fd, child->name, entry->inode, entry->mtime, child->old_dir);
+        new->entries[child->new_entry].dir = child_dir;
+    }
+    str_put_c (&r->path, path_len, "");
+
+    free (children);
+    close (fd);
+    mem_pool_end_temporary_memory (mrk);
+
+    return dir_idx;
+}
+
+char** _dir_index_changes_dup (mem_pool_t *pool, char **set, int len)
+{
+    char **res = (char**)pom_push_size (pool, MAX(len, 1)*sizeof(char*));
+    memcpy (res, set, len*sizeof(char*));
+    return res;
+}
+
+// Brings the index up to date with the file system. If changes isn't NULL the
+// added, removed and modified paths are allocated in pool and stored there.
+void dir_index_refresh (struct dir_index_t *idx, mem_pool_t *pool, struct dir_index_changes_t *changes)
+{
+    if (idx->watching) {
+        _dir_index_read_events (idx);
+    }
+
+    struct dir_index_t new = {0};
+    struct _dir_index_refresh_t r = {0};
+    r.old = idx;
+    r.new = &new;
+    r.pool = changes != NULL ? pool : NULL;
+
+    _dir_index_push_name (&new, idx->root);
+
+    str_set (&r.path, idx->root);
+    str_path_ensure_ends_in_separator (&r.path);
+    r.rel_start = str_len (&r.path);
+
+    int old_root = idx->dirs_len > 0 ? 0 : -1;
+    struct stat st;
+    if (stat (idx->root, &st) == 0 && S_ISDIR(st.st_mode)) {
+        _dir_index_refresh_dir (&r, AT_FDCWD, idx->root, st.st_ino, dir_index_mtime (&st), old_root);
+
+    } else if (old_root != -1) {
+        struct dir_index_dir_t *dir = &idx->dirs[old_root];
+        for (uint32_t i=0; i<dir->num_entries; i++) {
+            str_put_c (&r.path, r.rel_start, idx->names + idx->entries[dir->first_entry + i].name);
+            _dir_index_report_removed (&r, dir->first_entry + i);
+        }
+    }
+
+    if (idx->watching) {
+        // Watches of directories that are gone. If a directory was moved inside
+        // the tree its inode keeps the same watch descriptor, so only remove
+        // the ones that aren't used anymore.
+        idx->wd_dirs_len = 0;
+        for (int i=0; i<r.watches_len; i++) {
+            int wd = r.watches[i].wd;
+            while (wd >= idx->wd_dirs_len) {
+                DYNAMIC_ARRAY_APPEND (idx->wd_dirs, -1);
+            }
+            if (wd != -1) {
+                idx->wd_dirs[wd] = i;
+            }
+        }
+
+        for (int i=0; i<idx->dirs_len; i++) {
+            int wd = idx->watches[i].wd;
+            if (wd != -1 && (wd >= idx->wd_dirs_len || idx->wd_dirs[wd] == -1)) {
+                inotify_rm_watch (idx->inotify_fd, wd);
+            }
+        }
+    }
+
+    _dir_index_clear (idx);
+    idx->dirs = new.dirs;
+    idx->dirs_len = new.dirs_len;
+    idx->dirs_size = new.dirs_size;
+    idx->entries = new.entries;
+    idx->entries_len = new.entries_len;
+    idx->entries_size = new.entries_size;
+    idx->names = new.names;
+    idx->names_len = new.names_len;
+    idx->names_size = new.names_size;
+    idx->watches = r.watches;
+
+    if (changes != NULL) {
+        changes->added = _dir_index_changes_dup (pool, r.added, r.added_len);
+        changes->added_len = r.added_len;
+        changes->removed = _dir_index_changes_dup (pool, r.removed, r.removed_len);
+        changes->removed_len = r.removed_len;
+        changes->modified = _dir_index_changes_dup (pool, r.modified, r.modified_len);
+        changes->modified_len = r.modified_len;
+    }
+
+    free (r.added);
+    free (r.removed);
+    free (r.modified);
+    str_free (&r.path);
+    mem_pool_destroy (&r.tmp);
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+bool dir_index_test_set (struct test_ctx_t *t, char *name, char **set, int set_len, char **expected, int expected_len)
+{
+    qsort (set, set_len, sizeof(char*), strcmp_cb);
+
+    bool success = set_len == expected_len;
+    for (int i=0; success && i<set_len; i++) {
+        success = strcmp (set[i], expected[i]) == 0;
+    }
+
+    if (!success) {
+        str_cat_printf (t->error, "%s: expected", name);
+        for (int i=0; i<expected_len; i++) str_cat_printf (t->error, " '%s'", expected[i]);
+        str_cat_printf (t->error, "\ngot");
+        for (int i=0; i<set_len; i++) str_cat_printf (t->error, " '%s'", set[i]);
+        str_cat_printf (t->error, "\n");
+    }
+    return success;
+}
+
+// Expected sets must be sorted.
+void dir_index_test_changes (struct test_ctx_t *t, char *name, struct dir_index_changes_t *changes,
+                             char **added, int added_len,
+                             char **removed, int removed_len,
+                             char **modified, int modified_len)
+{
+    test_push (t, "%s", name);
+    bool success = dir_index_test_set (t, "added", changes->added, changes->added_len, added, added_len);
+    success = dir_index_test_set (t, "removed", changes->removed, changes->removed_len, removed, removed_len) && success;
+    success = dir_index_test_set (t, "modified", changes->modified, changes->modified_len, modified, modified_len) && success;
+    test_pop (t, success);
+}
+
+void dir_index_tests (struct test_ctx_t *t)
+{
+    test_push (t, "Directory index");
+
+    mem_pool_t pool = {0};
+    char *root = "bin/dir_index_test";
+    char *index_path = "bin/dir_index_test.idx";
+    path_rmrf (root);
+
+    char *tree[] = {
+        "a.c",
+        "b.c",
+        "src/c.c",
+        "src/d.h",
+        "src/lib/e.c",
+        "empty/",
+    };
+    create_fs_tree (root, tree, ARRAY_SIZE(tree));
+
+    struct dir_index_t idx;
+    dir_index_init (&idx, root);
+    test_bool (t, "missing index file", !dir_index_load (&idx, index_path));
+
+    struct dir_index_changes_t changes;
+    dir_index_refresh (&idx, &pool, &changes);
+    {
+        char *added[] = {"a.c", "b.c", "empty/", "src/", "src/c.c", "src/d.h", "src/lib/", "src/lib/e.c"};
+        dir_index_test_changes (t, "initial refresh", &changes, added, ARRAY_SIZE(added), NULL, 0, NULL, 0);
+    }
+
+    test_bool (t, "save", dir_index_save (&idx, index_path));
+    dir_index_destroy (&idx);
+
+    dir_index_init (&idx, root);
+    test_bool (t, "load", dir_index_load (&idx, index_path));
+    dir_index_refresh (&idx, &pool, &changes);
+    dir_index_test_changes (t, "no changes after load", &changes, NULL, 0, NULL, 0, NULL, 0);
+
+    full_file_write ("modified", 8, "bin/dir_index_test/src/c.c");
+    full_file_write ("new", 3, "bin/dir_index_test/src/lib/f.c");
+    unlink ("bin/dir_index_test/a.c");
+    path_ensure_dir ("bin/dir_index_test/new_dir");
+    full_file_write ("", 0, "bin/dir_index_test/new_dir/g.c");
+    path_rmrf ("bin/dir_index_test/empty");
+    dir_index_refresh (&idx, &pool, &changes);
+    {
+        char *added[] = {"new_dir/", "new_dir/g.c", "src/lib/f.c"};
+        char *removed[] = {"a.c", "empty/"};
+        char *modified[] = {"src/c.c"};
+        dir_index_test_changes (t, "changes", &changes, added, ARRAY_SIZE(added),
+                                removed, ARRAY_SIZE(removed), modified, ARRAY_SIZE(modified));
+    }
+
+    // A file replaced by a directory with the same name.
+    unlink ("bin/dir_index_test/b.c");
+    path_ensure_dir ("bin/dir_index_test/b.c");
+    path_rmrf ("bin/dir_index_test/src/lib");
+    dir_index_refresh (&idx, &pool, &changes);
+    {
+        char *added[] = {"b.c/"};
+        char *removed[] = {"b.c", "src/lib/", "src/lib/e.c", "src/lib/f.c"};
+        dir_index_test_changes (t, "type change and removed subtree", &changes, added, ARRAY_SIZE(added),
+                                removed, ARRAY_SIZE(removed), NULL, 0);
+    }
+
+    // Make a directory contain itself.
+    {
+        uint64_t len;
+        char *data = full_file_read (NULL, index_path, &len);
+        struct _dir_index_header_t header;
+        memcpy (&header, data, sizeof(header));
+        struct dir_index_dir_t *dirs = (struct dir_index_dir_t*)(data + sizeof(header));
+        struct dir_index_entry_t *entries = (struct dir_index_entry_t*)(dirs + header.num_dirs);
+        for (int i=0; i<header.num_dirs; i++) {
+            for (uint32_t j=0; j<dirs[i].num_entries; j++) {
+                struct dir_index_entry_t *entry = &entries[dirs[i].first_entry + j];
+                if (entry->dir != -1) {
+                    entry->dir = i == 0 ? entry->dir : i;
+                }
+            }
+        }
+        full_file_write (data, len, index_path);
+        free (data);
+    }
+    test_bool (t, "cyclic index file", !dir_index_load (&idx, index_path) && idx.dirs_len == 0);
+
+    full_file_write ("garbage", 7, index_path);
+    test_bool (t, "corrupt index file", !dir_index_load (&idx, index_path) && idx.dirs_len == 0);
+    dir_index_destroy (&idx);
+
+    dir_index_init (&idx, root);
+    if (dir_index_watch (&idx)) {
+        dir_index_refresh (&idx, &pool, &changes);
+        test_int (t, "watch mode initial refresh", changes.added_len, 6);
+
+        dir_index_refresh (&idx, &pool, &changes);
+        dir_index_test_changes (t, "watch mode no changes", &changes, NULL, 0, NULL, 0, NULL, 0);
+
+        full_file_write ("modified again", 14, "bin/dir_index_test/src/c.c");
+        path_ensure_dir ("bin/dir_index_test/new_dir/sub");
+        full_file_write ("", 0, "bin/dir_index_test/new_dir/sub/h.c");
+        unlink ("bin/dir_index_test/new_dir/g.c");
+        dir_index_refresh (&idx, &pool, &changes);
+        {
+            char *added[] = {"new_dir/sub/", "new_dir/sub/h.c"};
+            char *removed[] = {"new_dir/g.c"};
+            char *modified[] = {"src/c.c"};
+            dir_index_test_changes (t, "watch mode changes", &changes, added, ARRAY_SIZE(added),
+                                    removed, ARRAY_SIZE(removed), modified, ARRAY_SIZE(modified));
+        }
+
+        // Changes inside a directory created by the last refresh.
+        full_file_write ("x", 1, "bin/dir_index_test/new_dir/sub/h.c");
+        path_rmrf ("bin/dir_index_test/src");
+        dir_index_refresh (&idx, &pool, &changes);
+        {
+            char *removed[] = {"src/", "src/c.c", "src/d.h"};
+            char *modified[] = {"new_dir/sub/h.c"};
+            dir_index_test_changes (t, "watch mode new directory", &changes, NULL, 0,
+                                    removed, ARRAY_SIZE(removed), modified, ARRAY_SIZE(modified));
+        }
+
+        // Loading replaces the watched directories, watches are installed
+        // again by the next refresh.
+        test_bool (t, "save in watch mode", dir_index_save (&idx, index_path));
+        full_file_write ("yy", 2, "bin/dir_index_test/new_dir/sub/h.c");
+        test_bool (t, "load in watch mode", dir_index_load (&idx, index_path));
+        dir_index_refresh (&idx, &pool, &changes);
+        {
+            char *modified[] = {"new_dir/sub/h.c"};
+            dir_index_test_changes (t, "watch mode refresh after load", &changes, NULL, 0,
+                                    NULL, 0, modified, ARRAY_SIZE(modified));
+        }
+
+        full_file_write ("zzz", 3, "bin/dir_index_test/new_dir/sub/h.c");
+        dir_index_refresh (&idx, &pool, &changes);
+        {
+            char *modified[] = {"new_dir/sub/h.c"};
+            dir_index_test_changes (t, "watch mode changes after load", &changes, NULL, 0,
+                                    NULL, 0, modified, ARRAY_SIZE(modified));
+        }
+    }
+    dir_index_destroy (&idx);
+
+    unlink (index_path);
+    path_rmrf (root);
+    mem_pool_destroy (&pool);
+
+    test_pop_parent (t);
+}
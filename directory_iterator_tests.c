@@ -2,6 +2,47 @@
  * Copyright (C) 2022 Santiago León O.
  */
 
+struct dir_walk_test_t {
+    pthread_mutex_t mutex;
+    DYNAMIC_ARRAY_DEFINE (char*, paths);
+};
+
+DIR_WALK_CB (dir_walk_test_cb)
+{
+    struct dir_walk_test_t *res = (struct dir_walk_test_t*)data;
+    pthread_mutex_lock (&res->mutex);
+    DYNAMIC_ARRAY_APPEND (res->paths, strdup (path));
+    pthread_mutex_unlock (&res->mutex);
+}
+
+ITERATE_DIR_CB (iterate_dir_test_cb)
+{
+    struct dir_walk_test_t *res = (struct dir_walk_test_t*)data;
+    DYNAMIC_ARRAY_APPEND (res->paths, strdup (fname));
+}
+
+void dir_walk_test_free (struct dir_walk_test_t *res)
+{
+    for (int i=0; i<res->paths_len; i++) free (res->paths[i]);
+    free (res->paths);
+    *res = (struct dir_walk_test_t){0};
+}
+
+bool dir_walk_test_equal (struct test_ctx_t *t, struct dir_walk_test_t *a, struct dir_walk_test_t *b)
+{
+    bool success = a->paths_len == b->paths_len;
+    for (int i=0; success && i<a->paths_len; i++) {
+        success = strcmp (a->paths[i], b->paths[i]) == 0;
+        if (!success) {
+            str_cat_printf (t->error, "Expected '%s', got '%s'\n", b->paths[i], a->paths[i]);
+        }
+    }
+    if (a->paths_len != b->paths_len) {
+        str_cat_printf (t->error, "Expected %d entries, got %d\n", b->paths_len, a->paths_len);
+    }
+    return success;
+}
+
 void directory_iterator_tests (struct test_ctx_t *t)
 {
     char *test_dir[] = {
@@ -128,6 +169,215 @@ void directory_iterator_tests (struct test_ctx_t *t)
         test_pop_parent (t);
     }
 
+    {
+        test_push (t, "Parallel walk");
+
+        char *hidden[] = {".hidden_dir/file", "X_dir2/.hidden_file"};
+        create_fs_tree (base_dir, hidden, ARRAY_SIZE(hidden));
+
+        for (int include_hidden=0; include_hidden<2; include_hidden++) {
+            struct dir_walk_test_t expected = {0};
+            iterate_dir_full (base_dir, iterate_dir_test_cb, &expected, include_hidden);
+            qsort (expected.paths, expected.paths_len, sizeof(char*), strcmp_cb);
+
+            struct dir_walk_opts_t opts = {0};
+            opts.num_threads = 4;
+            opts.include_hidden = include_hidden;
+
+            struct dir_walk_test_t result = {0};
+            pthread_mutex_init (&result.mutex, NULL);
+            dir_walk_parallel (base_dir, dir_walk_test_cb, &result, &opts);
+            qsort (result.paths, result.paths_len, sizeof(char*), strcmp_cb);
+
+            test_push (t, "same entries as iterate_dir_full (include_hidden: %d)", include_hidden);
+            test_pop (t, dir_walk_test_equal (t, &result, &expected));
+            pthread_mutex_destroy (&result.mutex);
+            dir_walk_test_free (&result);
+
+            // Sorted walks are deterministic, and the same as sorting the
+            // result of iterate_dir_full() with '/' sorting before anything
+            // else.
+            opts.sorted = true;
+            pthread_mutex_init (&result.mutex, NULL);
+            dir_walk_parallel (base_dir, dir_walk_test_cb, &result, &opts);
+            for (int i=0; i<expected.paths_len; i++) {
+                for (char *c=expected.paths[i]; *c; c++) if (*c == '/') *c = '\1';
+            }
+            qsort (expected.paths, expected.paths_len, sizeof(char*), strcmp_cb);
+            for (int i=0; i<expected.paths_len; i++) {
+                for (char *c=expected.paths[i]; *c; c++) if (*c == '\1') *c = '/';
+            }
+
+            test_push (t, "sorted order (include_hidden: %d)", include_hidden);
+            test_pop (t, dir_walk_test_equal (t, &result, &expected));
+            pthread_mutex_destroy (&result.mutex);
+            dir_walk_test_free (&result);
+            dir_walk_test_free (&expected);
+        }
+
+        test_pop_parent (t);
+    }
+
+    {
+        // Enough entries to need several getdents64 calls.
+        char *dir = "bin/directory_iterator_test/large";
+        path_ensure_dir (dir);
+        int num_files = 3000;
+        string_t path = {0};
+        for (int i=0; i<num_files; i++) {
+            str_set_printf (&path, "%s/some_long_file_name_%d", dir, i);
+            full_file_write ("", 0, str_data(&path));
+        }
+        str_free (&path);
+
+        struct dir_walk_test_t result = {0};
+        iterate_dir (dir, iterate_dir_test_cb, &result);
+        test_int (t, "Large directory", result.paths_len, num_files + 1);
+        dir_walk_test_free (&result);
+
+        int count = 0;
+        PATH_FOR (dir, it) {
+            count++;
+        }
+        test_int (t, "Large directory (PATH_FOR)", count, num_files);
+    }
+
+    {
+        // Deeper than the old fixed size directory stack.
+        int depth = 300;
+        string_t path = str_new ("bin/directory_iterator_test/deep");
+        for (int i=0; i<depth; i++) {
+            path_ensure_dir (str_data(&path));
+            str_cat_c (&path, "/d");
+        }
+        full_file_write ("", 0, str_data(&path));
+
+        int count = 0;
+        PATH_FOR ("bin/directory_iterator_test/deep", it) {
+            count++;
+        }
+        test_int (t, "Deep tree", count, depth);
+
+        count = 0;
+        bool last_is_file = false;
+        PATH_FOR_SORTED ("bin/directory_iterator_test/deep", it) {
+            last_is_file = !it.is_dir && strcmp (str_data(&it.path), str_data(&path)) == 0;
+            count++;
+        }
+        test_bool (t, "Deep tree (sorted)", count == depth && last_is_file);
+        str_free (&path);
+    }
+
+    {
+        test_push (t, "Filters");
+
+        char *filter_dir = "bin/directory_iterator_test/filter";
+        char *filter_tree[] = {
+            "README",
+            ".hidden.c",
+            ".git/objects/x.c",
+            "node_modules/m/y.c",
+            "src/a.c",
+            "src/a.h",
+            "src/b.txt",
+            "src/sub/c.c",
+        };
+        create_fs_tree (filter_dir, filter_tree, ARRAY_SIZE(filter_tree));
+        int prefix_len = strlen (filter_dir) + 1;
+
+        char *exclude[] = {".git", "node_modules"};
+        char *extensions[] = {"c", "h"};
+
+        struct dir_filter_t filter = {0};
+        filter.extensions = extensions;
+        filter.num_extensions = ARRAY_SIZE(extensions);
+        filter.exclude_dirs = exclude;
+        filter.num_exclude_dirs = ARRAY_SIZE(exclude);
+        filter.skip_hidden = true;
+
+        struct dir_walk_test_t expected = {0};
+        char *expected_sources[] = {"src", "src/a.c", "src/a.h", "src/sub", "src/sub/c.c"};
+        for (int i=0; i<ARRAY_SIZE(expected_sources); i++) {
+            DYNAMIC_ARRAY_APPEND (expected.paths, strdup (expected_sources[i]));
+        }
+
+        struct dir_walk_test_t result = {0};
+        PATH_FOR_SORTED_FILTERED (filter_dir, &filter, it) {
+            DYNAMIC_ARRAY_APPEND (result.paths, strdup (str_data(&it.path) + prefix_len));
+        }
+        test_push (t, "extensions and excluded directories");
+        test_pop (t, dir_walk_test_equal (t, &result, &expected));
+        dir_walk_test_free (&result);
+
+        PATH_FOR_FILTERED (filter_dir, &filter, it) {
+            DYNAMIC_ARRAY_APPEND (result.paths, strdup (str_data(&it.path) + prefix_len));
+        }
+        qsort (result.paths, result.paths_len, sizeof(char*), strcmp_cb);
+        test_push (t, "extensions and excluded directories (unsorted)");
+        test_pop (t, dir_walk_test_equal (t, &result, &expected));
+        dir_walk_test_free (&result);
+        dir_walk_test_free (&expected);
+
+        filter = (struct dir_filter_t){0};
+        filter.max_depth = 1;
+        char *expected_top[] = {".git", ".hidden.c", "README", "node_modules", "src"};
+        for (int i=0; i<ARRAY_SIZE(expected_top); i++) {
+            DYNAMIC_ARRAY_APPEND (expected.paths, strdup (expected_top[i]));
+        }
+        PATH_FOR_SORTED_FILTERED (filter_dir, &filter, it) {
+            DYNAMIC_ARRAY_APPEND (result.paths, strdup (str_data(&it.path) + prefix_len));
+        }
+        test_push (t, "max depth");
+        test_pop (t, dir_walk_test_equal (t, &result, &expected));
+        dir_walk_test_free (&result);
+        dir_walk_test_free (&expected);
+
+        filter = (struct dir_filter_t){0};
+        filter.name_glob = "*.c";
+        char *expected_glob[] = {".git", ".git/objects", ".git/objects/x.c", ".hidden.c",
+            "node_modules", "node_modules/m", "node_modules/m/y.c", "src", "src/a.c", "src/sub", "src/sub/c.c"};
+        for (int i=0; i<ARRAY_SIZE(expected_glob); i++) {
+            DYNAMIC_ARRAY_APPEND (expected.paths, strdup (expected_glob[i]));
+        }
+        PATH_FOR_FILTERED (filter_dir, &filter, it) {
+            DYNAMIC_ARRAY_APPEND (result.paths, strdup (str_data(&it.path) + prefix_len));
+        }
+        qsort (result.paths, result.paths_len, sizeof(char*), strcmp_cb);
+        test_push (t, "glob");
+        test_pop (t, dir_walk_test_equal (t, &result, &expected));
+        dir_walk_test_free (&result);
+        dir_walk_test_free (&expected);
+
+        char *expected_skip[] = {".git", ".hidden.c", "README", "node_modules",
+            "src", "src/a.c", "src/a.h", "src/b.txt", "src/sub", "src/sub/c.c"};
+        for (int i=0; i<ARRAY_SIZE(expected_skip); i++) {
+            DYNAMIC_ARRAY_APPEND (expected.paths, strdup (expected_skip[i]));
+        }
+        PATH_FOR (filter_dir, it) {
+            DYNAMIC_ARRAY_APPEND (result.paths, strdup (str_data(&it.path) + prefix_len));
+            if (it.is_dir && (strcmp (it.basename, ".git") == 0 || strcmp (it.basename, "node_modules") == 0)) {
+                dir_iterator_skip_subtree (&it);
+            }
+        }
+        qsort (result.paths, result.paths_len, sizeof(char*), strcmp_cb);
+        test_push (t, "skip subtree");
+        test_pop (t, dir_walk_test_equal (t, &result, &expected));
+        dir_walk_test_free (&result);
+
+        PATH_FOR_SORTED (filter_dir, it) {
+            DYNAMIC_ARRAY_APPEND (result.paths, strdup (str_data(&it.path) + prefix_len));
+            if (it.is_dir && (strcmp (it.basename, ".git") == 0 || strcmp (it.basename, "node_modules") == 0)) {
+                dir_sorted_iterator_skip_subtree (&it);
+            }
+        }
+        test_push (t, "skip subtree (sorted)");
+        test_pop (t, dir_walk_test_equal (t, &result, &expected));
+        dir_walk_test_free (&result);
+        dir_walk_test_free (&expected);
+
+        test_pop_parent (t);
+    }
+
     path_rmrf (base_dir);
     test_pop_parent (t);
 }
@@ -0,0 +1,911 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Concurrent downloads
+//
+// Downloads many URLs at the same time from a single thread. Connections are
+// non blocking sockets driven by one epoll event loop, response bodies are
+// written as they arrive to a .part file next to the destination, which is
+// renamed to the destination once the download is complete. The .part file is
+// only created when a successful response starts, failed requests don't leave
+// anything behind.
+//
+//      struct downloader_t dl = {0};
+//      dl.max_per_host = 2;
+//      for (...) {
+//          downloader_add (&dl, url, dest);
+//      }
+//      if (!downloader_run (&dl)) {
+//          for (int i=0; i<dl.items_len; i++) {
+//              struct downloader_item_t *item = dl.items[i];
+//              if (item->status == DOWNLOADER_FAILED) {
+//                  printf ("Error downloading %s: %s\n", item->url, item->error);
+//              }
+//          }
+//      }
+//      downloader_destroy (&dl);
+//
+// If a .part file already exists, because a previous run was interrupted, only
+// the missing part is requested with a Range header. Servers that ignore the
+// header are handled by starting from scratch. Connections that drop or time
+// out in the middle of a transfer are retried the same way. Retries wait
+// retry_delay_ms, doubling after each attempt, so a server that refuses
+// connections isn't hammered.
+//
+// Only plain HTTP/1.1 is supported, there's no TLS. Each request uses its own
+// connection, responses can have a Content-Length, use chunked transfer
+// encoding or end when the server closes the connection. Redirects are
+// followed. Host names are resolved with getaddrinfo(), which blocks, but only
+// once per host.
+//
+// Nothing is printed, errors are reported per item.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+// Defaults for the fields of downloader_t left as 0.
+#define DOWNLOADER_MAX_CONNECTIONS 16
+#define DOWNLOADER_MAX_PER_HOST 4
+#define DOWNLOADER_TIMEOUT_MS 30000
+#define DOWNLOADER_MAX_RETRIES 3
+#define DOWNLOADER_RETRY_DELAY_MS 250
+
+#define DOWNLOADER_MAX_REDIRECTS 5
+#define DOWNLOADER_BUFFER_SIZE (64*1024)
+#define DOWNLOADER_MAX_HEADER_SIZE (16*1024)
+
+enum downloader_status_t {
+    DOWNLOADER_PENDING,
+    DOWNLOADER_ACTIVE,
+    DOWNLOADER_DONE,
+    DOWNLOADER_FAILED
+};
+
+struct downloader_t;
+struct downloader_item_t;
+
+#define DOWNLOADER_PROGRESS_CB(name) void name(struct downloader_t *dl, struct downloader_item_t *item, void *data)
+typedef DOWNLOADER_PROGRESS_CB(downloader_progress_cb_t);
+
+struct _downloader_conn_t;
+
+struct downloader_item_t {
+    char *url;
+    char *dest;
+
+    enum downloader_status_t status;
+
+    // Status code of the last response, 0 if none was received.
+    int http_status;
+
+    // Description of the failure, NULL if there's none.
+    const char *error;
+
+    // Bytes in the destination so far, including the ones of a resumed .part
+    // file, and the expected size or -1 if the server didn't say.
+    uint64_t received;
+    int64_t total;
+
+    // Offset requested with a Range header in the last request, 0 if the
+    // whole file was requested.
+    uint64_t resumed_from;
+
+    int retries;
+    int redirects;
+
+    // Private
+    int idx;
+    char *current_url;
+    char *part_path;
+    struct _downloader_conn_t *conn;
+
+    // Host of current_url, -1 if it hasn't been parsed yet.
+    int host;
+
+    // A pending item isn't started before this time.
+    int64_t retry_at;
+};
+
+struct _downloader_host_t {
+    char *name; // host:port
+    bool resolved;
+    const char *error;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    int active;
+};
+
+struct downloader_t {
+    // Configuration, 0 means the default.
+    int max_connections;
+    int max_per_host;
+    int timeout_ms;
+    int max_retries;
+    int retry_delay_ms;
+
+    downloader_progress_cb_t *progress_cb;
+    void *progress_data;
+
+    DYNAMIC_ARRAY_DEFINE (struct downloader_item_t*, items);
+
+    // Private
+    mem_pool_t pool;
+    DYNAMIC_ARRAY_DEFINE (struct _downloader_host_t, hosts);
+    struct _downloader_conn_t **conns;
+    int conns_len;
+    int first_pending;
+    int epoll_fd;
+
+    // Earliest retry_at of the pending items skipped by the last call to
+    // _downloader_schedule(), INT64_MAX if there's none.
+    int64_t next_retry_at;
+};
+
+enum _downloader_state_t {
+    _DOWNLOADER_CONNECTING,
+    _DOWNLOADER_SENDING,
+    _DOWNLOADER_HEADERS,
+    _DOWNLOADER_BODY,
+    _DOWNLOADER_CHUNK_SIZE,
+    _DOWNLOADER_CHUNK_DATA,
+    _DOWNLOADER_CHUNK_DATA_END,
+    _DOWNLOADER_TRAILER
+};
+
+struct _downloader_conn_t {
+    struct downloader_item_t *item;
+    int host;
+
+    int fd;
+    int file_fd;
+    enum _downloader_state_t state;
+
+    string_t request;
+    size_t request_sent;
+
+    char buff[DOWNLOADER_BUFFER_SIZE];
+    size_t buff_len;
+
+    bool chunked;
+    int64_t content_len;
+    uint64_t body_received;
+    uint64_t chunk_remaining;
+
+    int64_t last_activity;
+};
+
+static inline
+int64_t _downloader_now_ms ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+struct downloader_item_t* downloader_add (struct downloader_t *dl, char *url, char *dest)
+{
+    struct downloader_item_t *item = mem_pool_push_struct (&dl->pool, struct downloader_item_t);
+    *item = (struct downloader_item_t){0};
+    item->url = pom_strdup (&dl->pool, url);
+    item->dest = pom_strdup (&dl->pool, dest);
+    item->current_url = item->url;
+    item->part_path = pprintf (&dl->pool, "%s.part", dest);
+    item->total = -1;
+    item->idx = dl->items_len;
+    item->host = -1;
+
+    DYNAMIC_ARRAY_APPEND (dl->items, item);
+    return item;
+}
+
+void downloader_destroy (struct downloader_t *dl)
+{
+    free (dl->items);
+    free (dl->hosts);
+    mem_pool_destroy (&dl->pool);
+    *dl = (struct downloader_t){0};
+}
+
+// Splits an http:// URL, host is the host:port pair used to group connections.
+bool _downloader_parse_url (char *url, string_t *host, string_t *port, string_t *path)
+{
+    if (strncasecmp (url, "http://", 7) != 0) {
+        return false;
+    }
+
+    char *p = url + 7;
+    char *host_start = p;
+    if (*p == '[') {
+        // IPv6 address
+        while (*p != '\0' && *p != ']') p++;
+        if (*p != ']') return false;
+        p++;
+    } else {
+        while (*p != '\0' && *p != ':' && *p != '/' && *p != '?' && *p != '#') p++;
+    }
+    strn_set (host, host_start, p - host_start);
+    if (str_len (host) == 0) return false;
+
+    str_set (port, "80");
+    if (*p == ':') {
+        char *port_start = ++p;
+        while (*p >= '0' && *p <= '9') p++;
+        if (p == port_start) return false;
+        strn_set (port, port_start, p - port_start);
+    }
+
+    if (*p != '\0' && *p != '/' && *p != '?' && *p != '#') return false;
+
+    char *path_end = p;
+    while (*path_end != '\0' && *path_end != '#') path_end++;
+    if (*p != '/') {
+        str_set (path, "/");
+        strn_cat_c (path, p, path_end - p);
+    } else {
+        strn_set (path, p, path_end - p);
+    }
+
+    return true;
+}
+
+int _downloader_get_host (struct downloader_t *dl, string_t *host, string_t *port)
+{
+    string_t name = {0};
+    str_set_printf (&name, "%s:%s", str_data(host), str_data(port));
+
+    int idx = -1;
+    for (int i=0; i<dl->hosts_len; i++) {
+        if (strcmp (dl->hosts[i].name, str_data(&name)) == 0) {
+            idx = i;
+            break;
+        }
+    }
+
+    if (idx == -1) {
+        struct _downloader_host_t new_host = {0};
+        new_host.name = pom_strndup (&dl->pool, str_data(&name), str_len(&name));
+        DYNAMIC_ARRAY_APPEND (dl->hosts, new_host);
+        idx = dl->hosts_len - 1;
+    }
+
+    struct _downloader_host_t *h = &dl->hosts[idx];
+    if (!h->resolved) {
+        h->resolved = true;
+
+        // Brackets are part of the URL syntax, not of the address.
+        string_t node = {0};
+        if (str_data(host)[0] == '[') {
+            strn_set (&node, str_data(host) + 1, str_len(host) - 2);
+        } else {
+            str_cpy (&node, host);
+        }
+
+        struct addrinfo hints = {0};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *res;
+        int status = getaddrinfo (str_data(&node), str_data(port), &hints, &res);
+        if (status == 0) {
+            memcpy (&h->addr, res->ai_addr, res->ai_addrlen);
+            h->addr_len = res->ai_addrlen;
+            freeaddrinfo (res);
+        } else {
+            h->error = "could not resolve host";
+        }
+        str_free (&node);
+    }
+
+    str_free (&name);
+    return idx;
+}
+
+static inline
+void _downloader_progress (struct downloader_t *dl, struct downloader_item_t *item)
+{
+    if (dl->progress_cb != NULL) {
+        dl->progress_cb (dl, item, dl->progress_data);
+    }
+}
+
+// Ends the current connection of item. If error is NULL the download is
+// complete. If retry is true the item goes back to the queue unless it already
+// used all its retries.
+void _downloader_finish (struct downloader_t *dl, struct downloader_item_t *item, const char *error, bool retry)
+{
+    struct _downloader_conn_t *conn = item->conn;
+    if (conn != NULL) {
+        if (conn->fd != -1) close (conn->fd);
+        if (conn->file_fd != -1) close (conn->file_fd);
+        str_free (&conn->request);
+        dl->hosts[conn->host].active--;
+
+        for (int i=0; i<dl->conns_len; i++) {
+            if (dl->conns[i] == conn) {
+                dl->conns[i] = dl->conns[--dl->conns_len];
+                break;
+            }
+        }
+        free (conn);
+        item->conn = NULL;
+    }
+
+    int max_retries = dl->max_retries > 0 ? dl->max_retries : DOWNLOADER_MAX_RETRIES;
+    if (error == NULL) {
+        if (rename (item->part_path, item->dest) == 0) {
+            item->status = DOWNLOADER_DONE;
+            item->error = NULL;
+        } else {
+            item->status = DOWNLOADER_FAILED;
+            item->error = strerror (errno);
+        }
+
+    } else if (retry && item->retries < max_retries) {
+        int retry_delay_ms = dl->retry_delay_ms > 0 ? dl->retry_delay_ms : DOWNLOADER_RETRY_DELAY_MS;
+        item->retry_at = _downloader_now_ms () + ((int64_t)retry_delay_ms << MIN (item->retries, 16));
+        item->retries++;
+        item->status = DOWNLOADER_PENDING;
+        item->error = error;
+        dl->first_pending = MIN (dl->first_pending, item->idx);
+
+    } else {
+        item->status = DOWNLOADER_FAILED;
+        item->error = error;
+    }
+
+    if (item->status != DOWNLOADER_PENDING) {
+        _downloader_progress (dl, item);
+    }
+}
+
+// Starts a connection for item. Returns false if the host already has all
+// the connections it's allowed.
+bool _downloader_start (struct downloader_t *dl, struct downloader_item_t *item)
+{
+    string_t host = {0}, port = {0}, path = {0};
+    bool started = true;
+
+    if (!_downloader_parse_url (item->current_url, &host, &port, &path)) {
+        item->status = DOWNLOADER_FAILED;
+        item->error = "invalid URL, only http:// is supported";
+        _downloader_progress (dl, item);
+
+    } else {
+        int host_idx = _downloader_get_host (dl, &host, &port);
+        item->host = host_idx;
+        int max_per_host = dl->max_per_host > 0 ? dl->max_per_host : DOWNLOADER_MAX_PER_HOST;
+        struct _downloader_host_t *h = &dl->hosts[host_idx];
+
+        if (h->error != NULL) {
+            item->status = DOWNLOADER_FAILED;
+            item->error = h->error;
+            _downloader_progress (dl, item);
+
+        } else if (h->active >= max_per_host) {
+            started = false;
+
+        } else {
+            struct _downloader_conn_t *conn = calloc (1, sizeof(struct _downloader_conn_t));
+            conn->item = item;
+            conn->host = host_idx;
+            conn->fd = -1;
+            conn->file_fd = -1;
+            conn->content_len = -1;
+            conn->last_activity = _downloader_now_ms ();
+            item->conn = conn;
+            item->status = DOWNLOADER_ACTIVE;
+            h->active++;
+            dl->conns[dl->conns_len++] = conn;
+
+            // Resume from whatever a previous attempt left. The file is
+            // opened by _downloader_headers().
+            struct stat st;
+            int stat_status = stat (item->part_path, &st);
+            if (stat_status == -1 && errno != ENOENT) {
+                _downloader_finish (dl, item, strerror (errno), false);
+
+            } else {
+                item->resumed_from = stat_status == 0 ? st.st_size : 0;
+                item->received = item->resumed_from;
+
+                // The port is only part of the Host header if it's not the
+                // default one.
+                bool default_port = strcmp (str_data(&port), "80") == 0;
+                str_set_printf (&conn->request,
+                                "GET %s HTTP/1.1\r\n"
+                                "Host: %s%s%s\r\n"
+                                "User-Agent: downloader\r\n"
+                                "Accept-Encoding: identity\r\n"
+                                "Connection: close\r\n",
+                                str_data(&path), str_data(&host),
+                                default_port ? "" : ":", default_port ? "" : str_data(&port));
+                if (item->resumed_from > 0) {
+                    str_cat_printf (&conn->request, "Range: bytes=%"PRIu64"-\r\n", item->resumed_from);
+                }
+                str_cat_c (&conn->request, "\r\n");
+
+                conn->fd = socket (h->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+                if (conn->fd == -1) {
+                    _downloader_finish (dl, item, strerror (errno), false);
+
+                } else if (connect (conn->fd, (struct sockaddr*)&h->addr, h->addr_len) == -1 && errno != EINPROGRESS) {
+                    _downloader_finish (dl, item, strerror (errno), true);
+
+                } else {
+                    conn->state = _DOWNLOADER_CONNECTING;
+                    struct epoll_event ev = {0};
+                    ev.events = EPOLLOUT;
+                    ev.data.ptr = conn;
+                    epoll_ctl (dl->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+                }
+            }
+        }
+    }
+
+    str_free (&host);
+    str_free (&port);
+    str_free (&path);
+    return started;
+}
+
+// Starts pending items, in the order they were added, while there are free
+// connections. Items waiting for a retry, or whose host is known to have all
+// its connections in use, are skipped without parsing their URL again.
+void _downloader_schedule (struct downloader_t *dl)
+{
+    int max_connections = dl->max_connections > 0 ? dl->max_connections : DOWNLOADER_MAX_CONNECTIONS;
+    int max_per_host = dl->max_per_host > 0 ? dl->max_per_host : DOWNLOADER_MAX_PER_HOST;
+    int64_t now = _downloader_now_ms ();
+    dl->next_retry_at = INT64_MAX;
+
+    bool all_started = true;
+    for (int i=dl->first_pending; i<dl->items_len && dl->conns_len < max_connections; i++) {
+        struct downloader_item_t *item = dl->items[i];
+        if (item->status == DOWNLOADER_PENDING) {
+            if (item->retry_at > now) {
+                dl->next_retry_at = MIN (dl->next_retry_at, item->retry_at);
+                all_started = false;
+
+            } else if (item->host != -1 && dl->hosts[item->host].active >= max_per_host) {
+                all_started = false;
+
+            } else if (!_downloader_start (dl, item) || item->status == DOWNLOADER_PENDING) {
+                // Connections that fail right away may put the item back in
+                // the queue, it's retried in a later call.
+                all_started = false;
+            }
+        }
+
+        if (all_started) {
+            dl->first_pending = i + 1;
+        }
+    }
+}
+
+bool _downloader_write_body (struct downloader_t *dl, struct _downloader_conn_t *conn, char *data, size_t len)
+{
+    size_t written = 0;
+    while (written < len) {
+        ssize_t status = write (conn->file_fd, data + written, len - written);
+        if (status == -1) {
+            if (errno == EINTR) continue;
+            _downloader_finish (dl, conn->item, strerror (errno), false);
+            return false;
+        }
+        written += status;
+    }
+
+    conn->body_received += len;
+    conn->item->received += len;
+    return true;
+}
+
+// Starts the next request for item from scratch, used when the server doesn't
+// send the range we asked for.
+void _downloader_restart (struct downloader_t *dl, struct _downloader_conn_t *conn, const char *error)
+{
+    if (unlink (conn->item->part_path) == -1 && errno != ENOENT) {
+        _downloader_finish (dl, conn->item, strerror (errno), false);
+    } else {
+        conn->item->received = 0;
+        _downloader_finish (dl, conn->item, error, true);
+    }
+}
+
+// Case insensitive comparison of a header name. Returns a pointer to the value
+// or NULL if line is a different header.
+char* _downloader_header_value (char *line, char *name)
+{
+    size_t len = strlen (name);
+    if (strncasecmp (line, name, len) != 0 || line[len] != ':') {
+        return NULL;
+    }
+
+    char *value = line + len + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    return value;
+}
+
+// Handles the response headers, which are null terminated. Returns false if
+// the connection was finished.
+bool _downloader_headers (struct downloader_t *dl, struct _downloader_conn_t *conn, char *headers)
+{
+    struct downloader_item_t *item = conn->item;
+
+    int minor_version, status_code;
+    if (sscanf (headers, "HTTP/1.%d %d", &minor_version, &status_code) != 2) {
+        _downloader_finish (dl, item, "malformed response", true);
+        return false;
+    }
+    item->http_status = status_code;
+
+    char *location = NULL;
+    int64_t range_start = -1;
+    int64_t range_total = -1;
+
+    char *line = strstr (headers, "\r\n");
+    while (line != NULL) {
+        line += 2;
+        char *line_end = strstr (line, "\r\n");
+        if (line_end != NULL) *line_end = '\0';
+
+        char *value;
+        if ((value = _downloader_header_value (line, "Content-Length")) != NULL) {
+            conn->content_len = strtoll (value, NULL, 10);
+
+        } else if ((value = _downloader_header_value (line, "Transfer-Encoding")) != NULL) {
+            conn->chunked = strcasestr (value, "chunked") != NULL;
+
+        } else if ((value = _downloader_header_value (line, "Location")) != NULL) {
+            location = value;
+
+        } else if ((value = _downloader_header_value (line, "Content-Range")) != NULL) {
+            // bytes <start>-<end>/<total> or bytes */<total>
+            if (strncasecmp (value, "bytes ", 6) == 0) {
+                value += 6;
+                if (*value != '*') {
+                    range_start = strtoll (value, NULL, 10);
+                }
+                char *slash = strchr (value, '/');
+                if (slash != NULL && slash[1] != '*') {
+                    range_total = strtoll (slash + 1, NULL, 10);
+                }
+            }
+        }
+
+        line = line_end;
+    }
+    if (conn->chunked) {
+        conn->content_len = -1;
+    }
+
+    if (status_code >= 300 && status_code < 400 && location != NULL) {
+        if (item->redirects == DOWNLOADER_MAX_REDIRECTS) {
+            _downloader_finish (dl, item, "too many redirects", false);
+            return false;
+        }
+        item->redirects++;
+
+        if (strncasecmp (location, "http://", 7) == 0 || strncasecmp (location, "https://", 8) == 0) {
+            item->current_url = pom_strdup (&dl->pool, location);
+        } else {
+            // Relative to the current URL.
+            string_t host = {0}, port = {0}, path = {0};
+            _downloader_parse_url (item->current_url, &host, &port, &path);
+            string_t url = {0};
+            str_set_printf (&url, "http://%s:%s", str_data(&host), str_data(&port));
+            if (location[0] != '/') {
+                char *last_slash = strrchr (str_data(&path), '/');
+                strn_cat_c (&url, str_data(&path), last_slash - str_data(&path) + 1);
+            }
+            str_cat_c (&url, location);
+            item->current_url = pom_strndup (&dl->pool, str_data(&url), str_len(&url));
+            str_free (&url);
+            str_free (&host);
+            str_free (&port);
+            str_free (&path);
+        }
+
+        // A redirect doesn't count as a retry, and is followed right away.
+        item->retries--;
+        _downloader_finish (dl, item, "redirected", true);
+        item->retry_at = 0;
+        item->host = -1;
+        return false;
+
+    } else if (status_code == 416 && item->resumed_from > 0) {
+        // The .part file may already have everything.
+        if (range_total == (int64_t)item->resumed_from) {
+            item->total = range_total;
+            _downloader_finish (dl, item, NULL, false);
+        } else {
+            _downloader_restart (dl, conn, "requested range not satisfiable");
+        }
+        return false;
+
+    } else if (status_code == 206) {
+        if (range_start != (int64_t)item->resumed_from) {
+            _downloader_restart (dl, conn, "unexpected range in response");
+            return false;
+        }
+        if (range_total != -1) {
+            item->total = range_total;
+        } else if (conn->content_len != -1) {
+            item->total = item->resumed_from + conn->content_len;
+        }
+
+    } else if (status_code == 200) {
+        if (item->resumed_from > 0) {
+            // The server ignored the Range header, start over. The .part
+            // file is truncated when opened below.
+            item->resumed_from = 0;
+            item->received = 0;
+        }
+        item->total = conn->content_len;
+
+    } else {
+        // Keep the .part file, a later run may be able to resume it.
+        _downloader_finish (dl, item, "unexpected HTTP status", false);
+        return false;
+    }
+
+    int flags = O_WRONLY|O_CREAT|O_CLOEXEC|(item->resumed_from > 0 ? O_APPEND : O_TRUNC);
+    conn->file_fd = open (item->part_path, flags, 0666);
+    if (conn->file_fd == -1) {
+        _downloader_finish (dl, item, strerror (errno), false);
+        return false;
+    }
+
+    if (conn->chunked) {
+        conn->state = _DOWNLOADER_CHUNK_SIZE;
+    } else if (conn->content_len == 0) {
+        _downloader_finish (dl, item, NULL, false);
+        return false;
+    } else {
+        conn->state = _DOWNLOADER_BODY;
+    }
+
+    return true;
+}
+
+// Consumes as much as possible of the buffer. Returns false if the connection
+// was finished.
+bool _downloader_process (struct downloader_t *dl, struct _downloader_conn_t *conn)
+{
+    char *p = conn->buff;
+    char *end = conn->buff + conn->buff_len;
+    bool alive = true;
+    bool wrote = false;
+
+    while (alive && p < end) {
+        if (conn->state == _DOWNLOADER_HEADERS) {
+            char *headers_end = memmem (p, end - p, "\r\n\r\n", 4);
+            if (headers_end == NULL) {
+                if (end - p >= DOWNLOADER_MAX_HEADER_SIZE) {
+                    _downloader_finish (dl, conn->item, "response headers too large", false);
+                    alive = false;
+                }
+                break;
+            }
+
+            headers_end[2] = '\0';
+            alive = _downloader_headers (dl, conn, p);
+            p = headers_end + 4;
+
+        } else if (conn->state == _DOWNLOADER_BODY) {
+            size_t len = end - p;
+            if (conn->content_len != -1) {
+                len = MIN (len, conn->content_len - conn->body_received);
+            }
+
+            alive = _downloader_write_body (dl, conn, p, len);
+            wrote = true;
+            p += len;
+
+            if (alive && conn->content_len != -1 && conn->body_received == (uint64_t)conn->content_len) {
+                _downloader_finish (dl, conn->item, NULL, false);
+                alive = false;
+            }
+
+        } else if (conn->state == _DOWNLOADER_CHUNK_SIZE || conn->state == _DOWNLOADER_TRAILER) {
+            char *line_end = memmem (p, end - p, "\r\n", 2);
+            if (line_end == NULL) {
+                if (end - p >= 1024) {
+                    _downloader_finish (dl, conn->item, "malformed chunked encoding", false);
+                    alive = false;
+                }
+                break;
+            }
+
+            if (conn->state == _DOWNLOADER_CHUNK_SIZE) {
+                char *hex_end;
+                conn->chunk_remaining = strtoull (p, &hex_end, 16);
+                if (hex_end == p) {
+                    _downloader_finish (dl, conn->item, "malformed chunked encoding", false);
+                    alive = false;
+                    break;
+                }
+                conn->state = conn->chunk_remaining == 0 ? _DOWNLOADER_TRAILER : _DOWNLOADER_CHUNK_DATA;
+
+            } else if (line_end == p) {
+                // Empty line after the trailer headers.
+                _downloader_finish (dl, conn->item, NULL, false);
+                alive = false;
+            }
+            p = line_end + 2;
+
+        } else if (conn->state == _DOWNLOADER_CHUNK_DATA) {
+            size_t len = MIN ((uint64_t)(end - p), conn->chunk_remaining);
+            alive = _downloader_write_body (dl, conn, p, len);
+            if (!alive) break;
+            wrote = true;
+            p += len;
+
+            conn->chunk_remaining -= len;
+            if (conn->chunk_remaining == 0) {
+                conn->state = _DOWNLOADER_CHUNK_DATA_END;
+            }
+
+        } else if (conn->state == _DOWNLOADER_CHUNK_DATA_END) {
+            if (end - p < 2) break;
+            if (p[0] != '\r' || p[1] != '\n') {
+                _downloader_finish (dl, conn->item, "malformed chunked encoding", false);
+                alive = false;
+                break;
+            }
+            p += 2;
+            conn->state = _DOWNLOADER_CHUNK_SIZE;
+        }
+    }
+
+    // A finished connection was already reported and freed by
+    // _downloader_finish().
+    if (alive) {
+        if (wrote) {
+            _downloader_progress (dl, conn->item);
+        }
+
+        conn->buff_len = end - p;
+        memmove (conn->buff, p, conn->buff_len);
+    }
+    return alive;
+}
+
+void _downloader_handle (struct downloader_t *dl, struct _downloader_conn_t *conn)
+{
+    struct downloader_item_t *item = conn->item;
+    conn->last_activity = _downloader_now_ms ();
+
+    if (conn->state == _DOWNLOADER_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt (conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            _downloader_finish (dl, item, strerror (error), true);
+            return;
+        }
+        conn->state = _DOWNLOADER_SENDING;
+    }
+
+    if (conn->state == _DOWNLOADER_SENDING) {
+        while (conn->request_sent < str_len(&conn->request)) {
+            ssize_t status = send (conn->fd, str_data(&conn->request) + conn->request_sent,
+                                   str_len(&conn->request) - conn->request_sent, MSG_NOSIGNAL);
+            if (status == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) return;
+                _downloader_finish (dl, item, strerror (errno), true);
+                return;
+            }
+            conn->request_sent += status;
+        }
+
+        conn->state = _DOWNLOADER_HEADERS;
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        epoll_ctl (dl->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        return;
+    }
+
+    while (true) {
+        ssize_t status = read (conn->fd, conn->buff + conn->buff_len, DOWNLOADER_BUFFER_SIZE - conn->buff_len);
+        if (status == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            _downloader_finish (dl, item, strerror (errno), true);
+            return;
+
+        } else if (status == 0) {
+            // Without a length or chunked encoding, the end of the
+            // connection is the end of the body.
+            if (conn->state == _DOWNLOADER_BODY && conn->content_len == -1) {
+                _downloader_finish (dl, item, NULL, false);
+            } else {
+                _downloader_finish (dl, item, "connection closed before the end of the response", true);
+            }
+            return;
+        }
+
+        conn->buff_len += status;
+        if (!_downloader_process (dl, conn)) {
+            return;
+        }
+    }
+}
+
+// Runs until all downloads finished, either successfully or not. Returns true
+// if all of them succeeded. Items added while running, from the progress
+// callback, are downloaded too.
+bool downloader_run (struct downloader_t *dl)
+{
+    int max_connections = dl->max_connections > 0 ? dl->max_connections : DOWNLOADER_MAX_CONNECTIONS;
+    int timeout_ms = dl->timeout_ms > 0 ? dl->timeout_ms : DOWNLOADER_TIMEOUT_MS;
+
+    dl->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (dl->epoll_fd == -1) {
+        for (int i=0; i<dl->items_len; i++) {
+            dl->items[i]->status = DOWNLOADER_FAILED;
+            dl->items[i]->error = strerror (errno);
+        }
+        return false;
+    }
+
+    dl->conns = calloc (max_connections, sizeof(struct _downloader_conn_t*));
+    dl->conns_len = 0;
+    dl->first_pending = 0;
+
+    struct epoll_event events[64];
+    while (true) {
+        _downloader_schedule (dl);
+        if (dl->conns_len == 0 && dl->first_pending >= dl->items_len) {
+            break;
+        }
+
+        int64_t now = _downloader_now_ms ();
+        int64_t wait = MIN (timeout_ms, dl->next_retry_at - now);
+        for (int i=0; i<dl->conns_len; i++) {
+            wait = MIN (wait, dl->conns[i]->last_activity + timeout_ms - now);
+        }
+
+        int num_events = epoll_wait (dl->epoll_fd, events, ARRAY_SIZE(events), MAX (wait, 0));
+        for (int i=0; i<num_events; i++) {
+            struct _downloader_conn_t *conn = (struct _downloader_conn_t*)events[i].data.ptr;
+
+            // A connection finished by an earlier event in this batch may
+            // have been freed.
+            bool active = false;
+            for (int j=0; j<dl->conns_len; j++) {
+                if (dl->conns[j] == conn) {
+                    active = true;
+                    break;
+                }
+            }
+            if (active) {
+                _downloader_handle (dl, conn);
+            }
+        }
+
+        now = _downloader_now_ms ();
+        for (int i=0; i<dl->conns_len; i++) {
+            struct _downloader_conn_t *conn = dl->conns[i];
+            if (now - conn->last_activity >= timeout_ms) {
+                _downloader_finish (dl, conn->item, "timed out", true);
+                i--;
+            }
+        }
+    }
+
+    close (dl->epoll_fd);
+    free (dl->conns);
+    dl->conns = NULL;
+
+    bool success = true;
+    for (int i=0; i<dl->items_len; i++) {
+        success = success && dl->items[i]->status == DOWNLOADER_DONE;
+    }
+    return success;
+}
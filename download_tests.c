@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+#include <poll.h>
+
+// Minimal HTTP server used as the other end of the downloader. Each connection
+// is served by its own thread. The path selects the behavior:
+//
+//  /file/<n>      <n> bytes with Content-Length, supports Range.
+//  /slow/<n>      Same as /file/<n> but waits a bit before answering.
+//  /norange/<n>   Ignores Range headers.
+//  /chunked/<n>   Chunked transfer encoding.
+//  /badchunk      Chunked transfer encoding with an invalid chunk size.
+//  /eof/<n>       No length, the body ends when the connection is closed.
+//  /drop/<n>      Like /file/<n>, but the first response is cut in half.
+//  /redirect/<n>  Redirects to /file/<n>.
+//  /hang          Never answers.
+//  Anything else is a 404.
+struct download_test_server_t {
+    int listen_fd;
+    int port;
+    pthread_t thread;
+    volatile int stop;
+
+    volatile int threads;
+    volatile int active;
+    volatile int max_active;
+    volatile int drops;
+    volatile int64_t last_range;
+};
+
+struct download_test_conn_t {
+    struct download_test_server_t *srv;
+    int fd;
+};
+
+static inline
+char download_test_byte (uint64_t i)
+{
+    return 'a' + (i*7 + i/100)%26;
+}
+
+void download_test_send (int fd, const char *data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t status = send (fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (status <= 0) return;
+        sent += status;
+    }
+}
+
+void download_test_send_content (int fd, uint64_t start, uint64_t end)
+{
+    char buff[4096];
+    while (start < end) {
+        size_t len = MIN (sizeof(buff), end - start);
+        for (size_t i=0; i<len; i++) {
+            buff[i] = download_test_byte (start + i);
+        }
+        download_test_send (fd, buff, len);
+        start += len;
+    }
+}
+
+void* download_test_conn_thread (void *arg)
+{
+    struct download_test_conn_t *conn = (struct download_test_conn_t*)arg;
+    struct download_test_server_t *srv = conn->srv;
+    int fd = conn->fd;
+    free (conn);
+
+    int active = __sync_add_and_fetch (&srv->active, 1);
+    int max_active;
+    while ((max_active = srv->max_active) < active) {
+        __sync_bool_compare_and_swap (&srv->max_active, max_active, active);
+    }
+
+    char request[4096];
+    size_t request_len = 0;
+    while (request_len < sizeof(request) - 1) {
+        ssize_t status = recv (fd, request + request_len, sizeof(request) - 1 - request_len, 0);
+        if (status <= 0) break;
+        request_len += status;
+        request[request_len] = '\0';
+        if (strstr (request, "\r\n\r\n") != NULL) break;
+    }
+    request[request_len] = '\0';
+
+    char path[256] = "";
+    sscanf (request, "GET %255s", path);
+
+    int64_t range = -1;
+    char *range_header = strstr (request, "Range: bytes=");
+    if (range_header != NULL) {
+        range = strtoll (range_header + 13, NULL, 10);
+        srv->last_range = range;
+    }
+
+    char kind[64] = "";
+    uint64_t n = 0;
+    sscanf (path, "/%63[^/]/%"SCNu64, kind, &n);
+
+    string_t header = {0};
+    if (strcmp (kind, "slow") == 0) {
+        usleep (50*1000);
+        strcpy (kind, "file");
+    }
+
+    if (strcmp (kind, "file") == 0 || strcmp (kind, "drop") == 0 || strcmp (kind, "norange") == 0) {
+        uint64_t end = n;
+        if (strcmp (kind, "drop") == 0 && __sync_fetch_and_add (&srv->drops, 1) == 0) {
+            end = n/2;
+        }
+
+        if (range != -1 && strcmp (kind, "norange") != 0) {
+            if ((uint64_t)range >= n) {
+                str_set_printf (&header, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                         "Content-Range: bytes */%"PRIu64"\r\n"
+                                         "Content-Length: 0\r\n\r\n", n);
+                download_test_send (fd, str_data(&header), str_len(&header));
+            } else {
+                str_set_printf (&header, "HTTP/1.1 206 Partial Content\r\n"
+                                         "Content-Range: bytes %"PRIi64"-%"PRIu64"/%"PRIu64"\r\n"
+                                         "Content-Length: %"PRIu64"\r\n\r\n", range, n - 1, n, n - range);
+                download_test_send (fd, str_data(&header), str_len(&header));
+                download_test_send_content (fd, range, end);
+            }
+
+        } else {
+            str_set_printf (&header, "HTTP/1.1 200 OK\r\nContent-Length: %"PRIu64"\r\n\r\n", n);
+            download_test_send (fd, str_data(&header), str_len(&header));
+            download_test_send_content (fd, 0, end);
+        }
+
+    } else if (strcmp (kind, "chunked") == 0) {
+        str_set_printf (&header, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+        download_test_send (fd, str_data(&header), str_len(&header));
+
+        uint64_t pos = 0;
+        uint64_t chunk_len = 1;
+        while (pos < n) {
+            chunk_len = MIN (n - pos, (chunk_len*37 + 11)%5000 + 1);
+            str_set_printf (&header, "%"PRIx64";ext=1\r\n", chunk_len);
+            download_test_send (fd, str_data(&header), str_len(&header));
+            download_test_send_content (fd, pos, pos + chunk_len);
+            download_test_send (fd, "\r\n", 2);
+            pos += chunk_len;
+        }
+        str_set_printf (&header, "0\r\nX-Trailer: 1\r\n\r\n");
+        download_test_send (fd, str_data(&header), str_len(&header));
+
+    } else if (strcmp (kind, "badchunk") == 0) {
+        str_set_printf (&header, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                 "5\r\nabcde\r\nzz\r\n");
+        download_test_send (fd, str_data(&header), str_len(&header));
+
+    } else if (strcmp (kind, "eof") == 0) {
+        str_set_printf (&header, "HTTP/1.1 200 OK\r\n\r\n");
+        download_test_send (fd, str_data(&header), str_len(&header));
+        download_test_send_content (fd, 0, n);
+
+    } else if (strcmp (kind, "redirect") == 0) {
+        str_set_printf (&header, "HTTP/1.1 302 Found\r\nLocation: /file/%"PRIu64"\r\nContent-Length: 0\r\n\r\n", n);
+        download_test_send (fd, str_data(&header), str_len(&header));
+
+    } else if (strcmp (kind, "hang") == 0) {
+        while (!srv->stop) {
+            usleep (10*1000);
+        }
+
+    } else {
+        str_set_printf (&header, "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nNot found");
+        download_test_send (fd, str_data(&header), str_len(&header));
+    }
+
+    // Leave before closing the connection, otherwise the client may already
+    // count as having started the next one.
+    str_free (&header);
+    __sync_fetch_and_sub (&srv->active, 1);
+    close (fd);
+    __sync_fetch_and_sub (&srv->threads, 1);
+    return NULL;
+}
+
+void* download_test_server_thread (void *arg)
+{
+    struct download_test_server_t *srv = (struct download_test_server_t*)arg;
+
+    while (!srv->stop) {
+        struct pollfd pfd = {srv->listen_fd, POLLIN, 0};
+        if (poll (&pfd, 1, 10) <= 0) continue;
+
+        int fd = accept (srv->listen_fd, NULL, NULL);
+        if (fd == -1) continue;
+
+        struct download_test_conn_t *conn = malloc (sizeof(struct download_test_conn_t));
+        conn->srv = srv;
+        conn->fd = fd;
+
+        __sync_fetch_and_add (&srv->threads, 1);
+        pthread_t thread;
+        if (pthread_create (&thread, NULL, download_test_conn_thread, conn) == 0) {
+            pthread_detach (thread);
+        } else {
+            __sync_fetch_and_sub (&srv->threads, 1);
+            close (fd);
+            free (conn);
+        }
+    }
+    return NULL;
+}
+
+bool download_test_server_start (struct download_test_server_t *srv)
+{
+    *srv = (struct download_test_server_t){0};
+    srv->last_range = -1;
+
+    srv->listen_fd = socket (AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t addr_len = sizeof(addr);
+    if (bind (srv->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen (srv->listen_fd, 64) == -1 ||
+        getsockname (srv->listen_fd, (struct sockaddr*)&addr, &addr_len) == -1) {
+        close (srv->listen_fd);
+        return false;
+    }
+    srv->port = ntohs (addr.sin_port);
+
+    return pthread_create (&srv->thread, NULL, download_test_server_thread, srv) == 0;
+}
+
+void download_test_server_stop (struct download_test_server_t *srv)
+{
+    srv->stop = 1;
+    pthread_join (srv->thread, NULL);
+    while (srv->threads > 0) {
+        usleep (1000);
+    }
+    close (srv->listen_fd);
+}
+
+// Checks that path has the first n bytes served by the test server.
+bool download_test_check_file (char *path, uint64_t n)
+{
+    uint64_t len;
+    char *data = file_map (path, &len);
+    bool success = data != NULL && len == n;
+    for (uint64_t i=0; success && i<n; i++) {
+        success = data[i] == download_test_byte (i);
+    }
+    file_unmap (data, len);
+    return success;
+}
+
+void download_test_write_part (char *dest, uint64_t n)
+{
+    char *data = malloc (MAX(n, 1));
+    for (uint64_t i=0; i<n; i++) {
+        data[i] = download_test_byte (i);
+    }
+    string_t part = {0};
+    str_set_printf (&part, "%s.part", dest);
+    full_file_write (data, n, str_data(&part));
+    str_free (&part);
+    free (data);
+}
+
+struct download_test_progress_t {
+    int calls;
+    int finished;
+    bool consistent;
+};
+
+DOWNLOADER_PROGRESS_CB (download_test_progress)
+{
+    struct download_test_progress_t *progress = (struct download_test_progress_t*)data;
+    progress->calls++;
+    if (item->status == DOWNLOADER_DONE || item->status == DOWNLOADER_FAILED) {
+        progress->finished++;
+    }
+    if (item->total != -1 && item->received > (uint64_t)item->total) {
+        progress->consistent = false;
+    }
+}
+
+void download_tests (struct test_ctx_t *t)
+{
+    test_push (t, "Downloads");
+
+    struct download_test_server_t srv;
+    if (!download_test_server_start (&srv)) {
+        test_bool (t, "start server", false);
+        test_pop_parent (t);
+        return;
+    }
+
+    char *dir = "bin/download_test";
+    path_rmrf (dir);
+    path_ensure_dir (dir);
+
+    string_t url = {0};
+    string_t dest = {0};
+
+    {
+        struct {
+            char *kind;
+            uint64_t n;
+        } files[] = {
+            {"slow", 0}, {"slow", 1}, {"slow", 1000}, {"slow", 200000},
+            {"slow", 70000}, {"slow", 5}, {"slow", 65536}, {"slow", 123456},
+            {"chunked", 100000}, {"chunked", 3}, {"eof", 50000}, {"redirect", 3000},
+        };
+
+        struct download_test_progress_t progress = {0};
+        progress.consistent = true;
+
+        struct downloader_t dl = {0};
+        dl.max_per_host = 3;
+        dl.progress_cb = download_test_progress;
+        dl.progress_data = &progress;
+        for (int i=0; i<ARRAY_SIZE(files); i++) {
+            str_set_printf (&url, "http://127.0.0.1:%d/%s/%"PRIu64, srv.port, files[i].kind, files[i].n);
+            str_set_printf (&dest, "%s/file_%d", dir, i);
+            downloader_add (&dl, str_data(&url), str_data(&dest));
+        }
+
+        bool success = downloader_run (&dl);
+        test_bool (t, "all succeed", success);
+
+        for (int i=0; i<ARRAY_SIZE(files); i++) {
+            struct downloader_item_t *item = dl.items[i];
+            test_push (t, "%s %"PRIu64, files[i].kind, files[i].n);
+            bool ok = item->status == DOWNLOADER_DONE && item->received == files[i].n &&
+                      download_test_check_file (item->dest, files[i].n) && !path_exists (item->part_path);
+            if (!ok) {
+                str_cat_printf (t->error, "Status %d, HTTP %d, received %"PRIu64", error: %s\n",
+                                item->status, item->http_status, item->received, item->error);
+            }
+            test_pop (t, ok);
+        }
+
+        test_bool (t, "per host limit", srv.max_active == 3);
+        test_bool (t, "progress", progress.consistent && progress.finished == ARRAY_SIZE(files) &&
+                                  progress.calls > ARRAY_SIZE(files));
+        downloader_destroy (&dl);
+    }
+
+    {
+        struct downloader_t dl = {0};
+
+        // Part of the file was already downloaded.
+        str_set_printf (&url, "http://127.0.0.1:%d/file/50000", srv.port);
+        download_test_write_part ("bin/download_test/resume", 1000);
+        struct downloader_item_t *resume = downloader_add (&dl, str_data(&url), "bin/download_test/resume");
+
+        // The server doesn't support ranges.
+        str_set_printf (&url, "http://127.0.0.1:%d/norange/20000", srv.port);
+        download_test_write_part ("bin/download_test/norange", 500);
+        struct downloader_item_t *norange = downloader_add (&dl, str_data(&url), "bin/download_test/norange");
+
+        // Everything was downloaded but not renamed.
+        str_set_printf (&url, "http://127.0.0.1:%d/file/3000", srv.port);
+        download_test_write_part ("bin/download_test/complete", 3000);
+        struct downloader_item_t *complete = downloader_add (&dl, str_data(&url), "bin/download_test/complete");
+
+        bool success = downloader_run (&dl);
+
+        test_bool (t, "resume", success && resume->status == DOWNLOADER_DONE && resume->resumed_from == 1000 &&
+                                srv.last_range != -1 && download_test_check_file (resume->dest, 50000));
+        test_bool (t, "resume without range support", norange->status == DOWNLOADER_DONE &&
+                                                       download_test_check_file (norange->dest, 20000));
+        test_bool (t, "resume complete file", complete->status == DOWNLOADER_DONE && complete->http_status == 416 &&
+                                              download_test_check_file (complete->dest, 3000));
+        downloader_destroy (&dl);
+    }
+
+    {
+        struct downloader_t dl = {0};
+        str_set_printf (&url, "http://127.0.0.1:%d/drop/100000", srv.port);
+        struct downloader_item_t *item = downloader_add (&dl, str_data(&url), "bin/download_test/drop");
+        downloader_run (&dl);
+        test_bool (t, "retry dropped connection", item->status == DOWNLOADER_DONE && item->retries == 1 &&
+                                                  item->resumed_from == 50000 &&
+                                                  download_test_check_file (item->dest, 100000));
+        downloader_destroy (&dl);
+    }
+
+    {
+        // A port where nothing is listening.
+        int closed_fd = socket (AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        bind (closed_fd, (struct sockaddr*)&addr, sizeof(addr));
+        getsockname (closed_fd, (struct sockaddr*)&addr, &addr_len);
+        close (closed_fd);
+
+        struct downloader_t dl = {0};
+        dl.timeout_ms = 200;
+        dl.max_retries = 1;
+
+        str_set_printf (&url, "http://127.0.0.1:%d/missing", srv.port);
+        struct downloader_item_t *missing = downloader_add (&dl, str_data(&url), "bin/download_test/missing");
+        struct downloader_item_t *https = downloader_add (&dl, "https://127.0.0.1/file/10", "bin/download_test/https");
+        str_set_printf (&url, "http://127.0.0.1:%d/file/10", ntohs (addr.sin_port));
+        struct downloader_item_t *refused = downloader_add (&dl, str_data(&url), "bin/download_test/refused");
+        str_set_printf (&url, "http://127.0.0.1:%d/hang", srv.port);
+        struct downloader_item_t *hang = downloader_add (&dl, str_data(&url), "bin/download_test/hang");
+        str_set_printf (&url, "http://127.0.0.1:%d/badchunk", srv.port);
+        struct downloader_item_t *badchunk = downloader_add (&dl, str_data(&url), "bin/download_test/badchunk");
+
+        test_bool (t, "failures", !downloader_run (&dl));
+        test_bool (t, "not found", missing->status == DOWNLOADER_FAILED && missing->http_status == 404 &&
+                                   !path_exists (missing->dest) && !path_exists (missing->part_path));
+        test_bool (t, "unsupported URL", https->status == DOWNLOADER_FAILED);
+        test_bool (t, "connection refused", refused->status == DOWNLOADER_FAILED && refused->retries == 1 &&
+                                           !path_exists (refused->part_path));
+        test_bool (t, "timeout", hang->status == DOWNLOADER_FAILED && strcmp (hang->error, "timed out") == 0);
+        test_bool (t, "bad chunk size", badchunk->status == DOWNLOADER_FAILED &&
+                                        strcmp (badchunk->error, "malformed chunked encoding") == 0);
+        downloader_destroy (&dl);
+
+        // Retries wait 50 ms and then 100 ms instead of reconnecting in a
+        // tight loop.
+        dl = (struct downloader_t){0};
+        dl.max_retries = 2;
+        dl.retry_delay_ms = 50;
+        str_set_printf (&url, "http://127.0.0.1:%d/file/10", ntohs (addr.sin_port));
+        refused = downloader_add (&dl, str_data(&url), "bin/download_test/refused");
+        int64_t start = _downloader_now_ms ();
+        downloader_run (&dl);
+        test_bool (t, "retry delay", refused->status == DOWNLOADER_FAILED && refused->retries == 2 &&
+                                     _downloader_now_ms () - start >= 150);
+        downloader_destroy (&dl);
+    }
+
+    str_free (&url);
+    str_free (&dest);
+    download_test_server_stop (&srv);
+    path_rmrf (dir);
+
+    test_pop_parent (t);
+}
@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Batched file reading
+//
+// Reading many small files one at a time with full_file_read() leaves the disk
+// idle most of the time, each file needs a stat(), open(), read() and close()
+// that block before the next one starts. file_batch_read() keeps many files in
+// flight at the same time so the kernel can overlap directory lookups and
+// reads, which is mostly noticeable when files aren't in the page cache.
+//
+// On Linux io_uring is used if the kernel supports it, requests are submitted
+// through raw system calls so liburing is not needed. Otherwise, if pthread.h
+// was included before common.h, a pool of threads does the blocking reads.
+// As a last resort files are read sequentially.
+//
+//      struct file_batch_result_t *results =
+//          mem_pool_push_array (&pool, num_paths, struct file_batch_result_t);
+//      file_batch_read (&pool, paths, num_paths, results);
+//      for (int i=0; i<num_paths; i++) {
+//          if (results[i].error != 0) {
+//              printf ("Could not read %s: %s\n", paths[i], strerror(results[i].error));
+//          }
+//      }
+//
+// Contents are allocated in the pool and are null terminated. Errors are
+// reported per file as an errno value, nothing is printed.
+
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define FILE_BATCH_IO_URING
+#endif
+
+// Maximum number of files being read at the same time.
+#define FILE_BATCH_QUEUE_DEPTH 64
+
+// Number of threads used by the fallback implementation. Threads spend most of
+// their time blocked on I/O, so we use more than the number of CPUs.
+#define FILE_BATCH_THREADS 16
+
+struct file_batch_result_t {
+    char *data;
+    uint64_t len;
+    int error;
+};
+
+// Reads a file without printing errors. This is what the fallback
+// implementations use for each file.
+void file_batch_read_one (mem_pool_t *pool, char *path, struct file_batch_result_t *result)
+{
+    *result = (struct file_batch_result_t){0};
+
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        result->error = errno;
+        return;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == 0) {
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            char *data = mem_pool_push_size (pool, st.st_size + 1);
+            uint64_t bytes_read = 0;
+            while (bytes_read < st.st_size) {
+                ssize_t status = read (fd, data + bytes_read, st.st_size - bytes_read);
+                if (status == -1) {
+                    if (errno == EINTR) continue;
+                    result->error = errno;
+                    break;
+                } else if (status == 0) {
+                    break;
+                }
+                bytes_read += status;
+            }
+            data[bytes_read] = '\0';
+
+            if (result->error == 0) {
+                result->data = data;
+                result->len = bytes_read;
+            }
+
+        } else {
+            // Files that report a size of 0 like the ones in /proc, or
+            // things that aren't regular files.
+            uint64_t len;
+            char *data = file_map_read_fallback (fd, &len);
+            if (data != NULL) {
+                result->data = pom_strndup (pool, data, len);
+                result->len = len;
+                file_unmap (data, len);
+            } else {
+                result->error = errno;
+            }
+        }
+
+    } else {
+        result->error = errno;
+    }
+
+    close (fd);
+}
+
+void file_batch_read_sequential (mem_pool_t *pool, char **paths, int num_paths,
+                                 struct file_batch_result_t *results)
+{
+    for (int i=0; i<num_paths; i++) {
+        file_batch_read_one (pool, paths[i], &results[i]);
+    }
+}
+
+#ifdef _PTHREAD_H
+struct file_batch_threads_t {
+    char **paths;
+    int num_paths;
+    struct file_batch_result_t *results;
+
+    volatile int next_path;
+    mem_pool_t *pools;
+};
+
+THREAD_WORKER_CB(file_batch_thread)
+{
+    struct file_batch_threads_t *batch = (struct file_batch_threads_t*)clsr;
+
+    int idx;
+    while ((idx = __sync_fetch_and_add (&batch->next_path, 1)) < batch->num_paths) {
+        file_batch_read_one (&batch->pools[thread_idx], batch->paths[idx], &batch->results[idx]);
+    }
+}
+
+// Reads the files using a pool of threads. Each thread allocates in its own
+// pool, these become children of pool.
+void file_batch_read_threads (mem_pool_t *pool, char **paths, int num_paths,
+                              struct file_batch_result_t *results)
+{
+    int num_threads = MIN (FILE_BATCH_THREADS, num_paths);
+    if (num_threads <= 1) {
+        file_batch_read_sequential (pool, paths, num_paths, results);
+        return;
+    }
+
+    struct file_batch_threads_t batch = {0};
+    batch.paths = paths;
+    batch.num_paths = num_paths;
+    batch.results = results;
+    batch.pools = mem_pool_push_array (pool, num_threads, mem_pool_t);
+    for (int i=0; i<num_threads; i++) {
+        batch.pools[i] = (mem_pool_t){0};
+    }
+
+    run_threads (num_threads, file_batch_thread, &batch);
+
+    for (int i=0; i<num_threads; i++) {
+        mem_pool_add_child (pool, &batch.pools[i]);
+    }
+}
+#endif
+
+#ifdef FILE_BATCH_IO_URING
+struct file_batch_uring_t {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // Entries filled but not yet made visible to the kernel by updating the
+    // tail.
+    unsigned sq_pending;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+enum file_batch_state_t {
+    FILE_BATCH_OPEN,
+    FILE_BATCH_READ,
+    FILE_BATCH_CLOSE,
+    FILE_BATCH_DONE
+};
+
+struct file_batch_file_t {
+    enum file_batch_state_t state;
+    int fd;
+    uint64_t size;
+
+    // Only used if io_uring_enter() fails. The request for the current state
+    // is still in the submission queue, the kernel never saw it.
+    bool not_submitted;
+};
+
+void file_batch_uring_destroy (struct file_batch_uring_t *ring)
+{
+    if (ring->sqes != NULL) munmap (ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) munmap (ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL) munmap (ring->sq_ptr, ring->sq_len);
+    if (ring->fd != -1) close (ring->fd);
+}
+
+// Returns false if io_uring isn't available or doesn't support all the
+// operations we need.
+bool file_batch_uring_init (struct file_batch_uring_t *ring, unsigned entries)
+{
+    *ring = (struct file_batch_uring_t){0};
+
+    struct io_uring_params params = {0};
+    ring->fd = syscall (__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return false;
+    }
+
+    bool success = true;
+
+    // Check the kernel supports all the operations we use.
+    int num_probe_ops = 256;
+    struct io_uring_probe *probe =
+        calloc (1, sizeof(struct io_uring_probe) + num_probe_ops*sizeof(struct io_uring_probe_op));
+    if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, num_probe_ops) == 0) {
+        int ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+        for (int i=0; i<ARRAY_SIZE(ops); i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                success = false;
+            }
+        }
+    } else {
+        success = false;
+    }
+    free (probe);
+
+    if (success) {
+        ring->sq_len = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        ring->cq_len = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            ring->sq_len = ring->cq_len = MAX (ring->sq_len, ring->cq_len);
+        }
+
+        ring->sq_ptr = mmap (NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED) {
+            ring->sq_ptr = NULL;
+            success = false;
+        }
+    }
+
+    if (success) {
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            ring->cq_ptr = ring->sq_ptr;
+        } else {
+            ring->cq_ptr = mmap (NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING);
+            if (ring->cq_ptr == MAP_FAILED) {
+                ring->cq_ptr = NULL;
+                success = false;
+            }
+        }
+    }
+
+    if (success) {
+        ring->sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+        ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+            ring->sqes = NULL;
+            success = false;
+        }
+    }
+
+    if (success) {
+        char *sq = ring->sq_ptr;
+        ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+        ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+        char *cq = ring->cq_ptr;
+        ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+        ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    } else {
+        file_batch_uring_destroy (ring);
+    }
+
+    return success;
+}
+
+// The caller must make sure there is space in the submission queue. We never
+// have more than one request in flight per file and never more files than
+// entries in the queue.
+static inline
+struct io_uring_sqe* file_batch_uring_get_sqe (struct file_batch_uring_t *ring, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    unsigned idx = tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset (sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+void file_batch_uring_submit_next (struct file_batch_uring_t *ring, int idx, struct file_batch_file_t *file,
+                                   char *path, struct file_batch_result_t *result)
+{
+    struct io_uring_sqe *sqe = file_batch_uring_get_sqe (ring, idx);
+    switch (file->state) {
+        case FILE_BATCH_OPEN:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)path;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            break;
+
+        case FILE_BATCH_READ:
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = file->fd;
+            sqe->addr = (uint64_t)(uintptr_t)(result->data + result->len);
+            sqe->len = MIN (file->size - result->len, 1<<30);
+            sqe->off = result->len;
+            break;
+
+        case FILE_BATCH_CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = file->fd;
+            break;
+
+        case FILE_BATCH_DONE:
+            invalid_code_path;
+    }
+}
+
+// Processes the completion of the current request for a file. Returns true if
+// the file is done.
+bool file_batch_uring_complete (struct file_batch_uring_t *ring, mem_pool_t *pool,
+                                int idx, struct file_batch_file_t *file, int res,
+                                char *path, struct file_batch_result_t *result)
+{
+    switch (file->state) {
+        case FILE_BATCH_OPEN:
+            if (res < 0) {
+                result->error = -res;
+                return true;
+            }
+            file->fd = res;
+
+            // We use fstat() instead of IORING_OP_STATX because the kernel
+            // always runs statx requests in a worker thread, and on an open
+            // file it doesn't block anyway.
+            struct stat st;
+            if (fstat (file->fd, &st) == -1) {
+                result->error = errno;
+                file->state = FILE_BATCH_CLOSE;
+
+            } else if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+                // Files that report a size of 0 like the ones in /proc, or
+                // things that aren't regular files. These are rare so we read
+                // them synchronously.
+                uint64_t len;
+                char *data = file_map_read_fallback (file->fd, &len);
+                if (data != NULL) {
+                    result->data = pom_strndup (pool, data, len);
+                    result->len = len;
+                    file_unmap (data, len);
+                } else {
+                    result->error = errno;
+                }
+                file->state = FILE_BATCH_CLOSE;
+
+            } else {
+                file->size = st.st_size;
+                result->data = mem_pool_push_size (pool, file->size + 1);
+                result->len = 0;
+                file->state = FILE_BATCH_READ;
+            }
+            break;
+
+        case FILE_BATCH_READ:
+            if (res == -EINTR || res == -EAGAIN) {
+                // Retry the same read.
+            } else if (res < 0) {
+                result->error = -res;
+                file->state = FILE_BATCH_CLOSE;
+            } else {
+                result->len += res;
+                if (res == 0 || result->len == file->size) {
+                    result->data[result->len] = '\0';
+                    file->state = FILE_BATCH_CLOSE;
+                }
+            }
+            break;
+
+        case FILE_BATCH_CLOSE:
+            if (result->error != 0) {
+                result->data = NULL;
+                result->len = 0;
+            }
+            return true;
+
+        case FILE_BATCH_DONE:
+            invalid_code_path;
+    }
+
+    file_batch_uring_submit_next (ring, idx, file, path, result);
+    return false;
+}
+
+// Returns false if io_uring is not available, in that case no file was read.
+bool file_batch_read_uring (mem_pool_t *pool, char **paths, int num_paths,
+                            struct file_batch_result_t *results)
+{
+    struct file_batch_uring_t ring;
+    if (!file_batch_uring_init (&ring, FILE_BATCH_QUEUE_DEPTH)) {
+        return false;
+    }
+
+    struct file_batch_file_t *files = calloc (num_paths, sizeof(struct file_batch_file_t));
+
+    int next_path = 0;
+    int in_flight = 0;
+    int completed = 0;
+    while (completed < num_paths) {
+        while (in_flight < FILE_BATCH_QUEUE_DEPTH && next_path < num_paths) {
+            results[next_path] = (struct file_batch_result_t){0};
+            files[next_path].state = FILE_BATCH_OPEN;
+            file_batch_uring_submit_next (&ring, next_path, &files[next_path], paths[next_path], &results[next_path]);
+            next_path++;
+            in_flight++;
+        }
+
+        // Publish the new entries and wait for at least one completion.
+        unsigned sq_tail = *ring.sq_tail + ring.sq_pending;
+        __atomic_store_n (ring.sq_tail, sq_tail, __ATOMIC_RELEASE);
+        ring.sq_pending = 0;
+
+        unsigned to_submit = sq_tail - __atomic_load_n (ring.sq_head, __ATOMIC_ACQUIRE);
+        int status = syscall (__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (status == -1 && errno != EINTR) {
+            // Should not happen, finish the files that haven't been
+            // completed synchronously. Nothing was submitted by this call, so
+            // the requests left in the submission queue never reached the
+            // kernel.
+            for (unsigned h = *ring.sq_head; h != sq_tail; h++) {
+                struct io_uring_sqe *sqe = &ring.sqes[ring.sq_array[h & *ring.sq_mask]];
+                files[sqe->user_data].not_submitted = true;
+            }
+
+            for (int i=0; i<num_paths; i++) {
+                struct file_batch_file_t *file = &files[i];
+                if (i < next_path && file->state == FILE_BATCH_DONE) {
+                    continue;
+                }
+
+                if (i < next_path && file->state == FILE_BATCH_CLOSE) {
+                    // The result is final, only the file needs to be closed.
+                    // If the close request reached the kernel it will close it.
+                    if (file->not_submitted) {
+                        close (file->fd);
+                    }
+                    if (results[i].error != 0) {
+                        results[i].data = NULL;
+                        results[i].len = 0;
+                    }
+                    continue;
+                }
+
+                if (i < next_path && file->state == FILE_BATCH_READ) {
+                    // A read that reached the kernel may still write into the
+                    // old buffer, file_batch_read_one() allocates a new one.
+                    close (file->fd);
+                }
+
+                file_batch_read_one (pool, paths[i], &results[i]);
+            }
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int idx = cqe->user_data;
+            int res = cqe->res;
+            head++;
+
+            if (file_batch_uring_complete (&ring, pool, idx, &files[idx], res, paths[idx], &results[idx])) {
+                files[idx].state = FILE_BATCH_DONE;
+                in_flight--;
+                completed++;
+            }
+        }
+        __atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free (files);
+    file_batch_uring_destroy (&ring);
+    return true;
+}
+#endif
+
+// Reads the content of all files in paths, results[i] corresponds to
+// paths[i]. On success data points to the null terminated content, allocated
+// in pool, and error is 0. Otherwise data is NULL and error contains the errno
+// value of the failed operation.
+void file_batch_read (mem_pool_t *pool, char **paths, int num_paths,
+                      struct file_batch_result_t *results)
+{
+#ifdef FILE_BATCH_IO_URING
+    if (file_batch_read_uring (pool, paths, num_paths, results)) {
+        return;
+    }
+#endif
+
+#ifdef _PTHREAD_H
+    file_batch_read_threads (pool, paths, num_paths, results);
+#else
+    file_batch_read_sequential (pool, paths, num_paths, results);
+#endif
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+typedef void (*file_batch_read_func_t)(mem_pool_t*, char**, int, struct file_batch_result_t*);
+
+bool file_batch_test_results (struct test_ctx_t *t, char **paths, int num_paths,
+                              struct file_batch_result_t *results)
+{
+    bool success = true;
+    for (int i=0; success && i<num_paths; i++) {
+        struct stat st;
+        if (stat (paths[i], &st) == -1) {
+            success = results[i].data == NULL && results[i].error == errno;
+
+        } else if (S_ISDIR(st.st_mode)) {
+            success = results[i].data == NULL && results[i].error == EISDIR;
+
+        } else {
+            uint64_t len;
+            char *expected = file_map (paths[i], &len);
+            if (strncmp (paths[i], "/proc", 5) == 0) {
+                // Content may change between reads.
+                success = results[i].error == 0 && results[i].len > 0;
+            } else {
+                success = results[i].error == 0 && results[i].len == len &&
+                          memcmp (results[i].data, expected, len) == 0 &&
+                          results[i].data[len] == '\0';
+            }
+            file_unmap (expected, len);
+        }
+
+        if (!success) {
+            str_cat_printf (t->error, "Unexpected result for %s, error: %s\n",
+                            paths[i], strerror (results[i].error));
+        }
+    }
+
+    return success;
+}
+
+void file_batch_tests (struct test_ctx_t *t)
+{
+    test_push (t, "Batched file reading");
+
+    mem_pool_t pool = {0};
+
+    char *dir = "bin/file_batch_test";
+    path_ensure_dir (dir);
+
+    int num_files = 300;
+    int num_paths = num_files + 3;
+    char **paths = mem_pool_push_array (&pool, num_paths, char*);
+
+    string_t content = {0};
+    for (int i=0; i<num_files; i++) {
+        // Include empty files and some larger than a page.
+        str_set (&content, "");
+        int size = (i%10 == 0) ? 0 : rand_int_range (1, i%50 == 1 ? 20000 : 300);
+        for (int j=0; j<size; j++) {
+            char c = 'a' + rand_int_range (0, 25);
+            strn_cat_c (&content, &c, 1);
+        }
+
+        string_t path = {0};
+        str_set_printf (&path, "%s/file_%d", dir, i);
+        full_file_write (str_data(&content), str_len(&content), str_data(&path));
+        paths[i] = pom_strdup (&pool, str_data(&path));
+        str_free (&path);
+    }
+    str_free (&content);
+
+    paths[num_files] = "bin/file_batch_test/missing";
+    paths[num_files + 1] = dir;
+    paths[num_files + 2] = "/proc/self/status";
+
+    struct {
+        char *name;
+        file_batch_read_func_t func;
+    } implementations[] = {
+        {"default", file_batch_read},
+        {"threads", file_batch_read_threads},
+        {"sequential", file_batch_read_sequential},
+    };
+
+    for (int i=0; i<ARRAY_SIZE(implementations); i++) {
+        struct file_batch_result_t *results =
+            mem_pool_push_array (&pool, num_paths, struct file_batch_result_t);
+        implementations[i].func (&pool, paths, num_paths, results);
+
+        test_push (t, "%s", implementations[i].name);
+        test_pop (t, file_batch_test_results (t, paths, num_paths, results));
+    }
+
+#ifdef FILE_BATCH_IO_URING
+    {
+        struct file_batch_result_t *results =
+            mem_pool_push_array (&pool, num_paths, struct file_batch_result_t);
+        if (file_batch_read_uring (&pool, paths, num_paths, results)) {
+            test_push (t, "io_uring");
+            test_pop (t, file_batch_test_results (t, paths, num_paths, results));
+        }
+    }
+#endif
+
+    path_rmrf (dir);
+    mem_pool_destroy (&pool);
+
+    test_pop_parent (t);
+}
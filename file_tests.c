@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+void file_tests (struct test_ctx_t *t)
+{
+    test_push (t, "Files");
+
+    {
+        test_push (t, "Memory mapping");
+
+        char *path = "bin/file_map_test";
+        size_t page_size = sysconf (_SC_PAGESIZE);
+
+        // Sizes around the page size, where the null byte needs an extra page.
+        size_t sizes[] = {1, 100, page_size - 1, page_size, 2*page_size, 3*page_size + 5};
+        char *buff = malloc (3*page_size + 5);
+        for (int i=0; i<ARRAY_SIZE(sizes); i++) {
+            for (size_t j=0; j<sizes[i]; j++) {
+                buff[j] = 'a' + (j*7 + i)%26;
+            }
+            full_file_write (buff, sizes[i], path);
+
+            uint64_t len = 0;
+            char *data = file_map (path, &len);
+            test_push (t, "size %zu", sizes[i]);
+            test_pop (t, data != NULL && len == sizes[i] &&
+                         memcmp (data, buff, len) == 0 && data[len] == '\0');
+            file_unmap (data, len);
+        }
+        free (buff);
+
+        full_file_write ("", 0, path);
+        uint64_t len = 1;
+        char *data = file_map (path, &len);
+        test_bool (t, "empty file", data != NULL && len == 0 && data[0] == '\0');
+        file_unmap (data, len);
+
+        // Files in /proc report a size of 0 but have content.
+        data = file_map ("/proc/self/status", &len);
+        test_bool (t, "procfs fallback", data != NULL && len > 0 &&
+                                         strncmp (data, "Name:", 5) == 0 && data[len] == '\0');
+        file_unmap (data, len);
+
+        errno = 0;
+        test_bool (t, "missing file", file_map ("bin/file_map_test_missing", &len) == NULL && errno == ENOENT);
+
+        unlink (path);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Buffered writer");
+
+        char *path = "bin/file_writer_test";
+        full_file_write ("old content", 11, path);
+
+        // Mix small pieces that get buffered with large ones that are written
+        // directly.
+        string_t expected = {0};
+        string_t big = {0};
+        for (int i=0; i<3000; i++) {
+            str_cat_printf (&big, "%d", i);
+        }
+
+        struct file_writer_t wrtr;
+        file_writer_open (&wrtr, path, true);
+        for (int i=0; i<2000; i++) {
+            file_writer_printf (&wrtr, "line %d\n", i);
+            str_cat_printf (&expected, "line %d\n", i);
+
+            if (i%500 == 0) {
+                file_writer_str (&wrtr, &big);
+                str_cat (&expected, &big);
+            }
+
+            sstring_t piece = SSTRING("abcdef", i%6);
+            file_writer_sstr (&wrtr, piece);
+            strn_cat_c (&expected, piece.s, piece.len);
+        }
+
+        uint64_t len;
+        char *data = full_file_read (NULL, path, &len);
+        test_bool (t, "destination untouched before close", len == 11 && strcmp (data, "old content") == 0);
+        free (data);
+
+        test_bool (t, "close", file_writer_close (&wrtr));
+        data = full_file_read (NULL, path, &len);
+        test_bool (t, "content", len == str_len(&expected) && memcmp (data, str_data(&expected), len) == 0);
+        free (data);
+
+        file_writer_open (&wrtr, path, false);
+        file_writer_cstr (&wrtr, "discarded");
+        file_writer_discard (&wrtr);
+        data = full_file_read (NULL, path, &len);
+        test_bool (t, "discard", len == str_len(&expected));
+        free (data);
+
+        test_bool (t, "invalid directory", !file_writer_open (&wrtr, "bin/missing_dir/file", false) &&
+                                           !file_writer_close (&wrtr) && wrtr.error == ENOENT);
+
+        bool tmp_left = false;
+        DIR *dir = opendir ("bin");
+        struct dirent *entry;
+        while ((entry = readdir (dir)) != NULL) {
+            if (strncmp (entry->d_name, "file_writer_test.tmp", 20) == 0) {
+                tmp_left = true;
+            }
+        }
+        closedir (dir);
+        test_bool (t, "no temporary files left", !tmp_left);
+
+        unlink (path);
+        str_free (&big);
+        str_free (&expected);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Recursive removal");
+
+        mem_pool_t pool = {0};
+        char *dir = "bin/rmrf_test";
+        char *outside = "bin/rmrf_test_outside";
+        string_t path = {0};
+
+        for (int parallel=0; parallel<2; parallel++) {
+            path_ensure_dir (dir);
+            path_ensure_dir (outside);
+            full_file_write ("keep", 4, "bin/rmrf_test_outside/file");
+
+            for (int i=0; i<20; i++) {
+                str_set_printf (&path, "%s/dir_%d", dir, i);
+                path_ensure_dir (str_data(&path));
+                for (int j=0; j<10; j++) {
+                    str_set_printf (&path, "%s/dir_%d/sub_%d", dir, i, j);
+                    path_ensure_dir (str_data(&path));
+                    str_set_printf (&path, "%s/dir_%d/sub_%d/file", dir, i, j);
+                    full_file_write ("", 0, str_data(&path));
+                    str_set_printf (&path, "%s/dir_%d/file_%d", dir, i, j);
+                    full_file_write ("", 0, str_data(&path));
+                }
+            }
+            full_file_write ("", 0, "bin/rmrf_test/.hidden");
+
+            // Links must be removed, not followed.
+            symlink ("../rmrf_test_outside", "bin/rmrf_test/dir_0/link");
+
+            struct path_rmrf_error_t *errors = NULL;
+            int num_errors = -1;
+            bool success;
+            if (parallel) {
+                success = path_rmrf_parallel (dir, 4, &pool, &errors, &num_errors);
+            } else {
+                success = path_rmrf_full (dir, &pool, &errors, &num_errors);
+            }
+
+            struct stat st;
+            test_push (t, "%s", parallel ? "parallel" : "sequential");
+            test_pop (t, success && num_errors == 0 && lstat (dir, &st) == -1 &&
+                         stat ("bin/rmrf_test_outside/file", &st) == 0);
+        }
+
+        // Deeper than the number of files we can open.
+        {
+            struct rlimit old_limit;
+            getrlimit (RLIMIT_NOFILE, &old_limit);
+            struct rlimit limit = old_limit;
+            limit.rlim_cur = 64;
+
+            bool success = true;
+            for (int parallel=0; parallel<2; parallel++) {
+                str_set (&path, dir);
+                for (int i=0; i<400; i++) {
+                    str_cat_c (&path, "/d");
+                }
+                str_cat_c (&path, "/file");
+                ensure_path_exists (str_data(&path));
+                full_file_write ("", 0, str_data(&path));
+
+                setrlimit (RLIMIT_NOFILE, &limit);
+                struct path_rmrf_error_t *errors = NULL;
+                int num_errors = -1;
+                if (parallel) {
+                    success = path_rmrf_parallel (dir, 4, &pool, &errors, &num_errors) && success;
+                } else {
+                    success = path_rmrf_full (dir, &pool, &errors, &num_errors) && success;
+                }
+                setrlimit (RLIMIT_NOFILE, &old_limit);
+                success = success && num_errors == 0 && !path_exists (dir);
+            }
+            test_bool (t, "deep tree with few file descriptors", success);
+        }
+
+        // A directory replaced by a link after its parent was read.
+        {
+            path_ensure_dir (outside);
+            full_file_write ("keep", 4, "bin/rmrf_test_outside/file");
+            symlink ("rmrf_test_outside", "bin/rmrf_test_link");
+
+            struct _path_rmrf_t ctx = {0};
+            ctx.success = true;
+            string_t link_path = str_new ("bin/rmrf_test_link");
+            _path_rmrf_dir (&ctx, AT_FDCWD, "bin/rmrf_test_link", &link_path, 0);
+            str_free (&link_path);
+
+            struct stat st;
+            test_bool (t, "directory replaced by a link", ctx.success &&
+                       lstat ("bin/rmrf_test_link", &st) == -1 && stat ("bin/rmrf_test_outside/file", &st) == 0);
+        }
+
+        struct path_rmrf_error_t *errors = NULL;
+        int num_errors = 0;
+        test_bool (t, "missing path", !path_rmrf_full ("bin/rmrf_test", &pool, &errors, &num_errors) &&
+                                      num_errors == 1 && errors[0].error == ENOENT &&
+                                      strcmp (errors[0].path, "bin/rmrf_test") == 0);
+
+        test_bool (t, "single file", path_rmrf ("bin/rmrf_test_outside/file") == 0 &&
+                                     path_rmrf (outside) == 0);
+
+        str_free (&path);
+        mem_pool_destroy (&pool);
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Directory creation");
+
+        char *root = "bin/dir_cache_test";
+        path_rmrf (root);
+
+        test_bool (t, "ensure path", ensure_path_exists ("bin/dir_cache_test/a/b/c/file") &&
+                                     dir_exists ("bin/dir_cache_test/a/b/c") &&
+                                     !path_exists ("bin/dir_cache_test/a/b/c/file"));
+        test_bool (t, "ensure path trailing slash", ensure_path_exists ("bin/dir_cache_test/a/d/") &&
+                                                    dir_exists ("bin/dir_cache_test/a/d"));
+        test_bool (t, "ensure existing dir", path_ensure_dir ("bin/dir_cache_test/a"));
+
+        // Use few file descriptors so some cached directories don't keep one.
+        struct dir_cache_t cache = {0};
+        cache.max_fds = 4;
+
+        string_t path = {0};
+        bool success = true;
+        for (int i=0; i<5; i++) {
+            for (int j=0; j<5; j++) {
+                str_set_printf (&path, "%s/c/%d//%d/file", root, i, j);
+                int fd = dir_cache_open (&cache, str_data(&path), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+                if (fd == -1 || write (fd, "x", 1) != 1) success = false;
+                if (fd != -1) close (fd);
+
+                str_set_printf (&path, "%s/c/%d/%d/file", root, i, j);
+                if (!path_exists (str_data(&path))) success = false;
+            }
+        }
+        test_bool (t, "open", success && cache.num_fds == 4);
+
+        char *paths[] = {
+            "bin/dir_cache_test/bulk/1/f1",
+            "bin/dir_cache_test/bulk/2/f2",
+            "bin/dir_cache_test/bulk/1/f3",
+            "bin/dir_cache_test/bulk/3/",
+            "bin/dir_cache_test/c/0/0/file/f4",
+            "bin/dir_cache_test/bulk/2/f5",
+        };
+        int errors[ARRAY_SIZE(paths)];
+        success = !dir_cache_ensure_paths (&cache, paths, ARRAY_SIZE(paths), errors);
+        success = success && dir_exists ("bin/dir_cache_test/bulk/1") && dir_exists ("bin/dir_cache_test/bulk/2") &&
+                  dir_exists ("bin/dir_cache_test/bulk/3") && !path_exists ("bin/dir_cache_test/bulk/1/f1");
+        for (int i=0; i<ARRAY_SIZE(paths); i++) {
+            if (errors[i] != (i == 4 ? ENOTDIR : 0)) success = false;
+        }
+        test_bool (t, "bulk", success);
+
+        // Removing a cached directory behind the cache's back.
+        path_rmrf ("bin/dir_cache_test/c");
+        test_bool (t, "stale parent", dir_cache_ensure_dir (&cache, "bin/dir_cache_test/c/0/new") &&
+                                      dir_exists ("bin/dir_cache_test/c/0/new") &&
+                                      dir_cache_ensure_dir (&cache, "bin/dir_cache_test/c/1/2/new") &&
+                                      dir_exists ("bin/dir_cache_test/c/1/2/new"));
+
+        dir_cache_destroy (&cache);
+        str_free (&path);
+        path_rmrf (root);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Hashing");
+
+        struct {
+            char *str;
+            uint64_t seed;
+            uint64_t expected;
+        } vectors[] = {
+            {"", 0, 0xEF46DB3751D8E999ULL},
+            {"a", 0, 0xD24EC4F1A98C6E5BULL},
+            {"abc", 0, 0x44BC2CF5AD770999ULL},
+            {"abc", 1, 0xBEA9CA8199328908ULL},
+            {"Nobody inspects the spammish repetition", 0, 0xFBCEA83C8A378BF1ULL},
+        };
+        for (int i=0; i<ARRAY_SIZE(vectors); i++) {
+            test_push (t, "'%s' seed %"PRIu64, vectors[i].str, vectors[i].seed);
+            test_pop (t, hash_64 (vectors[i].str, strlen(vectors[i].str), vectors[i].seed) == vectors[i].expected);
+        }
+
+        // Larger than the file read buffer and not a multiple of it.
+        size_t big_len = 1000003;
+        uint64_t big_hash = 0x1E872D07705646F2ULL;
+        unsigned char *big = malloc (big_len);
+        for (size_t i=0; i<big_len; i++) {
+            big[i] = (i*7 + i/256) & 0xFF;
+        }
+        test_bool (t, "large buffer", hash_64 (big, big_len, 0) == big_hash);
+
+        bool success = true;
+        size_t piece_sizes[] = {1, 3, 31, 32, 33, 1000, 70000};
+        for (int i=0; i<ARRAY_SIZE(piece_sizes); i++) {
+            struct hash_64_state_t state;
+            hash_64_init (&state, 0);
+            for (size_t pos=0; pos<big_len; pos += piece_sizes[i]) {
+                hash_64_update (&state, big + pos, MIN(piece_sizes[i], big_len - pos));
+                if (pos == 0 && hash_64_final (&state) != hash_64 (big, MIN(piece_sizes[i], big_len), 0)) {
+                    success = false;
+                }
+            }
+            if (hash_64_final (&state) != big_hash) success = false;
+        }
+        test_bool (t, "incremental", success);
+
+        char *dir = "bin/hash_test";
+        path_rmrf (dir);
+        path_ensure_dir (dir);
+        full_file_write (big, big_len, "bin/hash_test/big");
+        full_file_write ("abc", 3, "bin/hash_test/abc");
+        full_file_write ("", 0, "bin/hash_test/empty");
+        path_ensure_dir ("bin/hash_test/sub");
+        full_file_write ("abc", 3, "bin/hash_test/sub/abc_copy");
+        full_file_write (big, FILE_HASH_BUFFER_SIZE, "bin/hash_test/sub/buffer_size");
+
+        // Opening a FIFO without a writer would block forever.
+        mkfifo ("bin/hash_test/sub/fifo", 0666);
+
+        uint64_t hash = 0;
+        test_bool (t, "file", file_hash_64 ("bin/hash_test/big", &hash) && hash == big_hash);
+        test_bool (t, "missing file", !file_hash_64 ("bin/hash_test/missing", &hash) && errno == ENOENT);
+        test_bool (t, "FIFO", !file_hash_64 ("bin/hash_test/sub/fifo", &hash) && errno == EINVAL);
+        test_bool (t, "directory", !file_hash_64 ("bin/hash_test/sub", &hash) && errno == EISDIR);
+
+        mem_pool_t pool = {0};
+        struct file_hash_t *files;
+        int num_files;
+        success = file_hash_tree_parallel (dir, NULL, 3, &pool, &files, &num_files) && num_files == 5;
+        for (int i=0; success && i<num_files; i++) {
+            uint64_t len;
+            char *data = full_file_read (NULL, files[i].path, &len);
+            success = files[i].error == 0 && files[i].size == len && files[i].hash == hash_64 (data, len, 0);
+            free (data);
+        }
+        test_bool (t, "parallel tree", success);
+
+        struct file_hash_t list[] = {{"bin/hash_test/abc"}, {"bin/hash_test/missing"}, {"bin/hash_test/sub/abc_copy"}};
+        test_bool (t, "parallel list", !file_hash_parallel (list, ARRAY_SIZE(list), 0) &&
+                                       list[0].error == 0 && list[1].error == ENOENT &&
+                                       list[0].hash == 0x44BC2CF5AD770999ULL && list[2].hash == list[0].hash);
+
+        path_rmrf (dir);
+        mem_pool_destroy (&pool);
+        free (big);
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Compression");
+
+        // Block produced by the reference LZ4 implementation.
+        char *lz4_block = "\x3f\x61\x62\x63\x03\x00\x08\x48\x5f\x78\x79\x7a\x04\x00\x50\x5f\x65\x6e\x64\x2e";
+        char *lz4_expected = "abcabcabcabcabcabcabcabcabcabc_xyz_xyz_xyz_xyz_end.";
+        char out[64];
+        ssize_t out_len = lz_decompress_block (lz4_block, 20, out, strlen(lz4_expected));
+        test_bool (t, "LZ4 block", out_len == strlen(lz4_expected) && memcmp (out, lz4_expected, out_len) == 0);
+        test_bool (t, "small output buffer", lz_decompress_block (lz4_block, 20, out, 10) == -1);
+
+        size_t big_len = 3*LZ_BLOCK_SIZE + 1234;
+        char *data = malloc (big_len);
+        uint64_t rnd = 1;
+
+        struct {
+            char *name;
+            size_t len;
+        } cases[] = {
+            {"empty", 0},
+            {"short", 11},
+            {"text", big_len},
+            {"random", 100000},
+            {"runs", 200000},
+        };
+        for (int i=0; i<ARRAY_SIZE(cases); i++) {
+            size_t len = cases[i].len;
+            for (size_t j=0; j<len; j++) {
+                rnd = rnd*6364136223846793005ULL + 1442695040888963407ULL;
+                if (strcmp (cases[i].name, "random") == 0) {
+                    data[j] = rnd >> 56;
+                } else if (strcmp (cases[i].name, "runs") == 0) {
+                    // Patterns with periods shorter than the copy chunks.
+                    size_t period = 1 + (j/1000)%17;
+                    data[j] = 'a' + (j%period);
+                } else {
+                    // Random words from a small vocabulary.
+                    char *words[] = {"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog\n"};
+                    char *word = words[rnd >> 61];
+                    for (; *word != '\0' && j<len; word++, j++) {
+                        data[j] = *word;
+                    }
+                    j--;
+                }
+            }
+
+            size_t compressed_len;
+            char *compressed = lz_compress (NULL, data, len, &compressed_len);
+
+            uint64_t decompressed_len;
+            char *decompressed = lz_decompress (NULL, compressed, compressed_len, &decompressed_len);
+
+            test_push (t, "%s", cases[i].name);
+            test_pop (t, decompressed != NULL && decompressed_len == len &&
+                         memcmp (decompressed, data, len) == 0 && decompressed[len] == '\0' &&
+                         compressed_len <= lz_frame_bound (len));
+            free (decompressed);
+
+            if (strcmp (cases[i].name, "text") == 0) {
+                test_bool (t, "text compresses", compressed_len < len*6/10);
+
+                // Any damage must be detected.
+                bool detected = true;
+                size_t positions[] = {0, 10, 20, compressed_len/2, compressed_len - 1};
+                for (int k=0; k<ARRAY_SIZE(positions); k++) {
+                    compressed[positions[k]] ^= 0x10;
+                    decompressed = lz_decompress (NULL, compressed, compressed_len, NULL);
+                    if (decompressed != NULL) detected = false;
+                    free (decompressed);
+                    compressed[positions[k]] ^= 0x10;
+                }
+                if (lz_decompress (NULL, compressed, compressed_len - 9, NULL) != NULL) detected = false;
+                test_bool (t, "corruption", detected);
+            }
+            free (compressed);
+        }
+
+        char *path = "bin/compressed_file_test";
+        mem_pool_t pool = {0};
+        test_bool (t, "file write", !full_file_write_compressed (data, big_len, path));
+        uint64_t len;
+        char *read = full_file_read_compressed (&pool, path, &len);
+        test_bool (t, "file read", read != NULL && len == big_len && memcmp (read, data, len) == 0);
+
+        unlink (path);
+        mem_pool_destroy (&pool);
+        free (data);
+        test_pop_parent (t);
+    }
+
+    test_pop_parent (t);
+}
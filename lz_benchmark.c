@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Benchmark of lz_compress_block(), lz_decompress_block() and
+// lz_decompress_into(). The corpus is the concatenation of the files passed as
+// arguments, or some of this repository's sources if there are none. See the
+// lz_benchmark snip in pymk.py, which also runs the lz4 tool on the same corpus
+// when it's installed.
+//
+// Each function runs in rounds over the whole input for at least
+// MIN_BENCHMARK_TIME_S. Both the average and the fastest round are printed,
+// the lz4 tool's benchmark reports the fastest one.
+
+#include "common.h"
+#include <time.h>
+
+#define MIN_BENCHMARK_TIME_S 2.0
+
+static inline
+double get_time_s ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+#define BENCHMARK(NAME,LEN,CODE)                                                  \
+{                                                                                 \
+    int rounds = 0;                                                               \
+    double total = 0, best = 0;                                                   \
+    do {                                                                          \
+        double start = get_time_s ();                                             \
+        CODE;                                                                     \
+        double elapsed = get_time_s () - start;                                   \
+        if (rounds == 0 || elapsed < best) best = elapsed;                        \
+        total += elapsed;                                                         \
+        rounds++;                                                                 \
+    } while (success && total < MIN_BENCHMARK_TIME_S);                            \
+                                                                                  \
+    printf ("%-20s %8.0f MB/s avg %8.0f MB/s best\n", NAME,                       \
+            (LEN)*(double)rounds/total/1e6, (LEN)/best/1e6);                      \
+}
+
+char *default_files[] = {"common.h", "scanner.c", "csv.c", "file_batch.c", "dir_index.c", "download.c"};
+
+int main (int argc, char **argv)
+{
+    char **files = default_files;
+    int num_files = ARRAY_SIZE(default_files);
+    if (argc > 1) {
+        files = argv + 1;
+        num_files = argc - 1;
+    }
+
+    string_t corpus = {0};
+    for (int i=0; i<num_files; i++) {
+        uint64_t len;
+        char *data = full_file_read (NULL, files[i], &len);
+        if (data == NULL) {
+            printf ("Could not read %s\n", files[i]);
+            return 1;
+        }
+        strn_cat_c (&corpus, data, len);
+        free (data);
+    }
+    char *data = str_data (&corpus);
+    size_t len = str_len (&corpus);
+
+    // A single block, like lz4 -b does for inputs smaller than its block size.
+    size_t block_len = MIN (len, LZ_BLOCK_SIZE);
+    char *compressed = malloc (block_len);
+    char *decompressed = malloc (block_len);
+    size_t compressed_len = lz_compress_block (data, block_len, compressed, block_len);
+    if (compressed_len == 0) {
+        printf ("Corpus doesn't compress\n");
+        return 1;
+    }
+    printf ("corpus %zu bytes, first block %zu -> %zu (%.1f%%)\n",
+            len, block_len, compressed_len, 100.0*compressed_len/block_len);
+
+    bool success = true;
+    BENCHMARK ("lz_compress_block", block_len,
+               success = lz_compress_block (data, block_len, compressed, block_len) == compressed_len);
+
+    BENCHMARK ("lz_decompress_block", block_len,
+               success = lz_decompress_block (compressed, compressed_len, decompressed, block_len) == (ssize_t)block_len);
+
+    if (!success || memcmp (data, decompressed, block_len) != 0) {
+        printf ("Decompressed data is different\n");
+        return 1;
+    }
+
+    // Whole frame, including the checksum.
+    size_t frame_len;
+    char *frame = lz_compress (NULL, data, len, &frame_len);
+    char *frame_decompressed = malloc (len);
+    BENCHMARK ("lz_decompress_into", len,
+               success = lz_decompress_into (frame, frame_len, frame_decompressed, len));
+
+    if (!success || memcmp (data, frame_decompressed, len) != 0) {
+        printf ("Decompressed frame is different\n");
+        return 1;
+    }
+
+    free (frame);
+    free (frame_decompressed);
+    free (compressed);
+    free (decompressed);
+    str_free (&corpus);
+    return 0;
+}
@@ -306,28 +306,32 @@ void memory_pool_tests (struct test_ctx_t *t)
         // We make a bin big enough to hold exactly 2 structs allocated by push_test_struct.
         pool.min_bin_size = expected_struct_size*2;
 
-        // Verify struct sizes match expected values
+        // Verify struct sizes match expected values. The size of string_t
+        // depends on STRING_T_32, test_structure_t embeds one.
+        size_t test_structure_size = 16 + STR_SMALL_SIZE;
+        size_t expected_size = test_structure_size + 32*3 + STR_SMALL_SIZE;
+        uint32_t bin_size = expected_size*2 + 32; /* 2*expected_struct_size + bin_info_t*/
         bool success = (sizeof(bin_info_t) == 32 &&
-            sizeof(struct test_structure_t) == 32 &&
+            sizeof(struct test_structure_t) == test_structure_size &&
             sizeof(struct on_destroy_callback_info_t) == 32 &&
-            sizeof(string_t) == 16 &&
-            expected_struct_size == 144);
+            sizeof(string_t) == STR_SMALL_SIZE &&
+            expected_struct_size == expected_size);
 
         if (!success) {
             str_cat_printf (t->error, "Struct sizes don't match expected values\n");
             str_cat_printf (t->error, "bin_info_t: %zu (expected 32)\n", sizeof(bin_info_t));
-            str_cat_printf (t->error, "test_structure_t: %zu (expected 32)\n", sizeof(struct test_structure_t));
+            str_cat_printf (t->error, "test_structure_t: %zu (expected %zu)\n", sizeof(struct test_structure_t), test_structure_size);
             str_cat_printf (t->error, "on_destroy_callback_info_t: %zu (expected 32)\n", sizeof(struct on_destroy_callback_info_t));
-            str_cat_printf (t->error, "string_t: %zu (expected 16)\n", sizeof(string_t));
-            str_cat_printf (t->error, "expected_struct_size: %zu (expected 144)\n", expected_struct_size);
+            str_cat_printf (t->error, "string_t: %zu (expected %d)\n", sizeof(string_t), STR_SMALL_SIZE);
+            str_cat_printf (t->error, "expected_struct_size: %zu (expected %zu)\n", expected_struct_size, expected_size);
         }
 
         push_test_struct (&pool, 10, 5.5, "This is a long string that will force a malloc");
         uint32_t allocated_after_1st = mem_pool_allocated(&pool);
-        success = success && (allocated_after_1st == 320);
+        success = success && (allocated_after_1st == bin_size);
 
-        if (allocated_after_1st != 320 /* 2*expected_struct_size + bin_info_t*/) {
-            str_cat_printf (t->error, "After 1st struct: allocated=%u (expected 320)\n", allocated_after_1st);
+        if (allocated_after_1st != bin_size) {
+            str_cat_printf (t->error, "After 1st struct: allocated=%u (expected %u)\n", allocated_after_1st, bin_size);
             success = false;
         }
 
@@ -337,20 +341,20 @@ void memory_pool_tests (struct test_ctx_t *t)
         // Allocate 2nd struct - should still fit in same bin
         push_test_struct (&pool, 4, 1.5, "And another long string");
         uint32_t allocated_after_2nd = mem_pool_allocated(&pool);
-        success = success && (allocated_after_2nd == 320);
+        success = success && (allocated_after_2nd == bin_size);
 
-        if (allocated_after_2nd != 320) {
-            str_cat_printf (t->error, "After 2nd struct: allocated=%u (expected 320)\n", allocated_after_2nd);
+        if (allocated_after_2nd != bin_size) {
+            str_cat_printf (t->error, "After 2nd struct: allocated=%u (expected %u)\n", allocated_after_2nd, bin_size);
             success = false;
         }
 
         // Allocate 3rd struct - should force new bin
         push_test_struct (&pool, 20, 3.25, "bar");
         uint32_t allocated_after_3rd = mem_pool_allocated(&pool);
-        success = success && (allocated_after_3rd == 640);
+        success = success && (allocated_after_3rd == 2*bin_size);
 
-        if (allocated_after_3rd != 640) {
-            str_cat_printf (t->error, "After 3rd struct: allocated=%u (expected 640)\n", allocated_after_3rd);
+        if (allocated_after_3rd != 2*bin_size) {
+            str_cat_printf (t->error, "After 3rd struct: allocated=%u (expected %u)\n", allocated_after_3rd, 2*bin_size);
             success = false;
         }
 
@@ -365,10 +369,10 @@ void memory_pool_tests (struct test_ctx_t *t)
 
         // Second bin should've been freed
         uint32_t allocated_after_temp_end = mem_pool_allocated(&pool);
-        success = success && (allocated_after_temp_end == 320);
+        success = success && (allocated_after_temp_end == bin_size);
 
-        if (allocated_after_temp_end != 320) {
-            str_cat_printf (t->error, "After temp memory end: allocated=%u (expected 320)\n", allocated_after_temp_end);
+        if (allocated_after_temp_end != bin_size) {
+            str_cat_printf (t->error, "After temp memory end: allocated=%u (expected %u)\n", allocated_after_temp_end, bin_size);
             success = false;
         }
 
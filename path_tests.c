@@ -39,6 +39,20 @@ void user_path_expanded (struct test_ctx_t *t, char *home_path, char *path, mem_
     str_free (&expected);
 }
 
+void path_expand_test (struct test_ctx_t *t, struct path_expander_t *exp, char *str, char *expected, mem_pool_t *pool)
+{
+    test_push (t, "%s", str);
+    char *expanded = path_expand (str, pool);
+    char *snapshot_expanded = path_expander_expand (exp, str, pool);
+
+    bool success = strcmp (expected, expanded) == 0 && strcmp (expected, snapshot_expanded) == 0;
+    if (!success) {
+        str_cat_printf (t->error, "Expected '%s', got '%s' and '%s'.\n", expected, expanded, snapshot_expanded);
+    }
+
+    test_pop (t, success);
+}
+
 void path_tests (struct test_ctx_t *t)
 {
     test_push (t, "Path Manipulation");
@@ -65,6 +79,66 @@ void path_tests (struct test_ctx_t *t)
         test_pop_parent (t);
     }
 
+    {
+        test_push (t, "Expansion");
+        char *home_path = getenv("HOME");
+        setenv ("PATH_EXPAND_TEST", "some value", 1);
+        setenv ("PATH_EXPAND_TEST_DIR", "bin/path_expand_test", 1);
+        unsetenv ("PATH_EXPAND_TEST_UNSET");
+
+        struct path_expander_t exp;
+        path_expander_init (&exp);
+
+        path_expand_test (t, &exp, "~", home_path, &pool);
+        path_expand_test (t, &exp, "~/file (1).docx", pprintf (&pool, "%s/file (1).docx", home_path), &pool);
+        path_expand_test (t, &exp, "~file", "~file", &pool);
+        path_expand_test (t, &exp, "a/~", "a/~", &pool);
+        path_expand_test (t, &exp, "~path_expand_no_such_user/a", "~path_expand_no_such_user/a", &pool);
+
+        struct passwd *root = getpwnam ("root");
+        if (root != NULL) {
+            path_expand_test (t, &exp, "~root/a", pprintf (&pool, "%s/a", root->pw_dir), &pool);
+        }
+
+        path_expand_test (t, &exp, "$PATH_EXPAND_TEST/x", "some value/x", &pool);
+        path_expand_test (t, &exp, "a${PATH_EXPAND_TEST}b", "asome valueb", &pool);
+        path_expand_test (t, &exp, "a$PATH_EXPAND_TEST_UNSET.b", "a.b", &pool);
+        path_expand_test (t, &exp, "$PATH_EXPAND_TES", "", &pool);
+        path_expand_test (t, &exp, "cost $5 ${ } ${PATH_EXPAND_TEST $", "cost $5 ${ } ${PATH_EXPAND_TEST $", &pool);
+        path_expand_test (t, &exp, "\\$PATH_EXPAND_TEST \\~ \\\\", "$PATH_EXPAND_TEST ~ \\", &pool);
+        path_expand_test (t, &exp, "$(rm -rf /) `ls` 'a'", "$(rm -rf /) `ls` 'a'", &pool);
+
+        // Changes to the environment after the snapshot are not seen.
+        setenv ("PATH_EXPAND_TEST", "new value", 1);
+        test_bool (t, "snapshot", strcmp (path_expander_expand (&exp, "$PATH_EXPAND_TEST", &pool), "some value") == 0 &&
+                                  strcmp (path_expand ("$PATH_EXPAND_TEST", &pool), "new value") == 0);
+
+        char *strs[] = {"~", "$PATH_EXPAND_TEST", "plain"};
+        char **expanded = path_expand_all (strs, ARRAY_SIZE(strs), &pool);
+        test_bool (t, "all", strcmp (expanded[0], home_path) == 0 && strcmp (expanded[1], "new value") == 0 &&
+                             strcmp (expanded[2], "plain") == 0);
+
+        char *tree[] = {"a.c", "b.c", "c.h", "sub/d.c", "*.h"};
+        create_fs_tree ("bin/path_expand_test", tree, ARRAY_SIZE(tree));
+
+        char **matches;
+        int num_matches = path_expander_glob (&exp, "$PATH_EXPAND_TEST_DIR/*.c", &pool, &matches);
+        test_bool (t, "glob", num_matches == 2 && strcmp (matches[0], "bin/path_expand_test/a.c") == 0 &&
+                              strcmp (matches[1], "bin/path_expand_test/b.c") == 0);
+
+        num_matches = path_expand_glob ("bin/path_expand_test/\\*.h", &pool, &matches);
+        test_bool (t, "glob escaped", num_matches == 1 && strcmp (matches[0], "bin/path_expand_test/*.h") == 0);
+
+        num_matches = path_expand_glob ("bin/path_expand_test/*.txt", &pool, &matches);
+        test_bool (t, "glob no match", num_matches == 1 && strcmp (matches[0], "bin/path_expand_test/*.txt") == 0);
+
+        path_rmrf ("bin/path_expand_test");
+        path_expander_destroy (&exp);
+        unsetenv ("PATH_EXPAND_TEST");
+        unsetenv ("PATH_EXPAND_TEST_DIR");
+        test_pop_parent (t);
+    }
+
     mem_pool_destroy (&pool);
 
     test_pop_parent (t);
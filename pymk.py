@@ -15,19 +15,52 @@ def default ():
     call_user_function(target)
 
 def tests ():
-    ex ('gcc -Wall -g -o bin/tests tests.c -lm -lrt')
+    ex ('gcc -Wall -g -pthread -o bin/tests tests.c -lm -lrt')
+
+def tests32 ():
+    ex ('gcc -Wall -g -pthread -DSTRING_T_32 -o bin/tests32 tests.c -lm -lrt')
 
 def run_tests ():
     tests()
     print(ecma_bold('== C Tests =='), flush=True)
     ex('./bin/tests')
 
+    tests32()
+    print(ecma_bold('\n== C Tests (32 byte string_t) =='), flush=True)
+    ex('./bin/tests32')
+
     print(ecma_bold('\n== Python Tests =='), flush=True)
     ex('python3 python/execute_tests.py')
 
 def linear_solver_usage ():
     ex ('gcc -Wall -g -o bin/linear_solver linear_solver_usage.c -lm -lrt')
 
+def string_benchmark ():
+    ex ('gcc -Wall -O2 -o bin/string_benchmark string_benchmark.c -lm -lrt')
+    ex ('gcc -Wall -O2 -DSTRING_T_32 -o bin/string_benchmark_32 string_benchmark.c -lm -lrt')
+
+    print(ecma_bold('== 16 byte string_t =='), flush=True)
+    ex ('./bin/string_benchmark')
+    print(ecma_bold('\n== 32 byte string_t =='), flush=True)
+    ex ('./bin/string_benchmark_32')
+
+def sorting_benchmark ():
+    ex ('gcc -Wall -O2 -o bin/sorting_benchmark sorting_benchmark.c -lm -lrt')
+    ex ('./bin/sorting_benchmark')
+
+def lz_benchmark ():
+    ex ('gcc -Wall -O2 -o bin/lz_benchmark lz_benchmark.c -lm -lrt')
+
+    # Same corpus for both, lz4 -b also decompresses a single block.
+    corpus = 'bin/lz_corpus'
+    ex (f'cat common.h scanner.c csv.c file_batch.c dir_index.c download.c > {corpus}')
+
+    print(ecma_bold('== lz_benchmark =='), flush=True)
+    ex (f'./bin/lz_benchmark {corpus}')
+    if shutil.which('lz4') != None:
+        print(ecma_bold('\n== lz4 -b1 =='), flush=True)
+        ex (f'lz4 -b1 {corpus}')
+
 def expand_macro ():
     """
     This is like a preprocessor but we preserve indentation and don't output
@@ -4,6 +4,14 @@
 
 struct scanner_t {
     char *pos;
+
+    // Scanning functions never read at or past this pointer, this allows
+    // scanning buffers that aren't null terminated like sstring_t slices or
+    // memory mapped files. For backwards compatibility, if this is NULL when
+    // the first scanning function is called, the input is assumed to be null
+    // terminated and end is set to the position of the null byte.
+    char *end;
+
     bool is_eof;
 
     // TODO: Currently this is only set by the caller, I would like to handle
@@ -22,12 +30,254 @@ struct scanner_t {
     char *error_message;
     char *location_str;
 
-    // TODO: Wrap the advancement of pos into a function so that we can be more
-    // certain we correctly keep track of line numbers. This would also allow us
-    // to keep track of the column number.
+    // Line number at line_offset, which is the beginning of the input unless
+    // the window of a streaming scanner slid past it. Callers scanning a piece
+    // of a larger input can set it before scanning. Lines aren't counted while
+    // scanning, use scanner_line() to get the line at the current position.
     int line_number;
+    uint64_t line_offset;
+
+    // Newline index built lazily by scanner_line(). line_blocks[i] is the
+    // number of newlines between line_offset and the end of the i-th block of
+    // SCANNER_LINE_BLOCK bytes after it. Released by scanner_destroy().
+    DYNAMIC_ARRAY_DEFINE (int, line_blocks);
+
+    // Start of the input currently in memory, and its offset from the
+    // beginning of the full input. These only differ from the initial values
+    // for streaming scanners, where the window slides over the input.
+    char *start;
+    uint64_t start_offset;
+
+    // See scanner_pin().
+    int pin_count;
+    uint64_t pin_offset;
+
+    // Number of active markers, see scanner_mark().
+    int mark_depth;
+
+    // Set by scanner_init_file(), released by scanner_destroy().
+    void *mapped;
+    size_t mapped_len;
+
+    // Set by scanner_init_fd(), released by scanner_destroy().
+    struct scanner_stream_t *stream;
+};
+
+// Character classification
+//
+// These don't depend on the current locale, unlike the ctype.h functions.
+// Spaces are the same as isspace() in the POSIX locale, identifiers are C
+// identifiers.
+#define SCANNER_CHAR_SPACE          0x01
+#define SCANNER_CHAR_DIGIT          0x02
+#define SCANNER_CHAR_IDENT_START    0x04
+#define SCANNER_CHAR_IDENT_CONTINUE 0x08
+#define SCANNER_CHAR_HEX            0x10
+
+static const uint8_t scanner_char_table[256] = {
+    [' '] = SCANNER_CHAR_SPACE,
+    ['\t' ... '\r'] = SCANNER_CHAR_SPACE,
+    ['0' ... '9'] = SCANNER_CHAR_DIGIT | SCANNER_CHAR_IDENT_CONTINUE | SCANNER_CHAR_HEX,
+    ['a' ... 'f'] = SCANNER_CHAR_IDENT_START | SCANNER_CHAR_IDENT_CONTINUE | SCANNER_CHAR_HEX,
+    ['A' ... 'F'] = SCANNER_CHAR_IDENT_START | SCANNER_CHAR_IDENT_CONTINUE | SCANNER_CHAR_HEX,
+    ['g' ... 'z'] = SCANNER_CHAR_IDENT_START | SCANNER_CHAR_IDENT_CONTINUE,
+    ['G' ... 'Z'] = SCANNER_CHAR_IDENT_START | SCANNER_CHAR_IDENT_CONTINUE,
+    ['_'] = SCANNER_CHAR_IDENT_START | SCANNER_CHAR_IDENT_CONTINUE,
+};
+
+#define SCANNER_CHAR_IS(c,flag) ((scanner_char_table[(uint8_t)(c)] & (flag)) != 0)
+
+static inline
+bool scanner_is_space (char c)
+{
+    return SCANNER_CHAR_IS (c, SCANNER_CHAR_SPACE);
+}
+
+static inline
+bool scanner_is_digit (char c)
+{
+    return SCANNER_CHAR_IS (c, SCANNER_CHAR_DIGIT);
+}
+
+static inline
+bool scanner_is_ident_start (char c)
+{
+    return SCANNER_CHAR_IS (c, SCANNER_CHAR_IDENT_START);
+}
+
+static inline
+bool scanner_is_ident_continue (char c)
+{
+    return SCANNER_CHAR_IS (c, SCANNER_CHAR_IDENT_CONTINUE);
+}
+
+static inline
+bool scanner_is_hex (char c)
+{
+    return SCANNER_CHAR_IS (c, SCANNER_CHAR_HEX);
+}
+
+static inline
+void scanner_ensure_end (struct scanner_t *scnr)
+{
+    if (scnr->end == NULL) {
+        scnr->start = scnr->pos;
+        scnr->end = scnr->pos + strlen (scnr->pos);
+    }
+}
+
+// Initializes a scanner over len bytes starting at data. The data doesn't need
+// to be null terminated.
+void scanner_init (struct scanner_t *scnr, char *data, size_t len)
+{
+    *scnr = ZERO_INIT(struct scanner_t);
+    scnr->pos = data;
+    scnr->start = data;
+    scnr->end = data + len;
+}
+
+static inline
+void scanner_init_sstr (struct scanner_t *scnr, sstring_t str)
+{
+    scanner_init (scnr, str.s, str.len);
+}
+
+static inline
+void scanner_init_str (struct scanner_t *scnr, string_t *str)
+{
+    scanner_init (scnr, str_data(str), str_len(str));
+}
+
+// Maps the file at path into memory and initializes the scanner over it. The
+// content is never copied. Call scanner_destroy() to unmap it.
+//
+// NOTE: Returns false if the file couldn't be mapped, in that case the scanner
+// is initialized to an empty input.
+bool scanner_init_file (struct scanner_t *scnr, char *path)
+{
+    uint64_t len;
+    char *data = file_map (path, &len);
+    if (data == NULL) {
+        scanner_init (scnr, "", 0);
+        return false;
+    }
+
+    scanner_init (scnr, data, len);
+    scnr->mapped = data;
+    scnr->mapped_len = len;
+    return true;
+}
+
+// Streaming scanners read their input from a file descriptor into a window
+// that slides over it, so memory usage is bounded by the window size instead of
+// the input size. The window is refilled transparently when a scanning
+// function reaches its end.
+//
+// Pointers into the input (like scnr->pos or anything computed from it) are
+// invalidated when the window is refilled. Use scanner_pin() and
+// scanner_pinned_sstr() to keep a token being matched in memory.
+#define SCANNER_STREAM_DEFAULT_WINDOW (64*1024)
+struct scanner_stream_t {
+    int fd;
+    bool fd_eof;
+
+    char *buff;
+    size_t size;
 };
 
+// Initializes a streaming scanner that reads from fd. If window_size is 0 a
+// default size is used.
+//
+// NOTE: The file descriptor is not closed by scanner_destroy().
+void scanner_init_fd (struct scanner_t *scnr, int fd, size_t window_size)
+{
+    if (window_size == 0) {
+        window_size = SCANNER_STREAM_DEFAULT_WINDOW;
+    }
+
+    struct scanner_stream_t *stream = malloc (sizeof(struct scanner_stream_t) + window_size);
+    *stream = ZERO_INIT(struct scanner_stream_t);
+    stream->fd = fd;
+    stream->buff = (char*)(stream + 1);
+    stream->size = window_size;
+
+    scanner_init (scnr, stream->buff, 0);
+    scnr->stream = stream;
+}
+
+void scanner_destroy (struct scanner_t *scnr)
+{
+    free (scnr->line_blocks);
+    scnr->line_blocks = NULL;
+    scnr->line_blocks_len = 0;
+    scnr->line_blocks_size = 0;
+
+    if (scnr->mapped != NULL) {
+        file_unmap (scnr->mapped, scnr->mapped_len);
+        scnr->mapped = NULL;
+        scnr->mapped_len = 0;
+    }
+
+    if (scnr->stream != NULL) {
+        if (scnr->stream->buff != (char*)(scnr->stream + 1)) {
+            free (scnr->stream->buff);
+        }
+        free (scnr->stream);
+        scnr->stream = NULL;
+    }
+}
+
+// Offset of the current position from the beginning of the input.
+static inline
+uint64_t scanner_offset (struct scanner_t *scnr)
+{
+    scanner_ensure_end (scnr);
+    return scnr->start_offset + (scnr->pos - scnr->start);
+}
+
+// Returns a pointer to the byte at offset. It must not be before the start of
+// the window, this is guaranteed for pinned offsets.
+static inline
+char* scanner_offset_ptr (struct scanner_t *scnr, uint64_t offset)
+{
+    assert (offset >= scnr->start_offset);
+    return scnr->start + (offset - scnr->start_offset);
+}
+
+// Pinning guarantees that all input from the current position onwards stays in
+// memory until the matching call to scanner_unpin(), even if the window of a
+// streaming scanner needs to be refilled. Pins can be nested. The returned
+// offset can be passed to scanner_pinned_sstr() to get the text matched since
+// the call to scanner_pin().
+//
+// If a pinned region doesn't fit in the window, the window grows.
+static inline
+uint64_t scanner_pin (struct scanner_t *scnr)
+{
+    uint64_t offset = scanner_offset (scnr);
+    if (scnr->pin_count == 0 || offset < scnr->pin_offset) {
+        scnr->pin_offset = offset;
+    }
+    scnr->pin_count++;
+    return offset;
+}
+
+static inline
+void scanner_unpin (struct scanner_t *scnr)
+{
+    assert (scnr->pin_count > 0);
+    scnr->pin_count--;
+}
+
+// NOTE: The result points into the scanner's window, it's only valid while
+// the offset is pinned.
+static inline
+sstring_t scanner_pinned_sstr (struct scanner_t *scnr, uint64_t pin_offset)
+{
+    char *s = scanner_offset_ptr (scnr, pin_offset);
+    return SSTRING(s, scnr->pos - s);
+}
+
 // Calling scanning functions will never set the error flag, it's the
 // responsability of the caller to call scanner_set_error() if a match should
 // have happened but didn't. To allow this the return value of scanning
@@ -56,6 +306,88 @@ void scanner_set_error (struct scanner_t *scnr, char *error_message)
     scanner_set_error_l (scnr, NULL, error_message);
 }
 
+// Number of newlines in [p, end).
+static inline
+int scanner_count_newlines (char *p, char *end)
+{
+    int count = 0;
+#ifdef __SSE2__
+    __m128i newline = _mm_set1_epi8 ('\n');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128 ((__m128i*)p);
+        count += __builtin_popcount (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, newline)));
+        p += 16;
+    }
+#endif
+
+    while (p < end) {
+        count += *p == '\n';
+        p++;
+    }
+    return count;
+}
+
+// Line numbers are computed on demand from the offset, so scanning functions
+// don't need to look for newlines. The first time a line is requested at some
+// offset, the number of newlines in each block of SCANNER_LINE_BLOCK bytes up
+// to it is stored, then only the newlines in the last partial block need to be
+// counted. Inputs smaller than a block don't allocate anything.
+#define SCANNER_LINE_BLOCK (64*1024)
+
+// Line number at offset, which must be inside the window.
+int scanner_line_at (struct scanner_t *scnr, uint64_t offset)
+{
+    scanner_ensure_end (scnr);
+    assert (offset >= scnr->line_offset);
+
+    uint64_t block = (offset - scnr->line_offset)/SCANNER_LINE_BLOCK;
+    while (scnr->line_blocks_len < block) {
+        uint64_t block_start = scnr->line_offset + (uint64_t)scnr->line_blocks_len*SCANNER_LINE_BLOCK;
+        char *p = scanner_offset_ptr (scnr, block_start);
+        int count = scnr->line_blocks_len > 0 ? DYNAMIC_ARRAY_GET_LAST (scnr->line_blocks) : 0;
+        count += scanner_count_newlines (p, p + SCANNER_LINE_BLOCK);
+        DYNAMIC_ARRAY_APPEND (scnr->line_blocks, count);
+    }
+
+    int line = scnr->line_number;
+    if (block > 0) {
+        line += scnr->line_blocks[block-1];
+    }
+
+    char *p = scanner_offset_ptr (scnr, scnr->line_offset + block*SCANNER_LINE_BLOCK);
+    return line + scanner_count_newlines (p, scanner_offset_ptr (scnr, offset));
+}
+
+// Line number of the current position. Lines start at the value of
+// line_number at the beginning of the input, 0 by default.
+int scanner_line (struct scanner_t *scnr)
+{
+    scanner_ensure_end (scnr);
+    char *pos = MIN (scnr->pos, scnr->end);
+    return scanner_line_at (scnr, scnr->start_offset + (pos - scnr->start));
+}
+
+// Column of the current position, starting at 1. It's computed on demand by
+// looking back for the start of the line, so we don't pay for it while
+// scanning. Returns 0 if the start of the line isn't available anymore, this
+// can only happen for streaming scanners.
+int scanner_column (struct scanner_t *scnr)
+{
+    scanner_ensure_end (scnr);
+
+    char *pos = MIN (scnr->pos, scnr->end);
+    char *line_start = memrchr (scnr->start, '\n', pos - scnr->start);
+    if (line_start != NULL) {
+        line_start++;
+    } else if (scnr->start_offset == 0) {
+        line_start = scnr->start;
+    } else {
+        return 0;
+    }
+
+    return pos - line_start + 1;
+}
+
 bool scanner_output_error (struct scanner_t *scnr, string_t *error_out)
 {
     bool has_no_error = true;
@@ -66,7 +398,13 @@ bool scanner_output_error (struct scanner_t *scnr, string_t *error_out)
         if (scnr->location_str != NULL) {
             location_str = scnr->location_str;
         } else {
-            str_set_printf (&buffer, "%d:", scnr->line_number);
+            int line = scanner_line (scnr);
+            int column = scanner_column (scnr);
+            if (column > 0) {
+                str_set_printf (&buffer, "%d:%d:", line, column);
+            } else {
+                str_set_printf (&buffer, "%d:", line);
+            }
             location_str = str_data(&buffer);
         }
 
@@ -98,14 +436,111 @@ void scanner_eof_set (struct scanner_t *scnr)
     }
 }
 
-// TODO: I still have to think about parsing optional stuff, sometimes we want
-// to test something but not consume it. Maybe split testing and consuming one
-// value creating something like scanner_consume_matched() that consumes
-// everything matched so far, and something like scanner_reset() that goes back
-// to the last position where we consumed something?. Another option is to
-// "backup" the position before consuming these things, and if we want to go
-// back, restore it (like memory pool markers). I need more experience with the
-// API to know which is better for the user, or if there are other alternatives.
+// Reads more input into the window of a streaming scanner. Everything before
+// the current position (or the first pinned position) is discarded. Returns
+// false if no more input is available, this is always the case for non
+// streaming scanners.
+bool scanner_refill (struct scanner_t *scnr)
+{
+    struct scanner_stream_t *stream = scnr->stream;
+    if (stream == NULL || stream->fd_eof) {
+        return false;
+    }
+
+    uint64_t keep_offset = scanner_offset (scnr);
+    if (scnr->pin_count > 0) {
+        keep_offset = MIN (keep_offset, scnr->pin_offset);
+    }
+
+    // The data before keep_offset is discarded, move the start of the line
+    // count to it.
+    if (keep_offset > scnr->line_offset) {
+        scnr->line_number = scanner_line_at (scnr, keep_offset);
+        scnr->line_offset = keep_offset;
+        scnr->line_blocks_len = 0;
+    }
+
+    // Slide the window so the data we need to keep is at its start.
+    char *keep = scanner_offset_ptr (scnr, keep_offset);
+    size_t keep_len = scnr->end - keep;
+    memmove (stream->buff, keep, keep_len);
+
+    // Most of the window is pinned data, grow it so we don't end up reading a
+    // few bytes at a time.
+    if (keep_len > stream->size/2) {
+        size_t new_size = 2*stream->size;
+        char *new_buff = malloc (new_size);
+        memcpy (new_buff, stream->buff, keep_len);
+        if (stream->buff != (char*)(stream + 1)) {
+            free (stream->buff);
+        }
+        stream->buff = new_buff;
+        stream->size = new_size;
+    }
+
+    uint64_t pos_offset = scanner_offset (scnr);
+    scnr->start = stream->buff;
+    scnr->start_offset = keep_offset;
+    scnr->pos = scanner_offset_ptr (scnr, pos_offset);
+    scnr->end = stream->buff + keep_len;
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = read (stream->fd, scnr->end, stream->size - keep_len);
+    } while (bytes_read == -1 && errno == EINTR);
+
+    if (bytes_read <= 0) {
+        stream->fd_eof = true;
+        if (bytes_read == -1) {
+            scanner_set_error (scnr, "Error reading input.");
+        }
+        return false;
+    }
+
+    scnr->end += bytes_read;
+    return true;
+}
+
+static inline
+bool scanner_is_end (struct scanner_t *scnr)
+{
+    scanner_ensure_end (scnr);
+    return scnr->pos >= scnr->end && !scanner_refill (scnr);
+}
+
+// Makes sure at least n bytes after the current position are in memory, if the
+// input has them. Returns the number of bytes available.
+static inline
+size_t scanner_fill (struct scanner_t *scnr, size_t n)
+{
+    scanner_ensure_end (scnr);
+    while (scnr->end - scnr->pos < n && scanner_refill (scnr));
+    return scnr->end - scnr->pos;
+}
+
+// Numbers are parsed with the strto*() family of functions, these expect a
+// null terminated string and may read past the end of the input. To avoid
+// this, we copy the characters that could be part of a number into a small
+// null terminated buffer and parse from there.
+#define SCANNER_NUMBER_MAX_LEN 128
+static inline
+char* scanner_number_buffer (struct scanner_t *scnr, char *buff, char *allowed_chars)
+{
+    scanner_fill (scnr, SCANNER_NUMBER_MAX_LEN - 1);
+
+    char *src = scnr->pos;
+    char *dst = buff;
+    while (src < scnr->end && dst < buff + SCANNER_NUMBER_MAX_LEN - 1 &&
+           *src != '\0' && char_in_str (*src, allowed_chars)) {
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+
+    return buff;
+}
+
+#define SCANNER_FLOAT_CHARS "0123456789abcdefABCDEFxXpP.+-"
+#define SCANNER_INT_CHARS "0123456789"
 
 bool scanner_float (struct scanner_t *scnr, float *value)
 {
@@ -118,17 +553,20 @@ bool scanner_float (struct scanner_t *scnr, float *value)
     // Don't accept leading spaces.
     // NOTE: We don't accept floats not starting with a digit like .5, INF or
     // NAN. But we do accept hexadecimal floats like 0x1.Cp2
-    if (!(isdigit (*scnr->pos) || *scnr->pos == '-')) {
+    if (scanner_is_end (scnr) || !(scanner_is_digit (*scnr->pos) || *scnr->pos == '-')) {
         return false;
     }
 
+    char buff[SCANNER_NUMBER_MAX_LEN];
+    scanner_number_buffer (scnr, buff, SCANNER_FLOAT_CHARS);
+
     char *end;
-    float res = strtof (scnr->pos, &end);
-    if (res != 0 || scnr->pos != end) {
+    float res = strtof (buff, &end);
+    if (res != 0 || buff != end) {
         *value = res;
-        scnr->pos = end;
+        scnr->pos += end - buff;
 
-        if (*scnr->pos == '\0') {
+        if (scanner_is_end (scnr)) {
             scanner_eof_set (scnr);
         }
         return true;
@@ -148,17 +586,20 @@ bool scanner_double (struct scanner_t *scnr, double *value)
     // Don't accept leading spaces.
     // NOTE: We don't accept floats not starting with a digit like .5, INF or
     // NAN. But we do accept hexadecimal floats like 0x1.Cp2
-    if (!(isdigit (*scnr->pos) || *scnr->pos == '-')) {
+    if (scanner_is_end (scnr) || !(scanner_is_digit (*scnr->pos) || *scnr->pos == '-')) {
         return false;
     }
 
+    char buff[SCANNER_NUMBER_MAX_LEN];
+    scanner_number_buffer (scnr, buff, SCANNER_FLOAT_CHARS);
+
     char *end;
-    double res = strtod (scnr->pos, &end);
-    if (res != 0 || scnr->pos != end) {
+    double res = strtod (buff, &end);
+    if (res != 0 || buff != end) {
         *value = res;
-        scnr->pos = end;
+        scnr->pos += end - buff;
 
-        if (*scnr->pos == '\0') {
+        if (scanner_is_end (scnr)) {
             scanner_eof_set (scnr);
         }
         return true;
@@ -176,17 +617,20 @@ bool scanner_int (struct scanner_t *scnr, int *value)
         return false;
 
     // Don't accept leading spaces.
-    if (!isdigit (*scnr->pos)) {
+    if (scanner_is_end (scnr) || !scanner_is_digit (*scnr->pos)) {
         return false;
     }
 
+    char buff[SCANNER_NUMBER_MAX_LEN];
+    scanner_number_buffer (scnr, buff, SCANNER_INT_CHARS);
+
     char *end;
-    int res = strtol (scnr->pos, &end, 10);
-    if (res != 0 || scnr->pos != end) {
+    int res = strtol (buff, &end, 10);
+    if (res != 0 || buff != end) {
         *value = res;
-        scnr->pos = end;
+        scnr->pos += end - buff;
 
-        if (*scnr->pos == '\0') {
+        if (scanner_is_end (scnr)) {
             scanner_eof_set (scnr);
         }
         return true;
@@ -195,20 +639,45 @@ bool scanner_int (struct scanner_t *scnr, int *value)
     return false;
 }
 
-// NOTE: The definition of a space demends on the locale. In the POSIX locale
-// it means space, \n, \f, \r, \t and \v.
-// TODO: We should have a scanner_is_space that uses an internal definition of
-// what a space is.
+// Returns a pointer to the first non space character in [p, end), or end.
+static inline
+char* scanner_space_span (char *p, char *end)
+{
+#ifdef __SSE2__
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128 ((__m128i*)p);
+
+        // Spaces are ' ' and the range from '\t' to '\r'.
+        __m128i is_space = _mm_or_si128 (
+            _mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+            _mm_cmpeq_epi8 (_mm_min_epu8 (_mm_sub_epi8 (v, _mm_set1_epi8 ('\t')), _mm_set1_epi8 ('\r' - '\t')),
+                            _mm_sub_epi8 (v, _mm_set1_epi8 ('\t'))));
+
+        uint32_t non_space = ~_mm_movemask_epi8 (is_space) & 0xFFFF;
+        if (non_space != 0) {
+            return p + __builtin_ctz (non_space);
+        }
+        p += 16;
+    }
+#endif
+
+    while (p < end && scanner_is_space (*p)) {
+        p++;
+    }
+
+    return p;
+}
+
 void scanner_consume_spaces (struct scanner_t *scnr)
 {
-    while (isspace(*scnr->pos)) {
-        if (*scnr->pos == '\n') {
-            scnr->line_number++;
+    while (!scanner_is_end (scnr)) {
+        scnr->pos = scanner_space_span (scnr->pos, scnr->end);
+        if (scnr->pos < scnr->end) {
+            break;
         }
-        scnr->pos++;
     }
 
-    if (*scnr->pos == '\0') {
+    if (scanner_is_end (scnr)) {
         scanner_eof_set (scnr);
     }
 }
@@ -218,10 +687,10 @@ bool scanner_char (struct scanner_t *scnr, char c)
     if (scnr->error)
         return false;
 
-    if (*scnr->pos == c) {
+    if (!scanner_is_end (scnr) && *scnr->pos == c) {
         scnr->pos++;
 
-        if (*scnr->pos == '\0') {
+        if (scanner_is_end (scnr)) {
             scanner_eof_set (scnr);
         }
 
@@ -233,11 +702,13 @@ bool scanner_char (struct scanner_t *scnr, char c)
 
 // TODO: Is it useful to have a *_char and a *_char_any function, I'm thinking
 // not...
+// NOTE: This is O(k) on the length of char_list, use scanner_char_peek_class()
+// when checking against the same set of characters many times.
 bool scanner_char_peek (struct scanner_t *scnr, char *char_list)
 {
     assert (char_list != NULL);
 
-    if (scnr->error)
+    if (scnr->error || scanner_is_end (scnr))
         return false;
 
     while (*char_list != '\0' && *scnr->pos != *char_list) {
@@ -253,11 +724,9 @@ bool scanner_char_peek (struct scanner_t *scnr, char *char_list)
 
 void scanner_advance_char (struct scanner_t *scnr)
 {
-    if (*scnr->pos == '\n') {
-        scnr->line_number++;
-
-    } else if (*scnr->pos == '\0') {
+    if (scanner_is_end (scnr)) {
         scanner_eof_set (scnr);
+        return;
     }
 
     scnr->pos++;
@@ -286,60 +755,110 @@ bool scanner_to_char (struct scanner_t *scnr, char c)
     if (scnr->error)
         return false;
 
-    while (*scnr->pos != '\0' && *scnr->pos != c) {
-        if (*scnr->pos == '\n') {
-            scnr->line_number++;
+    while (!scanner_is_end (scnr)) {
+        char *found = memchr (scnr->pos, c, scnr->end - scnr->pos);
+        if (found != NULL) {
+            scnr->pos = found;
+            break;
         }
-        scnr->pos++;
+        scnr->pos = scnr->end;
     }
 
-    if (*scnr->pos == '\0') {
+    if (scanner_is_end (scnr)) {
         scanner_eof_set (scnr);
         return false;
     } else {
-        scnr->pos++;
+        scanner_advance_char (scnr);
+
+        if (scanner_is_end (scnr)) {
+            scanner_eof_set (scnr);
+        }
         return true;
     }
 }
 
-// Consume all characters until any of the characters in char_list is found. The
-// found character will be consummed too.
-// TODO: Rename char_any to any_char
-// NOTE: This has O(n^2) complexity. This is only expected to be used in cases
-// where not many characters are expected until a character in char_list is
-// found. Also char_list is expected to be small.
-bool scanner_to_any_char (struct scanner_t *scnr, char *char_list)
+// Consume all characters that are part of cls. Returns true if at least one
+// character was consumed.
+bool scanner_skip_while (struct scanner_t *scnr, char_class_t *cls)
 {
     if (scnr->error)
         return false;
 
-    bool found = false;
-    while (*scnr->pos != '\0' && !found) {
-        char *c = char_list;
-        while (*c != '\0') {
-            if (*scnr->pos == *c) {
-                found = true;
-                break;
-            }
-            c++;
+    uint64_t start = scanner_offset (scnr);
+    while (!scanner_is_end (scnr)) {
+        char *p = char_class_span (cls, scnr->pos, scnr->end);
+        scnr->pos = p;
+        if (p < scnr->end) {
+            break;
         }
+    }
 
-        if (*scnr->pos == '\n') {
-            scnr->line_number++;
-        }
+    if (scanner_is_end (scnr)) {
+        scanner_eof_set (scnr);
+    }
 
-        scnr->pos++;
+    return scanner_offset (scnr) != start;
+}
+
+// Consume all characters until one that is part of cls is found. The found
+// character is NOT consumed. Returns false if the end of the input was reached
+// without finding one.
+bool scanner_skip_until (struct scanner_t *scnr, char_class_t *cls)
+{
+    if (scnr->error)
+        return false;
+
+    while (!scanner_is_end (scnr)) {
+        char *p = char_class_find (cls, scnr->pos, scnr->end);
+        scnr->pos = p;
+        if (p < scnr->end) {
+            return true;
+        }
     }
 
-    if (*scnr->pos == '\0') {
-        scanner_eof_set (scnr);
+    scanner_eof_set (scnr);
+    return false;
+}
+
+bool scanner_char_peek_class (struct scanner_t *scnr, char_class_t *cls)
+{
+    if (scnr->error || scanner_is_end (scnr))
         return false;
-    } else {
+
+    return char_class_has (cls, *scnr->pos);
+}
+
+bool scanner_char_any_class (struct scanner_t *scnr, char_class_t *cls)
+{
+    if (scanner_char_peek_class (scnr, cls)) {
+        scanner_advance_char (scnr);
         return true;
+
+    } else {
+        return false;
     }
 }
 
-// NOTE: A 'str' containing \n will mess up the line count
+// Consume all characters until any of the characters in char_list is found. The
+// found character will be consummed too.
+// TODO: Rename char_any to any_char
+// NOTE: This builds a character class from char_list on each call. Callers
+// that do this in a loop should build the class once and use
+// scanner_skip_until() instead.
+bool scanner_to_any_char (struct scanner_t *scnr, char *char_list)
+{
+    char_class_t cls = char_class_from_str (char_list);
+    bool found = scanner_skip_until (scnr, &cls);
+    if (found) {
+        scanner_advance_char (scnr);
+        if (scanner_is_end (scnr)) {
+            scanner_eof_set (scnr);
+        }
+    }
+
+    return found;
+}
+
 bool scanner_str (struct scanner_t *scnr, char *str)
 {
     assert (str != NULL);
@@ -347,10 +866,10 @@ bool scanner_str (struct scanner_t *scnr, char *str)
         return false;
 
     size_t len = strlen(str);
-    if (strncmp(scnr->pos, str, len) == 0) {
+    if (scanner_fill (scnr, len) >= len && memcmp(scnr->pos, str, len) == 0) {
         scnr->pos += len;
 
-        if (*scnr->pos == '\0') {
+        if (scanner_is_end (scnr)) {
             scanner_eof_set (scnr);
         }
 
@@ -360,7 +879,6 @@ bool scanner_str (struct scanner_t *scnr, char *str)
     return false;
 }
 
-// NOTE: A 'str' containing \n will mess up the line count
 bool scanner_strcase (struct scanner_t *scnr, char *str)
 {
     assert (str != NULL);
@@ -368,10 +886,10 @@ bool scanner_strcase (struct scanner_t *scnr, char *str)
         return false;
 
     size_t len = strlen(str);
-    if (strncasecmp(scnr->pos, str, len) == 0) {
+    if (scanner_fill (scnr, len) >= len && strncasecmp(scnr->pos, str, len) == 0) {
         scnr->pos += len;
 
-        if (*scnr->pos == '\0') {
+        if (scanner_is_end (scnr)) {
             scanner_eof_set (scnr);
         }
 
@@ -381,3 +899,585 @@ bool scanner_strcase (struct scanner_t *scnr, char *str)
     return false;
 }
 
+
+// Speculative parsing
+//
+// To try to match something that may not be there, and go back if it isn't,
+// set a marker before scanning and then either rewind to it or commit what was
+// matched, like memory pool markers:
+//
+//      struct scanner_marker_t mrk = scanner_mark (scnr);
+//      if (scanner_str (scnr, "0x") && scanner_int (scnr, &value)) {
+//          scanner_commit (scnr, &mrk);
+//      } else {
+//          scanner_rewind (scnr, &mrk);
+//      }
+//
+// Markers can be nested but must be released in the opposite order they were
+// created. They don't copy the input or allocate, for streaming scanners the
+// input after the marker is pinned until it's released.
+struct scanner_marker_t {
+    uint64_t offset;
+    bool is_eof;
+
+    bool error;
+    char *error_message;
+    char *location_str;
+
+    int depth;
+};
+
+struct scanner_marker_t scanner_mark (struct scanner_t *scnr)
+{
+    struct scanner_marker_t mrk;
+    mrk.offset = scanner_pin (scnr);
+    mrk.is_eof = scnr->is_eof;
+    mrk.error = scnr->error;
+    mrk.error_message = scnr->error_message;
+    mrk.location_str = scnr->location_str;
+
+    scnr->mark_depth++;
+    mrk.depth = scnr->mark_depth;
+    return mrk;
+}
+
+// Keeps everything matched since the marker was set.
+void scanner_commit (struct scanner_t *scnr, struct scanner_marker_t *mrk)
+{
+    assert (mrk->depth == scnr->mark_depth && "Markers must be released in LIFO order.");
+    scnr->mark_depth--;
+    scanner_unpin (scnr);
+}
+
+// Goes back to the state the scanner had when the marker was set. This
+// includes errors, so an unexpected EOF inside a failed alternative doesn't
+// leak to the caller.
+void scanner_rewind (struct scanner_t *scnr, struct scanner_marker_t *mrk)
+{
+    assert (mrk->depth == scnr->mark_depth && "Markers must be released in LIFO order.");
+    scnr->pos = scanner_offset_ptr (scnr, mrk->offset);
+    scnr->is_eof = mrk->is_eof;
+    scnr->error = mrk->error;
+    scnr->error_message = mrk->error_message;
+    scnr->location_str = mrk->location_str;
+
+    scnr->mark_depth--;
+    scanner_unpin (scnr);
+}
+
+// Memoized rules
+//
+// Grammars that need to try several alternatives sharing a common prefix may
+// end up scanning the same input with the same rule many times, in the worst
+// case an exponential number of times. scanner_memo_rule() calls a rule at most
+// once for each position in the input and remembers the result (packrat
+// parsing). Rules are identified by an integer chosen by the caller.
+//
+// Rules must not have side effects other than advancing the scanner, because
+// they won't be called again when their result is reused.
+#define SCANNER_RULE_CB(name) bool name(struct scanner_t *scnr, void *clsr)
+typedef SCANNER_RULE_CB(scanner_rule_cb_t);
+
+struct scanner_memo_entry_t {
+    int rule_id;
+    uint64_t offset;
+
+    bool matched;
+    uint64_t end_offset;
+    bool is_eof;
+
+    struct scanner_memo_entry_t *next;
+};
+
+struct scanner_memo_t {
+    mem_pool_t pool;
+
+    uint32_t num_buckets;
+    uint32_t num_entries;
+    struct scanner_memo_entry_t **buckets;
+};
+
+void scanner_memo_destroy (struct scanner_memo_t *memo)
+{
+    mem_pool_destroy (&memo->pool);
+    free (memo->buckets);
+    *memo = (struct scanner_memo_t){0};
+}
+
+static inline
+uint32_t scanner_memo_bucket (struct scanner_memo_t *memo, int rule_id, uint64_t offset)
+{
+    uint64_t h = (offset ^ ((uint64_t)rule_id << 48)) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) & (memo->num_buckets - 1);
+}
+
+void scanner_memo_grow (struct scanner_memo_t *memo)
+{
+    struct scanner_memo_t old = *memo;
+
+    memo->num_buckets = old.num_buckets == 0 ? 256 : 2*old.num_buckets;
+    memo->buckets = calloc (memo->num_buckets, sizeof(struct scanner_memo_entry_t*));
+    for (uint32_t i=0; i<old.num_buckets; i++) {
+        struct scanner_memo_entry_t *entry = old.buckets[i];
+        while (entry != NULL) {
+            struct scanner_memo_entry_t *next = entry->next;
+            uint32_t bucket = scanner_memo_bucket (memo, entry->rule_id, entry->offset);
+            entry->next = memo->buckets[bucket];
+            memo->buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free (old.buckets);
+}
+
+bool scanner_memo_rule (struct scanner_t *scnr, struct scanner_memo_t *memo,
+                        int rule_id, scanner_rule_cb_t *rule, void *clsr)
+{
+    if (scnr->error)
+        return false;
+
+    if (memo->num_buckets == 0) {
+        scanner_memo_grow (memo);
+    }
+
+    uint64_t offset = scanner_offset (scnr);
+    uint32_t bucket = scanner_memo_bucket (memo, rule_id, offset);
+
+    struct scanner_memo_entry_t *entry = memo->buckets[bucket];
+    while (entry != NULL && (entry->rule_id != rule_id || entry->offset != offset)) {
+        entry = entry->next;
+    }
+
+    if (entry != NULL) {
+        if (entry->matched) {
+            // The end of a previous match was already read so it's still in the
+            // window, everything from the current position onwards is kept.
+            scnr->pos = scanner_offset_ptr (scnr, entry->end_offset);
+            scnr->is_eof = entry->is_eof;
+        }
+        return entry->matched;
+    }
+
+    struct scanner_marker_t mrk = scanner_mark (scnr);
+    bool matched = rule (scnr, clsr);
+    if (matched) {
+        scanner_commit (scnr, &mrk);
+    } else {
+        scanner_rewind (scnr, &mrk);
+    }
+
+    // The rule may have called scanner_memo_rule() recursively and grown the
+    // table, compute the bucket again.
+    if (memo->num_entries >= memo->num_buckets) {
+        scanner_memo_grow (memo);
+    }
+    bucket = scanner_memo_bucket (memo, rule_id, offset);
+    entry = mem_pool_push_struct (&memo->pool, struct scanner_memo_entry_t);
+    entry->rule_id = rule_id;
+    entry->offset = offset;
+    entry->matched = matched;
+    entry->end_offset = scanner_offset (scnr);
+    entry->is_eof = scnr->is_eof;
+    entry->next = memo->buckets[bucket];
+    memo->buckets[bucket] = entry;
+    memo->num_entries++;
+
+    return matched;
+}
+
+// Keyword sets
+//
+// Matching one of many keywords with consecutive calls to scanner_str() is
+// O(keywords*length). A keyword set compiles a list of keywords into a trie so
+// scanner_keyword() can find the longest one at the current position in a
+// single pass over the input. The id of a keyword is its index in the list
+// used to build the set.
+//
+//      char *keywords[] = {"if", "else", "elif", "while"};
+//      struct scanner_keywords_t set = {0};
+//      scanner_keywords_init (&set, keywords, ARRAY_SIZE(keywords), false);
+//
+//      int id;
+//      if (scanner_keyword (scnr, &set, &id)) {
+//          ...
+//      }
+//
+// NOTE: Matches don't check for word boundaries, "elif" matches "elifant". Use
+// scanner_is_ident_continue() on the next character if that's a problem.
+struct scanner_keyword_node_t {
+    int32_t id; // -1 if no keyword ends here
+
+    // Children are stored as a dense row for the range of characters
+    // [lo, hi] in the next array of the set, 0 means no child.
+    uint8_t lo;
+    uint8_t hi;
+    uint32_t base;
+};
+
+struct scanner_keywords_t {
+    mem_pool_t pool;
+    bool case_insensitive;
+    uint32_t max_len;
+
+    uint32_t num_nodes;
+    struct scanner_keyword_node_t *nodes;
+    uint32_t *next;
+};
+
+static inline
+uint8_t scanner_keyword_char (struct scanner_keywords_t *set, char c)
+{
+    if (set->case_insensitive && c >= 'A' && c <= 'Z') {
+        c += 'a' - 'A';
+    }
+    return (uint8_t)c;
+}
+
+void scanner_keywords_init (struct scanner_keywords_t *set,
+                            char **keywords, int num_keywords, bool case_insensitive)
+{
+    *set = (struct scanner_keywords_t){0};
+    set->case_insensitive = case_insensitive;
+
+    // Build the trie with a full row of children per node, then compact it.
+    struct build_node_t {
+        int32_t id;
+        uint32_t children[256];
+    };
+
+    uint32_t nodes_size = 64;
+    uint32_t num_nodes = 1;
+    struct build_node_t *nodes = malloc (nodes_size*sizeof(struct build_node_t));
+    nodes[0].id = -1;
+    memset (nodes[0].children, 0, sizeof(nodes[0].children));
+
+    for (int i=0; i<num_keywords; i++) {
+        uint32_t curr = 0;
+        uint32_t len = 0;
+        for (char *c=keywords[i]; *c != '\0'; c++, len++) {
+            uint8_t b = scanner_keyword_char (set, *c);
+            if (nodes[curr].children[b] == 0) {
+                if (num_nodes == nodes_size) {
+                    nodes_size *= 2;
+                    nodes = realloc (nodes, nodes_size*sizeof(struct build_node_t));
+                }
+
+                nodes[num_nodes].id = -1;
+                memset (nodes[num_nodes].children, 0, sizeof(nodes[num_nodes].children));
+                nodes[curr].children[b] = num_nodes;
+                num_nodes++;
+            }
+            curr = nodes[curr].children[b];
+        }
+
+        // If a keyword is repeated the first one wins.
+        if (nodes[curr].id == -1) {
+            nodes[curr].id = i;
+        }
+        set->max_len = MAX (set->max_len, len);
+    }
+
+    uint32_t next_len = 0;
+    set->num_nodes = num_nodes;
+    set->nodes = mem_pool_push_array (&set->pool, num_nodes, struct scanner_keyword_node_t);
+    for (uint32_t i=0; i<num_nodes; i++) {
+        struct scanner_keyword_node_t *node = &set->nodes[i];
+        node->id = nodes[i].id;
+        node->lo = 255;
+        node->hi = 0;
+        for (int c=0; c<256; c++) {
+            if (nodes[i].children[c] != 0) {
+                node->lo = MIN (node->lo, c);
+                node->hi = MAX (node->hi, c);
+            }
+        }
+
+        node->base = next_len;
+        if (node->lo <= node->hi) {
+            next_len += node->hi - node->lo + 1;
+        }
+    }
+
+    set->next = mem_pool_push_array (&set->pool, MAX (next_len, 1), uint32_t);
+    for (uint32_t i=0; i<num_nodes; i++) {
+        struct scanner_keyword_node_t *node = &set->nodes[i];
+        for (int c=node->lo; c<=node->hi; c++) {
+            set->next[node->base + c - node->lo] = nodes[i].children[c];
+        }
+    }
+
+    free (nodes);
+}
+
+void scanner_keywords_destroy (struct scanner_keywords_t *set)
+{
+    mem_pool_destroy (&set->pool);
+    *set = (struct scanner_keywords_t){0};
+}
+
+// Consumes the longest keyword of set at the current position and stores its
+// id in id, which can be NULL. Returns false if no keyword matches.
+bool scanner_keyword (struct scanner_t *scnr, struct scanner_keywords_t *set, int *id)
+{
+    if (scnr->error || set->nodes == NULL)
+        return false;
+
+    size_t available = scanner_fill (scnr, set->max_len);
+
+    int32_t match_id = -1;
+    size_t match_len = 0;
+    uint32_t curr = 0;
+    for (size_t i=0; i<available; i++) {
+        struct scanner_keyword_node_t *node = &set->nodes[curr];
+        uint8_t b = scanner_keyword_char (set, scnr->pos[i]);
+        if (b < node->lo || b > node->hi) {
+            break;
+        }
+
+        curr = set->next[node->base + b - node->lo];
+        if (curr == 0) {
+            break;
+        }
+
+        if (set->nodes[curr].id != -1) {
+            match_id = set->nodes[curr].id;
+            match_len = i + 1;
+        }
+    }
+
+    if (match_id == -1) {
+        return false;
+    }
+
+    scnr->pos += match_len;
+    if (id != NULL) {
+        *id = match_id;
+    }
+
+    if (scanner_is_end (scnr)) {
+        scanner_eof_set (scnr);
+    }
+
+    return true;
+}
+
+#ifdef _PTHREAD_H
+// Parallel parsing of line oriented input
+//
+// The input is split into chunks at newline boundaries that are parsed by
+// worker threads. The callback is called once for each line with a scanner
+// bounded to the line (without the \n), where scanner_line() returns the line
+// number in the full input. It returns a pointer to the parsed result, which
+// should be allocated in the pool it receives, or NULL if the line doesn't
+// produce one. Each chunk has its own pool, so callbacks never contend for
+// memory. Results are returned in the same order as the lines in the input.
+//
+// If a callback sets an error in the scanner, the error of the earliest line
+// is reported and no results are returned.
+#define SCANNER_LINE_CB(name) void* name(struct scanner_t *scnr, mem_pool_t *pool, void *clsr)
+typedef SCANNER_LINE_CB(scanner_line_cb_t);
+
+struct scanner_parallel_chunk_t {
+    char *start;
+    char *end;
+    int first_line;
+
+    mem_pool_t pool;
+    DYNAMIC_ARRAY_DEFINE (void*, results);
+
+    bool error;
+    struct scanner_t error_scnr;
+};
+
+struct scanner_parallel_t {
+    scanner_line_cb_t *cb;
+    void *clsr;
+
+    int num_chunks;
+    struct scanner_parallel_chunk_t *chunks;
+    volatile int next_chunk;
+};
+
+THREAD_WORKER_CB(scanner_parallel_count_lines)
+{
+    struct scanner_parallel_t *prl = (struct scanner_parallel_t*)clsr;
+
+    int chunk_idx;
+    while ((chunk_idx = __sync_fetch_and_add (&prl->next_chunk, 1)) < prl->num_chunks) {
+        struct scanner_parallel_chunk_t *chunk = &prl->chunks[chunk_idx];
+
+        chunk->first_line = scanner_count_newlines (chunk->start, chunk->end);
+    }
+}
+
+THREAD_WORKER_CB(scanner_parallel_parse_lines)
+{
+    struct scanner_parallel_t *prl = (struct scanner_parallel_t*)clsr;
+
+    int chunk_idx;
+    while ((chunk_idx = __sync_fetch_and_add (&prl->next_chunk, 1)) < prl->num_chunks) {
+        struct scanner_parallel_chunk_t *chunk = &prl->chunks[chunk_idx];
+
+        int line_number = chunk->first_line;
+        char *line = chunk->start;
+        while (line < chunk->end) {
+            char *line_end = memchr (line, '\n', chunk->end - line);
+            if (line_end == NULL) {
+                line_end = chunk->end;
+            }
+
+            struct scanner_t scnr;
+            scanner_init (&scnr, line, line_end - line);
+            scnr.line_number = line_number;
+
+            void *result = prl->cb (&scnr, &chunk->pool, prl->clsr);
+            if (scnr.error) {
+                chunk->error = true;
+                chunk->error_scnr = scnr;
+                break;
+            }
+            scanner_destroy (&scnr);
+
+            if (result != NULL) {
+                DYNAMIC_ARRAY_APPEND (chunk->results, result);
+            }
+
+            line = line_end + 1;
+            line_number++;
+        }
+    }
+}
+
+// Parses [data, data+len) in num_threads threads, if num_threads is 0 one
+// thread per CPU is used. The chunk pools become children of pool, results are
+// valid until pool is destroyed. Errors are appended to error_out, or printed
+// if it's NULL.
+bool scanner_parse_lines_parallel (char *data, size_t len, int num_threads,
+                                   scanner_line_cb_t *cb, void *clsr,
+                                   mem_pool_t *pool, void ***results, size_t *num_results,
+                                   string_t *error_out)
+{
+    assert (pool != NULL && results != NULL && num_results != NULL);
+
+    if (num_threads <= 0) {
+        num_threads = get_num_cpus ();
+    }
+
+    // Use more chunks than threads so lines that are slower to parse don't
+    // leave threads idle.
+    struct scanner_parallel_t prl = {0};
+    prl.cb = cb;
+    prl.clsr = clsr;
+    prl.num_chunks = MAX (1, MIN ((size_t)4*num_threads, len/4096));
+    prl.chunks = calloc (prl.num_chunks, sizeof(struct scanner_parallel_chunk_t));
+
+    char *end = data + len;
+    char *chunk_start = data;
+    int num_chunks = 0;
+    for (int i=0; i<prl.num_chunks && chunk_start < end; i++) {
+        char *chunk_end = data + (len*(i+1))/prl.num_chunks;
+        if (chunk_end < chunk_start) {
+            chunk_end = chunk_start;
+        }
+
+        chunk_end = memchr (chunk_end, '\n', end - chunk_end);
+        chunk_end = chunk_end == NULL ? end : chunk_end + 1;
+
+        prl.chunks[num_chunks].start = chunk_start;
+        prl.chunks[num_chunks].end = chunk_end;
+        num_chunks++;
+
+        chunk_start = chunk_end;
+    }
+    prl.num_chunks = num_chunks;
+    num_threads = MIN (num_threads, MAX (num_chunks, 1));
+
+    // Count the lines in each chunk to know the line number at the start of
+    // each one, then parse them.
+    run_threads (num_threads, scanner_parallel_count_lines, &prl);
+
+    int line_number = 0;
+    for (int i=0; i<prl.num_chunks; i++) {
+        int count = prl.chunks[i].first_line;
+        prl.chunks[i].first_line = line_number;
+        line_number += count;
+    }
+
+    prl.next_chunk = 0;
+    run_threads (num_threads, scanner_parallel_parse_lines, &prl);
+
+    bool success = true;
+    size_t total_results = 0;
+    for (int i=0; i<prl.num_chunks; i++) {
+        struct scanner_parallel_chunk_t *chunk = &prl.chunks[i];
+        if (success && chunk->error) {
+            scanner_output_error (&chunk->error_scnr, error_out);
+            success = false;
+        }
+
+        if (chunk->error) {
+            scanner_destroy (&chunk->error_scnr);
+        }
+        total_results += chunk->results_len;
+    }
+
+    *results = NULL;
+    *num_results = 0;
+    if (success) {
+        *results = mem_pool_push_array (pool, MAX (total_results, 1), void*);
+        for (int i=0; i<prl.num_chunks; i++) {
+            struct scanner_parallel_chunk_t *chunk = &prl.chunks[i];
+            memcpy (*results + *num_results, chunk->results, chunk->results_len*sizeof(void*));
+            *num_results += chunk->results_len;
+        }
+    }
+
+    for (int i=0; i<prl.num_chunks; i++) {
+        struct scanner_parallel_chunk_t *chunk = &prl.chunks[i];
+        free (chunk->results);
+
+        if (success) {
+            mem_pool_t *chunk_pool = mem_pool_push_struct (pool, mem_pool_t);
+            *chunk_pool = chunk->pool;
+            mem_pool_add_child (pool, chunk_pool);
+        } else {
+            mem_pool_destroy (&chunk->pool);
+        }
+    }
+    free (prl.chunks);
+
+    return success;
+}
+
+ON_DESTROY_CALLBACK(scanner_pooled_destroy)
+{
+    scanner_destroy (allocated);
+}
+
+// Same as scanner_parse_lines_parallel() but the input is the content of the
+// file at path, which is memory mapped. Results may point into the mapping, so
+// it stays mapped until pool is destroyed.
+bool scanner_parse_file_lines_parallel (char *path, int num_threads,
+                                        scanner_line_cb_t *cb, void *clsr,
+                                        mem_pool_t *pool, void ***results, size_t *num_results,
+                                        string_t *error_out)
+{
+    struct scanner_t file_scnr;
+    if (!scanner_init_file (&file_scnr, path)) {
+        *results = NULL;
+        *num_results = 0;
+        return false;
+    }
+
+    bool success = scanner_parse_lines_parallel (file_scnr.pos, file_scnr.end - file_scnr.pos, num_threads,
+                                                 cb, clsr, pool, results, num_results, error_out);
+    if (success) {
+        struct scanner_t *pooled_scnr =
+            mem_pool_push_size_cb (pool, sizeof(struct scanner_t), scanner_pooled_destroy);
+        *pooled_scnr = file_scnr;
+    } else {
+        scanner_destroy (&file_scnr);
+    }
+    return success;
+}
+#endif
@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Grammar used to test memoization, without it matching S takes an exponential
+// number of calls to T:
+//
+//      S := T 'x' | T 'y'
+//      T := '(' S ')' | 'a'
+struct scanner_test_grammar_t {
+    struct scanner_memo_t memo;
+    int t_calls;
+};
+
+SCANNER_RULE_CB(scanner_test_rule_t);
+
+bool scanner_test_rule_s (struct scanner_t *scnr, struct scanner_test_grammar_t *grammar)
+{
+    struct scanner_marker_t mrk = scanner_mark (scnr);
+    if (scanner_memo_rule (scnr, &grammar->memo, 0, scanner_test_rule_t, grammar) && scanner_char (scnr, 'x')) {
+        scanner_commit (scnr, &mrk);
+        return true;
+    }
+    scanner_rewind (scnr, &mrk);
+
+    return scanner_memo_rule (scnr, &grammar->memo, 0, scanner_test_rule_t, grammar) && scanner_char (scnr, 'y');
+}
+
+SCANNER_RULE_CB(scanner_test_rule_t)
+{
+    struct scanner_test_grammar_t *grammar = (struct scanner_test_grammar_t*)clsr;
+    grammar->t_calls++;
+
+    if (scanner_char (scnr, '(')) {
+        return scanner_test_rule_s (scnr, grammar) && scanner_char (scnr, ')');
+    }
+    return scanner_char (scnr, 'a');
+}
+
+struct scanner_test_record_t {
+    int line_number;
+    int value;
+    sstring_t text;
+};
+
+SCANNER_LINE_CB(scanner_test_parse_record)
+{
+    int *error_line = (int*)clsr;
+
+    char *start = scnr->pos;
+    int value;
+    if (!scanner_int (scnr, &value) || !scanner_char (scnr, ';') || scanner_line (scnr) == *error_line) {
+        scanner_set_error (scnr, "Invalid record.");
+        return NULL;
+    }
+
+    struct scanner_test_record_t *record = mem_pool_push_struct (pool, struct scanner_test_record_t);
+    record->line_number = scanner_line (scnr);
+    record->value = value;
+    record->text = SSTRING(start, scnr->pos - start);
+    return record;
+}
+
+void scanner_tests (struct test_ctx_t *t)
+{
+    test_push (t, "Scanner");
+
+    {
+        test_push (t, "Null terminated input");
+
+        struct scanner_t scnr = {0};
+        scnr.pos = "12 abc\n-3.5";
+
+        int i_value = 0;
+        double d_value = 0;
+        test_bool (t, "int", scanner_int (&scnr, &i_value) && i_value == 12);
+        scanner_consume_spaces (&scnr);
+        test_bool (t, "str", scanner_str (&scnr, "abc"));
+        scanner_consume_spaces (&scnr);
+        test_int (t, "line number", scanner_line (&scnr), 1);
+        test_bool (t, "double", scanner_double (&scnr, &d_value) && d_value == -3.5);
+        test_bool (t, "eof", scnr.is_eof);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Bounded input");
+
+        // Only the first 6 bytes are part of the input, nothing after them
+        // should ever be matched.
+        char buff[] = "34 ab;cdef 99";
+        struct scanner_t scnr;
+        scanner_init (&scnr, buff, 6);
+
+        int value = 0;
+        test_bool (t, "int", scanner_int (&scnr, &value) && value == 34);
+        scanner_consume_spaces (&scnr);
+        test_bool (t, "str past end", !scanner_str (&scnr, "ab;c"));
+        test_bool (t, "to_char", scanner_to_char (&scnr, ';'));
+        test_bool (t, "eof", scnr.is_eof);
+        test_bool (t, "char past end", !scanner_char (&scnr, 'c'));
+        test_bool (t, "to_char past end", !scanner_to_char (&scnr, '9'));
+
+        scanner_init (&scnr, buff, 1);
+        test_bool (t, "number truncated at end", scanner_int (&scnr, &value) && value == 3);
+
+        sstring_t sstr = SSTRING(buff + 3, 2);
+        scanner_init_sstr (&scnr, sstr);
+        test_bool (t, "sstring_t", scanner_str (&scnr, "ab") && scnr.is_eof);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "File mapping");
+
+        char *path = "bin/scanner_test_file";
+        char *content = "first line\nsecond 42\n";
+        full_file_write (content, strlen(content), path);
+
+        struct scanner_t scnr;
+        test_bool (t, "mapped", scanner_init_file (&scnr, path));
+        scanner_to_char (&scnr, '\n');
+        scanner_str (&scnr, "second");
+        scanner_consume_spaces (&scnr);
+
+        int value = 0;
+        test_bool (t, "content", scanner_int (&scnr, &value) && value == 42);
+        scanner_consume_spaces (&scnr);
+        test_bool (t, "eof", scnr.is_eof);
+
+        scanner_destroy (&scnr);
+        unlink (path);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Streaming");
+
+        char *path = "bin/scanner_test_stream";
+        string_t content = {0};
+        for (int i=0; i<200; i++) {
+            str_cat_printf (&content, "key_%d = %d;\n", i, i*1000);
+        }
+        str_cat_c (&content, "a_very_long_token_that_does_not_fit_in_the_window_at_all");
+        full_file_write (str_data(&content), str_len(&content), path);
+
+        int fd = open (path, O_RDONLY);
+        struct scanner_t scnr;
+        scanner_init_fd (&scnr, fd, 16);
+
+        bool success = true;
+        for (int i=0; success && i<200; i++) {
+            string_t expected_key = {0};
+            str_set_printf (&expected_key, "key_%d", i);
+
+            uint64_t token_start = scanner_pin (&scnr);
+            while (scanner_char_any (&scnr, "key_0123456789"));
+            sstring_t key = scanner_pinned_sstr (&scnr, token_start);
+            success = key.len == str_len(&expected_key) &&
+                      strncmp (key.s, str_data(&expected_key), key.len) == 0;
+            scanner_unpin (&scnr);
+
+            int value;
+            scanner_consume_spaces (&scnr);
+            success = success && scanner_str (&scnr, "=");
+            scanner_consume_spaces (&scnr);
+            success = success && scanner_int (&scnr, &value) && value == i*1000;
+            success = success && scanner_char (&scnr, ';');
+            scanner_consume_spaces (&scnr);
+
+            str_free (&expected_key);
+        }
+        test_bool (t, "tokens across window boundaries", success);
+        test_int (t, "line number", scanner_line (&scnr), 200);
+
+        uint64_t token_start = scanner_pin (&scnr);
+        scanner_to_char (&scnr, '\0');
+        sstring_t token = scanner_pinned_sstr (&scnr, token_start);
+        scanner_unpin (&scnr);
+        test_bool (t, "pinned token larger than window",
+                   token.len == 56 && strncmp (token.s, "a_very_long_token", 17) == 0);
+        test_bool (t, "eof", scnr.is_eof);
+
+        scanner_destroy (&scnr);
+        close (fd);
+        unlink (path);
+        str_free (&content);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Character classes");
+
+        // Compare the vectorized search with a plain loop. Includes a class
+        // with many distinct nibble groups that can't use the shuffle based
+        // classifier.
+        char_class_t classes[4] = {0};
+        classes[0] = char_class_from_str (" \t\r\n");
+        char_class_add_range (&classes[1], 'a', 'z');
+        char_class_add_range (&classes[1], 'A', 'Z');
+        char_class_add_str (&classes[1], "_0123456789");
+        classes[2] = char_class_from_str ("\"");
+        for (int c=0; c<256; c+=17) {
+            char_class_add (&classes[3], (char)c);
+        }
+
+        // Lookups must not write to the class, it may be shared between
+        // threads.
+        char_class_t built[ARRAY_SIZE(classes)];
+        memcpy (built, classes, sizeof(classes));
+
+        char buff[1024];
+        bool success = true;
+        for (int i=0; success && i<500; i++) {
+            for (int j=0; j<ARRAY_SIZE(buff); j++) {
+                buff[j] = rand_int_range (0, 3) ? rand_int_range (' ', '~') : rand_int_range (0, 255);
+            }
+
+            char_class_t *cls = &classes[i%ARRAY_SIZE(classes)];
+            char *start = buff + rand_int_range (0, 64);
+            char *end = buff + rand_int_range (start - buff, ARRAY_SIZE(buff));
+
+            char *expected_find = start;
+            while (expected_find < end && !char_class_has (cls, *expected_find)) expected_find++;
+            char *expected_span = start;
+            while (expected_span < end && char_class_has (cls, *expected_span)) expected_span++;
+
+            success = char_class_find (cls, start, end) == expected_find &&
+                      char_class_span (cls, start, end) == expected_span;
+
+            // Long runs of class members
+            memset (start, 'a', end - start);
+            success = success && char_class_span (&classes[1], start, end) == end;
+        }
+        test_bool (t, "vectorized search", success);
+        test_bool (t, "lookups are read only", memcmp (built, classes, sizeof(classes)) == 0);
+        test_bool (t, "nibble tables", classes[1].has_nibble_tables && !classes[3].has_nibble_tables);
+
+        char *input = "    \n\n  identifier_123 rest of the line\n\tnext\n";
+        struct scanner_t scnr = {0};
+        scnr.pos = input;
+        test_bool (t, "skip_while", scanner_skip_while (&scnr, &classes[0]) && scanner_line (&scnr) == 2);
+        test_bool (t, "char_peek_class", scanner_char_peek_class (&scnr, &classes[1]));
+        scanner_skip_while (&scnr, &classes[1]);
+        test_bool (t, "skip_while stops", *scnr.pos == ' ');
+        test_bool (t, "skip_until", scanner_skip_until (&scnr, &classes[2]) == false && scnr.is_eof);
+        test_int (t, "line number", scanner_line (&scnr), 4);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Character tables");
+
+        bool success = true;
+        for (int c=0; c<256; c++) {
+            success = success &&
+                scanner_is_space (c) == (c == ' ' || (c >= '\t' && c <= '\r')) &&
+                scanner_is_digit (c) == (c >= '0' && c <= '9') &&
+                scanner_is_hex (c) == (c < 128 && isxdigit (c)) &&
+                scanner_is_ident_start (c) == (c < 128 && (isalpha (c) || c == '_')) &&
+                scanner_is_ident_continue (c) == (c < 128 && (isalnum (c) || c == '_'));
+        }
+        test_bool (t, "classification", success);
+
+        string_t input = {0};
+        int expected_lines = 0;
+        for (int i=0; i<40; i++) {
+            int run = rand_int_range (0, 40);
+            for (int j=0; j<run; j++) {
+                char c = " \t\n\r\v\f"[rand_int_range (0, 5)];
+                if (c == '\n') expected_lines++;
+                strn_cat_c (&input, &c, 1);
+            }
+            str_cat_c (&input, "x");
+        }
+
+        struct scanner_t scnr;
+        scanner_init_str (&scnr, &input);
+        success = true;
+        for (int i=0; success && i<40; i++) {
+            scanner_consume_spaces (&scnr);
+            success = scanner_char (&scnr, 'x');
+        }
+        test_bool (t, "consume_spaces", success && scnr.is_eof);
+        test_int (t, "line number", scanner_line (&scnr), expected_lines);
+        str_free (&input);
+
+        scnr = (struct scanner_t){0};
+        scnr.pos = "first\n  second\n";
+        scanner_to_char (&scnr, '\n');
+        scanner_consume_spaces (&scnr);
+        scanner_set_error (&scnr, "Bad token.");
+        string_t error = {0};
+        scanner_output_error (&scnr, &error);
+        test_bool (t, "error location", strstr (str_data(&error), "1:3:") != NULL);
+        str_free (&error);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Line numbers");
+
+        // Long enough for the newline index to have several blocks.
+        string_t input = {0};
+        while (str_len (&input) < 300*1024) {
+            int len = rand_int_range (0, 200);
+            for (int i=0; i<len; i++) {
+                char c = 'a' + rand_int_range (0, 25);
+                strn_cat_c (&input, &c, 1);
+            }
+            str_cat_c (&input, "\n");
+        }
+        char *data = str_data (&input);
+        size_t len = str_len (&input);
+
+        int *expected = malloc ((len + 1)*sizeof(int));
+        expected[0] = 0;
+        for (size_t i=0; i<len; i++) {
+            expected[i+1] = expected[i] + (data[i] == '\n');
+        }
+
+        struct scanner_t scnr;
+        scanner_init (&scnr, data, len);
+        scnr.line_number = 1;
+
+        bool success = true;
+        for (int i=0; success && i<1000; i++) {
+            size_t offset = rand_int_range (0, len);
+            scnr.pos = data + offset;
+            success = scanner_line (&scnr) == expected[offset] + 1;
+        }
+        test_bool (t, "random offsets", success);
+
+        scnr.pos = data;
+        success = true;
+        while (success && !scnr.is_eof) {
+            scanner_to_char (&scnr, '\n');
+            scanner_advance_char (&scnr);
+            success = scanner_line (&scnr) == expected[scanner_offset (&scnr)] + 1;
+        }
+        test_bool (t, "end of each line", success && scanner_line (&scnr) == expected[len] + 1);
+        scanner_destroy (&scnr);
+
+        char *path = "bin/scanner_test_lines";
+        full_file_write (data, len, path);
+        int fd = open (path, O_RDONLY);
+        scanner_init_fd (&scnr, fd, 4096);
+        success = true;
+        while (success && !scnr.is_eof) {
+            scanner_to_char (&scnr, '\n');
+            scanner_advance_char (&scnr);
+            success = scanner_line (&scnr) == expected[scanner_offset (&scnr)];
+        }
+        test_bool (t, "streaming", success && scanner_line (&scnr) == expected[len]);
+        scanner_destroy (&scnr);
+        close (fd);
+        unlink (path);
+
+        free (expected);
+        str_free (&input);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Markers");
+
+        struct scanner_t scnr = {0};
+        scnr.pos = "0x1F abc";
+
+        struct scanner_marker_t outer = scanner_mark (&scnr);
+        test_bool (t, "match", scanner_str (&scnr, "0x1F"));
+        struct scanner_marker_t inner = scanner_mark (&scnr);
+        scanner_consume_spaces (&scnr);
+        test_bool (t, "nested match", scanner_str (&scnr, "abc") && scnr.is_eof);
+        scanner_rewind (&scnr, &inner);
+        test_bool (t, "rewind nested", *scnr.pos == ' ' && !scnr.is_eof);
+        scanner_commit (&scnr, &outer);
+        test_bool (t, "commit", scanner_offset (&scnr) == 4 && scnr.mark_depth == 0 && scnr.pin_count == 0);
+
+        scnr.eof_is_error = true;
+        struct scanner_marker_t mrk = scanner_mark (&scnr);
+        scanner_to_char (&scnr, '@');
+        test_bool (t, "error inside alternative", scnr.error);
+        scanner_rewind (&scnr, &mrk);
+        test_bool (t, "rewind restores error state", !scnr.error && scanner_offset (&scnr) == 4);
+
+        // Rewinding a streaming scanner after the window was refilled.
+        char *path = "bin/scanner_test_marker";
+        char *content = "alternative_one_is_long_enough_to_refill;alternative_two";
+        full_file_write (content, strlen(content), path);
+        int fd = open (path, O_RDONLY);
+        scanner_init_fd (&scnr, fd, 8);
+        mrk = scanner_mark (&scnr);
+        scanner_to_char (&scnr, ';');
+        test_bool (t, "streaming alternative fails", !scanner_str (&scnr, "alternative_one"));
+        scanner_rewind (&scnr, &mrk);
+        test_bool (t, "streaming rewind", scanner_str (&scnr, "alternative_one") && scanner_to_char (&scnr, ';') &&
+                                          scanner_str (&scnr, "alternative_two"));
+        scanner_destroy (&scnr);
+        close (fd);
+        unlink (path);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Memoized rules");
+
+        int depth = 20;
+        string_t input = {0};
+        for (int i=0; i<depth; i++) str_cat_c (&input, "(");
+        str_cat_c (&input, "a");
+        for (int i=0; i<depth; i++) str_cat_c (&input, "y)");
+        str_cat_c (&input, "y");
+
+        struct scanner_test_grammar_t grammar = {0};
+        struct scanner_t scnr;
+        scanner_init_str (&scnr, &input);
+        test_bool (t, "match", scanner_test_rule_s (&scnr, &grammar) && scnr.is_eof);
+        test_bool (t, "linear number of calls", grammar.t_calls == depth + 1);
+
+        scanner_memo_destroy (&grammar.memo);
+        str_free (&input);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Keywords");
+
+        char *keywords[] = {"if", "else", "elif", "e", "while", "WHILE_NOT"};
+        struct scanner_keywords_t set;
+        scanner_keywords_init (&set, keywords, ARRAY_SIZE(keywords), false);
+
+        int id = -1;
+        struct scanner_t scnr = {0};
+        scnr.pos = "elif elsewhile else";
+        test_bool (t, "longest match", scanner_keyword (&scnr, &set, &id) && id == 2);
+        scanner_consume_spaces (&scnr);
+        test_bool (t, "prefix of longer keyword", scanner_keyword (&scnr, &set, &id) && id == 1);
+        test_bool (t, "adjacent keyword", scanner_keyword (&scnr, &set, &id) && id == 4);
+        scanner_consume_spaces (&scnr);
+        test_bool (t, "no partial match", scanner_keyword (&scnr, &set, &id) && id == 1 && scnr.is_eof);
+
+        scnr = (struct scanner_t){0};
+        scnr.pos = "While_not";
+        test_bool (t, "case sensitive", !scanner_keyword (&scnr, &set, &id) && scanner_offset (&scnr) == 0);
+        scanner_keywords_destroy (&set);
+
+        scanner_keywords_init (&set, keywords, ARRAY_SIZE(keywords), true);
+        test_bool (t, "case insensitive", scanner_keyword (&scnr, &set, &id) && id == 5 && scnr.is_eof);
+
+        // Only "el" is part of the input, so the longest match is "e".
+        char buff[] = "elxx";
+        scanner_init (&scnr, buff, 2);
+        test_bool (t, "bounded input", scanner_keyword (&scnr, &set, &id) && id == 3 && scanner_offset (&scnr) == 1);
+        scanner_keywords_destroy (&set);
+
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Parallel line parsing");
+
+        char *path = "bin/scanner_test_parallel";
+        int num_lines = 20000;
+        string_t content = {0};
+        for (int i=0; i<num_lines; i++) {
+            str_cat_printf (&content, "%d;\n", 3*i);
+        }
+        full_file_write (str_data(&content), str_len(&content), path);
+
+        mem_pool_t pool = {0};
+        void **results;
+        size_t num_results;
+        int error_line = -1;
+        bool success = scanner_parse_file_lines_parallel (path, 4, scanner_test_parse_record, &error_line,
+                                                          &pool, &results, &num_results, NULL);
+        test_bool (t, "success", success && num_results == num_lines);
+
+        bool in_order = true;
+        for (int i=0; in_order && i<num_results; i++) {
+            struct scanner_test_record_t *record = results[i];
+            in_order = record->line_number == i && record->value == 3*i;
+        }
+        test_bool (t, "results in order with global line numbers", in_order);
+
+        // Results point into the mapped file, it must stay mapped until the
+        // pool is destroyed.
+        unlink (path);
+        bool valid_text = true;
+        for (int i=0; valid_text && i<num_results; i++) {
+            struct scanner_test_record_t *record = results[i];
+            char expected[32];
+            int len = snprintf (expected, sizeof(expected), "%d;", 3*i);
+            valid_text = record->text.len == len && memcmp (record->text.s, expected, len) == 0;
+        }
+        test_bool (t, "results point into the mapping", valid_text);
+        full_file_write (str_data(&content), str_len(&content), path);
+
+        error_line = 12345;
+        string_t error = {0};
+        success = scanner_parse_file_lines_parallel (path, 4, scanner_test_parse_record, &error_line,
+                                                     &pool, &results, &num_results, &error);
+        test_bool (t, "error reported", !success && num_results == 0 && strstr (str_data(&error), "12345:") != NULL);
+
+        str_free (&error);
+        mem_pool_destroy (&pool);
+        str_free (&content);
+        unlink (path);
+
+        test_pop_parent (t);
+    }
+
+    test_pop_parent (t);
+}
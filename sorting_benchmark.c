@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Benchmark of templ_sort() against the previous top-down implementation,
+// which is kept here as templ_sort_recursive(), and against
+// templ_sort_unstable(). See the sorting_benchmark snip in pymk.py.
+//
+// The recursive version declares a variable length array of n elements at each
+// level, so it uses about 2*n*sizeof(TYPE) bytes of stack. It's skipped for
+// sizes that would overflow a default 8 MiB stack.
+
+#include "common.h"
+#include <time.h>
+
+#define MAX_RECURSIVE_STACK (4*1024*1024)
+#define MIN_ELEMENTS_PER_SIZE 5000000
+
+static inline
+double get_time_s ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+#define templ_sort_recursive(FUNCNAME,TYPE,IS_A_LT_B)                             \
+void FUNCNAME ## _user_data (TYPE *arr, int n, void *user_data)                   \
+{                                                                                 \
+    if (arr == NULL || n<=1) {                                                    \
+        return;                                                                   \
+    } else if (n == 2) {                                                          \
+        TYPE *a = &arr[1];                                                        \
+        TYPE *b = &arr[0];                                                        \
+        int c = IS_A_LT_B;                                                        \
+        if (c) {                                                                  \
+            swap_n_bytes (&arr[0], &arr[1], sizeof(TYPE));                        \
+        }                                                                         \
+    } else {                                                                      \
+        TYPE res[n];                                                              \
+        FUNCNAME ## _user_data (arr, n/2, user_data);                             \
+        FUNCNAME ## _user_data (&arr[n/2], n-n/2, user_data);                     \
+                                                                                  \
+        int i;                                                                    \
+        int h=0;                                                                  \
+        int k=n/2;                                                                \
+        for (i=0; k<n && h<n/2; i++) {                                            \
+            TYPE *a = &arr[h];                                                    \
+            TYPE *b = &arr[k];                                                    \
+            int c = IS_A_LT_B;                                                    \
+            if (c) {                                                              \
+                res[i] = arr[h];                                                  \
+                h++;                                                              \
+            } else {                                                              \
+                res[i] = arr[k];                                                  \
+                k++;                                                              \
+            }                                                                     \
+        }                                                                         \
+                                                                                  \
+        int rest_idx = k==n ? h : k;                                              \
+        for (; i<n; i++) {                                                        \
+            res[i] = arr[rest_idx];                                               \
+            rest_idx++;                                                           \
+        }                                                                         \
+                                                                                  \
+        for (i=0; i<n; i++) {                                                     \
+            arr[i] = res[i];                                                      \
+        }                                                                         \
+    }                                                                             \
+}                                                                                 \
+                                                                                  \
+void FUNCNAME(TYPE *arr, int n) {                                                 \
+    FUNCNAME ## _user_data (arr,n,NULL);                                          \
+}
+
+struct record_t {
+    uint64_t key;
+    uint64_t data[3];
+};
+
+templ_sort (int_sort_new, int, *a < *b);
+templ_sort_recursive (int_sort_old, int, *a < *b);
+
+templ_sort (record_sort_new, struct record_t, a->key < b->key);
+templ_sort_recursive (record_sort_old, struct record_t, a->key < b->key);
+
+templ_sort_unstable (int_sort_unstable, int, *a < *b);
+templ_sort_unstable (record_sort_unstable, struct record_t, a->key < b->key);
+
+enum order_t {
+    ORDER_RANDOM,
+    ORDER_SORTED,
+    ORDER_REVERSED,
+    ORDER_FEW_UNIQUE,
+    ORDER_NEARLY_SORTED
+};
+
+char *order_names[] = {"random", "sorted", "reversed", "few unique", "nearly sorted"};
+
+uint64_t generate_key (enum order_t order, int i, int n)
+{
+    switch (order) {
+        case ORDER_RANDOM:
+            return rand ();
+        case ORDER_SORTED:
+            return i;
+        case ORDER_REVERSED:
+            return n - i;
+        case ORDER_FEW_UNIQUE:
+            return rand_int_range (0, 15);
+        default:
+            return rand_int_range (0, 99) == 0 ? (uint64_t)rand () : (uint64_t)i;
+    }
+}
+
+#define BENCHMARK_SORT(FUNC,ARR,ORIGINAL,N,ROUNDS,ELAPSED) \
+{                                                          \
+    ELAPSED = 0;                                           \
+    for (int r=0; r<ROUNDS; r++) {                         \
+        memcpy (ARR, ORIGINAL, N*sizeof(*ARR));            \
+        double start = get_time_s ();                      \
+        FUNC (ARR, N);                                     \
+        ELAPSED += get_time_s () - start;                  \
+    }                                                      \
+    ELAPSED /= ROUNDS;                                     \
+}
+
+void print_result (char *type, char *order, int n, double old_s, double new_s, double unstable_s)
+{
+    if (old_s > 0) {
+        printf ("%-7s %-14s %9d | old %9.3f ms | new %9.3f ms | %5.2fx | unstable %9.3f ms\n",
+                type, order, n, old_s*1e3, new_s*1e3, old_s/new_s, unstable_s*1e3);
+    } else {
+        printf ("%-7s %-14s %9d | old %12s | new %9.3f ms | %5s  | unstable %9.3f ms\n",
+                type, order, n, "(stack)", new_s*1e3, "", unstable_s*1e3);
+    }
+}
+
+void run_size (int n)
+{
+    int rounds = MAX (1, MIN_ELEMENTS_PER_SIZE/n);
+
+    int *ints_original = malloc (n*sizeof(int));
+    int *ints = malloc (n*sizeof(int));
+    struct record_t *records_original = malloc (n*sizeof(struct record_t));
+    struct record_t *records = malloc (n*sizeof(struct record_t));
+
+    for (int order=0; order<ARRAY_SIZE(order_names); order++) {
+        for (int i=0; i<n; i++) {
+            uint64_t key = generate_key (order, i, n);
+            ints_original[i] = key;
+            records_original[i].key = key;
+            records_original[i].data[0] = i;
+        }
+
+        double old_s = 0, new_s, unstable_s;
+        if (2*(size_t)n*sizeof(int) <= MAX_RECURSIVE_STACK) {
+            BENCHMARK_SORT (int_sort_old, ints, ints_original, n, rounds, old_s);
+        }
+        BENCHMARK_SORT (int_sort_new, ints, ints_original, n, rounds, new_s);
+        BENCHMARK_SORT (int_sort_unstable, ints, ints_original, n, rounds, unstable_s);
+        print_result ("int", order_names[order], n, old_s, new_s, unstable_s);
+
+        old_s = 0;
+        if (2*(size_t)n*sizeof(struct record_t) <= MAX_RECURSIVE_STACK) {
+            BENCHMARK_SORT (record_sort_old, records, records_original, n, rounds, old_s);
+        }
+        BENCHMARK_SORT (record_sort_new, records, records_original, n, rounds, new_s);
+        BENCHMARK_SORT (record_sort_unstable, records, records_original, n, rounds, unstable_s);
+        print_result ("record", order_names[order], n, old_s, new_s, unstable_s);
+    }
+
+    free (ints_original);
+    free (ints);
+    free (records_original);
+    free (records);
+}
+
+int main (int argc, char **argv)
+{
+    srand (0);
+
+    int sizes[] = {100, 10000, 100000, 1000000, 5000000};
+    for (int i=0; i<ARRAY_SIZE(sizes); i++) {
+        run_size (sizes[i]);
+        printf ("\n");
+    }
+
+    return 0;
+}
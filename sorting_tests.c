@@ -105,8 +105,9 @@ bool test_linked_list_sort (struct sort_test_struct_t *list, size_t list_len, st
     return success;
 }
 
-// To see how templ_sort is not stable you can switch the definition of
-// stable_struct_sort() to use the non stable algorithm.
+// Only templ_sort_stable() promises stability. To check if the current
+// templ_sort() happens to be stable you can switch the definition of
+// stable_struct_sort() to use it.
 #if 1
 templ_sort_stable (stable_struct_sort, struct sort_test_struct_t, a->first - b->first);
 #else
@@ -276,6 +277,97 @@ bool get_struct_linked_list (mem_pool_t *pool, int i, struct sort_test_struct_t
     return has_next;
 }
 
+// Large inputs with different initial orders. The values are a permutation of
+// [0, n) so the result is correct if arr[i] == i.
+enum sort_test_order_t {
+    SORT_TEST_RANDOM,
+    SORT_TEST_SORTED,
+    SORT_TEST_REVERSED,
+    SORT_TEST_SAWTOOTH,
+    SORT_TEST_ORGAN_PIPE
+};
+
+void sort_test_permutation (int *arr, int n, enum sort_test_order_t order)
+{
+    uint32_t state = 0x9E3779B9;
+    for (int i=0; i<n; i++) {
+        if (order == SORT_TEST_REVERSED) {
+            arr[i] = n-1-i;
+        } else if (order == SORT_TEST_SAWTOOTH) {
+            // Ascending runs of 1000 elements, in descending order.
+            int run_start = (i/1000)*1000;
+            int run_len = MIN(1000, n - run_start);
+            int new_start = n - run_start - run_len;
+            arr[i] = new_start + i - run_start;
+        } else if (order == SORT_TEST_ORGAN_PIPE) {
+            // Even values ascending, then odd values descending.
+            arr[i] = i < (n+1)/2 ? 2*i : 2*(n-1-i) + 1;
+        } else {
+            arr[i] = i;
+        }
+    }
+
+    if (order == SORT_TEST_RANDOM) {
+        for (int i=n-1; i>0; i--) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            int j = state % (i+1);
+            int tmp = arr[i];
+            arr[i] = arr[j];
+            arr[j] = tmp;
+        }
+    }
+}
+
+templ_sort_unstable (unstable_ascending_sort, int, *a < *b);
+
+// Counts comparisons in the uint64_t pointed to by user_data.
+templ_sort_unstable (unstable_counting_sort, int, ((*(uint64_t*)user_data)++, *a < *b));
+
+// McIlroy's adversary for quicksort [1]. All values start as "gas", which is
+// greater than any other value. When two gas values are compared one of them
+// gets frozen to the next smallest value, choosing the one that makes the
+// pivot as bad as possible. The values assigned are consistent, so the result
+// is a real input that makes the sort do all the comparisons it did here.
+//
+// Elements of the array being sorted are indices into val.
+//
+// [1]: https://www.cs.dartmouth.edu/~doug/mdmspe.pdf
+struct sort_test_adversary_t {
+    int *val;
+    int gas;
+    int num_solid;
+    int candidate;
+    uint64_t comparisons;
+};
+
+bool sort_test_adversary_lt (int x, int y, struct sort_test_adversary_t *adv)
+{
+    adv->comparisons++;
+    if (adv->val[x] == adv->gas && adv->val[y] == adv->gas) {
+        if (x == adv->candidate) {
+            adv->val[x] = adv->num_solid++;
+        } else {
+            adv->val[y] = adv->num_solid++;
+        }
+    }
+
+    if (adv->val[x] == adv->gas) {
+        adv->candidate = x;
+    } else if (adv->val[y] == adv->gas) {
+        adv->candidate = y;
+    }
+
+    return adv->val[x] < adv->val[y];
+}
+
+templ_sort_unstable (unstable_adversary_sort, int,
+                     sort_test_adversary_lt (*a, *b, (struct sort_test_adversary_t*)user_data));
+
+templ_sort_stable (stable_struct_modulo_sort, struct sort_test_struct_t,
+                   (a->first % *(int*)user_data) - (b->first % *(int*)user_data));
+
 void sorting_tests (struct test_ctx_t *t)
 {
     test_push (t, "Sorting");
@@ -372,6 +464,166 @@ void sorting_tests (struct test_ctx_t *t)
         test_pop_parent (t);
     }
 
+    {
+        test_push (t, "Large arrays");
+
+        // Big enough to overflow the stack if the sort used it proportionally
+        // to n, and not a multiple of the insertion sort run length.
+        int n = 3000017;
+        int *arr = malloc (n*sizeof(int));
+
+        char *names[] = {"random", "sorted", "reversed", "sawtooth", "organ pipe"};
+        for (int order=0; order<ARRAY_SIZE(names); order++) {
+            sort_test_permutation (arr, n, order);
+            my_ascending_sort (arr, n);
+
+            bool success = true;
+            for (int i=0; i<n && success; i++) {
+                if (arr[i] != i) {
+                    str_cat_printf (t->error, "arr[%d] = %d\n", i, arr[i]);
+                    success = false;
+                }
+            }
+            test_bool (t, names[order], success);
+        }
+
+        {
+            // Sorting by first%modulo leaves many equal keys, the sort is
+            // stable if elements with the same key keep their original order,
+            // stored in second.
+            int modulo = 7;
+            struct sort_test_struct_t *structs = malloc (n*sizeof(struct sort_test_struct_t));
+            sort_test_permutation (arr, n, SORT_TEST_RANDOM);
+            for (int i=0; i<n; i++) {
+                structs[i].first = arr[i];
+                structs[i].second = i;
+            }
+            stable_struct_modulo_sort_user_data (structs, n, &modulo);
+
+            bool success = true;
+            for (int i=1; i<n && success; i++) {
+                int key_prev = structs[i-1].first % modulo;
+                int key = structs[i].first % modulo;
+                if (key_prev > key || (key_prev == key && structs[i-1].second > structs[i].second)) {
+                    str_cat_printf (t->error, "structs[%d] = {%d, %d}, structs[%d] = {%d, %d}\n",
+                                    i-1, structs[i-1].first, structs[i-1].second,
+                                    i, structs[i].first, structs[i].second);
+                    success = false;
+                }
+            }
+            test_bool (t, "stable with user data", success);
+            free (structs);
+        }
+
+        free (arr);
+        test_pop_parent (t);
+    }
+
+    {
+        test_push (t, "Unstable sort");
+
+        int *arr;
+        size_t arr_len = 0;
+        for (int i=0; get_test_array(&pool, i, &arr, &arr_len); i++) {
+            test_push (t, "arr%d", i);
+            unstable_ascending_sort (arr, arr_len);
+
+            bool success = true;
+            for (int j=0; j<arr_len-1; j++) {
+                if (arr[j] > arr[j+1]) {
+                    success = false;
+                }
+            }
+
+            if (!success) {
+                str_cat_array (t->error, arr, arr_len);
+            }
+            test_pop (t, success);
+
+            mem_pool_end_temporary_memory (mrkr);
+        }
+
+        // Checks the result and that the number of comparisons stays within
+        // a small factor of n*log2(n). For "few unique" the values of a random
+        // permutation are mapped to 16 distinct values, without changing
+        // their order.
+        int n = 1000003;
+        uint64_t max_comparisons = 3*n*(uint64_t)log2(n);
+        arr = malloc (n*sizeof(int));
+
+        char *names[] = {"random", "sorted", "reversed", "sawtooth", "organ pipe", "few unique"};
+        for (int order=0; order<ARRAY_SIZE(names); order++) {
+            int buckets = n;
+            if (strcmp (names[order], "few unique") == 0) {
+                sort_test_permutation (arr, n, SORT_TEST_RANDOM);
+                buckets = 16;
+            } else {
+                sort_test_permutation (arr, n, order);
+            }
+
+            for (int i=0; i<n; i++) {
+                arr[i] = (int64_t)arr[i]*buckets/n;
+            }
+
+            uint64_t comparisons = 0;
+            unstable_counting_sort_user_data (arr, n, &comparisons);
+
+            bool success = true;
+            for (int i=0; i<n && success; i++) {
+                int expected = (int64_t)i*buckets/n;
+                if (arr[i] != expected) {
+                    str_cat_printf (t->error, "arr[%d] = %d, expected %d\n", i, arr[i], expected);
+                    success = false;
+                }
+            }
+
+            if (comparisons > max_comparisons) {
+                str_cat_printf (t->error, "%"PRIu64" comparisons, expected at most %"PRIu64"\n",
+                                comparisons, max_comparisons);
+                success = false;
+            }
+            test_bool (t, names[order], success);
+        }
+        free (arr);
+
+        {
+            int n = 100000;
+            struct sort_test_adversary_t adv = {0};
+            adv.val = malloc (n*sizeof(int));
+            adv.gas = n;
+            adv.candidate = -1;
+
+            int *arr = malloc (n*sizeof(int));
+            for (int i=0; i<n; i++) {
+                arr[i] = i;
+                adv.val[i] = adv.gas;
+            }
+            unstable_adversary_sort_user_data (arr, n, &adv);
+
+            bool success = true;
+            for (int i=0; i<n-1 && success; i++) {
+                if (adv.val[arr[i]] > adv.val[arr[i+1]]) {
+                    success = false;
+                }
+            }
+
+            // This input makes the sort fall back to heap sort, which does
+            // more comparisons.
+            uint64_t max_comparisons = 4*n*(uint64_t)log2(n);
+            if (adv.comparisons > max_comparisons) {
+                str_cat_printf (t->error, "%"PRIu64" comparisons, expected at most %"PRIu64"\n",
+                                adv.comparisons, max_comparisons);
+                success = false;
+            }
+            test_bool (t, "quicksort adversary", success);
+
+            free (arr);
+            free (adv.val);
+        }
+
+        test_pop_parent (t);
+    }
+
     mem_pool_destroy (&pool);
 
     test_pop_parent (t);
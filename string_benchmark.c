@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2024 Santiago León O.
+ */
+
+// Benchmark for the small string optimization of string_t. It's meant to be
+// built twice, once with the default 16 byte string_t and once with
+// -DSTRING_T_32, then compare the output. See the string_benchmark snip in
+// pymk.py.
+//
+// For each dataset we report the number of strings that ended up on the heap,
+// how many of those allocations were avoided compared to a string_t with 15
+// bytes of inline storage, and the throughput of a set/free cycle.
+
+#include "common.h"
+#include <time.h>
+
+#define NUM_STRINGS 200000
+#define NUM_ROUNDS 10
+
+static inline
+double get_time_s ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+char *words[] = {"src", "lib", "common", "include", "scanner", "datetime",
+    "binary_tree", "utils", "build", "tests", "config", "node_modules",
+    "linear_solver", "memory_pool", "io", "x", "parser", "file_system"};
+
+char *extensions[] = {".c", ".h", ".txt", ".json", ".py", ""};
+
+char* random_word ()
+{
+    return words[rand_int_range (0, ARRAY_SIZE(words)-1)];
+}
+
+// Single path components and short relative paths, mostly 8 to 40 bytes.
+void generate_path (string_t *str)
+{
+    str_set (str, random_word());
+    int num_components = rand_int_range (0, 2);
+    for (int i=0; i<num_components; i++) {
+        str_cat_path (str, random_word());
+    }
+    str_cat_c (str, extensions[rand_int_range (0, ARRAY_SIZE(extensions)-1)]);
+}
+
+// snake_case identifiers between 4 and 30 bytes.
+void generate_identifier (string_t *str)
+{
+    str_set (str, random_word());
+    int num_parts = rand_int_range (0, 2);
+    for (int i=0; i<num_parts; i++) {
+        str_cat_c (str, "_");
+        str_cat_c (str, random_word());
+    }
+
+    if (str_len(str) > 30) {
+        str_shrink (str, 30);
+    }
+}
+
+// ISO 8601 dates, times and timestamps with offsets, from 10 to 29 bytes.
+void generate_date (string_t *str)
+{
+    int y = rand_int_range (1970, 2100);
+    int mo = rand_int_range (1, 12);
+    int d = rand_int_range (1, 28);
+    int h = rand_int_range (0, 23);
+    int mi = rand_int_range (0, 59);
+    int s = rand_int_range (0, 59);
+
+    switch (rand_int_range (0, 3)) {
+        case 0:
+            str_set_printf (str, "%04d-%02d-%02d", y, mo, d);
+            break;
+        case 1:
+            str_set_printf (str, "%04d-%02d-%02dT%02d:%02d:%02dZ", y, mo, d, h, mi, s);
+            break;
+        case 2:
+            str_set_printf (str, "%04d-%02d-%02d %02d:%02d", y, mo, d, h, mi);
+            break;
+        default:
+            str_set_printf (str, "%04d-%02d-%02dT%02d:%02d:%02d.%03d+%02d:00",
+                            y, mo, d, h, mi, s, rand_int_range (0, 999), rand_int_range (0, 12));
+            break;
+    }
+}
+
+typedef void (*generator_t)(string_t*);
+
+void run_dataset (char *name, generator_t generator)
+{
+    // Generate the dataset as plain C strings so that the timed section only
+    // measures string_t operations.
+    mem_pool_t pool = {0};
+    char **data = mem_pool_push_array (&pool, NUM_STRINGS, char*);
+    uint64_t total_bytes = 0;
+    {
+        string_t tmp = {0};
+        for (int i=0; i<NUM_STRINGS; i++) {
+            generator (&tmp);
+            data[i] = pom_strndup (&pool, str_data(&tmp), str_len(&tmp));
+            total_bytes += str_len(&tmp);
+        }
+        str_free (&tmp);
+    }
+
+    string_t *strings = calloc (NUM_STRINGS, sizeof(string_t));
+
+    uint64_t heap_strings = 0;
+    uint64_t avoided = 0;
+    double start = get_time_s ();
+    for (int r=0; r<NUM_ROUNDS; r++) {
+        for (int i=0; i<NUM_STRINGS; i++) {
+            str_set (&strings[i], data[i]);
+        }
+
+        for (int i=0; i<NUM_STRINGS; i++) {
+            string_t *str = &strings[i];
+            if (r == 0) {
+                if (!str_is_small(str)) {
+                    heap_strings++;
+                } else if (str_len(str) >= 15) {
+                    avoided++;
+                }
+            }
+            str_free (str);
+        }
+    }
+    double elapsed = get_time_s () - start;
+
+    uint64_t num_ops = (uint64_t)NUM_STRINGS*NUM_ROUNDS;
+    printf ("%-12s avg len %5.1f | heap strings %6.2f%% | allocations avoided %7"PRIu64" | %7.2f Mstr/s | %7.2f MB/s\n",
+            name, (double)total_bytes/NUM_STRINGS,
+            100.0*heap_strings/NUM_STRINGS, avoided,
+            num_ops/elapsed/1e6, (total_bytes*NUM_ROUNDS)/elapsed/1e6);
+
+    free (strings);
+    mem_pool_destroy (&pool);
+}
+
+int main (int argc, char **argv)
+{
+    srand (0);
+
+    printf ("sizeof(string_t): %zu, max inline length: %zu\n",
+            sizeof(string_t), ARRAY_SIZE(((string_t*)NULL)->str_small)-1);
+
+    run_dataset ("paths", generate_path);
+    run_dataset ("identifiers", generate_identifier);
+    run_dataset ("dates", generate_date);
+
+    return 0;
+}
@@ -40,6 +40,44 @@ void string_tests (struct test_ctx_t *t)
         str_free (&str);
     }
 
+    {
+        test_push (t, "small string boundary (%d bytes)", (int)sizeof(string_t));
+
+        // Build strings around the inline capacity both by setting them
+        // directly and by growing them one character at a time.
+        size_t small_capacity = ARRAY_SIZE(((string_t*)NULL)->str_small);
+        char buff[2*STR_SMALL_SIZE+1];
+        for (size_t len = small_capacity-2; len <= small_capacity+1; len++) {
+            for (size_t i=0; i<len; i++) {
+                buff[i] = 'a' + i%26;
+            }
+            buff[len] = '\0';
+
+            string_t set = {0};
+            strn_set (&set, buff, len);
+
+            string_t grown = {0};
+            for (size_t i=0; i<len; i++) {
+                strn_cat_c (&grown, &buff[i], 1);
+            }
+
+            test_push (t, "length %zu", len);
+            bool success = strcmp (str_data(&set), buff) == 0 && str_len(&set) == len &&
+                           strcmp (str_data(&grown), buff) == 0 && str_len(&grown) == len &&
+                           str_is_small(&set) == (len < small_capacity);
+            if (!success) {
+                str_cat_printf (t->error, "Expected '%s', got '%s' and '%s'.\n",
+                                buff, str_data(&set), str_data(&grown));
+            }
+            test_pop (t, success);
+
+            str_free (&set);
+            str_free (&grown);
+        }
+
+        test_pop_parent (t);
+    }
+
     {
         mem_pool_t pool = {0};
 
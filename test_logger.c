@@ -275,6 +275,12 @@ bool test_int (struct test_ctx_t *t, char *test_name, int result, int expected)
     return test_int_e (t, result, expected);
 }
 
+bool test_bool (struct test_ctx_t *t, char *test_name, bool result)
+{
+    test_push (t, "%s", test_name);
+    return test_bool_c (t, result);
+}
+
 
 // Frontend of _test_pop(). Pops a test but fails if any child test also failed
 // if there were no children or all child tests passed then the fail/sucess of
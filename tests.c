@@ -4,9 +4,17 @@
 
 #define TEST_NO_SUBPROCESS
 
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sys/resource.h>
 #include "common.h"
 #include "test_logger.c"
 #include "datetime.c"
+#include "scanner.c"
+#include "csv.c"
+#include "file_batch.c"
+#include "dir_index.c"
+#include "download.c"
 
 void create_fs_tree(char *base_dir, char *entries[], int num_entries)
 {
@@ -36,14 +44,20 @@ void create_fs_tree(char *base_dir, char *entries[], int num_entries)
 
 #include "string_tests.c"
 #include "path_tests.c"
+#include "file_tests.c"
+#include "file_batch_tests.c"
 #include "memory_pool_tests.c"
 #include "linked_list_tests.c"
 #include "sorting_tests.c"
 #include "binary_tree_tests.c"
 #include "datetime_tests.c"
 #include "directory_iterator_tests.c"
+#include "dir_index_tests.c"
+#include "download_tests.c"
 #include "test_logger_tests.c"
 #include "olc_tests.c"
+#include "scanner_tests.c"
+#include "csv_tests.c"
 
 // TODO: Add a CLI to select which tests get executed and which ones don't.
 int main (int argc, char **argv)
@@ -59,6 +73,10 @@ int main (int argc, char **argv)
 
     path_tests (&t);
 
+    file_tests (&t);
+
+    file_batch_tests (&t);
+
     linked_list_tests (&t);
 
     sorting_tests (&t);
@@ -69,8 +87,16 @@ int main (int argc, char **argv)
 
     directory_iterator_tests (&t);
 
+    dir_index_tests (&t);
+
+    download_tests (&t);
+
     olc_tests (&t);
 
+    scanner_tests (&t);
+
+    csv_tests (&t);
+
     printf ("\n%s", str_data(&t.result));
     test_ctx_destroy (&t);
 